@@ -0,0 +1,394 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "agg_core.h"
+#include "config_core.h"
+#include "global_defines.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "msg_buf.h"
+#include "packet_codec.h"
+#include "uwb_core.h"
+
+// Window aggregation. Producers (BTC task, load generator) fold readings
+// into the current bucket of their tag, agg_task closes a bucket every hop
+// and publishes the rollup of the buckets before it, waiting for the acks
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint16_t count;
+    uint16_t rssi_count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t last;
+    uint32_t last_time;
+    int8_t   rssi_min;
+    int8_t   rssi_max;
+    int32_t  rssi_sum;
+} agg_bucket_t;
+
+// One bucket more than the window has hops, the extra one is filling
+// while the others are rolled up
+typedef struct {
+    uint8_t      bda[6];
+    bool         used;
+    agg_bucket_t bucket[AGG_MAX_BUCKETS + 1];
+} agg_tag_t;
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "AGG_CORE";
+
+// Under agg_mux
+static agg_tag_t    tags[AGG_MAX_TAGS];
+static int          cur;     // bucket being filled
+static int          buckets; // AGG_MAX_BUCKETS at most, 1 for tumbling windows
+static uint8_t      raw_tags[AGG_MAX_RAW_TAGS][6];
+static int          raw_count;
+static agg_stats_t  stats;
+static portMUX_TYPE agg_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t window_ms; // 0: aggregation off, fixed at boot
+static uint32_t hop_ms;
+
+// Only ever used from agg_task
+static char         json_buf[AGG_JSON_SIZE];
+static agg_rollup_t pending[AGG_PENDING_ROLLUPS]; // not acked yet, oldest first
+static int          pending_first;
+
+static StackType_t  agg_stack[AGG_STACK_SIZE];
+static StaticTask_t agg_tcb;
+
+static const uint8_t no_tag[6];
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static bool is_raw(const uint8_t* bda) {
+    for (int i = 0; i < raw_count; i++) {
+        if (!memcmp(raw_tags[i], bda, 6)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called with agg_mux held. A slot is free once a whole window went by
+// without a reading, see close_window
+static agg_tag_t* find_tag(const uint8_t* bda) {
+    agg_tag_t* free_slot = NULL;
+    for (int i = 0; i < AGG_MAX_TAGS; i++) {
+        if (tags[i].used && !memcmp(tags[i].bda, bda, 6)) {
+            return &tags[i];
+        }
+        if (!tags[i].used && !free_slot) {
+            free_slot = &tags[i];
+        }
+    }
+    if (free_slot) {
+        memset(free_slot, 0, sizeof(*free_slot));
+        memcpy(free_slot->bda, bda, 6);
+        free_slot->used = true;
+    }
+    return free_slot;
+}
+
+bool agg_add(const msg_buf_t* msg) {
+    if (!window_ms || !memcmp(msg->tag, no_tag, sizeof(no_tag))) {
+        return false;
+    }
+    const uwb_packet_t* packet = (const uwb_packet_t*)msg->data;
+
+    bool taken = false;
+    portENTER_CRITICAL(&agg_mux);
+    if (is_raw(msg->tag)) {
+        stats.raw++;
+    } else {
+        agg_tag_t* tag = find_tag(msg->tag);
+        if (!tag) {
+            stats.table_full++;
+        } else {
+            agg_bucket_t* b = &tag->bucket[cur];
+            if (!b->count || packet->distance_uwb < b->min) {
+                b->min = packet->distance_uwb;
+            }
+            b->max       = MAX(b->max, packet->distance_uwb);
+            b->sum      += packet->distance_uwb;
+            b->last      = packet->distance_uwb;
+            b->last_time = packet->time;
+            b->count++;
+            if (msg->rssi) {
+                if (!b->rssi_count || msg->rssi < b->rssi_min) {
+                    b->rssi_min = msg->rssi;
+                }
+                if (!b->rssi_count || msg->rssi > b->rssi_max) {
+                    b->rssi_max = msg->rssi;
+                }
+                b->rssi_sum += msg->rssi;
+                b->rssi_count++;
+            }
+            stats.aggregated++;
+            taken = true;
+        }
+    }
+    portEXIT_CRITICAL(&agg_mux);
+    return taken;
+}
+
+// Rolls up every bucket of the tag but `filling`, oldest first so the
+// newest reading ends up as last. Called with agg_mux held.
+// Returns false if the window had no reading
+static bool rollup_tag(const agg_tag_t* tag, int filling, agg_rollup_t* out) {
+    uint64_t sum        = 0;
+    int32_t  rssi_sum   = 0;
+    uint16_t rssi_count = 0;
+
+    memset(out, 0, sizeof(*out));
+    for (int i = 1; i <= buckets; i++) {
+        const agg_bucket_t* b = &tag->bucket[(filling + i) % (buckets + 1)];
+        if (!b->count) {
+            continue;
+        }
+        out->distance_min  = out->count ? MIN(out->distance_min, b->min) : b->min;
+        out->distance_max  = MAX(out->distance_max, b->max);
+        out->distance_last = b->last;
+        out->time_last     = b->last_time;
+
+        out->count += b->count;
+        sum += b->sum;
+        if (b->rssi_count) {
+            out->rssi_min = rssi_count ? MIN(out->rssi_min, b->rssi_min) : b->rssi_min;
+            out->rssi_max = rssi_count ? MAX(out->rssi_max, b->rssi_max) : b->rssi_max;
+
+            rssi_sum += b->rssi_sum;
+            rssi_count += b->rssi_count;
+        }
+    }
+    if (!out->count) {
+        return false;
+    }
+    memcpy(out->tag, tag->bda, sizeof(out->tag));
+    out->window_ms     = window_ms;
+    out->distance_mean = sum / out->count;
+    out->rssi_mean     = rssi_count ? rssi_sum / rssi_count : 0;
+    return true;
+}
+
+// Keeps a rollup that wasn't acked for the next window, the oldest one
+// goes if there is no room
+static void pending_push(const agg_rollup_t* rollup) {
+    portENTER_CRITICAL(&agg_mux);
+    if (stats.pending == AGG_PENDING_ROLLUPS) {
+        pending_first = (pending_first + 1) % AGG_PENDING_ROLLUPS;
+        stats.pending--;
+        stats.dropped++;
+    }
+    pending[(pending_first + stats.pending) % AGG_PENDING_ROLLUPS] = *rollup;
+    stats.pending++;
+    portEXIT_CRITICAL(&agg_mux);
+}
+
+// true once the broker acked the rollup, or if it can never be sent
+static bool publish_rollup(const agg_rollup_t* rollup) {
+    mqtt_link_stats_t link;
+    mqtt_get_link_stats(&link);
+    if (link.state == MQTT_LINK_DOWN) {
+        return false;
+    }
+    int len = agg_rollup_to_json(rollup, json_buf, sizeof(json_buf));
+    if (len <= 0) {
+        ESP_LOGE(TAG, "Rollup doesn't fit %d bytes, dropped", sizeof(json_buf));
+        portENTER_CRITICAL(&agg_mux);
+        stats.dropped++;
+        portEXIT_CRITICAL(&agg_mux);
+        return true;
+    }
+    bool ok = mqtt_publish_acked(AGG_TOPIC, json_buf, len) == MQTT_SUCCESS;
+
+    portENTER_CRITICAL(&agg_mux);
+    if (ok) {
+        stats.rollups++;
+    } else {
+        stats.failed++;
+    }
+    portEXIT_CRITICAL(&agg_mux);
+    return ok;
+}
+
+// Resends the kept rollups oldest first, stops at the first one that
+// still isn't acked. Returns true if none is left
+static bool resend_pending(void) {
+    while (stats.pending) { // only agg_task changes it
+        if (!publish_rollup(&pending[pending_first])) {
+            return false;
+        }
+        portENTER_CRITICAL(&agg_mux);
+        pending_first = (pending_first + 1) % AGG_PENDING_ROLLUPS;
+        stats.pending--;
+        portEXIT_CRITICAL(&agg_mux);
+    }
+    return true;
+}
+
+static void close_window(void) {
+    agg_rollup_t rollup;
+
+    // new readings go to a cleared bucket from here on, the one that just
+    // closed and the ones before it make up the window
+    portENTER_CRITICAL(&agg_mux);
+    int filling = (cur + 1) % (buckets + 1);
+    for (int i = 0; i < AGG_MAX_TAGS; i++) {
+        memset(&tags[i].bucket[filling], 0, sizeof(agg_bucket_t));
+    }
+    cur = filling;
+    portEXIT_CRITICAL(&agg_mux);
+
+    // while older rollups still don't get through, new ones queue behind
+    // them instead of each waiting out its own ack timeouts
+    bool link_ok = resend_pending();
+    for (int i = 0; i < AGG_MAX_TAGS; i++) {
+        portENTER_CRITICAL(&agg_mux);
+        bool has_data = tags[i].used && rollup_tag(&tags[i], filling, &rollup);
+        if (tags[i].used && !has_data && !tags[i].bucket[filling].count) {
+            tags[i].used = false; // quiet for a whole window
+        }
+        portEXIT_CRITICAL(&agg_mux);
+        if (!has_data) {
+            continue;
+        }
+        if (!link_ok || !publish_rollup(&rollup)) {
+            pending_push(&rollup);
+            link_ok = false;
+        }
+    }
+}
+
+static void agg_task(void* arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+    while (true) {
+        vTaskDelayUntil(&last_wake, MAX(1, pdMS_TO_TICKS(hop_ms)));
+        close_window();
+    }
+}
+
+void agg_get_stats(agg_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&agg_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&agg_mux);
+}
+
+// 12 hex digits, colons allowed in between
+static bool parse_bda(const char* text, int len, uint8_t* bda) {
+    int digits = 0;
+    for (int i = 0; i < len && digits < 12; i++) {
+        char    c = text[i];
+        uint8_t v;
+        if (c >= '0' && c <= '9') {
+            v = c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            v = (c | 0x20) - 'a' + 10;
+        } else if (c == ':') {
+            continue;
+        } else {
+            break;
+        }
+        bda[digits / 2] = (digits % 2) ? (bda[digits / 2] | v) : (v << 4);
+        digits++;
+    }
+    return digits == 12;
+}
+
+// "agg_raw <bda> <on|off>", kept in NVS
+static void agg_raw_cmd(const char* args, int args_len) {
+    uint8_t bda[6];
+    if (!parse_bda(args, args_len, bda)) {
+        ESP_LOGE(TAG, "agg_raw <bda> <on|off>");
+        return;
+    }
+    bool on = args_len >= 2 && !memcmp(args + args_len - 2, "on", 2);
+
+    portENTER_CRITICAL(&agg_mux);
+    int index = 0;
+    for (; index < raw_count && memcmp(raw_tags[index], bda, 6); index++) {
+    }
+    if (on && index == raw_count && raw_count < AGG_MAX_RAW_TAGS) {
+        memcpy(raw_tags[raw_count++], bda, 6);
+    } else if (!on && index < raw_count) {
+        memcpy(raw_tags[index], raw_tags[--raw_count], 6);
+    }
+    int count = raw_count;
+    portEXIT_CRITICAL(&agg_mux);
+
+    nvs_handle_t nvs;
+    if (nvs_open(AGG_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, "raw_tags", raw_tags, count * 6) == ESP_OK && nvs_commit(nvs) == ESP_OK) {
+        ESP_LOGI(TAG, "%d raw tags", count);
+    }
+    nvs_close(nvs);
+}
+
+// "agg_stats", on AGG_STATS_TOPIC
+static void agg_stats_cmd(const char* args, int args_len) {
+    char        out[192];
+    agg_stats_t s;
+    agg_get_stats(&s);
+    int len = snprintf(out, sizeof(out),
+                       "window_ms=%d hop_ms=%d aggregated=%d raw=%d table_full=%d rollups=%d failed=%d pending=%d dropped=%d",
+                       window_ms, hop_ms, s.aggregated, s.raw, s.table_full, s.rollups, s.failed, s.pending, s.dropped);
+    mqtt_publish_raw(AGG_STATS_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
+void agg_init(void) {
+    mqtt_register_command("agg_raw", agg_raw_cmd);
+    mqtt_register_command("agg_stats", agg_stats_cmd);
+
+    nvs_handle_t nvs;
+    size_t       len = sizeof(raw_tags);
+    if (nvs_open(AGG_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        if (nvs_get_blob(nvs, "raw_tags", raw_tags, &len) == ESP_OK) {
+            raw_count = len / 6;
+        }
+        nvs_close(nvs);
+    }
+
+    window_ms = config_get(CFG_AGG_WINDOW_MS);
+    if (!window_ms) {
+        ESP_LOGI(TAG, "Aggregation off, every reading goes up raw");
+        return;
+    }
+    // the hop has to split the window into at most AGG_MAX_BUCKETS buckets
+    hop_ms  = config_get(CFG_AGG_HOP_MS);
+    buckets = (hop_ms && hop_ms < window_ms) ? MIN(window_ms / hop_ms, AGG_MAX_BUCKETS) : 1;
+    hop_ms  = window_ms / buckets;
+    ESP_LOGI(TAG, "%d ms windows, rollup every %d ms, %d raw tags", window_ms, hop_ms, raw_count);
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        agg_task,            // Function that implements the task.
+        "agg",               // Text name for the task.
+        AGG_STACK_SIZE,      // Stack size in bytes on the ESP32.
+        NULL,                // Parameter passed into the task.
+        AGG_PRIORITY,        // Priority at which the task is created.
+        agg_stack,           // Stack buffer.
+        &agg_tcb,            // Task control block.
+        MQTT_PIPELINE_CORE); // Core the task is pinned to.
+    ASSERT(handle);
+
+    mem_register_stack("agg", sizeof(agg_stack));
+    mem_register_static("agg_tags", sizeof(tags) + sizeof(raw_tags) + sizeof(json_buf) + sizeof(pending));
+}
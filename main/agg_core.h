@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Per tag rollups. With agg_window_ms set, readings from a known tag are
+// folded into fixed size per tag buckets instead of being published, and
+// one rollup per tag goes out when a window closes. agg_hop_ms below the
+// window makes it sliding: a rollup of the last window every hop.
+// Tags listed with "agg_raw" keep the per reading uplink, so do readings
+// without a tag address and everything while the link is down (the spool
+// only holds raw readings).
+// A folded reading is acked to its tag, so its rollup is published with
+// PUBACK tracking and retries. A rollup still not acked is kept, up to
+// AGG_PENDING_ROLLUPS of them, and resent before the next window's. The
+// open windows and the pending rollups are in RAM, a reboot loses them
+#define AGG_MAX_TAGS        (32)
+#define AGG_MAX_BUCKETS     (4) // hops per window
+#define AGG_MAX_RAW_TAGS    (8)
+#define AGG_PENDING_ROLLUPS (64) // two windows of every tag
+#define AGG_STACK_SIZE      (3072)
+#define AGG_PRIORITY        (4) // below the publish pipeline
+#define AGG_JSON_SIZE       (256)
+#define AGG_TOPIC           "/topic/cat_location/rollup"
+#define AGG_STATS_TOPIC     "/topic/gateway/agg"
+#define AGG_NVS_NAMESPACE   "agg"
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// One closed window of one tag, see AGG_ROLLUP_SCHEMA (packet_codec.h).
+// The RSSI fields are 0 if no reading of the window came with one
+typedef struct {
+    uint8_t  tag[6]; // BLE address
+    uint32_t window_ms;
+    uint16_t count;
+    uint32_t distance_min;
+    uint32_t distance_max;
+    uint32_t distance_mean;
+    uint32_t distance_last;
+    uint32_t time_last; // time field of the last reading
+    int8_t   rssi_min;
+    int8_t   rssi_max;
+    int8_t   rssi_mean;
+} __attribute__((packed)) agg_rollup_t;
+
+typedef struct {
+    uint32_t aggregated; // readings folded into a window
+    uint32_t raw;        // readings of agg_raw tags
+    uint32_t table_full; // readings sent raw, no free tag slot
+    uint32_t rollups;    // published and acked
+    uint32_t failed;     // publishes without an ack, the rollup is kept and resent
+    uint32_t pending;    // rollups waiting to be resent
+    uint32_t dropped;    // rollups lost, AGG_PENDING_ROLLUPS full
+} agg_stats_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void agg_init(void);
+
+// Takes the reading into its tag's window, false if it has to go up raw.
+// Never blocks, the caller keeps its reference either way
+struct msg_buf_t;
+bool agg_add(const struct msg_buf_t* msg);
+
+void agg_get_stats(agg_stats_t* stats);
@@ -0,0 +1,332 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "alert_core.h"
+#include "global_defines.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "msg_buf.h"
+#include "packet_codec.h"
+#include "uwb_core.h"
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// Rule state of one tag
+typedef struct {
+    uint8_t  bda[6];
+    bool     used;
+    uint32_t last_ms; // last reading
+    bool     active[ALERT_MAX_RULES];   // near: raised, presence: present
+    uint32_t since_ms[ALERT_MAX_RULES]; // near: first reading below enter_cm, 0 if above
+} alert_tag_t;
+
+typedef struct {
+    alert_event_t event;
+    int64_t       start_us; // latency counts from here
+} alert_queued_t;
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "ALERT_CORE";
+
+// Under alert_mux
+static alert_rule_t  rules[ALERT_MAX_RULES];
+static alert_tag_t   tags[ALERT_MAX_TAGS];
+static alert_stats_t stats;
+static bool          any_rule;
+static portMUX_TYPE  alert_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static QueueHandle_t alertQ;
+static StaticQueue_t alertQ_buf;
+static uint8_t       alertQ_storage[ALERT_QUEUE_DEPTH * sizeof(alert_queued_t)];
+static StackType_t   alert_stack[ALERT_STACK_SIZE];
+static StaticTask_t  alert_tcb;
+
+// Only ever used from alert_task
+static char json_buf[ALERT_JSON_SIZE];
+
+static const uint8_t any_tag[6];
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static bool rule_matches(const alert_rule_t* rule, const uint8_t* bda) {
+    return rule->type != ALERT_RULE_OFF
+           && (!memcmp(rule->tag, any_tag, sizeof(any_tag)) || !memcmp(rule->tag, bda, sizeof(rule->tag)));
+}
+
+// Called with alert_mux held, takes over the least recently seen tag
+// when the table is full
+static alert_tag_t* find_tag(const uint8_t* bda) {
+    alert_tag_t* victim = &tags[0];
+    for (int i = 0; i < ALERT_MAX_TAGS; i++) {
+        if (tags[i].used && !memcmp(tags[i].bda, bda, sizeof(tags[i].bda))) {
+            return &tags[i];
+        }
+        if (victim->used && (!tags[i].used || tags[i].last_ms < victim->last_ms)) {
+            victim = &tags[i];
+        }
+    }
+    memset(victim, 0, sizeof(*victim));
+    memcpy(victim->bda, bda, sizeof(victim->bda));
+    victim->used = true;
+    return victim;
+}
+
+// Events are collected under alert_mux and queued once it is released
+typedef struct {
+    alert_queued_t items[ALERT_MAX_RULES];
+    int            count;
+} alert_batch_t;
+
+static void add_event(alert_batch_t* batch, const uint8_t* bda, int rule, alert_event_type_t type, uint32_t distance,
+                      uint32_t time, int64_t start_us) {
+    if (batch->count == ALERT_MAX_RULES) {
+        return;
+    }
+    alert_queued_t* queued = &batch->items[batch->count++];
+    *queued                = (alert_queued_t){
+        .event    = { .rule = rule, .event = type, .distance = distance, .time = time },
+        .start_us = start_us,
+    };
+    memcpy(queued->event.tag, bda, sizeof(queued->event.tag));
+}
+
+// Never blocks, a full queue counts as dropped
+static void queue_batch(const alert_batch_t* batch) {
+    uint32_t dropped = 0;
+    for (int i = 0; i < batch->count; i++) {
+        if (xQueueSend(alertQ, &batch->items[i], 0) != pdTRUE) {
+            dropped++;
+        }
+    }
+    portENTER_CRITICAL(&alert_mux);
+    stats.raised += batch->count;
+    stats.dropped += dropped;
+    portEXIT_CRITICAL(&alert_mux);
+}
+
+void alert_ingest(const msg_buf_t* msg) {
+    if (!any_rule || !memcmp(msg->tag, any_tag, sizeof(any_tag))) {
+        return;
+    }
+    const uwb_packet_t* packet = (const uwb_packet_t*)msg->data;
+    uint32_t            now_ms = esp_timer_get_time() / 1000;
+    alert_batch_t       batch  = { .count = 0 };
+
+    portENTER_CRITICAL(&alert_mux);
+    alert_tag_t* tag = find_tag(msg->tag);
+    tag->last_ms     = now_ms;
+    for (int i = 0; i < ALERT_MAX_RULES; i++) {
+        const alert_rule_t* rule = &rules[i];
+        if (!rule_matches(rule, msg->tag)) {
+            continue;
+        }
+        if (rule->type == ALERT_RULE_PRESENCE) {
+            if (!tag->active[i]) {
+                tag->active[i] = true;
+                add_event(&batch, msg->tag, i, ALERT_EVENT_APPEAR, packet->distance_uwb, packet->time, msg->created_us);
+            }
+        } else if (!tag->active[i]) {
+            if (packet->distance_uwb >= rule->enter_cm) {
+                tag->since_ms[i] = 0;
+                continue;
+            }
+            if (!tag->since_ms[i]) {
+                tag->since_ms[i] = MAX(1, now_ms);
+            }
+            if (now_ms - tag->since_ms[i] >= rule->time_ms) {
+                tag->active[i] = true;
+                add_event(&batch, msg->tag, i, ALERT_EVENT_NEAR, packet->distance_uwb, packet->time, msg->created_us);
+            }
+        } else if (packet->distance_uwb > rule->exit_cm) {
+            tag->active[i]   = false;
+            tag->since_ms[i] = 0;
+            add_event(&batch, msg->tag, i, ALERT_EVENT_CLEAR, packet->distance_uwb, packet->time, msg->created_us);
+        }
+    }
+    portEXIT_CRITICAL(&alert_mux);
+    if (batch.count) {
+        queue_batch(&batch);
+    }
+}
+
+// Presence timeouts, run from alert_task
+static void check_vanished(void) {
+    int64_t       now_us = esp_timer_get_time();
+    uint32_t      now_ms = now_us / 1000;
+    alert_batch_t batch  = { .count = 0 };
+
+    portENTER_CRITICAL(&alert_mux);
+    for (int t = 0; t < ALERT_MAX_TAGS; t++) {
+        alert_tag_t* tag = &tags[t];
+        for (int i = 0; tag->used && i < ALERT_MAX_RULES && batch.count < ALERT_MAX_RULES; i++) {
+            const alert_rule_t* rule = &rules[i];
+            if (rule->type != ALERT_RULE_PRESENCE || !tag->active[i] || !rule_matches(rule, tag->bda)
+                || now_ms - tag->last_ms < rule->time_ms) {
+                continue;
+            }
+            tag->active[i] = false;
+            // latency counts from the moment the timeout ran out
+            add_event(&batch, tag->bda, i, ALERT_EVENT_VANISH, 0, 0,
+                      now_us - (int64_t)(now_ms - tag->last_ms - rule->time_ms) * 1000);
+        }
+    }
+    portEXIT_CRITICAL(&alert_mux);
+    if (batch.count) {
+        queue_batch(&batch);
+    }
+}
+
+static void publish_alert(const alert_queued_t* queued) {
+    mqtt_link_stats_t link;
+    mqtt_get_link_stats(&link);
+    int  len = alert_event_to_json(&queued->event, json_buf, sizeof(json_buf));
+    bool ok  = len > 0 && link.state != MQTT_LINK_DOWN && mqtt_publish_raw(ALERT_TOPIC, json_buf, len) >= 0;
+
+    uint32_t latency_us = esp_timer_get_time() - queued->start_us;
+    portENTER_CRITICAL(&alert_mux);
+    if (ok) {
+        stats.published++;
+        stats.last_us = latency_us;
+        stats.max_us  = MAX(stats.max_us, latency_us);
+        stats.total_us += latency_us;
+    } else {
+        stats.failed++;
+    }
+    portEXIT_CRITICAL(&alert_mux);
+    ESP_LOGI(TAG, "Alert %d for rule %d, %d us after ingest", queued->event.event, queued->event.rule, latency_us);
+}
+
+static void alert_task(void* arg) {
+    alert_queued_t queued;
+    while (true) {
+        if (xQueueReceive(alertQ, &queued, pdMS_TO_TICKS(ALERT_SCAN_MS)) == pdTRUE) {
+            publish_alert(&queued);
+        }
+        check_vanished();
+    }
+}
+
+void alert_get_stats(alert_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&alert_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&alert_mux);
+}
+
+static void store_rules(void) {
+    nvs_handle_t nvs;
+    if (nvs_open(ALERT_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, "rules", rules, sizeof(rules)) != ESP_OK || nvs_commit(nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Rules not stored");
+    }
+    nvs_close(nvs);
+}
+
+// "alert_rule", see alert_core.h
+static void alert_rule_cmd(const char* args, int args_len) {
+    char         text[80] = { 0 };
+    char         who[16];
+    char         kind[12];
+    int          n;
+    alert_rule_t rule = { 0 };
+
+    memcpy(text, args, MIN(args_len, sizeof(text) - 1));
+    int fields = sscanf(text, "%d %15s %11s %u %u %u", &n, who, kind, &rule.enter_cm, &rule.exit_cm, &rule.time_ms);
+    if (fields < 2 || n < 0 || n >= ALERT_MAX_RULES) {
+        ESP_LOGE(TAG, "alert_rule <0..%d> ...", ALERT_MAX_RULES - 1);
+        return;
+    }
+
+    if (strcmp(who, "off")) {
+        if (strcmp(who, "*") && sscanf(who, "%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx", &rule.tag[0], &rule.tag[1],
+                                       &rule.tag[2], &rule.tag[3], &rule.tag[4], &rule.tag[5]) != 6) {
+            ESP_LOGE(TAG, "Tag has to be * or 12 hex digits");
+            return;
+        }
+        if (fields == 6 && !strcmp(kind, "near") && rule.exit_cm >= rule.enter_cm) {
+            rule.type = ALERT_RULE_NEAR;
+        } else if (fields == 4 && !strcmp(kind, "presence") && rule.enter_cm) {
+            rule.type     = ALERT_RULE_PRESENCE;
+            rule.time_ms  = rule.enter_cm;
+            rule.enter_cm = 0;
+        } else {
+            ESP_LOGE(TAG, "near <enter_cm> <exit_cm >= enter_cm> <dwell_ms> or presence <timeout_ms>");
+            return;
+        }
+    }
+
+    portENTER_CRITICAL(&alert_mux);
+    rules[n] = rule;
+    // a changed rule starts from scratch on every tag
+    any_rule = false;
+    for (int t = 0; t < ALERT_MAX_TAGS; t++) {
+        tags[t].active[n]   = false;
+        tags[t].since_ms[n] = 0;
+    }
+    for (int i = 0; i < ALERT_MAX_RULES; i++) {
+        any_rule |= rules[i].type != ALERT_RULE_OFF;
+    }
+    portEXIT_CRITICAL(&alert_mux);
+    store_rules();
+    ESP_LOGI(TAG, "Rule %d set, type %d", n, rule.type);
+}
+
+// "alert_stats", on ALERT_STATS_TOPIC
+static void alert_stats_cmd(const char* args, int args_len) {
+    char          out[160];
+    alert_stats_t s;
+    alert_get_stats(&s);
+    int len = snprintf(out, sizeof(out), "raised=%d published=%d failed=%d dropped=%d last_us=%d max_us=%d mean_us=%d",
+                       s.raised, s.published, s.failed, s.dropped, s.last_us, s.max_us,
+                       s.published ? (uint32_t)(s.total_us / s.published) : 0);
+    mqtt_publish_raw(ALERT_STATS_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
+void alert_init(void) {
+    nvs_handle_t nvs;
+    size_t       len = sizeof(rules);
+    if (nvs_open(ALERT_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        if (nvs_get_blob(nvs, "rules", rules, &len) != ESP_OK || len != sizeof(rules)) {
+            memset(rules, 0, sizeof(rules));
+        }
+        nvs_close(nvs);
+    }
+    for (int i = 0; i < ALERT_MAX_RULES; i++) {
+        any_rule |= rules[i].type != ALERT_RULE_OFF;
+    }
+
+    alertQ = xQueueCreateStatic(ALERT_QUEUE_DEPTH, sizeof(alert_queued_t), alertQ_storage, &alertQ_buf);
+    ASSERT(alertQ);
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        alert_task,          // Function that implements the task.
+        "alert",             // Text name for the task.
+        ALERT_STACK_SIZE,    // Stack size in bytes on the ESP32.
+        NULL,                // Parameter passed into the task.
+        ALERT_PRIORITY,      // Priority at which the task is created.
+        alert_stack,         // Stack buffer.
+        &alert_tcb,          // Task control block.
+        MQTT_PIPELINE_CORE); // Core the task is pinned to.
+    ASSERT(handle);
+
+    mem_register_stack("alert", sizeof(alert_stack));
+    mem_register_static("alert_rules", sizeof(rules) + sizeof(tags) + sizeof(alertQ_storage) + sizeof(json_buf));
+    mqtt_register_command("alert_rule", alert_rule_cmd);
+    mqtt_register_command("alert_stats", alert_stats_cmd);
+}
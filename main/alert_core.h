@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Proximity alerts. Every reading is run through the rules inline, in the
+// producer's context, before it joins the publish pipeline or a rollup.
+// A matching event is queued for the alert task, which publishes it right
+// away on ALERT_TOPIC without waiting for the PUBACK.
+//
+//   near:     distance below enter_cm for time_ms raises ALERT_EVENT_NEAR,
+//             above exit_cm again raises ALERT_EVENT_CLEAR (hysteresis)
+//   presence: a reading from a tag that was gone raises ALERT_EVENT_APPEAR,
+//             no reading for time_ms raises ALERT_EVENT_VANISH
+//
+// Rules are set with "alert_rule" and kept in NVS:
+//   alert_rule <n> <bda|*> near <enter_cm> <exit_cm> <dwell_ms>
+//   alert_rule <n> <bda|*> presence <timeout_ms>
+//   alert_rule <n> off
+#define ALERT_MAX_RULES     (8)
+#define ALERT_MAX_TAGS      (32)
+#define ALERT_QUEUE_DEPTH   (8)
+#define ALERT_STACK_SIZE    (3072)
+#define ALERT_PRIORITY      (7) // above the sinks and the publish pipeline
+#define ALERT_SCAN_MS       (500) // vanish check period
+#define ALERT_JSON_SIZE     (128)
+#define ALERT_TOPIC         "/topic/alerts"
+#define ALERT_STATS_TOPIC   "/topic/gateway/alerts"
+#define ALERT_NVS_NAMESPACE "alert"
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef enum {
+    ALERT_RULE_OFF,
+    ALERT_RULE_NEAR,
+    ALERT_RULE_PRESENCE,
+} alert_rule_type_t;
+
+typedef enum {
+    ALERT_EVENT_NEAR = 1,
+    ALERT_EVENT_CLEAR,
+    ALERT_EVENT_APPEAR,
+    ALERT_EVENT_VANISH,
+} alert_event_type_t;
+
+typedef struct {
+    uint8_t  tag[6]; // all zero: every tag
+    uint8_t  type;   // alert_rule_type_t
+    uint32_t enter_cm;
+    uint32_t exit_cm;
+    uint32_t time_ms; // near: dwell, presence: timeout
+} alert_rule_t;
+
+// What goes out on ALERT_TOPIC, see ALERT_EVENT_SCHEMA (packet_codec.h)
+typedef struct {
+    uint8_t  tag[6];
+    uint8_t  rule;
+    uint8_t  event;    // alert_event_type_t
+    uint32_t distance; // of the reading that raised it, 0 for a vanish
+    uint32_t time;     // time field of that reading
+} __attribute__((packed)) alert_event_t;
+
+// Latency runs from msg_buf_alloc of the reading (for a vanish, from the
+// moment the timeout ran out) to the client taking the publish
+typedef struct {
+    uint32_t raised;
+    uint32_t published;
+    uint32_t failed;  // link down or the client refused it
+    uint32_t dropped; // alert queue full
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us;
+} alert_stats_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void alert_init(void);
+
+// Runs the rules on one reading. Never blocks, called for every reading
+// before anything else looks at it
+struct msg_buf_t;
+void alert_ingest(const struct msg_buf_t* msg);
+
+void alert_get_stats(alert_stats_t* stats);
@@ -1,8 +1,11 @@
 #include "esp_bt.h"
+#include <sys/param.h>
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
 #include "nvs_flash.h"
 
@@ -12,8 +15,17 @@
 #include "esp_gatts_api.h"
 
 #include "ble_core.h"
+#include "capture_core.h"
+#include "config_core.h"
+#include "global_defines.h"
+#include "mem_core.h"
 #include "stnp_core.h"
 #include "mqtt_core.h"
+#include "msg_buf.h"
+#include "packet_codec.h"
+#include "status_core.h"
+#include "upload_core.h"
+#include "uwb_core.h"
 
 #define GATTS_TABLE_TAG "BLE_CORE"
 
@@ -27,7 +39,6 @@
 *  the data length must be less than GATTS_DEMO_CHAR_VAL_LEN_MAX. 
 */
 #define GATTS_DEMO_CHAR_VAL_LEN_MAX 500
-#define PREPARE_BUF_MAX_SIZE        1024
 #define CHAR_DECLARATION_SIZE       (sizeof(uint8_t))
 
 #define ADV_CONFIG_FLAG      (1 << 0)
@@ -37,18 +48,96 @@
 #define PROVISIONED            (1)
 #define WIFI_OK                (2)
 
-static uint8_t device_id[]     = { 0xAB, 0xCD, 'A', '1', 'C' };
+// Advertised manufacturer data, the time part is refreshed every
+// BLE_ADV_TIME_REFRESH_MS so tags can sync from a scan instead of a
+// connection and a read of ID_TIME_VAL
+static ble_adv_time_t adv_time = {
+    .device_id = { 0xAB, 0xCD, 'A', '1', 'C' },
+};
+static esp_timer_handle_t adv_time_timer;
+
+// Scan response manufacturer data, refreshed with the time
+static ble_adv_status_t adv_status = {
+    .device_id = { 0xAB, 0xCD },
+};
+
 static uint8_t adv_config_done = 0;
 static uint8_t handle_start;
 
+// Per connection GATT state, BTC task only
+typedef struct {
+    bool              used;
+    uint16_t          conn_id;
+    uint16_t          mtu;
+    status_snapshot_t status; // served by the status read at offset 0 and its Read Blobs
+} ble_conn_t;
+
+static ble_conn_t conns[BLE_CONNS_MAX];
+
 uint16_t tera_fire_handle_table[ID_FINAL];
 
+// Bluedroid delivers all GATT events from the single BTC task, the prepare
+// buffer and response of the GATT handler are only used there
+static prepare_type_env_t prepare_write_env;
+static esp_gatt_rsp_t     prepare_rsp;
+
+// Last ACKed multi-record write per tag, replaced round robin
 typedef struct {
-    uint8_t* prepare_buf;
-    int      prepare_len;
-} prepare_type_env_t;
+    uint8_t  bda[6];
+    bool     used;
+    uint16_t seq;
+} batch_seq_t;
 
-static prepare_type_env_t prepare_write_env;
+// One write whose readings are with the publisher. It is answered once
+// the last of them was published or spooled, from whichever task finished
+// it, so the BTC task never waits on a PUBACK
+typedef struct {
+    bool              used;
+    bool              respond; // with a GATT response
+    esp_gatt_if_t     gatts_if;
+    uint16_t          conn_id;
+    uint32_t          trans_id;
+    ble_ingest_done_t done; // or with a call
+    void*             done_arg;
+    uint8_t           pending;   // readings with the publisher, +1 while they are submitted
+    int               status;    // MQTT_ERROR once any of them failed
+    TaskHandle_t      notify;    // multi-record writes: woken whenever a reading is through
+    uint8_t           in_flight; // of the batch task's readings, with the publisher
+    bool              has_seq;   // remember seq for bda once ACKed
+    uint16_t          seq;
+    uint8_t           bda[6];
+} ble_write_t;
+
+// A multi-record write copied out of the Bluedroid buffer for the batch task
+typedef struct {
+    bool         used; // under write_mux
+    ble_write_t* write;
+    bool         has_bda;
+    uint8_t      bda[6];
+    uint16_t     len;
+    uint8_t      value[PREPARE_BUF_MAX_SIZE];
+} batch_job_t;
+
+// A blocking ble_ingest_* caller, woken by the write's done
+typedef struct {
+    int          status;
+    TaskHandle_t task;
+} ingest_wait_t;
+
+// Under write_mux
+static batch_seq_t batch_seqs[BLE_BATCH_SEQ_TAGS];
+static int         batch_seq_next;
+
+static batch_job_t   batch_jobs[BLE_BATCH_JOBS];
+static QueueHandle_t batchQ; // batch_job_t pointers
+static StaticQueue_t batchQ_buf;
+static uint8_t       batchQ_storage[BLE_BATCH_JOBS * sizeof(batch_job_t*)];
+static StackType_t   batch_stack[BLE_BATCH_STACK_SIZE];
+static StaticTask_t  batch_tcb;
+static TaskHandle_t  batch_handle;
+
+static ble_write_t  writes[BLE_WRITES_MAX];
+static portMUX_TYPE write_mux = portMUX_INITIALIZER_UNLOCKED;
 
 #ifdef CONFIG_SET_RAW_ADV_DATA
 static uint8_t raw_adv_data[] = {
@@ -100,8 +189,8 @@ static esp_ble_adv_data_t adv_data = {
     .min_interval        = 0x0006, //slave connection min interval, Time = min_interval * 1.25 msec
     .max_interval        = 0x0010, //slave connection max interval, Time = max_interval * 1.25 msec
     .appearance          = 0x00,
-    .manufacturer_len    = sizeof(device_id),
-    .p_manufacturer_data = device_id,
+    .manufacturer_len    = sizeof(adv_time),
+    .p_manufacturer_data = (uint8_t*)&adv_time,
     .service_data_len    = 0,
     .p_service_data      = NULL,
     .service_uuid_len    = sizeof(service_uuid),
@@ -109,20 +198,21 @@ static esp_ble_adv_data_t adv_data = {
     .flag                = (ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT),
 };
 
-// scan response data
+// scan response data, the name and the gateway status fill it (the
+// service UUID is already in the advertising packet)
 static esp_ble_adv_data_t scan_rsp_data = {
     .set_scan_rsp        = true,
     .include_name        = true,
-    .include_txpower     = true,
+    .include_txpower     = false,
     .min_interval        = 0x0006,
     .max_interval        = 0x0010,
     .appearance          = 0x00,
-    .manufacturer_len    = 0,    //TEST_MANUFACTURER_DATA_LEN,
-    .p_manufacturer_data = NULL, //&test_manufacturer[0],
+    .manufacturer_len    = sizeof(adv_status),
+    .p_manufacturer_data = (uint8_t*)&adv_status,
     .service_data_len    = 0,
     .p_service_data      = NULL,
-    .service_uuid_len    = sizeof(service_uuid),
-    .p_service_uuid      = service_uuid,
+    .service_uuid_len    = 0,
+    .p_service_uuid      = NULL,
     .flag                = (ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT),
 };
 #endif /* CONFIG_SET_RAW_ADV_DATA */
@@ -167,13 +257,17 @@ static const uint16_t gatts_service_uuid_cw = 0x00FF;
 // Charecteristic values
 static const uint16_t gatts_char_uuid_time   = 0xB0F0;
 static const uint16_t gatts_char_uuid_dump   = 0xDEAD;
+static const uint16_t gatts_char_uuid_capture = 0xCA97;
+static const uint16_t gatts_char_uuid_config  = 0xC0F6;
+static const uint16_t gatts_char_uuid_upload  = 0xC4C5;
+static const uint16_t gatts_char_uuid_status  = 0x57A7;
 
 // Properties
 static const uint16_t primary_service_uuid       = ESP_GATT_UUID_PRI_SERVICE;
 static const uint16_t character_declaration_uuid = ESP_GATT_UUID_CHAR_DECLARE;
 static const uint8_t  char_prop_read             = ESP_GATT_CHAR_PROP_BIT_READ;
 static const uint8_t  char_prop_write            = ESP_GATT_CHAR_PROP_BIT_WRITE;
-//static const uint8_t  char_prop_read_write       = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE;
+static const uint8_t  char_prop_read_write       = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE;
 
 static const uint8_t prov_value[1]; // Note, this is not actually used, the application layer is in charge of repsonding to writes/reads of ATT objects
                                     // nevertheless, the API to set up the GATT table takes an arugement, so we pass this
@@ -190,8 +284,52 @@ static const esp_gatts_attr_db_t gatt_db[ID_FINAL] = {
     // Dump Characteristic Declaration (upload distance to cloud)
     [ID_DUMP_CHAR] = { { ESP_GATT_AUTO_RSP }, { ESP_UUID_LEN_16, (uint8_t*)&character_declaration_uuid, ESP_GATT_PERM_WRITE, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t*)&char_prop_write } },
     [ID_DUMP_VAL]  = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_16, (uint8_t*)&gatts_char_uuid_dump, ESP_GATT_PERM_WRITE, GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(prov_value), (uint8_t*)prov_value } },
+
+    // Capture Characteristic Declaration (ingest capture dump)
+    [ID_CAPTURE_CHAR] = { { ESP_GATT_AUTO_RSP }, { ESP_UUID_LEN_16, (uint8_t*)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t*)&char_prop_read } },
+    [ID_CAPTURE_VAL]  = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_16, (uint8_t*)&gatts_char_uuid_capture, ESP_GATT_PERM_READ, GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(prov_value), (uint8_t*)prov_value } },
+
+    // Config Characteristic Declaration (runtime tuning, see config_core.h)
+    [ID_CONFIG_CHAR] = { { ESP_GATT_AUTO_RSP }, { ESP_UUID_LEN_16, (uint8_t*)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t*)&char_prop_read_write } },
+    [ID_CONFIG_VAL]  = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_16, (uint8_t*)&gatts_char_uuid_config, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(prov_value), (uint8_t*)prov_value } },
+
+    // Upload Characteristic Declaration (missing chunks of the page being uploaded)
+    [ID_UPLOAD_CHAR] = { { ESP_GATT_AUTO_RSP }, { ESP_UUID_LEN_16, (uint8_t*)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t*)&char_prop_read } },
+    [ID_UPLOAD_VAL]  = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_16, (uint8_t*)&gatts_char_uuid_upload, ESP_GATT_PERM_READ, GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(prov_value), (uint8_t*)prov_value } },
+
+    // Status Characteristic Declaration (gateway health, see status_core.h)
+    [ID_STATUS_CHAR] = { { ESP_GATT_AUTO_RSP }, { ESP_UUID_LEN_16, (uint8_t*)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t*)&char_prop_read } },
+    [ID_STATUS_VAL]  = { { ESP_GATT_RSP_BY_APP }, { ESP_UUID_LEN_16, (uint8_t*)&gatts_char_uuid_status, ESP_GATT_PERM_READ, GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(prov_value), (uint8_t*)prov_value } },
 };
 
+#ifndef CONFIG_SET_RAW_ADV_DATA
+// esp_timer task, the only caller of esp_ble_gap_config_adv_data once
+// advertising runs, Bluedroid copies the data before this returns.
+// Refreshes the scan response status as well
+static void adv_time_refresh(void* arg) {
+    adv_time.utc          = get_time_utc();
+    adv_time.sync_quality = get_time_sync_quality();
+    esp_err_t ret         = esp_ble_gap_config_adv_data(&adv_data);
+    if (ret) {
+        ESP_LOGE(GATTS_TABLE_TAG, "adv time refresh failed, error code = %x", ret);
+    }
+
+    // the scan response keeps its last status if no consistent copy was taken
+    status_snapshot_t snap;
+    if (status_get(&snap)) {
+        adv_status.layout       = snap.layout;
+        adv_status.link         = snap.link;
+        adv_status.sync_quality = snap.sync_quality;
+        adv_status.busy         = snap.busy;
+        adv_status.spool_fill   = snap.spool_fill;
+        ret                     = esp_ble_gap_config_adv_data(&scan_rsp_data);
+        if (ret) {
+            ESP_LOGE(GATTS_TABLE_TAG, "scan response refresh failed, error code = %x", ret);
+        }
+    }
+}
+#endif
+
 static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
     switch (event) {
 #ifdef CONFIG_SET_RAW_ADV_DATA
@@ -209,12 +347,20 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
         break;
 #else
     case ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT:
+        if (!(adv_config_done & ADV_CONFIG_FLAG)) {
+            // a time refresh, advertising is already running
+            break;
+        }
         adv_config_done &= (~ADV_CONFIG_FLAG);
         if (adv_config_done == 0) {
             esp_ble_gap_start_advertising(&adv_params);
         }
         break;
     case ESP_GAP_BLE_SCAN_RSP_DATA_SET_COMPLETE_EVT:
+        if (!(adv_config_done & SCAN_RSP_CONFIG_FLAG)) {
+            // a status refresh, advertising is already running
+            break;
+        }
         adv_config_done &= (~SCAN_RSP_CONFIG_FLAG);
         if (adv_config_done == 0) {
             esp_ble_gap_start_advertising(&adv_params);
@@ -245,75 +391,472 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
                  param->update_conn_params.latency,
                  param->update_conn_params.timeout);
         break;
+    case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT:
+    case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
+    case ESP_GAP_BLE_SCAN_RESULT_EVT:
+        uwb_scan_gap_event(event, param);
+        break;
     default:
         break;
     }
 }
 
-void example_prepare_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t* prepare_write_env, esp_ble_gatts_cb_param_t* param) {
-    ESP_LOGI(GATTS_TABLE_TAG, "prepare write, handle = %d, value len = %d", param->write.handle, param->write.len);
-    esp_gatt_status_t status = ESP_GATT_OK;
-    if (prepare_write_env->prepare_buf == NULL) {
-        prepare_write_env->prepare_buf = (uint8_t*)malloc(PREPARE_BUF_MAX_SIZE * sizeof(uint8_t));
-        prepare_write_env->prepare_len = 0;
-        if (prepare_write_env->prepare_buf == NULL) {
-            ESP_LOGE(GATTS_TABLE_TAG, "%s, Gatt_server prep no mem", __func__);
-            status = ESP_GATT_NO_RESOURCES;
+static ble_write_t* write_begin(void) {
+    ble_write_t* write = NULL;
+    portENTER_CRITICAL(&write_mux);
+    for (int i = 0; i < BLE_WRITES_MAX; i++) {
+        if (!writes[i].used) {
+            write = &writes[i];
+            memset(write, 0, sizeof(*write));
+            write->used    = true;
+            write->pending = 1;
+            write->status  = MQTT_SUCCESS;
+            break;
         }
-    } else {
-        if (param->write.offset > PREPARE_BUF_MAX_SIZE) {
-            status = ESP_GATT_INVALID_OFFSET;
-        } else if ((param->write.offset + param->write.len) > PREPARE_BUF_MAX_SIZE) {
-            status = ESP_GATT_INVALID_ATTR_LEN;
+    }
+    portEXIT_CRITICAL(&write_mux);
+    if (!write) {
+        ESP_LOGE(GATTS_TABLE_TAG, "Too many writes in flight!");
+    }
+    return write;
+}
+
+// Called with write_mux held, NULL if bda has no ACKed write remembered
+static batch_seq_t* find_batch_seq(const uint8_t* bda) {
+    for (int i = 0; i < BLE_BATCH_SEQ_TAGS; i++) {
+        if (batch_seqs[i].used && !memcmp(batch_seqs[i].bda, bda, sizeof(batch_seqs[i].bda))) {
+            return &batch_seqs[i];
         }
     }
-    /*send response when param->write.need_rsp is true */
-    if (param->write.need_rsp) {
-        esp_gatt_rsp_t* gatt_rsp = (esp_gatt_rsp_t*)malloc(sizeof(esp_gatt_rsp_t));
-        if (gatt_rsp != NULL) {
-            gatt_rsp->attr_value.len      = param->write.len;
-            gatt_rsp->attr_value.handle   = param->write.handle;
-            gatt_rsp->attr_value.offset   = param->write.offset;
-            gatt_rsp->attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
-            memcpy(gatt_rsp->attr_value.value, param->write.value, param->write.len);
-            esp_err_t response_err = esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, gatt_rsp);
-            if (response_err != ESP_OK) {
-                ESP_LOGE(GATTS_TABLE_TAG, "Send response error");
-            }
-            free(gatt_rsp);
-        } else {
-            ESP_LOGE(GATTS_TABLE_TAG, "%s, malloc failed", __func__);
+    return NULL;
+}
+
+// Called with write_mux held. A tag not seen yet replaces the next entry
+// round robin
+static void remember_batch_seq(const uint8_t* bda, uint16_t seq) {
+    batch_seq_t* entry = find_batch_seq(bda);
+    if (!entry) {
+        entry          = &batch_seqs[batch_seq_next];
+        batch_seq_next = (batch_seq_next + 1) % BLE_BATCH_SEQ_TAGS;
+        memcpy(entry->bda, bda, sizeof(entry->bda));
+        entry->used = true;
+    }
+    entry->seq = seq;
+}
+
+// One reading of the write is through, or submitting them is over
+static void write_done(ble_write_t* write, int status) {
+    portENTER_CRITICAL(&write_mux);
+    if (status != MQTT_SUCCESS) {
+        write->status = MQTT_ERROR;
+    }
+    bool last = --write->pending == 0;
+    if (last && write->has_seq && write->status == MQTT_SUCCESS) {
+        remember_batch_seq(write->bda, write->seq);
+    }
+    portEXIT_CRITICAL(&write_mux);
+    if (!last) {
+        return;
+    }
+
+    // NACKed writes are resent by the tag
+    if (write->respond) {
+        ESP_LOGI(GATTS_TABLE_TAG, "Sending back %s!", write->status == MQTT_SUCCESS ? "ACK" : "NACK");
+        esp_ble_gatts_send_response(write->gatts_if, write->conn_id, write->trans_id,
+                                    write->status == MQTT_SUCCESS ? ESP_GATT_OK : ESP_GATT_ERROR, NULL);
+    }
+    ble_ingest_done_t done     = write->done;
+    void*             done_arg = write->done_arg;
+    status                     = write->status;
+    portENTER_CRITICAL(&write_mux);
+    write->used = false;
+    portEXIT_CRITICAL(&write_mux);
+    if (done) {
+        done(done_arg, status);
+    }
+}
+
+// msg_buf_t on_done, in the publisher task
+static void write_msg_done(msg_buf_t* msg) {
+    ble_write_t* write = msg->done_arg;
+    // the batch task holds the write until it is woken for the last reading
+    TaskHandle_t notify = write->notify;
+    if (notify) {
+        portENTER_CRITICAL(&write_mux);
+        write->in_flight--;
+        portEXIT_CRITICAL(&write_mux);
+    }
+    write_done(write, msg->status);
+    if (notify) {
+        xTaskNotifyGive(notify);
+    }
+}
+
+// upload_done_t, in the upload task
+static void write_upload_done(void* arg, int status) {
+    write_done(arg, status);
+}
+
+// One more outcome for write to wait for, ended by write_done
+static void write_hold(ble_write_t* write) {
+    portENTER_CRITICAL(&write_mux);
+    write->pending++;
+    portEXIT_CRITICAL(&write_mux);
+}
+
+// Hands a decoded reading to the pipeline on behalf of write, the caller
+// keeps its reference. Returns true if the publisher has it, false if it
+// is already through
+static bool write_submit(ble_write_t* write, msg_buf_t* msg) {
+    msg->on_done  = write_msg_done;
+    msg->done_arg = write;
+    write_hold(write);
+
+    int status = mqtt_submit_msg(msg);
+    if (status != MQTT_PENDING) {
+        write_done(write, status);
+        return false;
+    }
+    return true;
+}
+
+static void write_fail(ble_write_t* write) {
+    portENTER_CRITICAL(&write_mux);
+    write->status = MQTT_ERROR;
+    portEXIT_CRITICAL(&write_mux);
+}
+
+// A multi-record write (ble_batch_hdr_t), in the BTC task: checks it and
+// copies it for the batch task, which holds the write until every record
+// is submitted. The write is answered from wherever its last reading is
+// through
+static void batch_queue(ble_write_t* write, const uint8_t* bda, const uint8_t* value, uint16_t len) {
+    ble_batch_hdr_t hdr;
+    memcpy(&hdr, value, sizeof(hdr));
+    if (hdr.version != BLE_BATCH_VERSION || !hdr.count || len != sizeof(hdr) + hdr.count * UWB_PACKET_SIZE
+        || len > PREPARE_BUF_MAX_SIZE) {
+        ESP_LOGE(GATTS_TABLE_TAG, "Bad multi-record write, version %d, %d records in %d bytes", hdr.version, hdr.count, len);
+        write_fail(write);
+        return;
+    }
+
+    batch_job_t* job   = NULL;
+    bool         taken = false;
+    portENTER_CRITICAL(&write_mux);
+    if (bda) {
+        batch_seq_t* last = find_batch_seq(bda);
+        taken             = last && last->seq == hdr.seq;
+    }
+    for (int i = 0; i < BLE_BATCH_JOBS && !taken; i++) {
+        if (!batch_jobs[i].used) {
+            job       = &batch_jobs[i];
+            job->used = true;
+            break;
         }
     }
-    if (status != ESP_GATT_OK) {
+    portEXIT_CRITICAL(&write_mux);
+    if (taken) {
+        // the ACK got lost, the records are already up
+        ESP_LOGI(GATTS_TABLE_TAG, "Write %d already taken", hdr.seq);
+        return;
+    }
+    if (!job) {
+        ESP_LOGE(GATTS_TABLE_TAG, "Batch task busy, write %d NACKed", hdr.seq);
+        write_fail(write);
         return;
     }
-    memcpy(prepare_write_env->prepare_buf + param->write.offset,
-           param->write.value,
-           param->write.len);
-    prepare_write_env->prepare_len += param->write.len;
+
+    write->notify  = batch_handle;
+    write->has_seq = bda != NULL;
+    write->seq     = hdr.seq;
+    if (bda) {
+        memcpy(write->bda, bda, sizeof(write->bda));
+    }
+    job->write   = write;
+    job->has_bda = bda != NULL;
+    job->len     = len;
+    memcpy(job->bda, write->bda, sizeof(job->bda));
+    memcpy(job->value, value, len);
+    msg_buf_count_copy(len);
+    write_hold(write);
+    xQueueSend(batchQ, &job, portMAX_DELAY); // as deep as batch_jobs, never waits
+}
+
+// A buffer for the next record once fewer than BLE_BATCH_WINDOW readings
+// of the write are with the publisher. NULL if the pool is empty and none
+// of them is, nothing this write waits for would free one
+static msg_buf_t* batch_alloc(ble_write_t* write) {
+    while (true) {
+        portENTER_CRITICAL(&write_mux);
+        uint8_t in_flight = write->in_flight;
+        portEXIT_CRITICAL(&write_mux);
+        msg_buf_t* msg = in_flight < BLE_BATCH_WINDOW ? msg_buf_alloc() : NULL;
+        if (msg || !in_flight) {
+            return msg;
+        }
+        // woken by write_msg_done
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+// Every record becomes its own reading, BLE_BATCH_WINDOW of them go to
+// the publisher at a time instead of one write per round trip. Only
+// waits for the window, never for an ack
+static void batch_task(void* arg) {
+    batch_job_t* job;
+    while (true) {
+        xQueueReceive(batchQ, &job, portMAX_DELAY);
+        ble_write_t*   write  = job->write;
+        int            count  = (job->len - sizeof(ble_batch_hdr_t)) / UWB_PACKET_SIZE;
+        const uint8_t* record = job->value + sizeof(ble_batch_hdr_t);
+        for (int i = 0; i < count; i++, record += UWB_PACKET_SIZE) {
+            msg_buf_t* msg = batch_alloc(write);
+            if (!msg) {
+                ESP_LOGE(GATTS_TABLE_TAG, "Message pool empty!");
+                write_fail(write);
+                continue;
+            }
+            if (job->has_bda) {
+                memcpy(msg->tag, job->bda, sizeof(msg->tag));
+            }
+            uwb_packet_decode(record, UWB_PACKET_SIZE, (uwb_packet_t*)msg->data);
+            msg->len = UWB_PACKET_SIZE;
+            msg_buf_count_copy(msg->len);
+
+            portENTER_CRITICAL(&write_mux);
+            write->in_flight++;
+            portEXIT_CRITICAL(&write_mux);
+            if (!write_submit(write, msg)) {
+                portENTER_CRITICAL(&write_mux);
+                write->in_flight--;
+                portEXIT_CRITICAL(&write_mux);
+            }
+            msg_buf_unref(msg);
+        }
+        ESP_LOGI(GATTS_TABLE_TAG, "Write %d, %d records submitted", write->seq, count);
+
+        portENTER_CRITICAL(&write_mux);
+        job->used = false;
+        portEXIT_CRITICAL(&write_mux);
+        // the batch task's hold, the write is answered once the readings are through
+        write_done(write, MQTT_SUCCESS);
+    }
 }
 
-// returns MQTT_SUCCESS/MQTT_ERROR 
-int example_exec_write_event_env(prepare_type_env_t* prepare_write_env, esp_ble_gatts_cb_param_t* param) {
-    int ret = MQTT_ERROR;
-    if (param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC && prepare_write_env->prepare_buf) {
-        esp_log_buffer_hex(GATTS_TABLE_TAG, prepare_write_env->prepare_buf, prepare_write_env->prepare_len);
+// Decodes a written reading straight into a pooled message buffer, the
+// only copy it gets on its way to the publisher (Bluedroid frees value
+// once the event handler returns). bda is the writer, NULL if unknown.
+// Never waits on the publisher, the outcome goes to write
+static void ingest_reading(ble_write_t* write, const uint8_t* bda, const uint8_t* value, uint16_t len) {
+    // page uploads share the dump characteristic, a chunk frame is told
+    // apart by its length and magic
+    if (upload_is_chunk(value, len)) {
+        write_hold(write);
+        int status = upload_chunk(bda, value, len, write_upload_done, write);
+        if (status != MQTT_PENDING) {
+            write_done(write, status);
+        }
+        return;
+    }
+    // a single reading is exactly UWB_PACKET_SIZE, a multi-record write longer
+    uint16_t magic;
+    if (len > UWB_PACKET_SIZE && len >= sizeof(ble_batch_hdr_t)) {
+        memcpy(&magic, value, sizeof(magic));
+        if (magic == BLE_BATCH_MAGIC) {
+            batch_queue(write, bda, value, len);
+            return;
+        }
+    }
+
+    msg_buf_t* msg = msg_buf_alloc();
+    if (!msg) {
+        ESP_LOGE(GATTS_TABLE_TAG, "Message pool empty!");
+        write_fail(write);
+        return;
+    }
+    if (bda) {
+        memcpy(msg->tag, bda, sizeof(msg->tag));
+    }
+
+    if (uwb_packet_decode(value, len, (uwb_packet_t*)msg->data)) {
+        msg->len = UWB_PACKET_SIZE;
+        msg_buf_count_copy(msg->len);
+        write_submit(write, msg);
     } else {
-        ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATT_PREP_WRITE_CANCEL");
+        ESP_LOGE(GATTS_TABLE_TAG, "Write of %d bytes is too short for a reading", len);
+        write_fail(write);
+    }
+    msg_buf_unref(msg);
+}
+
+// Starts a write and submits its readings, done is called once they are
+// through. False if too many writes are in flight, done is not called then
+static bool ingest_async(const uint8_t* bda, const uint8_t* value, uint16_t len, ble_ingest_done_t done, void* done_arg) {
+    ble_write_t* write = write_begin();
+    if (!write) {
+        return false;
+    }
+    write->done     = done;
+    write->done_arg = done_arg;
+    ingest_reading(write, bda, value, len);
+    write_done(write, MQTT_SUCCESS);
+    return true;
+}
+
+// The same for a GATT write, answered with a response once its readings
+// are through (or right away with ESP_GATT_BUSY)
+static void ingest_gatt(esp_gatt_if_t gatts_if, uint16_t conn_id, uint32_t trans_id, bool need_rsp,
+                        const uint8_t* bda, const uint8_t* value, uint16_t len) {
+    ble_write_t* write = write_begin();
+    if (!write) {
+        if (need_rsp) {
+            esp_ble_gatts_send_response(gatts_if, conn_id, trans_id, ESP_GATT_BUSY, NULL);
+        }
+        return;
     }
-    if (prepare_write_env->prepare_buf) {
-        // commit this value to NVS (for the case the MTU was LESS than the size of the data)
-        ESP_LOGI(GATTS_TABLE_TAG, "Commiting to memory!");
-      
-        ret = send_packet_to_aws(prepare_write_env->prepare_buf);
+    write->respond  = need_rsp;
+    write->gatts_if = gatts_if;
+    write->conn_id  = conn_id;
+    write->trans_id = trans_id;
+    ingest_reading(write, bda, value, len);
+    write_done(write, MQTT_SUCCESS);
+}
+
+// ble_ingest_done_t of the blocking calls, arg is the caller's ingest_wait_t
+static void ingest_wake(void* arg, int status) {
+    ingest_wait_t* wait = arg;
+    wait->status        = status;
+    xTaskNotifyGive(wait->task);
+}
+
+// Blocking, for callers that stand in for the BTC task one write at a time
+static int ingest_wait(const uint8_t* bda, const uint8_t* value, uint16_t len) {
+    ingest_wait_t wait = { MQTT_ERROR, xTaskGetCurrentTaskHandle() };
+    if (!ingest_async(bda, value, len, ingest_wake, &wait)) {
+        return MQTT_ERROR;
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return wait.status;
+}
+
+// Transport independent part of a prepared write: validates and stages
+// one fragment. Used by the GATT handler and by the load generator
+esp_gatt_status_t ble_ingest_prepare_write(prepare_type_env_t* prepare_write_env, uint16_t offset, const uint8_t* value, uint16_t len) {
+    if (prepare_write_env->prepare_buf == NULL) {
+        prepare_write_env->prepare_buf = prepare_write_env->storage;
+        prepare_write_env->prepare_len = 0;
+    }
+    // the storage is always PREPARE_BUF_MAX_SIZE, prep_buf_size can only lower the limit
+    uint32_t limit = config_get(CFG_PREPARE_BUF_SIZE);
+    if (offset > limit) {
+        return ESP_GATT_INVALID_OFFSET;
+    } else if ((offset + len) > limit) {
+        return ESP_GATT_INVALID_ATTR_LEN;
+    }
+    memcpy(prepare_write_env->prepare_buf + offset, value, len);
+    msg_buf_count_copy(len);
+    prepare_write_env->prepare_len += len;
+    return ESP_GATT_OK;
+}
 
-        free(prepare_write_env->prepare_buf);
-        prepare_write_env->prepare_buf = NULL;
+// Ends the prepared write staged in prepare_write_env. Returns the value
+// to ingest, NULL if the write was cancelled or nothing was staged. The
+// value stays valid until the next fragment is staged
+static const uint8_t* prepare_end(prepare_type_env_t* prepare_write_env, bool exec, uint16_t* len) {
+    const uint8_t* value = exec ? prepare_write_env->prepare_buf : NULL;
+    *len                 = prepare_write_env->prepare_len;
+    if (value) {
+        esp_log_buffer_hex(GATTS_TABLE_TAG, value, *len);
+    } else if (!exec) {
+        ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATT_PREP_WRITE_CANCEL");
     }
-    // send response when param->write.need_rsp is true
+    prepare_write_env->prepare_buf = NULL;
     prepare_write_env->prepare_len = 0;
-    return ret;
+    return value;
+}
+
+// Transport independent part of an exec write
+// returns MQTT_SUCCESS/MQTT_ERROR once the readings are through
+int ble_ingest_exec_write(prepare_type_env_t* prepare_write_env, const uint8_t* bda, bool exec) {
+    uint16_t       len;
+    const uint8_t* value = prepare_end(prepare_write_env, exec, &len);
+    if (!value) {
+        return exec ? MQTT_ERROR : MQTT_SUCCESS;
+    }
+    return ingest_wait(bda, value, len);
+}
+
+bool ble_ingest_exec_write_async(prepare_type_env_t* prepare_write_env, const uint8_t* bda, bool exec,
+                                 ble_ingest_done_t done, void* done_arg) {
+    uint16_t       len;
+    const uint8_t* value = prepare_end(prepare_write_env, exec, &len);
+    if (!value) {
+        if (done) {
+            done(done_arg, exec ? MQTT_ERROR : MQTT_SUCCESS);
+        }
+        return true;
+    }
+    return ingest_async(bda, value, len, done, done_arg);
+}
+
+// Transport independent part of a single (shorter than MTU) write
+// returns MQTT_SUCCESS/MQTT_ERROR once the reading is through
+int ble_ingest_write(const uint8_t* bda, const uint8_t* value, uint16_t len) {
+    esp_log_buffer_hex(GATTS_TABLE_TAG, value, len);
+    return ingest_wait(bda, value, len);
+}
+
+bool ble_ingest_write_async(const uint8_t* bda, const uint8_t* value, uint16_t len, ble_ingest_done_t done, void* done_arg) {
+    esp_log_buffer_hex(GATTS_TABLE_TAG, value, len);
+    return ingest_async(bda, value, len, done, done_arg);
+}
+
+void example_prepare_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t* prepare_write_env, esp_ble_gatts_cb_param_t* param) {
+    ESP_LOGI(GATTS_TABLE_TAG, "prepare write, handle = %d, value len = %d", param->write.handle, param->write.len);
+    esp_gatt_status_t status = ble_ingest_prepare_write(prepare_write_env, param->write.offset, param->write.value, param->write.len);
+
+    /*send response when param->write.need_rsp is true */
+    if (param->write.need_rsp) {
+        esp_gatt_rsp_t* gatt_rsp      = &prepare_rsp;
+        gatt_rsp->attr_value.len      = param->write.len;
+        gatt_rsp->attr_value.handle   = param->write.handle;
+        gatt_rsp->attr_value.offset   = param->write.offset;
+        gatt_rsp->attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
+        memcpy(gatt_rsp->attr_value.value, param->write.value, param->write.len);
+        esp_err_t response_err = esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, gatt_rsp);
+        if (response_err != ESP_OK) {
+            ESP_LOGE(GATTS_TABLE_TAG, "Send response error");
+        }
+    }
+}
+
+// Answered once the readings are through, a cancel right away
+void example_exec_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t* prepare_write_env, esp_ble_gatts_cb_param_t* param) {
+    bool           exec = param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC;
+    uint16_t       len;
+    const uint8_t* value = prepare_end(prepare_write_env, exec, &len);
+    if (value) {
+        ingest_gatt(gatts_if, param->exec_write.conn_id, param->exec_write.trans_id, true, param->exec_write.bda, value, len);
+    } else {
+        esp_ble_gatts_send_response(gatts_if, param->exec_write.conn_id, param->exec_write.trans_id,
+                                    exec ? ESP_GATT_ERROR : ESP_GATT_OK, NULL);
+    }
+}
+
+static ble_conn_t* conn_find(uint16_t conn_id) {
+    for (int i = 0; i < BLE_CONNS_MAX; i++) {
+        if (conns[i].used && conns[i].conn_id == conn_id) {
+            return &conns[i];
+        }
+    }
+    return NULL;
+}
+
+// Bytes of a value that fit one read response on conn_id
+static uint16_t conn_read_len(uint16_t conn_id) {
+    ble_conn_t* conn = conn_find(conn_id);
+    uint16_t    mtu  = conn ? conn->mtu : ESP_GATT_DEF_BLE_MTU_SIZE;
+    return MIN(mtu - 1, GATTS_DEMO_CHAR_VAL_LEN_MAX);
 }
 
 static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param) {
@@ -336,7 +879,9 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_
         adv_config_done |= SCAN_RSP_CONFIG_FLAG;
 #else
         //config adv data
-        esp_err_t ret = esp_ble_gap_config_adv_data(&adv_data);
+        adv_time.utc          = get_time_utc();
+        adv_time.sync_quality = get_time_sync_quality();
+        esp_err_t ret         = esp_ble_gap_config_adv_data(&adv_data);
         if (ret) {
             ESP_LOGE(GATTS_TABLE_TAG, "config adv data failed, error code = %x", ret);
         }
@@ -347,66 +892,111 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_
             ESP_LOGE(GATTS_TABLE_TAG, "config scan response data failed, error code = %x", ret);
         }
         adv_config_done |= SCAN_RSP_CONFIG_FLAG;
+        esp_timer_start_periodic(adv_time_timer, BLE_ADV_TIME_REFRESH_MS * 1000);
 #endif
         esp_err_t create_attr_ret = esp_ble_gatts_create_attr_tab(gatt_db, gatts_if, ID_FINAL, SVC_INST_ID);
         if (create_attr_ret) {
             ESP_LOGE(GATTS_TABLE_TAG, "create attr table failed, error code = %x", create_attr_ret);
         }
     } break;
-    case ESP_GATTS_READ_EVT:
-        ESP_LOGI(GATTS_TABLE_TAG, "GATT_READ_EVT, conn_id %d, trans_id %d, handle %d\n", param->read.conn_id, param->read.trans_id, param->read.handle);
+    case ESP_GATTS_READ_EVT: {
+        ESP_LOGI(GATTS_TABLE_TAG, "GATT_READ_EVT, conn_id %d, trans_id %d, handle %d, offset %d\n", param->read.conn_id, param->read.trans_id, param->read.handle, param->read.offset);
         esp_gatt_rsp_t rsp;
         memset(&rsp, 0, sizeof(esp_gatt_rsp_t));
         rsp.attr_value.handle = param->read.handle;
+        rsp.attr_value.offset = param->read.offset;
         rsp.attr_value.len    = 4;
+        esp_gatt_status_t status   = ESP_GATT_OK;
+        uint16_t          read_len = conn_read_len(param->read.conn_id);
 
         if (param->read.handle == handle_start + ID_TIME_VAL) {
             ESP_LOGI(GATTS_TABLE_TAG, "Reading SNTP time");
             uint32_t time = get_time_utc();
             ESP_LOGI(GATTS_TABLE_TAG, "Time requested... = %d", time);
             memcpy(rsp.attr_value.value, &time, sizeof(uint32_t));
+        } else if (param->read.handle == handle_start + ID_CAPTURE_VAL) {
+            rsp.attr_value.len = capture_read_chunk(rsp.attr_value.value, read_len);
+        } else if (param->read.handle == handle_start + ID_CONFIG_VAL) {
+            // the whole table is longer than one response at the default
+            // MTU, the client reads on with Read Blob from read.offset
+            int len = config_read(param->read.offset, rsp.attr_value.value, read_len);
+            if (len < 0) {
+                status = ESP_GATT_INVALID_OFFSET;
+                len    = 0;
+            }
+            rsp.attr_value.len = len;
+        } else if (param->read.handle == handle_start + ID_UPLOAD_VAL) {
+            rsp.attr_value.len = upload_read_status(param->read.bda, rsp.attr_value.value, read_len);
+        } else if (param->read.handle == handle_start + ID_STATUS_VAL) {
+            // lock free, never waits on the publish pipeline. The snapshot is
+            // longer than one response at the default MTU, it is read on
+            // with Read Blob
+            ble_conn_t* conn = conn_find(param->read.conn_id);
+            int         len  = conn ? status_read(&conn->status, param->read.offset, rsp.attr_value.value, read_len) : 0;
+            if (len < 0) {
+                status = ESP_GATT_INVALID_OFFSET;
+                len    = 0;
+            }
+            rsp.attr_value.len = len;
         } else {
             ESP_LOGI(GATTS_TABLE_TAG, "Read unknown item?!");
         }
 
         esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id,
-                                    ESP_GATT_OK, &rsp);
+                                    status, &rsp);
 
-        break;
+    } break;
     case ESP_GATTS_WRITE_EVT:
-        if (!param->write.is_prep) {
+        if (param->write.handle == handle_start + ID_CONFIG_VAL) {
+            // config writes are short, signed and never staged in the ingest prepare buffer
+            esp_gatt_status_t status = ESP_GATT_INSUF_AUTHORIZATION;
+            if (!param->write.is_prep && config_gatt_write(param->write.value, param->write.len)) {
+                status = ESP_GATT_OK;
+            }
+            if (param->write.need_rsp) {
+                esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, NULL);
+            }
+        } else if (capture_replaying()) {
+            // a replay owns the ingest path, live writes would interleave with it
+            // (the tag resends once it is over)
+            if (param->write.need_rsp) {
+                esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_BUSY, NULL);
+            }
+        } else if (!param->write.is_prep) {
             // Smaller than MTU
             ESP_LOGI(GATTS_TABLE_TAG, "GATT_WRITE_EVT, handle = %d, value len = %d, value :", param->write.handle, param->write.len);
+            capture_gatt_write(CAPTURE_WRITE, param->write.conn_id, param->write.handle, 0, param->write.value, param->write.len);
             esp_log_buffer_hex(GATTS_TABLE_TAG, param->write.value, param->write.len);
-        
-            send_packet_to_aws(param->write.value);
-
-            if (param->write.need_rsp) {
-                esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
-            }
+            // answered once the reading is published or spooled, NACKed like
+            // a failed exec write so the tag resends
+            ingest_gatt(gatts_if, param->write.conn_id, param->write.trans_id, param->write.need_rsp,
+                        param->write.bda, param->write.value, param->write.len);
         } else {
             ESP_LOGI(GATTS_TABLE_TAG, "Prepared write!");
+            capture_gatt_write(CAPTURE_PREP_WRITE, param->write.conn_id, param->write.handle, param->write.offset, param->write.value, param->write.len);
             example_prepare_write_event_env(gatts_if, &prepare_write_env, param);
         }
         break;
     case ESP_GATTS_EXEC_WRITE_EVT:
         // the length of gattc prepare write data must be less than GATTS_DEMO_CHAR_VAL_LEN_MAX.
         ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_EXEC_WRITE_EVT");
-        int ret = example_exec_write_event_env(&prepare_write_env, param);
-
-        if (param->write.need_rsp) {
-            if (ret == MQTT_SUCCESS){
-              ESP_LOGI(GATTS_TABLE_TAG, "Sending back ACK!");
-              esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
-            } else {
-              ESP_LOGI(GATTS_TABLE_TAG, "Sending back NACK!");
-              esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_ERROR, NULL);
-            }
+        capture_gatt_write(CAPTURE_EXEC_WRITE, param->exec_write.conn_id, 0, param->exec_write.exec_write_flag, NULL, 0);
+        if (capture_replaying()) {
+            // fragments staged before the replay started are dropped with the write
+            prepare_write_env.prepare_buf = NULL;
+            prepare_write_env.prepare_len = 0;
+            esp_ble_gatts_send_response(gatts_if, param->exec_write.conn_id, param->exec_write.trans_id, ESP_GATT_BUSY, NULL);
+        } else {
+            example_exec_write_event_env(gatts_if, &prepare_write_env, param);
         }
         break;
-    case ESP_GATTS_MTU_EVT:
-        ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_MTU_EVT, MTU %d", param->mtu.mtu);
-        break;
+    case ESP_GATTS_MTU_EVT: {
+        ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_MTU_EVT, conn_id %d, MTU %d", param->mtu.conn_id, param->mtu.mtu);
+        ble_conn_t* conn = conn_find(param->mtu.conn_id);
+        if (conn) {
+            conn->mtu = param->mtu.mtu;
+        }
+    } break;
     case ESP_GATTS_CONF_EVT:
         ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_CONF_EVT, status = %d, attr_handle %d", param->conf.status, param->conf.handle);
         break;
@@ -417,21 +1007,32 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_
     case ESP_GATTS_CONNECT_EVT:
         esp_ble_gap_start_advertising(&adv_params);
         ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_CONNECT_EVT, conn_id = %d", param->connect.conn_id);
+        for (int i = 0; i < BLE_CONNS_MAX; i++) {
+            if (!conns[i].used) {
+                conns[i] = (ble_conn_t){ .used = true, .conn_id = param->connect.conn_id, .mtu = ESP_GATT_DEF_BLE_MTU_SIZE };
+                break;
+            }
+        }
         esp_log_buffer_hex(GATTS_TABLE_TAG, param->connect.remote_bda, 6);
         esp_ble_conn_update_params_t conn_params = { 0 };
         memcpy(conn_params.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
         /* For the iOS system, please refer to Apple official documents about the BLE connection parameters restrictions. */
-        conn_params.latency = 0;
-        conn_params.max_int = 0x20; // max_int = 0x20*1.25ms = 40ms
-        conn_params.min_int = 0x10; // min_int = 0x10*1.25ms = 20ms
-        conn_params.timeout = 400;  // timeout = 400*10ms = 4000ms
+        // defaults: latency 0, 20-40 ms interval, 4 s supervision timeout
+        conn_params.latency = config_get(CFG_CONN_LATENCY);
+        conn_params.max_int = config_get(CFG_CONN_MAX_INT); // units of 1.25ms
+        conn_params.min_int = config_get(CFG_CONN_MIN_INT); // units of 1.25ms
+        conn_params.timeout = config_get(CFG_CONN_TIMEOUT); // units of 10ms
         //start sent the update connection parameters to the peer device.
         esp_ble_gap_update_conn_params(&conn_params);
         break;
-    case ESP_GATTS_DISCONNECT_EVT:
+    case ESP_GATTS_DISCONNECT_EVT: {
         ESP_LOGI(GATTS_TABLE_TAG, "ESP_GATTS_DISCONNECT_EVT, reason = 0x%x", param->disconnect.reason);
+        ble_conn_t* conn = conn_find(param->disconnect.conn_id);
+        if (conn) {
+            conn->used = false;
+        }
         esp_ble_gap_start_advertising(&adv_params);
-        break;
+    } break;
     case ESP_GATTS_CREAT_ATTR_TAB_EVT: {
         if (param->add_attr_tab.status != ESP_GATT_OK) {
             ESP_LOGE(GATTS_TABLE_TAG, "create attribute table failed, error code=0x%x", param->add_attr_tab.status);
@@ -488,6 +1089,33 @@ static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_
 void ble_init(void) {
     esp_err_t ret;
 
+    mem_register_static("ble_prepare_buf", sizeof(prepare_write_env) + sizeof(prepare_rsp) + sizeof(batch_seqs) + sizeof(writes));
+    mem_register_static("ble_conns", sizeof(conns));
+
+    batchQ = xQueueCreateStatic(BLE_BATCH_JOBS, sizeof(batch_job_t*), batchQ_storage, &batchQ_buf);
+    ASSERT(batchQ);
+    batch_handle = xTaskCreateStaticPinnedToCore(
+        batch_task,            // Function that implements the task.
+        "ble_batch",           // Text name for the task.
+        BLE_BATCH_STACK_SIZE,  // Stack size in bytes on the ESP32.
+        NULL,                  // Parameter passed into the task.
+        BLE_BATCH_PRIORITY,    // Priority at which the task is created.
+        batch_stack,           // Stack buffer.
+        &batch_tcb,            // Task control block.
+        BLE_BATCH_CORE);       // Core the task is pinned to.
+    ASSERT(batch_handle);
+    mem_register_stack("ble_batch", sizeof(batch_stack));
+    mem_register_static("ble_batch_jobs", sizeof(batch_jobs) + sizeof(batchQ_storage));
+
+#ifndef CONFIG_SET_RAW_ADV_DATA
+    const esp_timer_create_args_t timer_args = {
+        .callback        = adv_time_refresh,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "adv_time",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &adv_time_timer));
+#endif
+
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
 
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
@@ -537,4 +1165,8 @@ void ble_init(void) {
     if (local_mtu_ret) {
         ESP_LOGE(GATTS_TABLE_TAG, "set local  MTU failed, error code = %x", local_mtu_ret);
     }
+
+    if (uwb_scan_adv() != MQTT_SUCCESS) {
+        ESP_LOGE(GATTS_TABLE_TAG, "Tag advertisement scanning not started");
+    }
 }
@@ -1,18 +1,85 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "esp_gatts_api.h"
+
 /*********************************************************
 *                     TYPEDEFS
 **********************************************************/
+#define PREPARE_BUF_MAX_SIZE 1024 // prepare buffer storage, upper bound of prep_buf_size
+
+// One prepared write in progress. Every caller of the ingest path (the GATT
+// handler, the load generator, the capture replay) owns one with its own
+// storage, so they can stage writes at the same time
+typedef struct {
+    uint8_t* prepare_buf; // NULL until the first fragment, then storage
+    int      prepare_len;
+    uint8_t  storage[PREPARE_BUF_MAX_SIZE];
+} prepare_type_env_t;
+
+// Manufacturer data in the advertising packet, little endian. Keep it
+// short, flags + name + this + tx power fill the 31 byte packet
+typedef struct {
+    uint8_t  device_id[5];
+    uint32_t utc;          // seconds, valid when sync_quality != 0
+    uint8_t  sync_quality; // 0 never synced, else 255 - minutes since the last SNTP sync
+} __attribute__((packed)) ble_adv_time_t;
+
+// Manufacturer data in the scan response, a few fields of the status
+// snapshot (status_core.h) so tags can skip a busy gateway without connecting
+typedef struct {
+    uint8_t  device_id[2];
+    uint8_t  layout; // STATUS_LAYOUT_VERSION
+    uint8_t  link;   // mqtt_link_state_t
+    uint8_t  sync_quality;
+    uint8_t  busy;       // 0..100
+    uint16_t spool_fill; // permille
+} __attribute__((packed)) ble_adv_status_t;
+
+// Multi-record write to the dump characteristic, so one write at the
+// negotiated MTU carries up to ~60 readings instead of one:
+//   [ble_batch_hdr_t][count uwb_packet_t, UWB_PACKET_SIZE bytes each]
+// The BTC task copies the write to the batch task, which submits the
+// records with at most BLE_BATCH_WINDOW of them in flight and never waits
+// on a PUBACK itself. The write is ACKed once every record is published
+// (or spooled), a resend of the seq last ACKed to the same tag is ACKed
+// without publishing again
+typedef struct {
+    uint16_t magic;   // BLE_BATCH_MAGIC
+    uint8_t  version; // BLE_BATCH_VERSION
+    uint8_t  count;   // records, at least 1
+    uint16_t seq;     // per tag, picked by the tag
+} __attribute__((packed)) ble_batch_hdr_t;
+
+// Outcome of a write: MQTT_SUCCESS once every reading it carried was
+// published or spooled, else MQTT_ERROR. Called from the task that
+// finished the last reading, usually the publisher
+typedef void (*ble_ingest_done_t)(void* arg, int status);
 
 /**********************************************************
 *                   GLOBAL FUNCTIONS
 **********************************************************/
 void ble_init(void);
 
+// The GATT write path without the BLE transport, these run in the BTC
+// task context, or a task standing in for it (the load generator's ingest
+// task, the capture replay), each with its own prepare_type_env_t.
+// bda is the writing tag, NULL if unknown (the reading then always goes up raw).
+// The GATT handler itself never blocks, it answers a write once its
+// readings are through. ble_ingest_write and ble_ingest_exec_write block
+// until then and return the status, the _async ones return right away
+// and call done later (false if the write was refused, done is not called)
+esp_gatt_status_t ble_ingest_prepare_write(prepare_type_env_t* prepare_write_env, uint16_t offset, const uint8_t* value, uint16_t len);
+int               ble_ingest_exec_write(prepare_type_env_t* prepare_write_env, const uint8_t* bda, bool exec);
+int               ble_ingest_write(const uint8_t* bda, const uint8_t* value, uint16_t len);
+bool              ble_ingest_exec_write_async(prepare_type_env_t* prepare_write_env, const uint8_t* bda, bool exec,
+                                              ble_ingest_done_t done, void* done_arg);
+bool              ble_ingest_write_async(const uint8_t* bda, const uint8_t* value, uint16_t len, ble_ingest_done_t done, void* done_arg);
+
 /**********************************************************
 *                      GLOBALS    
 *********************************************************/
@@ -20,6 +87,17 @@ void ble_init(void);
 /**********************************************************
 *                      DEFINES
 **********************************************************/
+#define BLE_ADV_TIME_REFRESH_MS (1000)
+#define BLE_BATCH_MAGIC         (0xBA7C)
+#define BLE_BATCH_VERSION       (1)
+#define BLE_BATCH_WINDOW        (8) // readings of one write in flight, half the msg_buf pool
+#define BLE_BATCH_JOBS          (2) // multi-record writes copied for the batch task, more are NACKed
+#define BLE_BATCH_STACK_SIZE    (2560)
+#define BLE_BATCH_PRIORITY      (5)
+#define BLE_BATCH_CORE          (0) // with the BTC task
+#define BLE_BATCH_SEQ_TAGS      (8) // tags whose last ACKed seq is remembered
+#define BLE_CONNS_MAX           (3) // CONFIG_BTDM_CTRL_BLE_MAX_CONN
+#define BLE_WRITES_MAX          (8) // writes waiting on the publisher, more are answered ESP_GATT_BUSY
 
 /**********************************************************
 *                      ENUMS
@@ -36,5 +114,21 @@ enum {
     ID_DUMP_CHAR,
     ID_DUMP_VAL,
 
+    // Reads out the ingest capture (see capture_core.h), one chunk per read
+    ID_CAPTURE_CHAR,
+    ID_CAPTURE_VAL,
+
+    // Runtime tuning, reads return the values, writes are HMAC signed (see config_core.h)
+    ID_CONFIG_CHAR,
+    ID_CONFIG_VAL,
+
+    // Page upload progress, reads return the reader's upload_status_t (see upload_core.h)
+    ID_UPLOAD_CHAR,
+    ID_UPLOAD_VAL,
+
+    // Gateway health, reads return a status_snapshot_t (see status_core.h)
+    ID_STATUS_CHAR,
+    ID_STATUS_VAL,
+
     ID_FINAL,
 };
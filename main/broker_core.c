@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "broker_core.h"
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+void broker_set_init(broker_set_t* set, int count, int64_t now_us) {
+    memset(set, 0, sizeof(*set));
+    set->count = count < 1 ? 1 : (count > BROKER_MAX ? BROKER_MAX : count);
+    for (int i = 0; i < set->count; i++) {
+        set->health[i].changed_us = now_us;
+    }
+}
+
+void broker_ack(broker_set_t* set, int idx, uint32_t rtt_us, int64_t now_us) {
+    broker_health_t* h = &set->health[idx];
+    h->srtt_us         = h->acks ? h->srtt_us - h->srtt_us / 8 + rtt_us / 8 : rtt_us;
+    h->last_ack_us     = now_us;
+    h->err_permille -= h->err_permille / 8;
+    h->samples++;
+    h->acks++;
+}
+
+void broker_error(broker_set_t* set, int idx) {
+    broker_health_t* h = &set->health[idx];
+    h->err_permille += (1000 - h->err_permille) / 8;
+    h->samples++;
+    h->errors++;
+}
+
+void broker_up(broker_set_t* set, int idx, int64_t now_us) {
+    broker_health_t* h  = &set->health[idx];
+    h->up               = true;
+    h->changed_us       = now_us;
+    h->connect_failures = 0;
+    h->samples          = 0;
+    h->err_permille     = 0;
+}
+
+void broker_down(broker_set_t* set, int idx, int64_t now_us) {
+    broker_health_t* h = &set->health[idx];
+    if (h->up) {
+        h->up         = false;
+        h->changed_us = now_us;
+    } else {
+        h->connect_failures++;
+    }
+}
+
+uint32_t broker_score(const broker_health_t* h) {
+    uint64_t srtt_us = h->acks ? h->srtt_us : BROKER_SRTT_UNKNOWN_US;
+    // an error costs like four times the latency, a failed connect a second
+    return srtt_us / 1000 * (1000 + 4 * h->err_permille) / 1000 + h->connect_failures * BROKER_CONNECT_PENALTY;
+}
+
+bool broker_healthy(const broker_health_t* h) {
+    return h->samples < BROKER_MIN_SAMPLES || h->err_permille < BROKER_ERR_FAILOVER;
+}
+
+int broker_pick(const broker_set_t* set, int64_t now_us, uint32_t failover_ms) {
+    const broker_health_t* cur = &set->health[set->active];
+
+    bool failing = !cur->up || !broker_healthy(cur);
+    if (failing) {
+        // a warm broker first, the best scored one
+        int best = -1;
+        for (int i = 0; i < set->count; i++) {
+            const broker_health_t* h = &set->health[i];
+            if (i != set->active && h->up && broker_healthy(h)
+                && (best < 0 || broker_score(h) < broker_score(&set->health[best]))) {
+                best = i;
+            }
+        }
+        // otherwise the next one in the list, cold, once the active one has
+        // neither connected nor acked anything for failover_ms
+        int64_t since_us = cur->last_ack_us > cur->changed_us ? cur->last_ack_us : cur->changed_us;
+        if (best < 0 && set->count > 1 && now_us - since_us >= (int64_t)failover_ms * 1000) {
+            best = (set->active + 1) % set->count;
+        }
+        return best;
+    }
+
+    // back to a preferred broker that has been fine for a while
+    for (int i = 0; i < set->active; i++) {
+        const broker_health_t* h = &set->health[i];
+        if (h->up && broker_healthy(h) && now_us - h->changed_us >= (int64_t)BROKER_FAILBACK_MS * 1000) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int broker_standby_target(const broker_set_t* set) {
+    for (int i = 0; i < set->count; i++) {
+        if (i != set->active) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void broker_switch(broker_set_t* set, int to, int64_t now_us) {
+    set->health[set->active].failovers++;
+    set->active = to;
+    if (!set->health[to].up) {
+        // connecting from now on, down for failover_ms from here moves on again
+        set->health[to].changed_us = now_us;
+    }
+}
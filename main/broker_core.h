@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Broker failover policy. The uplink goes to one broker of an ordered list
+// (the first is preferred). Each broker is scored from its PUBACK latency
+// and the share of publishes that failed on it. When the active broker is
+// down, or up but failing publishes (error rate above BROKER_ERR_FAILOVER),
+// the uplink moves at once to a connected healthy standby, and without one
+// to the next broker in the list after failover_ms without an ack. It goes
+// back to a broker earlier in the list once that one has been up and
+// healthy for BROKER_FAILBACK_MS.
+// No IDF calls, tools/failover_sim.c builds it on the host
+#define BROKER_MAX             (3)
+#define BROKER_URI_LEN         (96)
+#define BROKER_ERR_FAILOVER    (500)    // permille
+#define BROKER_MIN_SAMPLES     (8)      // publishes since connect before the error rate counts
+#define BROKER_FAILBACK_MS     (60000)
+#define BROKER_SRTT_UNKNOWN_US (500000) // score of a broker without ack samples
+#define BROKER_CONNECT_PENALTY (1000)   // score per failed connect in a row
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    bool     up;
+    int64_t  changed_us;       // last up/down change, or when it became active
+    int64_t  last_ack_us;
+    uint32_t srtt_us;          // PUBACK latency, gain 1/8
+    uint16_t err_permille;     // failed publishes, gain 1/8
+    uint32_t samples;          // acks + errors since the last connect
+    uint32_t connect_failures; // in a row
+    uint32_t acks;
+    uint32_t errors;
+    uint32_t failovers; // times the uplink moved away from it
+} broker_health_t;
+
+typedef struct {
+    int             count;
+    int             active;
+    broker_health_t health[BROKER_MAX];
+} broker_set_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void broker_set_init(broker_set_t* set, int count, int64_t now_us);
+
+void broker_ack(broker_set_t* set, int idx, uint32_t rtt_us, int64_t now_us);
+void broker_error(broker_set_t* set, int idx);
+void broker_up(broker_set_t* set, int idx, int64_t now_us);
+// A connection lost, or a connect attempt that failed
+void broker_down(broker_set_t* set, int idx, int64_t now_us);
+
+// Lower is better
+uint32_t broker_score(const broker_health_t* health);
+bool     broker_healthy(const broker_health_t* health);
+
+// The broker the uplink should move to now, -1 to stay
+int broker_pick(const broker_set_t* set, int64_t now_us, uint32_t failover_ms);
+// The broker a standby connection should keep warm, -1 if there is none
+int broker_standby_target(const broker_set_t* set);
+// Makes to the active broker
+void broker_switch(broker_set_t* set, int to, int64_t now_us);
@@ -0,0 +1,430 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "mqtt_client.h"
+
+#include "ble_core.h"
+#include "capture_core.h"
+#include "global_defines.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "msg_buf.h"
+
+// Every inbound GATT write and every MQTT event goes into a RAM ring as a
+// capture_record_t + payload, oldest records are dropped when it is full.
+// Dumping or replaying freezes the ring so it can be walked without copying.
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint32_t pos;  // offset from the oldest byte in the ring
+    uint32_t used; // ring bytes at the time the cursor started
+} capture_cursor_t;
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "CAPTURE";
+
+static uint8_t      ring[CAPTURE_RING_SIZE];
+static uint32_t     ring_tail; // oldest byte
+static uint32_t     ring_used;
+static uint32_t     ring_dropped; // records overwritten since boot
+static bool         frozen;
+static portMUX_TYPE ring_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// BLE dump, the file header is served first, then the ring
+static capture_file_header_t dump_header;
+static uint32_t              dump_pos;
+static bool                  dump_active;
+
+// Replay, one cursor per consumer so the BLE side can block on an ack
+// while the MQTT side keeps feeding events in capture order. The publish
+// cursor is walked by whoever publishes through the hook, under its mutex
+static uint32_t           replay_speedup;
+static int64_t            replay_start_us;
+static uint32_t           replay_first_ms;
+static capture_cursor_t   replay_publish_cursor;
+static SemaphoreHandle_t  replay_publish_sem;
+static StaticSemaphore_t  replay_publish_sem_buf;
+static prepare_type_env_t replay_prepare_env; // its own prepare buffer, BTC keeps writing to its own
+static uint8_t            replay_payload[CAPTURE_MAX_PAYLOAD];
+static uint8_t            replay_event_payload[sizeof(int32_t)];
+static volatile int       replay_tasks_running;
+
+static StackType_t  replay_ble_stack[CAPTURE_REPLAY_STACK];
+static StaticTask_t replay_ble_tcb;
+static StackType_t  replay_mqtt_stack[CAPTURE_REPLAY_STACK];
+static StaticTask_t replay_mqtt_tcb;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+// must hold ring_mux, or have the ring frozen
+static void ring_copy_out(uint32_t pos, void* out, uint32_t len) {
+    uint32_t start = (ring_tail + pos) % CAPTURE_RING_SIZE;
+    uint32_t first = MIN(len, CAPTURE_RING_SIZE - start);
+    memcpy(out, ring + start, first);
+    memcpy((uint8_t*)out + first, ring, len - first);
+}
+
+// must hold ring_mux, or have the ring frozen
+static void ring_copy_in(const void* in, uint32_t len) {
+    uint32_t start = (ring_tail + ring_used) % CAPTURE_RING_SIZE;
+    uint32_t first = MIN(len, CAPTURE_RING_SIZE - start);
+    memcpy(ring + start, in, first);
+    memcpy(ring, (const uint8_t*)in + first, len - first);
+    ring_used += len;
+}
+
+// must hold ring_mux, or have the ring frozen
+static void ring_drop_oldest(void) {
+    capture_record_t rec;
+    ring_copy_out(0, &rec, sizeof(rec));
+    uint32_t size = sizeof(rec) + rec.len;
+    ring_tail     = (ring_tail + size) % CAPTURE_RING_SIZE;
+    ring_used -= size;
+    ring_dropped++;
+}
+
+static void capture_record(uint8_t type, uint16_t conn_id, uint16_t handle, uint16_t offset, const void* payload, uint16_t len) {
+    capture_record_t rec;
+    rec.ts_ms   = (uint32_t)(esp_timer_get_time() / 1000);
+    rec.type    = type;
+    rec.conn_id = conn_id;
+    rec.handle  = handle;
+    rec.offset  = offset;
+    rec.len     = MIN(len, CAPTURE_MAX_PAYLOAD);
+
+    portENTER_CRITICAL(&ring_mux);
+    if (!frozen) {
+        while (CAPTURE_RING_SIZE - ring_used < sizeof(rec) + rec.len) {
+            ring_drop_oldest();
+        }
+        ring_copy_in(&rec, sizeof(rec));
+        if (rec.len) {
+            ring_copy_in(payload, rec.len);
+        }
+    }
+    portEXIT_CRITICAL(&ring_mux);
+}
+
+void capture_gatt_write(uint8_t type, uint16_t conn_id, uint16_t handle, uint16_t offset, const uint8_t* value, uint16_t len) {
+    capture_record(type, conn_id, handle, offset, value, len);
+}
+
+void capture_publish(int message_id) {
+    int32_t id = message_id;
+    capture_record(CAPTURE_PUBLISH, 0, 0, 0, &id, sizeof(id));
+}
+
+void capture_mqtt_event(int event_id, int message_id) {
+    int32_t id = message_id;
+    capture_record(CAPTURE_MQTT_EVENT, 0, 0, (uint16_t)event_id, &id, sizeof(id));
+}
+
+static void freeze(bool on) {
+    portENTER_CRITICAL(&ring_mux);
+    frozen = on;
+    portEXIT_CRITICAL(&ring_mux);
+}
+
+// Walks the frozen ring, returns false at the end
+static bool cursor_next(capture_cursor_t* cursor, capture_record_t* rec, uint8_t* payload, uint32_t payload_max) {
+    if (cursor->pos + sizeof(*rec) > cursor->used) {
+        return false;
+    }
+    ring_copy_out(cursor->pos, rec, sizeof(*rec));
+    ring_copy_out(cursor->pos + sizeof(*rec), payload, MIN(rec->len, payload_max));
+    cursor->pos += sizeof(*rec) + rec->len;
+    return true;
+}
+
+static void cursor_start(capture_cursor_t* cursor) {
+    cursor->pos  = 0;
+    cursor->used = ring_used;
+}
+
+/**********************************************************
+*                                                   DUMPS *
+**********************************************************/
+
+static void dump_begin(void) {
+    freeze(true);
+    dump_header.magic              = CAPTURE_MAGIC;
+    dump_header.version            = CAPTURE_FORMAT_VERSION;
+    dump_header.record_header_size = sizeof(capture_record_t);
+    dump_header.bytes              = ring_used;
+    dump_pos                       = 0;
+    dump_active                    = true;
+    ESP_LOGI(TAG, "Dumping %d bytes, %d records dropped so far", ring_used, ring_dropped);
+}
+
+// Copies the next max_len bytes of header + records
+static uint16_t dump_next(uint8_t* out, uint16_t max_len) {
+    uint32_t total  = sizeof(dump_header) + dump_header.bytes;
+    uint16_t copied = 0;
+
+    while (copied < max_len && dump_pos < total) {
+        if (dump_pos < sizeof(dump_header)) {
+            uint32_t n = MIN(max_len - copied, sizeof(dump_header) - dump_pos);
+            memcpy(out + copied, (uint8_t*)&dump_header + dump_pos, n);
+            copied += n;
+            dump_pos += n;
+        } else {
+            uint32_t n = MIN(max_len - copied, total - dump_pos);
+            ring_copy_out(dump_pos - sizeof(dump_header), out + copied, n);
+            copied += n;
+            dump_pos += n;
+        }
+    }
+    return copied;
+}
+
+static void dump_end(void) {
+    dump_active = false;
+    freeze(false);
+}
+
+// GATT reads come from the BTC task one at a time, the first read starts
+// a dump and an empty read ends it
+uint16_t capture_read_chunk(uint8_t* out, uint16_t max_len) {
+    if (replay_tasks_running) {
+        return 0;
+    }
+    if (!dump_active) {
+        dump_begin();
+    }
+    uint16_t len = dump_next(out, max_len);
+    if (!len) {
+        dump_end();
+    }
+    return len;
+}
+
+// MQTT command "capture_dump", each chunk is prefixed with its byte
+// offset in the dump so the host can spot a lost chunk
+static void capture_dump_cmd(const char* args, int args_len) {
+    static uint8_t chunk[sizeof(uint32_t) + CAPTURE_DUMP_CHUNK];
+
+    if (dump_active || replay_tasks_running) {
+        ESP_LOGE(TAG, "Capture busy, not dumping");
+        return;
+    }
+
+    dump_begin();
+    while (true) {
+        uint32_t offset = dump_pos;
+        uint16_t len    = dump_next(chunk + sizeof(offset), CAPTURE_DUMP_CHUNK);
+        if (!len) {
+            break;
+        }
+        memcpy(chunk, &offset, sizeof(offset));
+        if (mqtt_publish_raw(CAPTURE_DUMP_TOPIC, (const char*)chunk, sizeof(offset) + len) < 0) {
+            ESP_LOGE(TAG, "Failed to publish dump chunk at %d", offset);
+            break;
+        }
+    }
+    dump_end();
+}
+
+/**********************************************************
+*                                                  REPLAY *
+**********************************************************/
+
+// Waits until the record's (scaled) time since the start of the capture
+static void replay_wait(uint32_t ts_ms) {
+    if (!replay_speedup) {
+        return;
+    }
+    int64_t due = replay_start_us + ((int64_t)(ts_ms - replay_first_ms) * 1000) / replay_speedup;
+    int64_t now = esp_timer_get_time();
+    if (due > now) {
+        vTaskDelay(MAX(1, (due - now) / 1000 / portTICK_PERIOD_MS));
+    }
+}
+
+// Stands in for the broker during a replay: hands out the message ids
+// in the order the client returned them when the capture was taken
+static int replay_publish_hook(const char* topic, const char* data, int len, int qos) {
+    capture_record_t rec;
+    int32_t          id;
+    int              message_id = -1;
+
+    xSemaphoreTake(replay_publish_sem, portMAX_DELAY);
+    while (cursor_next(&replay_publish_cursor, &rec, (uint8_t*)&id, sizeof(id))) {
+        if (rec.type == CAPTURE_PUBLISH) {
+            message_id = id;
+            break;
+        }
+    }
+    xSemaphoreGive(replay_publish_sem);
+
+    if (message_id < 0) {
+        ESP_LOGE(TAG, "Replay ran out of captured message ids");
+    }
+    return message_id;
+}
+
+bool capture_replaying(void) {
+    return replay_tasks_running > 0;
+}
+
+// Live ingest is refused from the moment a replay is requested, this waits
+// for readings already taken to leave the pipeline, so none of them gets a
+// captured message id. False if they didn't within CAPTURE_QUIESCE_MS
+static bool replay_quiesce(void) {
+    msg_buf_stats_t stats;
+    for (int waited_ms = 0; waited_ms < CAPTURE_QUIESCE_MS; waited_ms += CAPTURE_QUIESCE_POLL_MS) {
+        msg_buf_get_stats(&stats);
+        if (!stats.in_use) {
+            return true;
+        }
+        vTaskDelay(MAX(1, CAPTURE_QUIESCE_POLL_MS / portTICK_PERIOD_MS));
+    }
+    ESP_LOGE(TAG, "%d live readings still in the pipeline, not replaying", stats.in_use);
+    return false;
+}
+
+static void replay_done(void) {
+    portENTER_CRITICAL(&ring_mux);
+    replay_tasks_running--;
+    bool last = replay_tasks_running == 0;
+    portEXIT_CRITICAL(&ring_mux);
+
+    if (last) {
+        mqtt_set_publish_hook(NULL);
+        freeze(false);
+        ESP_LOGI(TAG, "Replay finished");
+    }
+}
+
+static void replay_mqtt_task(void* arg);
+
+static void replay_ble_task(void* arg) {
+    capture_cursor_t cursor;
+    capture_record_t rec;
+
+    if (!replay_quiesce()) {
+        portENTER_CRITICAL(&ring_mux);
+        replay_tasks_running = 0;
+        portEXIT_CRITICAL(&ring_mux);
+        freeze(false);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    // both cursors start at the same time, the hook before either
+    cursor_start(&cursor);
+    replay_start_us = esp_timer_get_time();
+    mqtt_set_publish_hook(replay_publish_hook);
+    TaskHandle_t handle = xTaskCreateStatic(replay_mqtt_task, "cap_replay_mqtt", CAPTURE_REPLAY_STACK, NULL,
+                                            CAPTURE_REPLAY_PRIO, replay_mqtt_stack, &replay_mqtt_tcb);
+    ASSERT(handle);
+
+    while (cursor_next(&cursor, &rec, replay_payload, sizeof(replay_payload))) {
+        if (rec.type != CAPTURE_WRITE && rec.type != CAPTURE_PREP_WRITE && rec.type != CAPTURE_EXEC_WRITE) {
+            continue;
+        }
+        replay_wait(rec.ts_ms);
+        switch (rec.type) {
+        case CAPTURE_WRITE:
+            ble_ingest_write(NULL, replay_payload, rec.len);
+            break;
+        case CAPTURE_PREP_WRITE:
+            ble_ingest_prepare_write(&replay_prepare_env, rec.offset, replay_payload, rec.len);
+            break;
+        case CAPTURE_EXEC_WRITE:
+            ble_ingest_exec_write(&replay_prepare_env, NULL, rec.offset);
+            break;
+        }
+    }
+    replay_done();
+    vTaskDelete(NULL);
+}
+
+static void replay_mqtt_task(void* arg) {
+    capture_cursor_t cursor;
+    capture_record_t rec;
+    int32_t          id;
+    cursor_start(&cursor);
+
+    while (cursor_next(&cursor, &rec, replay_event_payload, sizeof(replay_event_payload))) {
+        if (rec.type != CAPTURE_MQTT_EVENT) {
+            continue;
+        }
+        replay_wait(rec.ts_ms);
+        memcpy(&id, replay_event_payload, sizeof(id));
+        // Only acks drive the pipeline today
+        if (rec.offset == MQTT_EVENT_PUBLISHED) {
+            mqtt_notify_published(id);
+        }
+    }
+    replay_done();
+    vTaskDelete(NULL);
+}
+
+// The replay takes over the publish path until it finishes: live GATT
+// writes and advertised readings are refused, the spool drain is paused
+// and the pipeline runs as if the link was up, so the captured readings
+// meet the captured acks and nothing else
+void capture_replay(uint32_t speedup) {
+    capture_record_t rec;
+
+    if (dump_active || replay_tasks_running) {
+        ESP_LOGE(TAG, "Capture busy, not replaying");
+        return;
+    }
+
+    freeze(true);
+    cursor_start(&replay_publish_cursor);
+    if (ring_used < sizeof(rec)) {
+        ESP_LOGE(TAG, "Nothing captured");
+        freeze(false);
+        return;
+    }
+    ring_copy_out(0, &rec, sizeof(rec));
+
+    replay_speedup       = speedup;
+    replay_first_ms      = rec.ts_ms;
+    replay_tasks_running = 2;
+
+    ESP_LOGI(TAG, "Replaying %d bytes at x%d", ring_used, speedup);
+    TaskHandle_t handle = xTaskCreateStatic(replay_ble_task, "cap_replay_ble", CAPTURE_REPLAY_STACK, NULL,
+                                            CAPTURE_REPLAY_PRIO, replay_ble_stack, &replay_ble_tcb);
+    ASSERT(handle);
+}
+
+// MQTT command "capture_replay [speedup]", defaults to real time
+static void capture_replay_cmd(const char* args, int args_len) {
+    char     num[12] = { 0 };
+    uint32_t speedup = 1;
+    if (args_len > 0) {
+        memcpy(num, args, MIN(args_len, sizeof(num) - 1));
+        speedup = strtoul(num, NULL, 10);
+    }
+    capture_replay(speedup);
+}
+
+void capture_init(void) {
+    replay_publish_sem = xSemaphoreCreateMutexStatic(&replay_publish_sem_buf);
+    ASSERT(replay_publish_sem);
+
+    mem_register_static("capture_ring", sizeof(ring) + sizeof(replay_prepare_env));
+    mem_register_stack("cap_replay_ble", sizeof(replay_ble_stack));
+    mem_register_stack("cap_replay_mqtt", sizeof(replay_mqtt_stack));
+
+    mqtt_register_command("capture_dump", capture_dump_cmd);
+    mqtt_register_command("capture_replay", capture_replay_cmd);
+}
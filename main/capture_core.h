@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define CAPTURE_RING_SIZE       (16 * 1024)
+#define CAPTURE_MAX_PAYLOAD     (512) // longer writes are truncated
+#define CAPTURE_DUMP_CHUNK      (768)
+#define CAPTURE_DUMP_TOPIC      "/topic/gateway/capture"
+#define CAPTURE_REPLAY_STACK    (3072)
+#define CAPTURE_REPLAY_PRIO     (5)
+#define CAPTURE_FORMAT_VERSION  (1)
+#define CAPTURE_QUIESCE_MS      (3000) // for live readings to leave the pipeline before a replay
+#define CAPTURE_QUIESCE_POLL_MS (20)
+
+// record types
+#define CAPTURE_WRITE      (1) // handle, conn, payload
+#define CAPTURE_PREP_WRITE (2) // handle, conn, offset, payload
+#define CAPTURE_EXEC_WRITE (3) // conn, offset holds the exec flag
+#define CAPTURE_PUBLISH    (4) // payload is the int32 message id the client returned
+#define CAPTURE_MQTT_EVENT (5) // offset holds the event id, payload the int32 msg_id
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// On the wire (and in the ring) a capture is a sequence of these
+// headers, each followed by len payload bytes. Dumps start with a
+// capture_file_header_t so the host knows what it is looking at
+typedef struct {
+    uint32_t ts_ms; // uptime in ms
+    uint8_t  type;
+    uint8_t  conn_id;
+    uint16_t handle;
+    uint16_t offset;
+    uint16_t len;
+} __attribute__((packed)) capture_record_t;
+_Static_assert(sizeof(capture_record_t) == 12, "capture record header is not 12 bytes long!");
+
+typedef struct {
+    uint32_t magic; // CAPTURE_MAGIC
+    uint16_t version;
+    uint16_t record_header_size;
+    uint32_t bytes; // record bytes following this header
+} __attribute__((packed)) capture_file_header_t;
+
+#define CAPTURE_MAGIC (0x43415054) // "CAPT"
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void capture_init(void);
+
+// Capture points, callable from the BTC and MQTT tasks
+void capture_gatt_write(uint8_t type, uint16_t conn_id, uint16_t handle, uint16_t offset, const uint8_t* value, uint16_t len);
+void capture_publish(int message_id);
+void capture_mqtt_event(int event_id, int message_id);
+
+// Reads the next dump chunk for the GATT capture characteristic,
+// returns the number of bytes copied, 0 once the dump is complete
+uint16_t capture_read_chunk(uint8_t* out, uint16_t max_len);
+
+// Feeds the frozen RAM capture back through the ingest path and the MQTT
+// manager, speedup 0 runs as fast as possible
+void capture_replay(uint32_t speedup);
+
+// True from the moment a replay is requested until it finished, live
+// ingest is refused meanwhile
+bool capture_replaying(void);
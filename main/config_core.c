@@ -0,0 +1,267 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "mbedtls/md.h"
+
+#include "ble_core.h"
+#include "config_core.h"
+#include "flash_core.h"
+#include "global_defines.h"
+#include "mqtt_core.h"
+#include "sink_core.h"
+
+// Runtime tuning: a typed parameter table with defaults and ranges,
+// overridden from NVS at boot and updated over MQTT or an authenticated
+// GATT write
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "CONFIG_CORE";
+
+static const config_desc_t config_desc[CFG_COUNT] = {
+    [CFG_ACK_TIMEOUT_MS]     = { "ack_timeout_ms", 10000, 100, 60000, true },
+    [CFG_REPLAY_DELAY_MS]    = { "replay_ms", 20, 10, 60000, true },
+    [CFG_MAX_REPLAYS]        = { "max_replays", MAXIMUM_REPLAYS, 0, 16, true },
+    [CFG_PUB_SLOTS]          = { "pub_slots", PUB_ARR_SIZE, 1, PUB_ARR_SIZE, true },
+    [CFG_MQTT_Q_DEPTH]       = { "mqtt_q_depth", DEPTTH_MQTT_Q, 1, DEPTTH_MQTT_Q, false },
+    [CFG_PREPARE_BUF_SIZE]   = { "prep_buf_size", PREPARE_BUF_MAX_SIZE, 16, PREPARE_BUF_MAX_SIZE, true },
+    [CFG_CONN_MIN_INT]       = { "conn_min_int", 0x10, 6, 3200, true },
+    [CFG_CONN_MAX_INT]       = { "conn_max_int", 0x20, 6, 3200, true },
+    [CFG_CONN_LATENCY]       = { "conn_latency", 0, 0, 499, true },
+    [CFG_CONN_TIMEOUT]       = { "conn_timeout", 400, 10, 3200, true },
+    [CFG_DRAIN_PER_SEC]      = { "drain_per_sec", MQTT_DRAIN_PER_SEC, 1, 1000, true },
+    [CFG_FLASH_SYNC_RECORDS] = { "flash_sync_recs", 0, 0, FLASH_PACKETS_PER_CHUNK, true },
+    [CFG_FLASH_SYNC_MS]      = { "flash_sync_ms", 1000, 0, 60000, true },
+    [CFG_SCAN_INTERVAL]      = { "scan_interval", 0x50, 0x4, 0x4000, false },
+    [CFG_SCAN_WINDOW]        = { "scan_window", 0x40, 0x4, 0x4000, false },
+    [CFG_SINK_MASK]          = { "sink_mask", 1 << SINK_MQTT, 0, (1 << SINK_COUNT) - 1, false },
+    [CFG_PROF_MS]            = { "prof_ms", 10000, 0, 600000, true },
+    [CFG_PUB_RETRIES]        = { "pub_retries", 2, 0, 8, true },
+    [CFG_AGG_WINDOW_MS]      = { "agg_window_ms", 0, 0, 3600000, false },
+    [CFG_AGG_HOP_MS]         = { "agg_hop_ms", 0, 0, 3600000, false },
+    [CFG_FAILOVER_MS]        = { "failover_ms", 5000, 500, 600000, true },
+    [CFG_BROKER_STANDBY]     = { "broker_standby", 0, 0, 1, false },
+    [CFG_ENC_WINDOW_MS]      = { "enc_window_ms", 0, 0, 3600000, false },
+};
+
+volatile uint32_t config_values[CFG_COUNT];
+
+static nvs_handle_t config_nvs;
+static uint8_t      auth_secret[CONFIG_AUTH_SECRET_LEN];
+static bool         auth_provisioned;
+static uint32_t     auth_counter; // last accepted GATT write
+
+#define AUTH_SECRET_KEY  "auth_secret"
+#define AUTH_COUNTER_KEY "auth_counter"
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+// The connection parameters only work together: min_int <= max_int, and
+// the supervision timeout has to outlast the events a peripheral may skip,
+// timeout > (1 + latency) * max_int * 2 (Core spec, Vol 6 Part B 4.5.2).
+// timeout is in 10 ms units and the intervals in 1.25 ms ones
+static bool conn_params_valid(const volatile uint32_t* values) {
+    uint32_t min_int = values[CFG_CONN_MIN_INT];
+    uint32_t max_int = values[CFG_CONN_MAX_INT];
+    uint32_t latency = values[CFG_CONN_LATENCY];
+    uint32_t timeout = values[CFG_CONN_TIMEOUT];
+    if (min_int > max_int) {
+        ESP_LOGE(TAG, "conn_min_int %d above conn_max_int %d", min_int, max_int);
+        return false;
+    }
+    if (timeout * 4 <= (1 + latency) * max_int) {
+        ESP_LOGE(TAG, "conn_timeout %d too short for conn_max_int %d at conn_latency %d", timeout, max_int, latency);
+        return false;
+    }
+    return true;
+}
+
+static int find_key(const char* key, int key_len) {
+    for (int i = 0; i < CFG_COUNT; i++) {
+        if (strlen(config_desc[i].key) == key_len && !strncmp(config_desc[i].key, key, key_len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool config_set(config_id_t id, uint32_t value) {
+    if (id >= CFG_COUNT) {
+        return false;
+    }
+    const config_desc_t* desc = &config_desc[id];
+    if (value < desc->min || value > desc->max) {
+        ESP_LOGE(TAG, "%s=%d out of range [%d, %d]", desc->key, value, desc->min, desc->max);
+        return false;
+    }
+    if (id >= CFG_CONN_MIN_INT && id <= CFG_CONN_TIMEOUT) {
+        uint32_t values[CFG_COUNT];
+        memcpy(values, (const void*)config_values, sizeof(values));
+        values[id] = value;
+        if (!conn_params_valid(values)) {
+            return false;
+        }
+    }
+
+    esp_err_t err = nvs_set_u32(config_nvs, desc->key, value);
+    if (err == ESP_OK) {
+        err = nvs_commit(config_nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store %s, err %d", desc->key, err);
+        return false;
+    }
+
+    if (desc->live) {
+        config_values[id] = value;
+        ESP_LOGI(TAG, "%s=%d", desc->key, value);
+    } else {
+        ESP_LOGI(TAG, "%s=%d, applied after reboot", desc->key, value);
+    }
+    return true;
+}
+
+bool config_set_text(const char* text, int len) {
+    char buf[CONFIG_MAX_TEXT_LEN + 1] = { 0 };
+    if (len <= 0 || len > CONFIG_MAX_TEXT_LEN) {
+        return false;
+    }
+    memcpy(buf, text, len);
+
+    char* eq = strchr(buf, '=');
+    if (!eq) {
+        return false;
+    }
+    int id = find_key(buf, eq - buf);
+    if (id < 0) {
+        ESP_LOGE(TAG, "Unknown key %.*s", (int)(eq - buf), buf);
+        return false;
+    }
+
+    char*         end;
+    unsigned long value = strtoul(eq + 1, &end, 0);
+    if (end == eq + 1 || *end != '\0') {
+        return false;
+    }
+    return config_set(id, value);
+}
+
+static bool tags_equal(const uint8_t* a, const uint8_t* b, int len) {
+    uint8_t diff = 0;
+    for (int i = 0; i < len; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+bool config_gatt_write(const uint8_t* value, uint16_t len) {
+    uint8_t  mac[32];
+    uint32_t counter;
+
+    if (!auth_provisioned) {
+        ESP_LOGE(TAG, "No secret provisioned, GATT config is locked");
+        return false;
+    }
+    if (len <= sizeof(counter) + CONFIG_AUTH_TAG_LEN) {
+        return false;
+    }
+
+    uint16_t signed_len = len - CONFIG_AUTH_TAG_LEN;
+    int      err        = mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), auth_secret,
+                                          sizeof(auth_secret), value, signed_len, mac);
+    if (err) {
+        ESP_LOGE(TAG, "HMAC failed, -0x%x", -err);
+        return false;
+    }
+    if (!tags_equal(mac, value + signed_len, CONFIG_AUTH_TAG_LEN)) {
+        ESP_LOGE(TAG, "Bad config write tag");
+        return false;
+    }
+
+    memcpy(&counter, value, sizeof(counter));
+    if (counter <= auth_counter) {
+        ESP_LOGE(TAG, "Stale config write counter %d (last %d)", counter, auth_counter);
+        return false;
+    }
+    auth_counter = counter;
+    nvs_set_u32(config_nvs, AUTH_COUNTER_KEY, auth_counter);
+    nvs_commit(config_nvs);
+
+    return config_set_text((const char*)value + sizeof(counter), signed_len - sizeof(counter));
+}
+
+int config_read(uint16_t offset, uint8_t* out, uint16_t max_len) {
+    uint32_t table[CFG_COUNT];
+    if (offset > sizeof(table)) {
+        return -1;
+    }
+    for (int i = 0; i < CFG_COUNT; i++) {
+        table[i] = config_values[i];
+    }
+    uint16_t len = MIN(max_len, sizeof(table) - offset);
+    memcpy(out, (uint8_t*)table + offset, len);
+    return len;
+}
+
+// "config_set key=value"
+static void config_set_cmd(const char* args, int args_len) {
+    if (!config_set_text(args, args_len)) {
+        ESP_LOGE(TAG, "Rejected config_set %.*s", args_len, args);
+    }
+}
+
+// "config_get", publishes every key=value on CONFIG_TOPIC
+static void config_get_cmd(const char* args, int args_len) {
+    static char out[CFG_COUNT * 32];
+    int         len = 0;
+    for (int i = 0; i < CFG_COUNT && len < sizeof(out); i++) {
+        len += snprintf(out + len, sizeof(out) - len, "%s=%d\n", config_desc[i].key, config_values[i]);
+    }
+    mqtt_publish_raw(CONFIG_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
+void config_init(void) {
+    ESP_ERROR_CHECK(nvs_open(CONFIG_NVS_NAMESPACE, NVS_READWRITE, &config_nvs));
+
+    for (int i = 0; i < CFG_COUNT; i++) {
+        const config_desc_t* desc  = &config_desc[i];
+        uint32_t             value = desc->def;
+        if (nvs_get_u32(config_nvs, desc->key, &value) == ESP_OK) {
+            if (value < desc->min || value > desc->max) {
+                ESP_LOGE(TAG, "Stored %s=%d out of range, using %d", desc->key, value, desc->def);
+                value = desc->def;
+            } else if (value != desc->def) {
+                ESP_LOGI(TAG, "%s=%d (default %d)", desc->key, value, desc->def);
+            }
+        }
+        config_values[i] = value;
+    }
+    if (!conn_params_valid(config_values)) {
+        ESP_LOGE(TAG, "Stored connection parameters don't fit together, using the defaults");
+        for (int i = CFG_CONN_MIN_INT; i <= CFG_CONN_TIMEOUT; i++) {
+            config_values[i] = config_desc[i].def;
+        }
+    }
+
+    size_t secret_len = sizeof(auth_secret);
+    auth_provisioned  = nvs_get_blob(config_nvs, AUTH_SECRET_KEY, auth_secret, &secret_len) == ESP_OK
+                       && secret_len == sizeof(auth_secret);
+    nvs_get_u32(config_nvs, AUTH_COUNTER_KEY, &auth_counter);
+    if (!auth_provisioned) {
+        ESP_LOGW(TAG, "No GATT config secret in NVS, see tools/config_secret.py");
+    }
+
+    mqtt_register_command("config_set", config_set_cmd);
+    mqtt_register_command("config_get", config_get_cmd);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define CONFIG_NVS_NAMESPACE "cfg"
+#define CONFIG_TOPIC         "/topic/gateway/config"
+
+// GATT config writes are
+//   [u32 counter][key=value][CONFIG_AUTH_TAG_LEN bytes of HMAC-SHA256(secret, counter | key=value)]
+// the counter has to grow with every write so a sniffed write can't be replayed.
+// The secret is per device and written into the NVS partition at the factory
+// (tools/config_secret.py makes the image and signs writes), it never goes
+// over the air. Without one GATT config is locked
+#define CONFIG_AUTH_TAG_LEN    (8)
+#define CONFIG_AUTH_SECRET_LEN (32)
+#define CONFIG_MAX_TEXT_LEN    (48)
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef enum {
+    CFG_ACK_TIMEOUT_MS,     // ceiling of the RTT based PUBACK timeout
+    CFG_REPLAY_DELAY_MS,    // base of the backoff before re-matching an ack that beat its registration
+    CFG_MAX_REPLAYS,        // re-matches before such an ack is dropped
+    CFG_PUB_SLOTS,          // in-flight publishes, up to PUB_ARR_SIZE
+    CFG_MQTT_Q_DEPTH,       // sentQ/replayQ depth, up to DEPTTH_MQTT_Q, reboot
+    CFG_PREPARE_BUF_SIZE,   // long write limit, up to PREPARE_BUF_MAX_SIZE
+    CFG_CONN_MIN_INT,       // 1.25 ms units, CFG_CONN_* are checked as one block, keep them in order
+    CFG_CONN_MAX_INT,       // 1.25 ms units
+    CFG_CONN_LATENCY,       // connection events
+    CFG_CONN_TIMEOUT,       // 10 ms units
+    CFG_DRAIN_PER_SEC,      // spool drain rate after a reconnect
+    CFG_FLASH_SYNC_RECORDS, // program a partial chunk after this many records, 0 = full chunks only
+    CFG_FLASH_SYNC_MS,      // or once it has been staged this long, 0 = never
+    CFG_SCAN_INTERVAL,      // tag advertisement scan, 0.625 ms units, reboot
+    CFG_SCAN_WINDOW,        // 0.625 ms units, at most the interval, reboot
+    CFG_SINK_MASK,          // local output sinks, bit per sink_id_t, reboot
+    CFG_PROF_MS,            // task profiler interval, 0 = off
+    CFG_PUB_RETRIES,        // re-publishes after an ack timeout before a reading fails
+    CFG_AGG_WINDOW_MS,      // per tag rollup window, 0 = raw uplink only, reboot
+    CFG_AGG_HOP_MS,         // rollup every hop (sliding), 0 = once per window, reboot
+    CFG_FAILOVER_MS,        // failing broker without acks this long before a cold failover
+    CFG_BROKER_STANDBY,     // 1 = keep a second connection warm on the standby broker, reboot
+    CFG_ENC_WINDOW_MS,      // encounter record window, 0 = off, reboot
+    CFG_COUNT,
+} config_id_t;
+
+typedef struct {
+    const char* key; // also the NVS key, at most 15 characters
+    uint32_t    def;
+    uint32_t    min;
+    uint32_t    max;
+    bool        live; // false: stored now, used after the next reboot
+} config_desc_t;
+
+/**********************************************************
+*                                                 GLOBALS *
+**********************************************************/
+// RAM copy of every parameter, read directly on the hot paths. Only
+// config_core writes it, a 32 bit store is atomic on the ESP32
+extern volatile uint32_t config_values[CFG_COUNT];
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+// Loads NVS over the defaults, must run right after nvs_flash_init
+void config_init(void);
+
+static inline uint32_t config_get(config_id_t id) {
+    return config_values[id];
+}
+
+// Range checks and persists the value, returns false if key or value is
+// bad. The BLE connection parameters are also checked against each other
+bool config_set(config_id_t id, uint32_t value);
+
+// "key=value" text form, used by both the MQTT and the GATT path
+bool config_set_text(const char* text, int len);
+
+// Checks the counter and HMAC of an authenticated GATT write and applies it
+bool config_gatt_write(const uint8_t* value, uint16_t len);
+
+// Packs the current values (CFG_COUNT little endian u32s in id order)
+// from byte offset on, for the GATT read and its Read Blob continuations.
+// Returns the number of bytes written, -1 if offset is past the end
+int config_read(uint16_t offset, uint8_t* out, uint16_t max_len);
@@ -0,0 +1,155 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "config_core.h"
+#include "enc_core.h"
+#include "enc_table.h"
+#include "flash_core.h"
+#include "global_defines.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "stnp_core.h"
+
+// Two tables: the BTC task folds advertisements into the active one while
+// enc_task writes out and clears the other. Closing a window only swaps
+// them under enc_mux, so the flash writes never hold up the scan results
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "ENC_CORE";
+
+// Under enc_mux, except the closed table, which only enc_task touches
+static enc_table_t  tables[2];
+static int          active;
+static enc_stats_t  stats;
+static portMUX_TYPE enc_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t window_ms;
+
+static StackType_t  enc_stack[ENC_STACK_SIZE];
+static StaticTask_t enc_tcb;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+bool enc_ingest(const uint8_t* adv, uint8_t adv_len, int rssi) {
+    uint8_t key[BLE_MANUFACTURERS_DATA_LEN];
+    if (!window_ms) {
+        return false;
+    }
+
+    bool keyed = enc_key_from_adv(adv, adv_len, key);
+    portENTER_CRITICAL(&enc_mux);
+    stats.reports++;
+    bool folded = keyed && enc_table_add(&tables[active], key, rssi);
+    if (!keyed) {
+        stats.no_data++;
+    }
+    portEXIT_CRITICAL(&enc_mux);
+    return folded;
+}
+
+// One record per advertiser, stamped with the window's start
+static void close_window(enc_table_t* table, int32_t utc) {
+    flash_packet_t record;
+    uint32_t       records = 0;
+    uint32_t       failed  = 0;
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < ENC_SLOTS; i++) {
+        if (!table->slots[i].count) {
+            continue;
+        }
+        enc_entry_record(&table->slots[i], utc, &record);
+        if (flash_write_record(&record)) {
+            records++;
+        } else {
+            failed++;
+        }
+    }
+    uint32_t close_us = esp_timer_get_time() - start;
+
+    portENTER_CRITICAL(&enc_mux);
+    stats.windows++;
+    stats.records += records;
+    stats.failed += failed;
+    stats.folded += table->folded;
+    stats.refused += table->refused;
+    stats.max_used     = MAX(stats.max_used, table->used);
+    stats.max_close_us = MAX(stats.max_close_us, close_us);
+    portEXIT_CRITICAL(&enc_mux);
+
+    ESP_LOGD(TAG, "Window of %d advertisers (%d sightings, %d refused) in %d us",
+             table->used, table->folded, table->refused, close_us);
+    enc_table_clear(table);
+}
+
+static void enc_task(void* arg) {
+    TickType_t last = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&last, pdMS_TO_TICKS(window_ms));
+        int32_t utc = get_time_utc() - window_ms / 1000;
+
+        portENTER_CRITICAL(&enc_mux);
+        enc_table_t* closed = &tables[active];
+        active ^= 1;
+        portEXIT_CRITICAL(&enc_mux);
+        close_window(closed, utc);
+    }
+}
+
+void enc_get_stats(enc_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&enc_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&enc_mux);
+}
+
+// "enc_stats", on ENC_STATS_TOPIC
+static void enc_stats_cmd(const char* args, int args_len) {
+    char        out[200];
+    enc_stats_t s;
+    enc_get_stats(&s);
+    int len = snprintf(out, sizeof(out),
+                       "window_ms=%d reports=%d no_data=%d folded=%d refused=%d windows=%d records=%d failed=%d max_used=%d max_close_us=%d",
+                       window_ms, s.reports, s.no_data, s.folded, s.refused, s.windows, s.records, s.failed,
+                       s.max_used, s.max_close_us);
+    mqtt_publish_raw(ENC_STATS_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
+void enc_init(void) {
+    mqtt_register_command("enc_stats", enc_stats_cmd);
+
+    uint32_t window = config_get(CFG_ENC_WINDOW_MS);
+    if (!window) {
+        ESP_LOGI(TAG, "Encounter records off");
+        return;
+    }
+    enc_table_clear(&tables[0]);
+    enc_table_clear(&tables[1]);
+    window_ms = MAX(window, ENC_MIN_WINDOW_MS);
+    ESP_LOGI(TAG, "%d ms encounter windows, up to %d advertisers each", window_ms, ENC_MAX_FILL);
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        enc_task,            // Function that implements the task.
+        "enc",               // Text name for the task.
+        ENC_STACK_SIZE,      // Stack size in bytes on the ESP32.
+        NULL,                // Parameter passed into the task.
+        ENC_PRIORITY,        // Priority at which the task is created.
+        enc_stack,           // Stack buffer.
+        &enc_tcb,            // Task control block.
+        MQTT_PIPELINE_CORE); // Core the task is pinned to.
+    ASSERT(handle);
+
+    mem_register_stack("enc", sizeof(enc_stack));
+    mem_register_static("enc_tables", sizeof(tables));
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Encounters. With enc_window_ms set, every advertisement that is not a
+// tag reading is folded into a per window entry of its advertiser (keyed
+// by manufacturer data, see enc_table.h), and when the window closes one
+// flash_packet_t per advertiser goes into the record log: RSSI max, mean
+// and min, and the number of sightings. flash_query reads them back
+#define ENC_STACK_SIZE    (2560)
+#define ENC_PRIORITY      (2) // flash writes, well below ingest
+#define ENC_MIN_WINDOW_MS (1000)
+#define ENC_STATS_TOPIC   "/topic/gateway/enc"
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint32_t reports;      // advertisements offered
+    uint32_t no_data;      // without manufacturer data
+    uint32_t folded;       // into a window
+    uint32_t refused;      // new advertisers with the table full
+    uint32_t windows;      // closed
+    uint32_t records;      // written to the record log
+    uint32_t failed;       // the record log did not take them
+    uint32_t max_used;     // most advertisers in one window
+    uint32_t max_close_us; // longest window close
+} enc_stats_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+// Call after flash_init, before scanning starts
+void enc_init(void);
+
+// One advertising report, from the BTC task. Never blocks, false if it
+// was not counted
+bool enc_ingest(const uint8_t* adv, uint8_t adv_len, int rssi);
+
+void enc_get_stats(enc_stats_t* stats);
@@ -0,0 +1,82 @@
+#include <string.h>
+
+#include "enc_table.h"
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+#define AD_TYPE_MANUFACTURER_SPECIFIC (0xFF)
+
+// FNV-1a
+static uint32_t key_hash(const uint8_t* key) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < BLE_MANUFACTURERS_DATA_LEN; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void enc_table_clear(enc_table_t* table) {
+    memset(table, 0, sizeof(*table));
+}
+
+bool enc_key_from_adv(const uint8_t* adv, uint8_t adv_len, uint8_t key[BLE_MANUFACTURERS_DATA_LEN]) {
+    int pos = 0;
+    // AD structures: [len][type][len - 1 bytes of data], len 0 ends the data
+    while (pos < adv_len) {
+        uint8_t len = adv[pos];
+        if (len == 0 || pos + 1 + len > adv_len) {
+            break;
+        }
+        if (adv[pos + 1] == AD_TYPE_MANUFACTURER_SPECIFIC && len > 1) {
+            uint8_t data_len = len - 1 < BLE_MANUFACTURERS_DATA_LEN ? len - 1 : BLE_MANUFACTURERS_DATA_LEN;
+            memset(key, 0, BLE_MANUFACTURERS_DATA_LEN);
+            memcpy(key, &adv[pos + 2], data_len);
+            return true;
+        }
+        pos += 1 + len;
+    }
+    return false;
+}
+
+bool enc_table_add(enc_table_t* table, const uint8_t key[BLE_MANUFACTURERS_DATA_LEN], int8_t rssi) {
+    uint32_t index = key_hash(key);
+    for (int probe = 0; probe < ENC_MAX_PROBE; probe++, index++) {
+        enc_entry_t* entry = &table->slots[index & (ENC_SLOTS - 1)];
+        if (!entry->count) {
+            if (table->used >= ENC_MAX_FILL) {
+                break;
+            }
+            memcpy(entry->key, key, BLE_MANUFACTURERS_DATA_LEN);
+            entry->rssi_min = rssi;
+            entry->rssi_max = rssi;
+            table->used++;
+        } else if (memcmp(entry->key, key, BLE_MANUFACTURERS_DATA_LEN)) {
+            continue;
+        }
+        if (entry->count < UINT16_MAX) {
+            entry->count++;
+            entry->rssi_sum += rssi;
+            entry->rssi_min = rssi < entry->rssi_min ? rssi : entry->rssi_min;
+            entry->rssi_max = rssi > entry->rssi_max ? rssi : entry->rssi_max;
+        }
+        table->folded++;
+        return true;
+    }
+    table->refused++;
+    return false;
+}
+
+void enc_entry_record(const enc_entry_t* entry, int32_t utc, flash_packet_t* record) {
+    memset(record, 0, sizeof(*record));
+    record->type = PAGE_NORMAL_ENTRY_MAGIC;
+    memcpy(record->manufactuers_data, entry->key, BLE_MANUFACTURERS_DATA_LEN);
+    record->specifics.encounter.rssi_mean = entry->count ? entry->rssi_sum / entry->count : 0;
+    record->specifics.encounter.rssi_min  = entry->rssi_min;
+    record->specifics.encounter.sightings = entry->count;
+    // readers tell encounters from UWB readings by a non zero RSSI
+    record->RSSI   = entry->rssi_max ? entry->rssi_max : -1;
+    record->counts = entry->count > UINT8_MAX ? UINT8_MAX : entry->count;
+    record->utc    = utc;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "flash_core.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Encounter table: advertisers seen in one window, keyed by their
+// manufacturer data (BLE_MANUFACTURERS_DATA_LEN bytes, zero padded).
+// Open addressing with linear probing in a fixed array, so folding an
+// advertisement is a hash and a few compares and never allocates.
+// New keys are refused once ENC_MAX_FILL slots are taken, which keeps
+// probes short; repeats of known keys are always folded in.
+// No IDF calls, tools/enc_bench.c builds it on the host
+#define ENC_SLOTS     (256) // a power of two
+#define ENC_MAX_FILL  (ENC_SLOTS * 3 / 4)
+#define ENC_MAX_PROBE (16)
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint8_t  key[BLE_MANUFACTURERS_DATA_LEN];
+    uint16_t count; // sightings, 0 for a free slot, saturates
+    int8_t   rssi_min;
+    int8_t   rssi_max;
+    int32_t  rssi_sum;
+} enc_entry_t;
+
+typedef struct {
+    enc_entry_t slots[ENC_SLOTS];
+    uint16_t    used;
+    uint32_t    folded;  // advertisements taken
+    uint32_t    refused; // new keys with the table at ENC_MAX_FILL or no slot in ENC_MAX_PROBE
+} enc_table_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void enc_table_clear(enc_table_t* table);
+
+// The manufacturer data of raw advertising data (AD structures) as a key,
+// false if there is none
+bool enc_key_from_adv(const uint8_t* adv, uint8_t adv_len, uint8_t key[BLE_MANUFACTURERS_DATA_LEN]);
+
+// Folds one sighting into the key's entry, false if the key had no room
+bool enc_table_add(enc_table_t* table, const uint8_t key[BLE_MANUFACTURERS_DATA_LEN], int8_t rssi);
+
+// The record of one entry, see flash_packet_t.specifics.encounter
+void enc_entry_record(const enc_entry_t* entry, int32_t utc, flash_packet_t* record);
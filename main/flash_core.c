@@ -0,0 +1,683 @@
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "config_core.h"
+#include "flash_core.h"
+#include "global_defines.h"
+#include "mqtt_core.h"
+#include "mem_core.h"
+#include "record_store.h"
+#include "stnp_core.h"
+
+// Record log: a ring of FLASH_PAGE_SIZE pages in the "records" partition.
+// Records are staged in a RAM chunk and programmed a chunk at a time,
+// chunks are aligned to UPLOAD_SIZE_CHUNK so one never straddles a 256
+// byte flash program page. A low priority task keeps the next pages
+// erased, so the writer normally never waits on a sector erase.
+// The pages live in a record_store_t, on a mapped store queries hand
+// records to their callback in place
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "FLASH_CORE";
+
+// NULL when the log is disabled
+static record_store_t* store;
+static record_store_t  store_buf;
+
+// Writer state, guarded by flash_sem
+static SemaphoreHandle_t flash_sem;
+static StaticSemaphore_t flash_sem_buf;
+static SemaphoreHandle_t query_sem;
+static StaticSemaphore_t query_sem_buf;
+static flash_curr_t      curr;
+static flash_packet_t    chunk[FLASH_PACKETS_PER_CHUNK];
+static uint16_t          chunk_base;    // slot of chunk[0] in the current page
+static uint16_t          chunk_count;   // records staged
+static uint16_t          chunk_flushed; // records of chunk already programmed
+static uint32_t          since_sync;
+static int64_t           last_sync_us;
+static flash_stats_t     stats;
+
+// Pre-erase state, shared by the writer and the background task. Erases
+// run outside the writer lock, this only covers the bookkeeping
+static portMUX_TYPE      erase_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint16_t          total_pages;
+static uint16_t          erased_ahead; // pages after curr.current_valid_page that are erased
+static bool              erasing;
+static int32_t           erase_target = -1; // page being erased, by either
+static int32_t           pinned_page  = -1; // a query is reading it, not to be erased
+static SemaphoreHandle_t erase_done;
+static StaticSemaphore_t erase_done_buf;
+
+// Time range of every page, so queries only read the pages they need.
+// Written by the writer and the pre-erase, read by queries
+static flash_index_entry_t page_index[FLASH_MAX_PAGES];
+static portMUX_TYPE        index_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t bg_handle;
+static StackType_t  bg_stack[FLASH_BG_STACK_SIZE];
+static StaticTask_t bg_tcb;
+
+// FLASH_BENCH baseline: program every record on its own and erase inline
+static bool direct_mode;
+// FLASH_BENCH baseline: queries copy records out even from a mapped store
+static bool copy_reads;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static inline size_t slot_offset(uint16_t page, uint16_t slot) {
+    return (size_t)page * FLASH_PAGE_SIZE + (size_t)slot * FLASH_SIZE_PACKET;
+}
+
+static void index_reset(uint16_t page, uint32_t id) {
+    portENTER_CRITICAL(&index_mux);
+    page_index[page].id              = id;
+    page_index[page].summary.min_utc = INT32_MAX;
+    page_index[page].summary.max_utc = INT32_MIN;
+    page_index[page].summary.count   = 0;
+    portEXIT_CRITICAL(&index_mux);
+}
+
+static void index_add(uint16_t page, int32_t utc) {
+    portENTER_CRITICAL(&index_mux);
+    flash_page_summary_t* summary = &page_index[page].summary;
+    summary->min_utc              = MIN(summary->min_utc, utc);
+    summary->max_utc              = MAX(summary->max_utc, utc);
+    summary->count++;
+    portEXIT_CRITICAL(&index_mux);
+}
+
+static void program_chunk(void) {
+    uint16_t count = chunk_count - chunk_flushed;
+    if (!count) {
+        return;
+    }
+    esp_err_t err = store->write(store, slot_offset(curr.current_valid_page, chunk_base + chunk_flushed),
+                                 &chunk[chunk_flushed], count * FLASH_SIZE_PACKET);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to program %d records at page %d, err %d", count, curr.current_valid_page, err);
+    }
+    stats.programs++;
+    since_sync   = 0;
+    last_sync_us = esp_timer_get_time();
+
+    if (chunk_base % FLASH_PACKETS_PER_CHUNK + chunk_count == FLASH_PACKETS_PER_CHUNK) {
+        chunk_count   = 0;
+        chunk_flushed = 0;
+    } else {
+        // durability point, the rest of the chunk is programmed later
+        // into the still erased slots behind it
+        chunk_flushed = chunk_count;
+        stats.syncs++;
+    }
+}
+
+static void write_page_header(void) {
+    flash_packet_t header;
+    memset(&header, 0xFF, sizeof(header));
+    header.type         = PAGE_HEADER_MAGIC;
+    header.specifics.id = curr.current_id;
+    header.utc          = get_time_utc();
+    ESP_ERROR_CHECK(store->write(store, slot_offset(curr.current_valid_page, HEADER_PACKET_OFFSET), &header, sizeof(header)));
+    stats.programs++;
+}
+
+// Moves the writer to the next page, takes a pre-erased one if there is
+// one, waits for an erase in progress, or erases inline as a last resort
+static void open_next_page(void) {
+    bool inline_erase = false;
+    while (true) {
+        bool wait = false;
+        portENTER_CRITICAL(&erase_mux);
+        uint16_t next = (curr.current_valid_page + 1) % total_pages;
+        if (erased_ahead) {
+            erased_ahead--;
+            curr.current_valid_page = next;
+        } else if (erasing || next == pinned_page) {
+            wait = true;
+        } else {
+            inline_erase            = true;
+            curr.current_valid_page = next;
+            erase_target            = next;
+        }
+        portEXIT_CRITICAL(&erase_mux);
+
+        if (!wait) {
+            break;
+        }
+        xSemaphoreTake(erase_done, portMAX_DELAY);
+    }
+
+    if (inline_erase) {
+        index_reset(curr.current_valid_page, 0);
+        ESP_ERROR_CHECK(store->erase(store, slot_offset(curr.current_valid_page, 0), FLASH_PAGE_SIZE));
+        stats.inline_erases++;
+        portENTER_CRITICAL(&erase_mux);
+        erase_target = -1;
+        portEXIT_CRITICAL(&erase_mux);
+    }
+
+    curr.current_id++;
+    curr.current_valid_packet_in_page = HEADER_PACKET_OFFSET + 1;
+    curr.total_valid_pages            = MIN(curr.total_valid_pages + 1, total_pages);
+    index_reset(curr.current_valid_page, curr.current_id);
+    write_page_header();
+
+    if (bg_handle) {
+        xTaskNotifyGive(bg_handle);
+    }
+}
+
+bool flash_write_record(const flash_packet_t* record) {
+    ASSERT(record);
+    if (!store) {
+        return false;
+    }
+
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(flash_sem, portMAX_DELAY);
+
+    if (!chunk_count) {
+        chunk_base    = curr.current_valid_packet_in_page;
+        chunk_flushed = 0;
+    }
+    chunk[chunk_count]      = *record;
+    chunk[chunk_count].type = PAGE_NORMAL_ENTRY_MAGIC;
+    chunk_count++;
+    curr.current_valid_packet_in_page++;
+    since_sync++;
+    stats.records++;
+    index_add(curr.current_valid_page, record->utc);
+
+    if (curr.current_valid_packet_in_page == SUMMARY_PACKET_OFFSET) {
+        // page is full, its summary rides along with the last chunk
+        flash_packet_t* summary = &chunk[chunk_count];
+        memset(summary, 0xFF, sizeof(*summary));
+        summary->type         = PAGE_SUMMARY_MAGIC;
+        summary->specifics.id = curr.current_id;
+        portENTER_CRITICAL(&index_mux);
+        memcpy(summary->manufactuers_data, &page_index[curr.current_valid_page].summary, sizeof(flash_page_summary_t));
+        portEXIT_CRITICAL(&index_mux);
+        chunk_count++;
+        curr.current_valid_packet_in_page++;
+    }
+
+    uint32_t sync_records = config_get(CFG_FLASH_SYNC_RECORDS);
+    if (direct_mode || chunk_base % FLASH_PACKETS_PER_CHUNK + chunk_count == FLASH_PACKETS_PER_CHUNK
+        || (sync_records && since_sync >= sync_records)) {
+        program_chunk();
+    }
+    if (curr.current_valid_packet_in_page == PACKETS_IN_PAGE) {
+        // pages hold a whole number of chunks, so the last one was just programmed
+        open_next_page();
+    }
+
+    uint32_t stall_us  = esp_timer_get_time() - start;
+    stats.max_stall_us = MAX(stats.max_stall_us, stall_us);
+    xSemaphoreGive(flash_sem);
+    return true;
+}
+
+void flash_sync(void) {
+    if (!store) {
+        return;
+    }
+    xSemaphoreTake(flash_sem, portMAX_DELAY);
+    program_chunk();
+    xSemaphoreGive(flash_sem);
+}
+
+void flash_get_stats(flash_stats_t* out) {
+    ASSERT(out);
+    xSemaphoreTake(flash_sem, portMAX_DELAY);
+    *out             = stats;
+    out->total_pages = total_pages;
+    portENTER_CRITICAL(&erase_mux);
+    out->erased_ahead = erased_ahead;
+    portEXIT_CRITICAL(&erase_mux);
+    xSemaphoreGive(flash_sem);
+}
+
+void flash_get_curr(flash_curr_t* out) {
+    ASSERT(out);
+    xSemaphoreTake(flash_sem, portMAX_DELAY);
+    *out = curr;
+    xSemaphoreGive(flash_sem);
+}
+
+// Erases one page ahead of the writer, returns false if enough are ready
+static bool preerase_one(void) {
+    uint16_t target;
+    portENTER_CRITICAL(&erase_mux);
+    bool go = !direct_mode && !erasing && erased_ahead < MIN(FLASH_PREERASE_PAGES, total_pages - 1);
+    if (go) {
+        target = (curr.current_valid_page + 1 + erased_ahead) % total_pages;
+        go     = target != pinned_page;
+    }
+    if (go) {
+        erasing      = true;
+        erase_target = target;
+    }
+    portEXIT_CRITICAL(&erase_mux);
+    if (!go) {
+        return false;
+    }
+
+    index_reset(target, 0);
+    ESP_ERROR_CHECK(store->erase(store, slot_offset(target, 0), FLASH_PAGE_SIZE));
+
+    portENTER_CRITICAL(&erase_mux);
+    erased_ahead++;
+    erasing      = false;
+    erase_target = -1;
+    stats.preerased++;
+    portEXIT_CRITICAL(&erase_mux);
+    xSemaphoreGive(erase_done);
+    return true;
+}
+
+// Keeps pages erased ahead of the writer and programs a partial chunk
+// once it has been staged for longer than flash_sync_ms
+static void flash_bg_task(void* arg) {
+    while (true) {
+        uint32_t sync_ms = config_get(CFG_FLASH_SYNC_MS);
+        ulTaskNotifyTake(pdTRUE, sync_ms ? pdMS_TO_TICKS(sync_ms) : portMAX_DELAY);
+
+        while (preerase_one()) {
+        }
+
+        if (sync_ms) {
+            xSemaphoreTake(flash_sem, portMAX_DELAY);
+            if (chunk_count > chunk_flushed && esp_timer_get_time() - last_sync_us >= (int64_t)sync_ms * 1000) {
+                program_chunk();
+            }
+            xSemaphoreGive(flash_sem);
+        }
+    }
+}
+
+// Rebuilds a page's index entry from its records, returns the first empty slot
+static uint16_t scan_page(uint16_t page, uint32_t id) {
+    flash_packet_t block[FLASH_PACKETS_PER_CHUNK];
+
+    index_reset(page, id);
+    for (uint16_t base = 0; base < PACKETS_IN_PAGE; base += FLASH_PACKETS_PER_CHUNK) {
+        ESP_ERROR_CHECK(store->read(store, slot_offset(page, base), block, sizeof(block)));
+        for (uint16_t i = 0; i < FLASH_PACKETS_PER_CHUNK; i++) {
+            if (block[i].type == PAGE_HEADER_MAGIC_EMTPY) {
+                return base + i;
+            }
+            if (block[i].type == PAGE_NORMAL_ENTRY_MAGIC) {
+                index_add(page, block[i].utc);
+            }
+        }
+    }
+    return PACKETS_IN_PAGE;
+}
+
+// Finds the newest page (highest header id) and the first free slot in it,
+// and loads the index from the page summaries (scanning pages that have none)
+static void recover(void) {
+    flash_packet_t packet;
+    bool           found = false;
+
+    curr.total_valid_pages = 0;
+    for (uint16_t page = 0; page < total_pages; page++) {
+        ESP_ERROR_CHECK(store->read(store, slot_offset(page, HEADER_PACKET_OFFSET), &packet, sizeof(packet)));
+        if (packet.type != PAGE_HEADER_MAGIC) {
+            index_reset(page, 0);
+            continue;
+        }
+        uint32_t id = packet.specifics.id;
+        curr.total_valid_pages++;
+        if (!found || id > curr.current_id) {
+            curr.current_id         = id;
+            curr.current_valid_page = page;
+            found                   = true;
+        }
+
+        ESP_ERROR_CHECK(store->read(store, slot_offset(page, SUMMARY_PACKET_OFFSET), &packet, sizeof(packet)));
+        if (packet.type == PAGE_SUMMARY_MAGIC && packet.specifics.id == id) {
+            portENTER_CRITICAL(&index_mux);
+            page_index[page].id = id;
+            memcpy(&page_index[page].summary, packet.manufactuers_data, sizeof(flash_page_summary_t));
+            portEXIT_CRITICAL(&index_mux);
+        } else {
+            scan_page(page, id);
+        }
+    }
+
+    if (!found) {
+        ESP_LOGI(TAG, "Empty record log, starting at page 0");
+        ESP_ERROR_CHECK(store->erase(store, 0, FLASH_PAGE_SIZE));
+        curr.current_id                   = 1;
+        curr.current_valid_page           = 0;
+        curr.current_valid_packet_in_page = HEADER_PACKET_OFFSET + 1;
+        curr.total_valid_pages            = 1;
+        index_reset(0, curr.current_id);
+        write_page_header();
+        return;
+    }
+
+    uint16_t slot                     = scan_page(curr.current_valid_page, curr.current_id);
+    curr.current_valid_packet_in_page = slot;
+    ESP_LOGI(TAG, "Resuming page %d (id %d) at slot %d, %d valid pages",
+             curr.current_valid_page, curr.current_id, slot, curr.total_valid_pages);
+
+    if (slot == SUMMARY_PACKET_OFFSET) {
+        // went down between the last record and the summary
+        memset(&packet, 0xFF, sizeof(packet));
+        packet.type         = PAGE_SUMMARY_MAGIC;
+        packet.specifics.id = curr.current_id;
+        memcpy(packet.manufactuers_data, &page_index[curr.current_valid_page].summary, sizeof(flash_page_summary_t));
+        ESP_ERROR_CHECK(store->write(store, slot_offset(curr.current_valid_page, slot), &packet, sizeof(packet)));
+        slot = PACKETS_IN_PAGE;
+    }
+    if (slot == PACKETS_IN_PAGE) {
+        open_next_page();
+    }
+}
+
+// Keeps page from being erased until unpin_page. False if an erase of it
+// is under way, its records are going anyway
+static bool pin_page(uint16_t page) {
+    portENTER_CRITICAL(&erase_mux);
+    bool pinned = erase_target != page;
+    if (pinned) {
+        pinned_page = page;
+    }
+    portEXIT_CRITICAL(&erase_mux);
+    return pinned;
+}
+
+static void unpin_page(void) {
+    portENTER_CRITICAL(&erase_mux);
+    pinned_page = -1;
+    portEXIT_CRITICAL(&erase_mux);
+    // the writer may be waiting on it, and the pre-erase stopped at it
+    xSemaphoreGive(erase_done);
+    if (bg_handle) {
+        xTaskNotifyGive(bg_handle);
+    }
+}
+
+// Reads one page, handing runs of matching records to cb. The page is
+// pinned meanwhile, so on a mapped store the records are passed in place
+// and a run can cover the whole page. A page the ring took back before
+// it was pinned is skipped
+static bool query_page(uint16_t page, uint32_t id, int32_t from_utc, int32_t to_utc,
+                       flash_query_cb_t cb, void* ctx, uint32_t* matches) {
+    flash_packet_t block[FLASH_PACKETS_PER_CHUNK];
+    bool           in_place = store->map && !copy_reads;
+    uint16_t       step     = in_place ? PACKETS_IN_PAGE : FLASH_PACKETS_PER_CHUNK;
+    bool           more     = true;
+    bool           end      = false;
+
+    if (!pin_page(page)) {
+        ESP_LOGE(TAG, "Page %d (id %d) went away during the query", page, id);
+        return true;
+    }
+    const flash_packet_t* header = record_store_records(store, slot_offset(page, HEADER_PACKET_OFFSET), block, 1, copy_reads);
+    if (!header || header->type != PAGE_HEADER_MAGIC || header->specifics.id != id) {
+        ESP_LOGE(TAG, "Page %d (id %d) went away during the query", page, id);
+        unpin_page();
+        return true;
+    }
+
+    for (uint16_t base = 0; base < PACKETS_IN_PAGE && more && !end; base += step) {
+        const flash_packet_t* records = record_store_records(store, slot_offset(page, base), block, step, copy_reads);
+        if (!records) {
+            ESP_LOGE(TAG, "Failed to read page %d", page);
+            break;
+        }
+        uint16_t run = 0; // matching records up to i not handed out yet
+        for (uint16_t i = 0; i <= step && more && !end; i++) {
+            // one past the last record flushes the run
+            end = i < step && records[i].type == PAGE_HEADER_MAGIC_EMTPY;
+            bool match = i < step && !end && records[i].type == PAGE_NORMAL_ENTRY_MAGIC
+                         && records[i].utc >= from_utc && records[i].utc <= to_utc;
+            if (match) {
+                run++;
+                (*matches)++;
+                continue;
+            }
+            if (run) {
+                more = cb(&records[i - run], run, ctx);
+                run  = 0;
+            }
+        }
+    }
+    unpin_page();
+    return more;
+}
+
+uint32_t flash_query(int32_t from_utc, int32_t to_utc, flash_query_cb_t cb, void* ctx) {
+    uint32_t matches    = 0;
+    uint32_t pages_read = 0;
+    if (!store) {
+        return 0;
+    }
+
+    // staged records have to be on flash to be found
+    flash_sync();
+    // one pinned page, so one query at a time
+    xSemaphoreTake(query_sem, portMAX_DELAY);
+
+    flash_curr_t now;
+    flash_get_curr(&now);
+    // oldest page first, the ring's oldest page is the one after the current
+    for (uint16_t n = 1; n <= total_pages; n++) {
+        uint16_t            page = (now.current_valid_page + n) % total_pages;
+        flash_index_entry_t entry;
+        portENTER_CRITICAL(&index_mux);
+        entry = page_index[page];
+        portEXIT_CRITICAL(&index_mux);
+
+        if (!entry.id || !entry.summary.count || entry.summary.max_utc < from_utc || entry.summary.min_utc > to_utc) {
+            continue;
+        }
+        pages_read++;
+        if (!query_page(page, entry.id, from_utc, to_utc, cb, ctx, &matches)) {
+            break;
+        }
+    }
+    xSemaphoreGive(query_sem);
+    ESP_LOGI(TAG, "Query [%d, %d]: %d records from %d of %d pages", from_utc, to_utc, matches, pages_read, total_pages);
+    return matches;
+}
+
+typedef struct {
+    flash_packet_t batch[FLASH_QUERY_BATCH];
+    int            count;
+    bool           failed;
+} query_stream_t;
+
+static bool query_publish(query_stream_t* stream, const flash_packet_t* records, int count) {
+    if (count && mqtt_publish_raw(FLASH_QUERY_TOPIC, (const char*)records, count * sizeof(flash_packet_t)) < 0) {
+        ESP_LOGE(TAG, "Failed to publish query batch");
+        stream->failed = true;
+    }
+    return !stream->failed;
+}
+
+static bool query_publish_batch(query_stream_t* stream) {
+    int count     = stream->count;
+    stream->count = 0;
+    return query_publish(stream, stream->batch, count);
+}
+
+// Whole batches go out straight from the records (from the flash mapping
+// on a mapped store), only the remainder is gathered in the batch
+static bool query_stream_cb(const flash_packet_t* records, uint16_t count, void* ctx) {
+    query_stream_t* stream = ctx;
+    while (count && !stream->failed) {
+        if (!stream->count && count >= FLASH_QUERY_BATCH) {
+            query_publish(stream, records, FLASH_QUERY_BATCH);
+            records += FLASH_QUERY_BATCH;
+            count -= FLASH_QUERY_BATCH;
+            continue;
+        }
+        uint16_t n = MIN(count, FLASH_QUERY_BATCH - stream->count);
+        memcpy(&stream->batch[stream->count], records, n * sizeof(flash_packet_t));
+        stream->count += n;
+        records += n;
+        count -= n;
+        if (stream->count == FLASH_QUERY_BATCH) {
+            query_publish_batch(stream);
+        }
+    }
+    return !stream->failed;
+}
+
+// "flash_query <from_utc> <to_utc>"
+static void flash_query_cmd(const char* args, int args_len) {
+    static query_stream_t stream;
+    char                  buf[32] = { 0 };
+    char*                 mid;
+    char*                 end;
+
+    memcpy(buf, args, MIN(args_len, sizeof(buf) - 1));
+    int32_t from_utc = strtol(buf, &mid, 10);
+    int32_t to_utc   = strtol(mid, &end, 10);
+    if (mid == buf || end == mid || to_utc < from_utc) {
+        ESP_LOGE(TAG, "Bad flash_query range %s", buf);
+        return;
+    }
+
+    stream.count     = 0;
+    stream.failed    = false;
+    uint32_t matches = flash_query(from_utc, to_utc, query_stream_cb, &stream);
+    query_publish_batch(&stream);
+    mqtt_publish_raw(FLASH_QUERY_TOPIC, (const char*)&matches, sizeof(matches));
+}
+
+void flash_init(void) {
+    flash_sem  = xSemaphoreCreateMutexStatic(&flash_sem_buf);
+    query_sem  = xSemaphoreCreateMutexStatic(&query_sem_buf);
+    erase_done = xSemaphoreCreateBinaryStatic(&erase_done_buf);
+    ASSERT(flash_sem && query_sem && erase_done);
+
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, FLASH_PARTITION_TYPE, FLASH_PARTITION_LABEL);
+    if (part) {
+        ESP_ERROR_CHECK(record_store_open_partition(&store_buf, part));
+        store = &store_buf;
+    } else {
+#ifdef FLASH_RAM_STORE_PAGES
+        ESP_LOGW(TAG, "No %s partition, record log in RAM", FLASH_PARTITION_LABEL);
+        ESP_ERROR_CHECK(record_store_open_ram(&store_buf, FLASH_RAM_STORE_PAGES * FLASH_PAGE_SIZE));
+        store = &store_buf;
+#else
+        ESP_LOGE(TAG, "No %s partition, record log disabled", FLASH_PARTITION_LABEL);
+        return;
+#endif
+    }
+    total_pages = MIN(store->size / FLASH_PAGE_SIZE, FLASH_MAX_PAGES);
+    ASSERT(total_pages > 1);
+    ESP_LOGI(TAG, "Record log on %s store, %d pages, %s reads", store->name, total_pages, store->map ? "mapped" : "copying");
+
+    recover();
+    last_sync_us = esp_timer_get_time();
+
+    bg_handle = xTaskCreateStatic(flash_bg_task, "flash_bg", FLASH_BG_STACK_SIZE, NULL,
+                                  FLASH_BG_PRIORITY, bg_stack, &bg_tcb);
+    ASSERT(bg_handle);
+    xTaskNotifyGive(bg_handle);
+
+    mqtt_register_command("flash_query", flash_query_cmd);
+
+    mem_register_stack("flash_bg", sizeof(bg_stack));
+    mem_register_static("flash_chunk", sizeof(chunk));
+    mem_register_static("flash_index", sizeof(page_index));
+}
+
+static void bench_run(bool direct) {
+    flash_packet_t record;
+    memset(&record, 0, sizeof(record));
+
+    xSemaphoreTake(flash_sem, portMAX_DELAY);
+    program_chunk();
+    memset(&stats, 0, sizeof(stats));
+    direct_mode = direct;
+    if (direct) {
+        // the pages already erased get erased again inline, like before pre-erase
+        portENTER_CRITICAL(&erase_mux);
+        erased_ahead = 0;
+        portEXIT_CRITICAL(&erase_mux);
+    }
+    xSemaphoreGive(flash_sem);
+    // let the background task catch up before timing
+    vTaskDelay(200 / portTICK_PERIOD_MS);
+
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < FLASH_BENCH_RECORDS; i++) {
+        record.specifics.distance_uwb = i;
+        flash_write_record(&record);
+        // readings arrive spread out, give the background task room like ingest would
+        if (!(i % FLASH_PACKETS_PER_CHUNK)) {
+            taskYIELD();
+        }
+    }
+    flash_sync();
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    ESP_LOGI(TAG, "%s: %d records in %d ms, %d records/s, %d programs, %d inline erases, worst stall %d us",
+             direct ? "direct" : "coalesced",
+             FLASH_BENCH_RECORDS,
+             (int)(elapsed / 1000),
+             (int)((int64_t)FLASH_BENCH_RECORDS * 1000000 / elapsed),
+             stats.programs,
+             stats.inline_erases,
+             stats.max_stall_us);
+}
+
+// Stands in for a serializer, touches every byte of the records
+static bool bench_drain_cb(const flash_packet_t* records, uint16_t count, void* ctx) {
+    const uint8_t* bytes = (const uint8_t*)records;
+    uint32_t*      sum   = ctx;
+    for (size_t i = 0; i < count * sizeof(flash_packet_t); i++) {
+        *sum += bytes[i];
+    }
+    return true;
+}
+
+static void bench_drain(bool copy) {
+    uint32_t sum     = 0;
+    copy_reads       = copy;
+    int64_t  start   = esp_timer_get_time();
+    uint32_t records = flash_query(INT32_MIN, INT32_MAX, bench_drain_cb, &sum);
+    int64_t  elapsed = MAX(esp_timer_get_time() - start, 1);
+    copy_reads       = false;
+
+    ESP_LOGI(TAG, "%s drain: %d records in %d ms, %d records/s (sum %d)",
+             copy ? "copy" : (store->map ? "mapped" : "copy (no mapping)"),
+             records,
+             (int)(elapsed / 1000),
+             (int)((int64_t)records * 1000000 / elapsed),
+             sum);
+}
+
+// Overwrites records, for bring up only
+void flash_bench(void) {
+    if (!store) {
+        return;
+    }
+    bench_run(true);
+    bench_run(false);
+    direct_mode = false;
+    bench_drain(true);
+    bench_drain(false);
+}
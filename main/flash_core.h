@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 /**********************************************************
@@ -22,6 +23,8 @@
 #define PAGE_HEADER_MAGIC       (0xDEAD)
 #define PAGE_NORMAL_ENTRY_MAGIC (0xC0FE)
 #define PAGE_HEADER_MAGIC_EMTPY (0xFFFF)
+#define PAGE_SUMMARY_MAGIC      (0x5A11) // last packet of a full page, see flash_page_summary_t
+#define SUMMARY_PACKET_OFFSET   (PACKETS_IN_PAGE - 1)
 
 #define MAX_VALID_ID (0xFFFFFFFF)
 
@@ -35,8 +38,26 @@
 #define UPLOADING_DONE       (3)
 
 //#define TEST_MODE_FLASH // if set, will do a quick sanity check of flash
+//#define FLASH_BENCH     // if set, app_main benchmarks the record log with and without coalescing
 #define BLE_MANUFACTURERS_DATA_LEN (20)
 
+// Record log on the ESP32, a ring of pages in the "records" data partition.
+// Each page starts with a header packet (PAGE_HEADER_MAGIC, id = page sequence)
+#define FLASH_PARTITION_LABEL "records"
+#define FLASH_PARTITION_TYPE  (0x40) // custom data subtype in partitions.csv
+#define FLASH_PREERASE_PAGES  (2)    // erased pages kept ready ahead of the writer
+#define FLASH_BG_STACK_SIZE   (2048)
+#define FLASH_BG_PRIORITY     (1) // just above idle, erases must not delay ingest
+#define FLASH_BENCH_RECORDS   (2048)
+#define FLASH_MAX_PAGES       (256) // RAM index size, the partition can't have more pages
+//#define FLASH_RAM_STORE_PAGES (16)  // if set, a board without the partition keeps the log in RAM (lost on reboot)
+
+// "flash_query <from_utc> <to_utc>" streams matching records to
+// FLASH_QUERY_TOPIC, FLASH_QUERY_BATCH raw flash_packet_t per message,
+// followed by a 4 byte message holding the number of records sent
+#define FLASH_QUERY_TOPIC "/topic/gateway/records"
+#define FLASH_QUERY_BATCH (24)
+
 /**********************************************************
 *                                                   TYPES *
 **********************************************************/
@@ -47,7 +68,12 @@ typedef struct {
     uint16_t type;
     union {
         uint32_t id;           // Only valid for type == page header
-        uint32_t distance_uwb; // Only valid for readings
+        uint32_t distance_uwb;  // Only valid for readings
+        struct {
+            int8_t   rssi_mean;
+            int8_t   rssi_min;
+            uint16_t sightings; // counts without the 8 bit cap
+        } __attribute__((packed)) encounter; // Only valid for encounter records (enc_core.h), RSSI is the max
     } specifics;
     uint8_t manufactuers_data[BLE_MANUFACTURERS_DATA_LEN];
     int8_t  RSSI;
@@ -69,6 +95,53 @@ typedef struct {
     uint16_t total_valid_pages;
 } flash_curr_t;
 
+// Per page time range, kept in RAM for every page and written into the
+// manufactuers_data of the page's summary packet when the page fills up
+typedef struct {
+    int32_t  min_utc;
+    int32_t  max_utc;
+    uint16_t count;
+} __attribute__((packed)) flash_page_summary_t;
+_Static_assert(sizeof(flash_page_summary_t) <= BLE_MANUFACTURERS_DATA_LEN, "page summary does not fit a flash packet!");
+
+typedef struct {
+    uint32_t             id; // page header id, 0 if the page holds nothing
+    flash_page_summary_t summary;
+} flash_index_entry_t;
+
+// Query callback, a run of count matching records that sit next to each
+// other in the log. On a mapped store they are read in place and only
+// valid during the call. Return false to stop the query
+typedef bool (*flash_query_cb_t)(const flash_packet_t* records, uint16_t count, void* ctx);
+
+typedef struct {
+    uint32_t records;       // records accepted
+    uint32_t programs;      // SPI flash program operations
+    uint32_t syncs;         // partial chunks flushed at a durability point
+    uint32_t preerased;     // pages erased by the background task
+    uint32_t inline_erases; // pages the writer had to erase itself
+    uint32_t max_stall_us;  // worst flash_write_record call
+    uint16_t total_pages;
+    uint16_t erased_ahead;
+} flash_stats_t;
+
 /**********************************************************
 *                                                 GLOBALS *
 **********************************************************/
+void flash_init(void);
+
+// Stages a record in the RAM chunk, programs the chunk once it holds
+// FLASH_PACKETS_PER_CHUNK records or a durability point is reached
+bool flash_write_record(const flash_packet_t* record);
+
+// Durability point: programs whatever is staged
+void flash_sync(void);
+
+void flash_get_stats(flash_stats_t* stats);
+void flash_get_curr(flash_curr_t* curr);
+
+// Calls cb, oldest first, for every stored record with from_utc <= utc <= to_utc.
+// Only pages whose index range overlaps are read. Returns the number of matches
+uint32_t flash_query(int32_t from_utc, int32_t to_utc, flash_query_cb_t cb, void* ctx);
+
+void flash_bench(void);
@@ -0,0 +1,435 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "agg_core.h"
+#include "alert_core.h"
+#include "ble_core.h"
+#include "global_defines.h"
+#include "loadgen_core.h"
+#include "loadgen_model.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "msg_buf.h"
+#include "packet_codec.h"
+#include "uwb_core.h"
+
+// Synthetic tag fleet. The generator task plays thousands of tags (the
+// traffic model in loadgen_model.c), the ingest task plays the BTC task and
+// drives the real GATT write path (ble_ingest_*), and the broker task plays
+// AWS through the mqtt publish hook. Nothing here touches the radio.
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    bool            valid;
+    int64_t         due_us;
+    loadgen_event_t event;
+} loadgen_retry_t;
+
+typedef struct {
+    bool    valid;
+    int     message_id;
+    int64_t due_us;
+} loadgen_ack_t;
+
+// A write the gateway took and has not answered yet
+typedef struct {
+    bool            valid;
+    loadgen_event_t event;
+} loadgen_write_t;
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "LOADGEN";
+
+static loadgen_config_t config;
+static loadgen_model_t  model; // arrivals only advance in the generator task
+
+static loadgen_stats_t stats;
+static loadgen_hist_t  latency; // counts under stats_mux
+static portMUX_TYPE    stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static loadgen_retry_t retry_arr[LOADGEN_RETRY_SLOTS];
+static portMUX_TYPE    retry_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static loadgen_ack_t ack_arr[LOADGEN_BROKER_SLOTS];
+static portMUX_TYPE  ack_mux = portMUX_INITIALIZER_UNLOCKED;
+static int           next_message_id = 1;
+
+static loadgen_write_t writes_arr[BLE_WRITES_MAX]; // the gateway refuses more anyway
+static portMUX_TYPE    writes_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static prepare_type_env_t loadgen_prepare_env;
+static uint8_t            payload[LOADGEN_MAX_PAYLOAD];
+
+static QueueHandle_t eventQ;
+static StaticQueue_t eventQ_buf;
+static uint8_t       eventQ_storage[LOADGEN_EVENT_Q_DEPTH * sizeof(loadgen_event_t)];
+
+static StackType_t  generator_stack[LOADGEN_STACK_SIZE];
+static StaticTask_t generator_tcb;
+static StackType_t  ingest_stack[LOADGEN_STACK_SIZE];
+static StaticTask_t ingest_tcb;
+static StackType_t  broker_stack[LOADGEN_STACK_SIZE];
+static StaticTask_t broker_tcb;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static void latency_record(int64_t us) {
+    int i = loadgen_hist_bucket(&latency, us);
+    portENTER_CRITICAL(&stats_mux);
+    latency.counts[i]++;
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+#define STATS_ADD(field)               \
+    do {                               \
+        portENTER_CRITICAL(&stats_mux); \
+        stats.field++;                 \
+        portEXIT_CRITICAL(&stats_mux);  \
+    } while (0)
+
+void loadgen_get_stats(loadgen_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&stats_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+/**********************************************************
+*                                        SIMULATED BROKER *
+**********************************************************/
+
+// Called from the publisher task, in place of esp_mqtt_client_publish
+static int broker_publish(const char* topic, const char* data, int len, int qos) {
+    int     message_id = 0;
+    bool    lost       = loadgen_model_ack_lost(&model);
+    int64_t due        = esp_timer_get_time() + loadgen_model_ack_delay_us(&model);
+
+    portENTER_CRITICAL(&ack_mux);
+    message_id = next_message_id++;
+    if (!lost) {
+        lost = true; // unless we find a slot
+        for (int i = 0; i < LOADGEN_BROKER_SLOTS; i++) {
+            if (!ack_arr[i].valid) {
+                ack_arr[i].valid      = true;
+                ack_arr[i].message_id = message_id;
+                ack_arr[i].due_us     = due;
+                lost                  = false;
+                break;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&ack_mux);
+
+    if (lost) {
+        STATS_ADD(broker_lost);
+    }
+    return message_id;
+}
+
+static void broker_task(void* arg) {
+    while (true) {
+        vTaskDelay(LOADGEN_TICK_MS / portTICK_PERIOD_MS);
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < LOADGEN_BROKER_SLOTS; i++) {
+            int message_id = -1;
+            portENTER_CRITICAL(&ack_mux);
+            if (ack_arr[i].valid && ack_arr[i].due_us <= now) {
+                message_id       = ack_arr[i].message_id;
+                ack_arr[i].valid = false;
+            }
+            portEXIT_CRITICAL(&ack_mux);
+
+            if (message_id >= 0) {
+                mqtt_notify_published(message_id);
+            }
+        }
+    }
+}
+
+/**********************************************************
+*                                           INGEST (BTC) *
+**********************************************************/
+
+static bool retry_push(const loadgen_event_t* event) {
+    bool pushed = false;
+    portENTER_CRITICAL(&retry_mux);
+    for (int i = 0; i < LOADGEN_RETRY_SLOTS; i++) {
+        if (!retry_arr[i].valid) {
+            retry_arr[i].valid  = true;
+            retry_arr[i].due_us = esp_timer_get_time() + (int64_t)config.retry_delay_ms * 1000;
+            retry_arr[i].event  = *event;
+            pushed              = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&retry_mux);
+    return pushed;
+}
+
+// What a tag does with the gateway's answer
+static void outcome(loadgen_event_t* event, int status) {
+    if (status == MQTT_SUCCESS) {
+        STATS_ADD(accepted);
+        latency_record(esp_timer_get_time() - event->created_us);
+        return;
+    }
+
+    STATS_ADD(nacked);
+    if (event->retries >= config.max_retries) {
+        STATS_ADD(given_up);
+        return;
+    }
+    event->retries++;
+    if (!retry_push(event)) {
+        STATS_ADD(given_up);
+    }
+}
+
+// ble_ingest_done_t, usually in the publisher task
+static void answered(void* arg, int status) {
+    loadgen_write_t* write = arg;
+    loadgen_event_t  event = write->event;
+    portENTER_CRITICAL(&writes_mux);
+    write->valid = false;
+    portEXIT_CRITICAL(&writes_mux);
+    outcome(&event, status);
+}
+
+// Delivers one reading the way a tag would over GATT. Like the BTC task the
+// ingest task doesn't wait for the answer, answered gets it
+// returns false if the gateway refused the write
+static bool deliver(loadgen_write_t* write) {
+    const loadgen_event_t* event = &write->event;
+    // random static address range, one per synthetic tag
+    const uint8_t bda[6] = { 0xC0, 0x4C, 0x47, 0, event->tag_id >> 8, event->tag_id & 0xFF };
+
+    memset(payload, 0xFF, sizeof(payload));
+    uwb_packet_encode(&event->packet, payload, sizeof(payload));
+
+    if (!event->long_write) {
+        return ble_ingest_write_async(bda, payload, sizeof(uwb_packet_t), answered, write);
+    }
+
+    // prepared write, the ATT header takes part of each fragment
+    uint16_t fragment = loadgen_model_fragment(&config);
+    for (uint16_t offset = 0; offset < LOADGEN_MAX_PAYLOAD; offset += fragment) {
+        uint16_t len = MIN(fragment, LOADGEN_MAX_PAYLOAD - offset);
+        if (ESP_GATT_OK != ble_ingest_prepare_write(&loadgen_prepare_env, offset, payload + offset, len)) {
+            ble_ingest_exec_write_async(&loadgen_prepare_env, bda, false, NULL, NULL);
+            return false;
+        }
+    }
+    return ble_ingest_exec_write_async(&loadgen_prepare_env, bda, true, answered, write);
+}
+
+static loadgen_write_t* write_alloc(const loadgen_event_t* event) {
+    loadgen_write_t* write = NULL;
+    portENTER_CRITICAL(&writes_mux);
+    for (int i = 0; i < BLE_WRITES_MAX; i++) {
+        if (!writes_arr[i].valid) {
+            write        = &writes_arr[i];
+            write->valid = true;
+            write->event = *event;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&writes_mux);
+    return write;
+}
+
+static void ingest_task(void* arg) {
+    loadgen_event_t event;
+
+    while (true) {
+        if (pdTRUE != xQueueReceive(eventQ, &event, portMAX_DELAY)) {
+            continue;
+        }
+
+        // every write slot busy is the gateway's ESP_GATT_BUSY
+        loadgen_write_t* write = write_alloc(&event);
+        if (!write) {
+            outcome(&event, MQTT_ERROR);
+        } else if (!deliver(write)) {
+            portENTER_CRITICAL(&writes_mux);
+            write->valid = false;
+            portEXIT_CRITICAL(&writes_mux);
+            outcome(&event, MQTT_ERROR);
+        }
+    }
+}
+
+/**********************************************************
+*                                         TAG GENERATOR *
+**********************************************************/
+
+static void emit(const loadgen_event_t* event) {
+    if (pdTRUE != xQueueSend(eventQ, event, RTOS_DONT_WAIT)) {
+        STATS_ADD(dropped_q);
+    }
+}
+
+static void retry_poll(int64_t now) {
+    for (int i = 0; i < LOADGEN_RETRY_SLOTS; i++) {
+        loadgen_event_t event;
+        bool             due = false;
+        portENTER_CRITICAL(&retry_mux);
+        if (retry_arr[i].valid && retry_arr[i].due_us <= now) {
+            event              = retry_arr[i].event;
+            retry_arr[i].valid = false;
+            due                = true;
+        }
+        portEXIT_CRITICAL(&retry_mux);
+
+        if (due) {
+            STATS_ADD(retried);
+            emit(&event);
+        }
+    }
+}
+
+static void report(int64_t interval_us) {
+    static loadgen_stats_t last;
+    static loadgen_hist_t  hist;
+    loadgen_stats_t        now;
+
+    portENTER_CRITICAL(&stats_mux);
+    now = stats;
+    hist = latency;
+    memset(latency.counts, 0, sizeof(latency.counts));
+    portEXIT_CRITICAL(&stats_mux);
+
+    uint32_t accepted = now.accepted - last.accepted;
+    ESP_LOGI(TAG, "%d tags: offered %d, accepted %d (%d.%02d/s), nack %d, retried %d, dropped %d, gave up %d, broker lost %d",
+             config.tags,
+             now.generated - last.generated,
+             accepted,
+             (int)((int64_t)accepted * 1000000 / interval_us),
+             (int)(((int64_t)accepted * 100000000 / interval_us) % 100),
+             now.nacked - last.nacked,
+             now.retried - last.retried,
+             now.dropped_q - last.dropped_q,
+             now.given_up - last.given_up,
+             now.broker_lost - last.broker_lost);
+    ESP_LOGI(TAG, "latency us: p50 %d, p90 %d, p99 %d, max %d",
+             loadgen_hist_percentile(&hist, 50),
+             loadgen_hist_percentile(&hist, 90),
+             loadgen_hist_percentile(&hist, 99),
+             loadgen_hist_percentile(&hist, 100));
+
+    // payload copies per reading on the ingest -> publish path, in hundredths
+    static msg_buf_stats_t last_buf;
+    msg_buf_stats_t        buf;
+    msg_buf_get_stats(&buf);
+    uint32_t readings = MAX(1, buf.allocs - last_buf.allocs);
+    ESP_LOGI(TAG, "copies per reading %d.%02d, bytes copied per reading %d, pool high water %d/%d, pool empty %d",
+             (buf.copies - last_buf.copies) / readings,
+             (buf.copies - last_buf.copies) * 100 / readings % 100,
+             (buf.bytes_copied - last_buf.bytes_copied) / readings,
+             buf.high_water, MSG_BUF_POOL_SIZE,
+             buf.empty - last_buf.empty);
+    last_buf = buf;
+
+    rtt_est_t rtt;
+    mqtt_get_rtt(&rtt);
+    ESP_LOGI(TAG, "broker srtt %d ms, rttvar %d ms, rto %d ms << %d, ack timeouts %d (%d spurious)",
+             rtt.srtt_us / 1000, rtt.rttvar_us / 1000, rtt.rto_us / 1000, rtt.backoff, rtt.timeouts, rtt.spurious);
+
+    // with agg_window_ms set, uplink messages are rollups instead of readings
+    static agg_stats_t last_agg;
+    agg_stats_t        agg;
+    agg_get_stats(&agg);
+    ESP_LOGI(TAG, "aggregated %d readings into %d rollups, %d raw, %d table full",
+             agg.aggregated - last_agg.aggregated, agg.rollups - last_agg.rollups,
+             agg.raw - last_agg.raw, agg.table_full - last_agg.table_full);
+    last_agg = agg;
+
+    // alert latency next to the pipeline's, it should stay flat under load
+    static alert_stats_t last_alert;
+    alert_stats_t        alert;
+    alert_get_stats(&alert);
+    uint32_t alerts = alert.published - last_alert.published;
+    ESP_LOGI(TAG, "alerts %d raised, %d published, %d dropped, mean %d us, max %d us (ingest to publish)",
+             alert.raised - last_alert.raised, alerts, alert.dropped - last_alert.dropped,
+             alerts ? (uint32_t)((alert.total_us - last_alert.total_us) / alerts) : 0, alert.max_us);
+    last_alert = alert;
+    last = now;
+}
+
+static void generator_task(void* arg) {
+    int64_t start       = esp_timer_get_time();
+    int64_t next_report = start + (int64_t)config.report_ms * 1000;
+    int64_t last_report = start;
+
+    ESP_LOGI(TAG, "Starting, %d tags, %d mHz per tag, mtu %d, %d%% long writes",
+             config.tags, config.rate_mhz_per_tag, config.mtu, config.long_write_pct);
+
+    while (true) {
+        vTaskDelay(LOADGEN_TICK_MS / portTICK_PERIOD_MS);
+        int64_t now = esp_timer_get_time();
+
+        loadgen_event_t event;
+        while (loadgen_model_next(&model, now, &event)) {
+            STATS_ADD(generated);
+            emit(&event);
+        }
+
+        retry_poll(now);
+
+        if (now >= next_report) {
+            report(now - last_report);
+            last_report = now;
+            next_report = now + (int64_t)config.report_ms * 1000;
+        }
+    }
+}
+
+static TaskHandle_t start_task(TaskFunction_t fn, const char* name, StackType_t* stack, StaticTask_t* tcb) {
+    TaskHandle_t handle = xTaskCreateStatic(
+        fn,                 // Function that implements the task.
+        name,               // Text name for the task.
+        LOADGEN_STACK_SIZE, // Stack size in bytes on the ESP32.
+        NULL,               // Parameter passed into the task.
+        LOADGEN_PRIORITY,   // Priority at which the task is created.
+        stack,              // Stack buffer.
+        tcb);               // Task control block.
+    if (!handle) {
+        ESP_LOGE(TAG, "Failed to create thread!");
+        ASSERT(0);
+    }
+    mem_register_stack(name, LOADGEN_STACK_SIZE);
+    return handle;
+}
+
+// Installs the simulated broker, must run before mqtt_init
+void loadgen_init(const loadgen_config_t* cfg) {
+    config = cfg ? *cfg : loadgen_default_config;
+    ASSERT(config.tags && config.rate_mhz_per_tag && config.report_ms);
+
+    loadgen_hist_init(&latency);
+    loadgen_model_init(&model, &config, esp_random, esp_timer_get_time());
+    eventQ = xQueueCreateStatic(LOADGEN_EVENT_Q_DEPTH, sizeof(loadgen_event_t), eventQ_storage, &eventQ_buf);
+    ASSERT(eventQ);
+
+    mqtt_set_publish_hook(broker_publish);
+}
+
+// Starts the fleet, must run after mqtt_init
+void loadgen_start(void) {
+    start_task(broker_task, "lg_broker", broker_stack, &broker_tcb);
+    start_task(ingest_task, "lg_ingest", ingest_stack, &ingest_tcb);
+    start_task(generator_task, "lg_generator", generator_stack, &generator_tcb);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "loadgen_model.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+//#define LOADGEN_ENABLED // if set, app_main runs the synthetic tag fleet instead of BLE/WiFi
+
+// The fleet's traffic model is in loadgen_model.c and also builds on the
+// host (tools/loadgen_plan.c, to size a config before flashing it). The
+// measurement itself runs here: what is being measured is the gateway's
+// own ingest path, ble_ingest_* into the msg_buf pool, the SPSC ring and
+// the publisher task under FreeRTOS scheduling on the pinned core, and
+// none of that exists off target. A host can't play thousands of BLE
+// centrals at a real radio either, so the tags are played in process
+
+#define LOADGEN_STACK_SIZE    (3072)
+#define LOADGEN_PRIORITY      (5)
+#define LOADGEN_EVENT_Q_DEPTH (32) // stands in for the BTC task's event queue
+#define LOADGEN_RETRY_SLOTS   (64)
+#define LOADGEN_BROKER_SLOTS  (32)
+#define LOADGEN_TICK_MS       (10) // one FreeRTOS tick at 100Hz
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint32_t generated;
+    uint32_t accepted;   // ACKed by the gateway
+    uint32_t nacked;     // NACK seen by a tag (may be retried)
+    uint32_t retried;
+    uint32_t dropped_q;  // gateway busy, event never reached the ingest path
+    uint32_t given_up;   // NACKed after max_retries
+    uint32_t broker_lost;
+} loadgen_stats_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+// loadgen_init (config may be NULL for the defaults) goes before
+// mqtt_init, loadgen_start after it
+void loadgen_init(const loadgen_config_t* config);
+void loadgen_start(void);
+void loadgen_get_stats(loadgen_stats_t* stats);
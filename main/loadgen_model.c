@@ -0,0 +1,127 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "loadgen_model.h"
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+const loadgen_config_t loadgen_default_config = {
+    .tags             = LOADGEN_DEFAULT_TAGS,
+    .rate_mhz_per_tag = LOADGEN_DEFAULT_RATE_MHZ,
+    .burst_factor     = LOADGEN_DEFAULT_BURST_FACTOR,
+    .burst_ms         = LOADGEN_DEFAULT_BURST_MS,
+    .burst_period_ms  = LOADGEN_DEFAULT_BURST_PERIOD_MS,
+    .mtu              = LOADGEN_DEFAULT_MTU,
+    .long_write_pct   = LOADGEN_DEFAULT_LONG_WRITE_PCT,
+    .max_retries      = LOADGEN_DEFAULT_MAX_RETRIES,
+    .retry_delay_ms   = LOADGEN_DEFAULT_RETRY_DELAY_MS,
+    .ack_delay_ms     = LOADGEN_DEFAULT_ACK_DELAY_MS,
+    .ack_jitter_ms    = LOADGEN_DEFAULT_ACK_JITTER_MS,
+    .ack_loss_pct     = LOADGEN_DEFAULT_ACK_LOSS_PCT,
+    .report_ms        = LOADGEN_DEFAULT_REPORT_MS,
+};
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static uint32_t random_below(const loadgen_model_t* model, uint32_t limit) {
+    if (!limit) {
+        return 0;
+    }
+    return model->random() % limit;
+}
+
+// exponentially distributed sample, for Poisson arrivals
+static int64_t random_exp_us(const loadgen_model_t* model, double mean_us) {
+    double u = ((double)model->random() + 1.0) / 4294967296.0;
+    return (int64_t)(-log(u) * mean_us);
+}
+
+void loadgen_model_init(loadgen_model_t* model, const loadgen_config_t* config, uint32_t (*random)(void), int64_t now_us) {
+    model->config   = config;
+    model->random   = random;
+    model->mean_us  = 1e9 / ((double)config->tags * config->rate_mhz_per_tag);
+    model->start_us = now_us;
+    model->next_us  = now_us + random_exp_us(model, model->mean_us);
+}
+
+bool loadgen_model_bursting(const loadgen_model_t* model, int64_t now_us) {
+    const loadgen_config_t* config = model->config;
+    return config->burst_factor > 1 && config->burst_period_ms
+           && ((now_us - model->start_us) / 1000) % config->burst_period_ms < config->burst_ms;
+}
+
+bool loadgen_model_next(loadgen_model_t* model, int64_t now_us, loadgen_event_t* event) {
+    if (model->next_us > now_us) {
+        return false;
+    }
+    const loadgen_config_t* config = model->config;
+    event->tag_id              = random_below(model, config->tags);
+    event->retries             = 0;
+    event->long_write          = random_below(model, 100) < config->long_write_pct;
+    event->created_us          = model->next_us;
+    event->packet.distance_uwb = random_below(model, 5000);
+    event->packet.time         = (uint32_t)(model->next_us / 1000000);
+
+    double mean = loadgen_model_bursting(model, now_us) ? model->mean_us / config->burst_factor : model->mean_us;
+    model->next_us += random_exp_us(model, mean);
+    return true;
+}
+
+uint16_t loadgen_model_fragment(const loadgen_config_t* config) {
+    return config->mtu > LOADGEN_ATT_HEADER ? config->mtu - LOADGEN_ATT_HEADER : 1;
+}
+
+int64_t loadgen_model_ack_delay_us(const loadgen_model_t* model) {
+    const loadgen_config_t* config = model->config;
+    return (int64_t)(config->ack_delay_ms + random_below(model, config->ack_jitter_ms + 1)) * 1000;
+}
+
+bool loadgen_model_ack_lost(const loadgen_model_t* model) {
+    return random_below(model, 100) < model->config->ack_loss_pct;
+}
+
+void loadgen_hist_init(loadgen_hist_t* hist) {
+    double bound = 500.0;
+    for (int i = 0; i < LOADGEN_LATENCY_BUCKETS; i++) {
+        hist->bound_us[i] = (uint32_t)bound;
+        bound *= 1.189207; // 2^(1/4)
+    }
+    memset(hist->counts, 0, sizeof(hist->counts));
+}
+
+int loadgen_hist_bucket(const loadgen_hist_t* hist, int64_t us) {
+    int i = 0;
+    while (i < LOADGEN_LATENCY_BUCKETS - 1 && us > hist->bound_us[i]) {
+        i++;
+    }
+    return i;
+}
+
+uint32_t loadgen_hist_total(const loadgen_hist_t* hist) {
+    uint32_t total = 0;
+    for (int i = 0; i < LOADGEN_LATENCY_BUCKETS; i++) {
+        total += hist->counts[i];
+    }
+    return total;
+}
+
+uint32_t loadgen_hist_percentile(const loadgen_hist_t* hist, int pct) {
+    uint32_t total = loadgen_hist_total(hist);
+    if (!total) {
+        return 0;
+    }
+    uint32_t target = ((uint64_t)total * pct + 99) / 100;
+    uint32_t seen   = 0;
+    for (int i = 0; i < LOADGEN_LATENCY_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            return hist->bound_us[i];
+        }
+    }
+    return hist->bound_us[LOADGEN_LATENCY_BUCKETS - 1];
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uwb_core.h"
+
+// Traffic model of the synthetic tag fleet: Poisson arrivals with periodic
+// bursts, long (prepared) writes split at the MTU, tag retries and the
+// simulated broker's ack delay and loss, plus the latency histogram the
+// results are reported in. No IDF calls, the same files build into the
+// host planning tool (tools/loadgen_plan.c); loadgen_core.c runs the model
+// on target against the real ingest path
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define LOADGEN_LATENCY_BUCKETS (56)  // 4 per octave from 500us, ~8s
+#define LOADGEN_MAX_PAYLOAD     (256) // one 8 packet flash chunk
+#define LOADGEN_ATT_HEADER      (5)   // prepared write header, per fragment
+
+// Defaults for loadgen_config_t, a 200 tag site reporting every 5s
+#define LOADGEN_DEFAULT_TAGS            (200)
+#define LOADGEN_DEFAULT_RATE_MHZ        (200) // per tag, in milli-readings per second
+#define LOADGEN_DEFAULT_BURST_FACTOR    (4)
+#define LOADGEN_DEFAULT_BURST_MS        (2000)
+#define LOADGEN_DEFAULT_BURST_PERIOD_MS (20000)
+#define LOADGEN_DEFAULT_MTU             (23)
+#define LOADGEN_DEFAULT_LONG_WRITE_PCT  (10)
+#define LOADGEN_DEFAULT_MAX_RETRIES     (2)
+#define LOADGEN_DEFAULT_RETRY_DELAY_MS  (250)
+#define LOADGEN_DEFAULT_ACK_DELAY_MS    (40)
+#define LOADGEN_DEFAULT_ACK_JITTER_MS   (60)
+#define LOADGEN_DEFAULT_ACK_LOSS_PCT    (1)
+#define LOADGEN_DEFAULT_REPORT_MS       (10000)
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    // Fleet
+    uint32_t tags;
+    uint32_t rate_mhz_per_tag; // mean arrival rate per tag (Poisson)
+    uint32_t burst_factor;     // rate multiplier while bursting, 1 disables bursts
+    uint32_t burst_ms;
+    uint32_t burst_period_ms;
+
+    // Link
+    uint16_t mtu;            // prepared writes carry (mtu - LOADGEN_ATT_HEADER) bytes each
+    uint8_t  long_write_pct; // share of readings sent as a prepared (long) write
+    uint8_t  max_retries;    // how many times a tag resends after a NACK
+    uint32_t retry_delay_ms;
+
+    // Simulated broker
+    uint32_t ack_delay_ms;
+    uint32_t ack_jitter_ms;
+    uint8_t  ack_loss_pct;
+
+    uint32_t report_ms;
+} loadgen_config_t;
+
+// One reading as a tag sends it
+typedef struct {
+    uint16_t     tag_id;
+    uint8_t      retries;
+    uint8_t      long_write;
+    int64_t      created_us; // first attempt, so retries count towards latency
+    uwb_packet_t packet;
+} loadgen_event_t;
+
+// Arrival process of the whole fleet, one aggregate Poisson process
+typedef struct {
+    const loadgen_config_t* config;
+    uint32_t (*random)(void); // uniform 32 bit, esp_random on target
+    double  mean_us;          // between two readings from anywhere in the fleet
+    int64_t start_us;
+    int64_t next_us;
+} loadgen_model_t;
+
+// Latency histogram, bucket i holds samples up to bound_us[i]
+typedef struct {
+    uint32_t bound_us[LOADGEN_LATENCY_BUCKETS];
+    uint32_t counts[LOADGEN_LATENCY_BUCKETS];
+} loadgen_hist_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+extern const loadgen_config_t loadgen_default_config;
+
+void loadgen_model_init(loadgen_model_t* model, const loadgen_config_t* config, uint32_t (*random)(void), int64_t now_us);
+
+// Next reading due at or before now_us, false once the fleet has caught up.
+// Call until it returns false, the burst state is taken at now_us
+bool loadgen_model_next(loadgen_model_t* model, int64_t now_us, loadgen_event_t* event);
+
+bool loadgen_model_bursting(const loadgen_model_t* model, int64_t now_us);
+
+// Bytes of payload per prepared write fragment at the configured MTU
+uint16_t loadgen_model_fragment(const loadgen_config_t* config);
+
+// The simulated broker: how long until a publish is acked, or whether
+// the ack is lost
+int64_t loadgen_model_ack_delay_us(const loadgen_model_t* model);
+bool    loadgen_model_ack_lost(const loadgen_model_t* model);
+
+void     loadgen_hist_init(loadgen_hist_t* hist);
+int      loadgen_hist_bucket(const loadgen_hist_t* hist, int64_t us);
+uint32_t loadgen_hist_total(const loadgen_hist_t* hist);
+// upper bound of the bucket holding the pct'th percentile, in us
+uint32_t loadgen_hist_percentile(const loadgen_hist_t* hist, int pct);
@@ -9,20 +9,73 @@
 #include <sys/param.h>
 #include "protocol_examples_common.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #include "ble_core.h"
+#include "capture_core.h"
+#include "config_core.h"
+#include "enc_core.h"
+#include "flash_core.h"
+#include "global_defines.h"
+#include "loadgen_core.h"
+#include "mem_core.h"
 #include "mqtt_core.h"
+#include "prof_core.h"
 #include "stnp_core.h"
 
+static const char* TAG = "MAIN";
+
+#define NET_BRINGUP_STACK_SIZE (4096)
+#define NET_BRINGUP_PRIORITY   (5)
+
+static StackType_t  net_bringup_stack[NET_BRINGUP_STACK_SIZE];
+static StaticTask_t net_bringup_tcb;
+
+// Wi-Fi association, DHCP and SNTP can take seconds (or never finish),
+// so they run here while BLE ingest is already up and spooling
+static void net_bringup(void* arg) {
+    ESP_ERROR_CHECK(example_connect());
+    initialize_sntp();
+    mqtt_start();
+    vTaskDelete(NULL);
+}
+
 int app_main() {
     ESP_ERROR_CHECK(nvs_flash_init());
+    config_init();
+
+    flash_init();
+#ifdef FLASH_BENCH
+    flash_bench();
+#endif
+    enc_init();
+
+#ifdef LOADGEN_ENABLED
+    // No radio, the synthetic fleet drives the ingest path against a fake broker
+    loadgen_init(NULL);
+    mqtt_init();
+    mqtt_start();
+    loadgen_start();
+    prof_init();
+    mem_init();
+    return (0);
+#endif
+
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    ESP_ERROR_CHECK(example_connect());
-
-    initialize_sntp();
 
     //init_wifi();
+    // Ingest first: the pipeline starts with the link DOWN, so readings
+    // are spooled (and timestamped) until the network catches up
+    capture_init();
     mqtt_init();
     ble_init();
+
+    ASSERT(xTaskCreateStatic(net_bringup, "net_bringup", NET_BRINGUP_STACK_SIZE, NULL,
+                             NET_BRINGUP_PRIORITY, net_bringup_stack, &net_bringup_tcb));
+    mem_register_stack("net_bringup", sizeof(net_bringup_stack));
+    prof_init();
+    mem_init();
     return (0);
 }
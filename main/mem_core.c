@@ -0,0 +1,134 @@
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "global_defines.h"
+#include "mem_core.h"
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "MEM_CORE";
+
+// Registrations only happen from the init path (app_main), before the
+// report task is started, so this table needs no locking
+static mem_static_entry_t static_table[MEM_MAX_STATIC_ENTRIES];
+static int                static_entries;
+
+static TaskStatus_t task_status[MEM_MAX_TASKS_REPORTED];
+
+static StackType_t  mem_report_stack[MEM_REPORT_STACK_SIZE];
+static StaticTask_t mem_report_tcb;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static void add_entry(const char* name, size_t bytes, uint32_t stack_bytes) {
+    if (static_entries == MEM_MAX_STATIC_ENTRIES) {
+        ESP_LOGE(TAG, "Static table full, %s not tracked", name);
+        return;
+    }
+    static_table[static_entries].name        = name;
+    static_table[static_entries].bytes       = bytes;
+    static_table[static_entries].stack_bytes = stack_bytes;
+    static_entries++;
+}
+
+// Records a static object in the build-time budget
+void mem_register_static(const char* name, size_t bytes) {
+    add_entry(name, bytes, 0);
+}
+
+// Same as mem_register_static, but lets the report match the
+// stack size with the task's high water mark by name
+void mem_register_stack(const char* name, uint32_t stack_bytes) {
+    add_entry(name, stack_bytes, stack_bytes);
+}
+
+static uint32_t get_static_total(void) {
+    uint32_t total = 0;
+    for (int i = 0; i < static_entries; i++) {
+        total += static_table[i].bytes;
+    }
+    return total;
+}
+
+void mem_get_snapshot(mem_snapshot_t* snap) {
+    ASSERT(snap);
+    snap->heap_free          = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    snap->heap_min_free      = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    snap->heap_largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    snap->static_total       = get_static_total();
+}
+
+static uint32_t find_stack_size(const char* task_name) {
+    for (int i = 0; i < static_entries; i++) {
+        if (static_table[i].stack_bytes && !strcmp(static_table[i].name, task_name)) {
+            return static_table[i].stack_bytes;
+        }
+    }
+    return 0;
+}
+
+// Logs the static budget, every task's stack high water mark and the heap
+// state. High water marks are in bytes on the ESP32 port (StackType_t is a byte)
+void mem_report(void) {
+    mem_snapshot_t snap;
+    mem_get_snapshot(&snap);
+
+    ESP_LOGI(TAG, "---- static budget (%d bytes) ----", snap.static_total);
+    for (int i = 0; i < static_entries; i++) {
+        ESP_LOGI(TAG, "%-20s %6d", static_table[i].name, static_table[i].bytes);
+    }
+
+    UBaseType_t tasks = uxTaskGetSystemState(task_status, MEM_MAX_TASKS_REPORTED, NULL);
+    if (tasks == 0) {
+        ESP_LOGE(TAG, "More than %d tasks, raise MEM_MAX_TASKS_REPORTED", MEM_MAX_TASKS_REPORTED);
+    }
+
+    ESP_LOGI(TAG, "---- stacks (%d tasks) ----", tasks);
+    for (int i = 0; i < tasks; i++) {
+        uint32_t size = find_stack_size(task_status[i].pcTaskName);
+        if (size) {
+            ESP_LOGI(TAG, "%-16s free %5d of %5d (%d%% used)",
+                     task_status[i].pcTaskName,
+                     task_status[i].usStackHighWaterMark,
+                     size,
+                     ((size - task_status[i].usStackHighWaterMark) * 100) / size);
+        } else {
+            ESP_LOGI(TAG, "%-16s free %5d", task_status[i].pcTaskName, task_status[i].usStackHighWaterMark);
+        }
+    }
+
+    ESP_LOGI(TAG, "---- heap ----");
+    ESP_LOGI(TAG, "free %d, minimum free %d, largest block %d",
+             snap.heap_free, snap.heap_min_free, snap.heap_largest_block);
+}
+
+static void mem_report_task(void* arg) {
+    while (true) {
+        mem_report();
+        vTaskDelay(MEM_REPORT_PERIOD_MS / portTICK_PERIOD_MS);
+    }
+}
+
+void mem_init(void) {
+    mem_register_stack("mem_report", sizeof(mem_report_stack));
+    mem_register_static("mem_task_status", sizeof(task_status));
+
+    TaskHandle_t handle = xTaskCreateStatic(
+        mem_report_task,       // Function that implements the task.
+        "mem_report",          // Text name for the task.
+        MEM_REPORT_STACK_SIZE, // Stack size in bytes on the ESP32.
+        NULL,                  // Parameter passed into the task.
+        MEM_REPORT_PRIORITY,   // Priority at which the task is created.
+        mem_report_stack,      // Stack buffer.
+        &mem_report_tcb);      // Task control block.
+    ASSERT(handle);
+}
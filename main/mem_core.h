@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define MEM_MAX_STATIC_ENTRIES   (40)
+#define MEM_MAX_TASKS_REPORTED   (24)
+#define MEM_REPORT_PERIOD_MS     (60 * 1000)
+#define MEM_REPORT_STACK_SIZE    (2560)
+#define MEM_REPORT_PRIORITY      (1)
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// One statically allocated object (task stack, queue storage, pool...)
+// the build-time part of the budget is just the sum of these
+typedef struct {
+    const char* name;
+    size_t      bytes;
+    uint32_t    stack_bytes; // non zero if this entry is a task stack
+} mem_static_entry_t;
+
+typedef struct {
+    uint32_t heap_free;
+    uint32_t heap_min_free;      // low water mark since boot
+    uint32_t heap_largest_block; // fragmentation indicator
+    uint32_t static_total;       // sum of all registered static objects
+} mem_snapshot_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void mem_init(void);
+void mem_register_static(const char* name, size_t bytes);
+void mem_register_stack(const char* name, uint32_t stack_bytes);
+void mem_get_snapshot(mem_snapshot_t* snap);
+void mem_report(void);
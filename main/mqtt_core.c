@@ -6,9 +6,11 @@
    software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
    CONDITIONS OF ANY KIND, either express or implied.
 */
+#include "esp_attr.h"
 #include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "nvs_flash.h"
 #include "protocol_examples_common.h"
@@ -16,6 +18,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
@@ -33,8 +36,25 @@
 
 #include "trace_packet_helper.h"
 #include "aws_clientcredential.h"
+#include "agg_core.h"
+#include "alert_core.h"
+#include "broker_core.h"
+#include "capture_core.h"
+#include "config_core.h"
 #include "global_defines.h"
+#include "mem_core.h"
 #include "mqtt_core.h"
+#include "msg_buf.h"
+#include "nvs.h"
+#include "packet_codec.h"
+#include "sink_core.h"
+#include "spool_core.h"
+#include "spsc_ring.h"
+#include "status_core.h"
+#include "tls_core.h"
+#include "stnp_core.h"
+#include "upload_core.h"
+#include "uwb_core.h"
 
 /*********************************************************
 *                                                STATICS *
@@ -47,8 +67,115 @@ static QueueHandle_t            sentQ;   // used to indicate a messageID was pub
 static QueueHandle_t            replayQ; // used to replay a message
 
 static replay_message_t         replay_arr[PUB_ARR_SIZE];
+static rtt_est_t                rtt; // under mqtt_arr_sem
+
+// Publishes that timed out, their acks may still come in. Only the manager
+// touches it
+typedef struct {
+    int     message_id; // 0: empty
+    int64_t sent_us;
+} mqtt_timed_out_t;
+
+static mqtt_timed_out_t timed_out[PUB_ARR_SIZE];
+static int              timed_out_next;
 static esp_mqtt_client_handle_t client;
 
+// Backing storage for the steady state objects above, nothing here
+// comes from the heap once mqtt_init returns
+static StaticSemaphore_t mqtt_arr_sem_buf;
+static StaticQueue_t     sentQ_buf;
+static StaticQueue_t     replayQ_buf;
+static uint8_t           sentQ_storage[DEPTTH_MQTT_Q * sizeof(replay_message_t)];
+static uint8_t           replayQ_storage[DEPTTH_MQTT_Q * sizeof(replay_message_t)];
+static StaticQueue_t     notification_q_buf[PUB_ARR_SIZE];
+static uint8_t           notification_q_storage[PUB_ARR_SIZE][sizeof(int)];
+
+static StackType_t  mqtt_manager_stack[MQTT_STACK_SIZE];
+static StaticTask_t mqtt_manager_tcb;
+static StackType_t  replay_task_stack[MQTT_STACK_SIZE];
+static StaticTask_t replay_task_tcb;
+
+// Only ever used from the publisher task
+static char json_buf[MQTT_JSON_BUF_SIZE];
+
+// BLE core -> MQTT core handoff of msg_buf_t references. Every producing
+// task claims its own SPSC ring on its first reading and keeps it, the
+// tasks are static so a restarted one gets its ring back. Neither side
+// takes a lock, lane_mux only guards claiming
+typedef struct {
+    TaskHandle_t owner; // set once, under lane_mux
+    spsc_ring_t  ring;
+    void*        slots[MSG_BUF_POOL_SIZE];
+} ingest_lane_t;
+
+static ingest_lane_t ingest_lanes[MQTT_INGEST_PRODUCERS];
+static portMUX_TYPE  lane_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t  publisher_handle;
+
+static StackType_t  publisher_stack[MQTT_PUBLISHER_STACK_SIZE];
+static StaticTask_t publisher_tcb;
+
+static void publisher_task(void* arg);
+static void drain_task(void* arg);
+
+// Link state machine, written from the MQTT client task (connect/disconnect)
+// and the drain task (drained), read by the BLE core on every reading
+static mqtt_link_state_t link_state = MQTT_LINK_DOWN;
+static mqtt_link_stats_t link_stats;
+static int64_t           link_changed_us;
+static portMUX_TYPE      link_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t      drain_handle;
+static char              drain_json_buf[MQTT_JSON_BUF_SIZE];
+
+static StackType_t  drain_stack[MQTT_DRAIN_STACK_SIZE];
+static StaticTask_t drain_tcb;
+
+// Startup latency, each field set once
+static mqtt_boot_stats_t boot_stats;
+static portMUX_TYPE      boot_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// When set, reading publishes go here instead of the ESP-MQTT client (load
+// generator, capture replay), and the pipeline runs as if the link was up
+static mqtt_publish_hook_t publish_hook;
+
+// Reconnect policy state. The counters live in RTC memory so a soft reboot
+// (panic, watchdog, OTA restart) keeps its backoff and timing history
+typedef struct {
+    uint32_t          magic;
+    mqtt_conn_stats_t stats;
+} mqtt_conn_rtc_t;
+
+static RTC_NOINIT_ATTR mqtt_conn_rtc_t conn_rtc;
+static portMUX_TYPE                    conn_mux = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t              reconnect_timer;
+static int64_t                         handshake_start_us;
+
+// The client config has to outlive mqtt_app_start, ESP-MQTT keeps
+// pointers into it
+static esp_mqtt_client_config_t mqtt_cfg;
+static esp_mqtt_client_config_t standby_cfg;
+
+// Broker failover (broker_core.h). client carries the uplink, with
+// broker_standby set standby_client keeps a connection to standby_broker
+// ready. The two handles swap on a warm failover, under broker_mux
+static broker_set_t             brokers;
+static char                     broker_uris[BROKER_MAX][BROKER_URI_LEN];
+static esp_mqtt_client_handle_t standby_client;
+static int                      standby_broker = -1;
+static bool                     standby_dropped; // its next disconnect was ours
+static bool                     uplink_dropped;  // same for client
+static uint32_t                 standby_attempts;
+static esp_timer_handle_t       standby_timer;
+static portMUX_TYPE             broker_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Bumped under mqtt_arr_sem on every failover, acks stamped with an older
+// epoch belong to the old connection (the new client reuses message ids)
+static volatile uint8_t client_epoch;
+
+// Registered at init time, before the client is started
+static mqtt_cmd_t mqtt_cmds[MQTT_MAX_COMMANDS];
+static int        mqtt_cmd_count;
+
 /*********************************************************
 *                                                EXTERNS *
 *********************************************************/
@@ -58,13 +185,282 @@ extern const uint8_t client_cert_pem_end[] asm("_binary_client_crt_end");
 extern const uint8_t client_key_pem_start[] asm("_binary_client_key_start");
 extern const uint8_t client_key_pem_end[] asm("_binary_client_key_end");
 
+void mqtt_register_command(const char* name, mqtt_cmd_handler_t handler) {
+    if (mqtt_cmd_count == MQTT_MAX_COMMANDS) {
+        ESP_LOGE(TAG, "No room for command %s", name);
+        ASSERT(0);
+    }
+    mqtt_cmds[mqtt_cmd_count].name    = name;
+    mqtt_cmds[mqtt_cmd_count].handler = handler;
+    mqtt_cmd_count++;
+}
+
+// "<name> <args>" -> handler(args)
+static void dispatch_command(const char* data, int data_len) {
+    int name_len = 0;
+    while (name_len < data_len && data[name_len] != ' ') {
+        name_len++;
+    }
+    const char* args     = data + name_len;
+    int         args_len = data_len - name_len;
+    if (args_len) {
+        args++;
+        args_len--;
+    }
+
+    for (int i = 0; i < mqtt_cmd_count; i++) {
+        if (strlen(mqtt_cmds[i].name) == name_len && !strncmp(mqtt_cmds[i].name, data, name_len)) {
+            ESP_LOGI(TAG, "Running command %s", mqtt_cmds[i].name);
+            mqtt_cmds[i].handler(args, args_len);
+            return;
+        }
+    }
+    ESP_LOGE(TAG, "Unknown command %.*s", name_len, data);
+}
+
+void mqtt_get_link_stats(mqtt_link_stats_t* stats) {
+    ASSERT(stats);
+    portENTER_CRITICAL(&link_mux);
+    *stats       = link_stats;
+    stats->state = link_state;
+    portEXIT_CRITICAL(&link_mux);
+}
+
+void mqtt_get_boot_stats(mqtt_boot_stats_t* stats) {
+    ASSERT(stats);
+    portENTER_CRITICAL(&boot_mux);
+    *stats = boot_stats;
+    portEXIT_CRITICAL(&boot_mux);
+}
+
+// Stamps *field with the current uptime the first time it's called for
+// it, returns true that one time
+static bool boot_mark(uint32_t* field, const char* what) {
+    uint32_t now_ms = esp_timer_get_time() / 1000;
+    bool     first  = false;
+    portENTER_CRITICAL(&boot_mux);
+    if (!*field) {
+        *field = MAX(1, now_ms);
+        first  = true;
+    }
+    portEXIT_CRITICAL(&boot_mux);
+    if (first) {
+        ESP_LOGI(TAG, "Boot: %s after %d ms", what, now_ms);
+    }
+    return first;
+}
+
+// "boot_stats", startup latency on MQTT_BOOT_TOPIC. Also published by
+// itself once the first reading is acked
+static void boot_stats_cmd(const char* args, int args_len) {
+    char              out[128];
+    mqtt_boot_stats_t s;
+    mqtt_get_boot_stats(&s);
+    int len = snprintf(out, sizeof(out), "first_accepted_ms=%d first_connected_ms=%d first_published_ms=%d",
+                       s.first_accepted_ms, s.first_connected_ms, s.first_published_ms);
+    mqtt_publish_raw(MQTT_BOOT_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
+// Wall clock time of an uptime stamp, so readings spooled before SNTP
+// synced get their receipt time once it has. 0 while it never synced
+static uint32_t utc_of_uptime(uint32_t uptime_ms) {
+    if (!get_time_sync_quality()) {
+        return 0;
+    }
+    uint32_t now_ms = esp_timer_get_time() / 1000;
+    return get_time_utc() - (now_ms - uptime_ms) / 1000;
+}
+
+// Spools a reading with its tag, RSSI and receipt time
+static bool spool_reading(const msg_buf_t* msg) {
+    spool_entry_t entry;
+    memcpy(entry.data, msg->data, sizeof(entry.data));
+    memcpy(entry.tag, msg->tag, sizeof(entry.tag));
+    entry.rssi  = msg->rssi;
+    entry.rx_ms = msg->created_us / 1000;
+    return spool_push(&entry);
+}
+
+// The link as the pipeline sees it, with a hook standing in for the
+// broker the client's connection has no say
+static mqtt_link_state_t pipeline_link(void) {
+    return publish_hook ? MQTT_LINK_UP : link_state;
+}
+
+static void link_connected(void) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&link_mux);
+    link_stats.last_outage_ms = (now - link_changed_us) / 1000;
+    link_state                = MQTT_LINK_DRAINING;
+    link_changed_us           = now;
+    portEXIT_CRITICAL(&link_mux);
+
+    ESP_LOGI(TAG, "Link up after %d ms, draining spool", link_stats.last_outage_ms);
+    boot_mark(&boot_stats.first_connected_ms, "first connect");
+    xTaskNotifyGive(drain_handle);
+}
+
+static void fail_pending(int status);
+
+static void link_disconnected(void) {
+    portENTER_CRITICAL(&link_mux);
+    if (link_state != MQTT_LINK_DOWN) {
+        link_stats.disconnects++;
+        link_changed_us = esp_timer_get_time();
+    }
+    link_state = MQTT_LINK_DOWN;
+    portEXIT_CRITICAL(&link_mux);
+
+    // Don't make in-flight publishes sit out the ack timeout, the
+    // publisher spools them as soon as they fail
+    if (!publish_hook) {
+        fail_pending(MQTT_ERROR);
+    }
+}
+
+void mqtt_get_conn_stats(mqtt_conn_stats_t* stats) {
+    ASSERT(stats);
+    portENTER_CRITICAL(&conn_mux);
+    *stats = conn_rtc.stats;
+    portEXIT_CRITICAL(&conn_mux);
+}
+
+static void conn_stats_init(void) {
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (conn_rtc.magic != MQTT_CONN_STATS_MAGIC || reason == ESP_RST_POWERON) {
+        memset(&conn_rtc, 0, sizeof(conn_rtc));
+        conn_rtc.magic = MQTT_CONN_STATS_MAGIC;
+        return;
+    }
+    conn_rtc.stats.boots++;
+    ESP_LOGI(TAG, "Soft reboot %d, %d connects so far, resuming backoff at attempt %d",
+             conn_rtc.stats.boots, conn_rtc.stats.connects, conn_rtc.stats.attempts);
+}
+
+// Equal jitter: half the ceiling is fixed, the other half random, so a
+// fleet that lost the same AP doesn't come back in lockstep
+static uint32_t next_backoff_ms(uint32_t attempt) {
+    uint32_t ceil_ms = MQTT_RECONNECT_MAX_MS;
+    if (attempt < 16) {
+        ceil_ms = MIN((uint32_t)MQTT_RECONNECT_BASE_MS << attempt, MQTT_RECONNECT_MAX_MS);
+    }
+    return ceil_ms / 2 + esp_random() % (ceil_ms / 2);
+}
+
+static void reconnect_timer_cb(void* arg) {
+    ESP_LOGI(TAG, "Reconnect attempt %d", conn_rtc.stats.attempts);
+    esp_mqtt_client_reconnect(client);
+}
+
+static void schedule_reconnect(void) {
+    portENTER_CRITICAL(&conn_mux);
+    uint32_t delay_ms              = next_backoff_ms(conn_rtc.stats.attempts);
+    conn_rtc.stats.next_backoff_ms = delay_ms;
+    conn_rtc.stats.attempts++;
+    portEXIT_CRITICAL(&conn_mux);
+
+    ESP_LOGI(TAG, "Reconnecting in %d ms", delay_ms);
+    esp_timer_stop(reconnect_timer);
+    esp_timer_start_once(reconnect_timer, (uint64_t)delay_ms * 1000);
+}
+
+static void conn_connected(void) {
+    uint32_t handshake_ms = 0;
+    if (handshake_start_us) {
+        handshake_ms = (esp_timer_get_time() - handshake_start_us) / 1000;
+    }
+    esp_timer_stop(reconnect_timer);
+
+    portENTER_CRITICAL(&conn_mux);
+    conn_rtc.stats.connects++;
+    conn_rtc.stats.attempts          = 0;
+    conn_rtc.stats.next_backoff_ms   = 0;
+    conn_rtc.stats.last_handshake_ms = handshake_ms;
+    conn_rtc.stats.max_handshake_ms  = MAX(conn_rtc.stats.max_handshake_ms, handshake_ms);
+    portEXIT_CRITICAL(&conn_mux);
+
+    ESP_LOGI(TAG, "Handshake took %d ms", handshake_ms);
+}
+
+// A fresh DHCP lease means the network is back, don't sit out the rest of
+// the backoff. Only cancels the timer if the client accepted the request,
+// esp_mqtt_client_reconnect fails unless it is waiting to reconnect
+static void got_ip_handler(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    mqtt_link_stats_t stats;
+    mqtt_get_link_stats(&stats);
+    if (stats.state != MQTT_LINK_DOWN || !client) {
+        return;
+    }
+    if (esp_mqtt_client_reconnect(client) == ESP_OK) {
+        esp_timer_stop(reconnect_timer);
+        portENTER_CRITICAL(&conn_mux);
+        conn_rtc.stats.fast_reconnects++;
+        portEXIT_CRITICAL(&conn_mux);
+        ESP_LOGI(TAG, "Got IP, reconnecting now");
+    }
+}
+
+static void schedule_standby_reconnect(void) {
+    uint32_t delay_ms = next_backoff_ms(standby_attempts++);
+    ESP_LOGI(TAG, "Standby reconnecting in %d ms", delay_ms);
+    esp_timer_stop(standby_timer);
+    esp_timer_start_once(standby_timer, (uint64_t)delay_ms * 1000);
+}
+
+static void standby_timer_cb(void* arg) {
+    esp_mqtt_client_reconnect(standby_client);
+}
+
+// Events of the standby connection. It publishes nothing, only its
+// connection state counts
+static void standby_event(esp_mqtt_event_handle_t event) {
+    int64_t now_us = esp_timer_get_time();
+    switch (event->event_id) {
+    case MQTT_EVENT_CONNECTED:
+        portENTER_CRITICAL(&broker_mux);
+        broker_up(&brokers, standby_broker, now_us);
+        standby_attempts = 0;
+        portEXIT_CRITICAL(&broker_mux);
+        ESP_LOGI(TAG, "Standby connected to broker %d", standby_broker);
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        portENTER_CRITICAL(&broker_mux);
+        if (!standby_dropped) {
+            broker_down(&brokers, standby_broker, now_us);
+        }
+        standby_dropped = false;
+        portEXIT_CRITICAL(&broker_mux);
+        schedule_standby_reconnect();
+        break;
+    default:
+        break;
+    }
+}
+
 static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
+    portENTER_CRITICAL(&broker_mux);
+    bool standby = standby_client && event->client == standby_client;
+    portEXIT_CRITICAL(&broker_mux);
+    if (standby) {
+        standby_event(event);
+        return ESP_OK;
+    }
+
     esp_mqtt_client_handle_t client = event->client;
     int                      msg_id;
     // your_context_t *context = event->context;
+    capture_mqtt_event(event->event_id, event->msg_id);
     switch (event->event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+        handshake_start_us = esp_timer_get_time();
+        break;
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+        portENTER_CRITICAL(&broker_mux);
+        broker_up(&brokers, brokers.active, esp_timer_get_time());
+        portEXIT_CRITICAL(&broker_mux);
+        conn_connected();
+        link_connected();
         msg_id = esp_mqtt_client_subscribe(client, "/topic/qos0", 0);
         ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
 
@@ -73,9 +469,20 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
 
         msg_id = esp_mqtt_client_unsubscribe(client, "/topic/qos1");
         ESP_LOGI(TAG, "sent unsubscribe successful, msg_id=%d", msg_id);
+
+        msg_id = esp_mqtt_client_subscribe(client, MQTT_CMD_TOPIC, 1);
+        ESP_LOGI(TAG, "sent command subscribe successful, msg_id=%d", msg_id);
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        portENTER_CRITICAL(&broker_mux);
+        if (!uplink_dropped) {
+            broker_down(&brokers, brokers.active, esp_timer_get_time());
+        }
+        uplink_dropped = false;
+        portEXIT_CRITICAL(&broker_mux);
+        link_disconnected();
+        schedule_reconnect();
         break;
 
     case MQTT_EVENT_SUBSCRIBED:
@@ -88,16 +495,19 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
         break;
     case MQTT_EVENT_PUBLISHED:
         ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-        replay_message_t test_mem;
-        test_mem.message_id    = event->msg_id;
-        test_mem.total_replays = 0;
-        xQueueSend(sentQ, &test_mem, 1000);
-
+        // with a hook in place the acks of reading publishes come from it,
+        // the broker's would only be for raw publishes and could alias them
+        if (!publish_hook) {
+            mqtt_notify_published(event->msg_id);
+        }
         break;
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
         printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
         printf("DATA=%.*s\r\n", event->data_len, event->data);
+        if (event->topic_len == strlen(MQTT_CMD_TOPIC) && !strncmp(event->topic, MQTT_CMD_TOPIC, event->topic_len)) {
+            dispatch_command(event->data, event->data_len);
+        }
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -109,20 +519,198 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
     return ESP_OK;
 }
 
+// The first broker is the AWS endpoint unless broker_list replaced the list
+static void load_broker_list(void) {
+    nvs_handle_t nvs;
+    size_t       len = sizeof(broker_uris);
+    if (nvs_open(MQTT_BROKER_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        if (nvs_get_blob(nvs, "uris", broker_uris, &len) != ESP_OK || len != sizeof(broker_uris)) {
+            memset(broker_uris, 0, sizeof(broker_uris));
+        }
+        nvs_close(nvs);
+    }
+    int count = 0;
+    while (count < BROKER_MAX && broker_uris[count][0]) {
+        // stored by an older build that took any scheme
+        if (!tls_parse_uri(broker_uris[count], NULL, 0, NULL, 0)) {
+            ESP_LOGE(TAG, "Stored broker %s is not mqtts://, using the default", broker_uris[count]);
+            memset(broker_uris, 0, sizeof(broker_uris));
+            count = 0;
+            break;
+        }
+        count++;
+    }
+    if (!count) {
+        snprintf(broker_uris[0], BROKER_URI_LEN, "mqtts://%s:%d", clientcredentialMQTT_BROKER_ENDPOINT, clientcredentialMQTT_BROKER_PORT);
+        count = 1;
+    }
+    broker_set_init(&brokers, count, esp_timer_get_time());
+    for (int i = 0; i < count; i++) {
+        ESP_LOGI(TAG, "Broker %d: %s", i, broker_uris[i]);
+    }
+}
+
+// "broker_list <uri> [<uri> ...]", no uri goes back to the AWS endpoint
+static void broker_list_cmd(const char* args, int args_len) {
+    char uris[BROKER_MAX][BROKER_URI_LEN] = { { 0 } };
+    int  count                            = 0;
+    int  pos                              = 0;
+    while (pos < args_len && count < BROKER_MAX) {
+        int start = pos;
+        while (pos < args_len && args[pos] != ' ') {
+            pos++;
+        }
+        if (pos - start >= BROKER_URI_LEN) {
+            ESP_LOGE(TAG, "Broker URI longer than %d", BROKER_URI_LEN - 1);
+            return;
+        }
+        if (pos > start) {
+            memcpy(uris[count], args + start, pos - start);
+            // the client certificate is presented to every broker, never
+            // over plain TCP
+            if (!tls_parse_uri(uris[count], NULL, 0, NULL, 0)) {
+                ESP_LOGE(TAG, "Not an mqtts://host[:port] URI: %s, list not stored", uris[count]);
+                return;
+            }
+            count++;
+        }
+        pos++;
+    }
+
+    nvs_handle_t nvs;
+    if (nvs_open(MQTT_BROKER_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, "uris", uris, sizeof(uris)) != ESP_OK || nvs_commit(nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Broker list not stored");
+    } else {
+        ESP_LOGI(TAG, "%d brokers stored, used from the next boot", count);
+    }
+    nvs_close(nvs);
+}
+
+void mqtt_get_brokers(broker_set_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&broker_mux);
+    *out = brokers;
+    portEXIT_CRITICAL(&broker_mux);
+}
+
+// "broker_stats", one line per broker on MQTT_BROKER_TOPIC
+static void broker_stats_cmd(const char* args, int args_len) {
+    static char  out[96 * BROKER_MAX]; // off the MQTT client task's stack
+    int          len = 0;
+    broker_set_t set;
+    mqtt_get_brokers(&set);
+    for (int i = 0; i < set.count && len < sizeof(out); i++) {
+        const broker_health_t* h = &set.health[i];
+        len += snprintf(out + len, sizeof(out) - len,
+                        "%d%s up=%d srtt_ms=%d err=%d acks=%d errors=%d connect_failures=%d failovers=%d\n",
+                        i, i == set.active ? "*" : (i == standby_broker ? "+" : ""), h->up, h->srtt_us / 1000,
+                        h->err_permille, h->acks, h->errors, h->connect_failures, h->failovers);
+    }
+    mqtt_publish_raw(MQTT_BROKER_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
+// "conn_stats", reconnect and handshake counters on MQTT_CONN_TOPIC
+static void conn_stats_cmd(const char* args, int args_len) {
+    char              out[256];
+    mqtt_conn_stats_t conn;
+    tls_stats_t       tls;
+    mqtt_get_conn_stats(&conn);
+    tls_get_stats(&tls);
+    int len = snprintf(out, sizeof(out),
+                       "boots=%d connects=%d attempts=%d fast_reconnects=%d last_handshake_ms=%d max_handshake_ms=%d "
+                       "tls_full=%d tls_resumed=%d tls_rejected=%d tls_failed=%d last_full_ms=%d last_resumed_ms=%d",
+                       conn.boots, conn.connects, conn.attempts, conn.fast_reconnects, conn.last_handshake_ms,
+                       conn.max_handshake_ms, tls.full, tls.resumed, tls.rejected, tls.failed, tls.last_full_ms,
+                       tls.last_resumed_ms);
+    mqtt_publish_raw(MQTT_CONN_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
 static void mqtt_app_start(void) {
-    char mq_uri[100];
-    memset(mq_uri, 0, sizeof(mq_uri));
-    sprintf(mq_uri, "mqtts://%s:%d", clientcredentialMQTT_BROKER_ENDPOINT, clientcredentialMQTT_BROKER_PORT);
-    const esp_mqtt_client_config_t mqtt_cfg = {
-        .uri             = mq_uri,
-        .client_cert_pem = (const char*)keyCLIENT_CERTIFICATE_PEM,
-        .client_key_pem  = (const char*)keyCLIENT_PRIVATE_KEY_PEM,
-        .event_handle    = mqtt_event_handler,
+    conn_stats_init();
+
+    const esp_timer_create_args_t timer_args = {
+        .callback        = reconnect_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "mqtt_reconnect",
     };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &reconnect_timer));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, got_ip_handler, NULL));
+
+    // The clients connect through the TLS relay (tls_core.h), which
+    // presents the client certificate and resumes sessions
+    load_broker_list();
+    tls_init(broker_uris, brokers.count, (const char*)keyCLIENT_CERTIFICATE_PEM, (const char*)keyCLIENT_PRIVATE_KEY_PEM);
+    mqtt_cfg.uri          = tls_local_uri(brokers.active);
+    mqtt_cfg.event_handle = mqtt_event_handler;
+    // Reconnects are driven by reconnect_timer instead of the client's
+    // fixed reconnect_timeout_ms
+    mqtt_cfg.disable_auto_reconnect = true;
 
     ESP_LOGI(TAG, "[APP] Free memory: %d bytes", esp_get_free_heap_size());
     client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_start(client);
+
+    // Same identity on every broker, only the endpoint differs
+    int target = broker_standby_target(&brokers);
+    if (config_get(CFG_BROKER_STANDBY) && target >= 0) {
+        const esp_timer_create_args_t standby_args = {
+            .callback        = standby_timer_cb,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name            = "mqtt_standby",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&standby_args, &standby_timer));
+        standby_cfg     = mqtt_cfg;
+        standby_cfg.uri = tls_local_uri(target);
+        standby_broker  = target;
+        standby_client  = esp_mqtt_client_init(&standby_cfg);
+        esp_mqtt_client_start(standby_client);
+        ESP_LOGI(TAG, "Standby connection to broker %d", target);
+    }
+}
+
+// Feeds a PUBACK for message_id into the manager, this is what
+// MQTT_EVENT_PUBLISHED does, exposed so a simulated broker can ack too
+void mqtt_notify_published(int message_id) {
+    replay_message_t published;
+    published.message_id    = message_id;
+    published.total_replays = 0;
+    published.epoch         = client_epoch;
+    xQueueSend(sentQ, &published, 1000);
+}
+
+void mqtt_set_publish_hook(mqtt_publish_hook_t hook) {
+    publish_hook = hook;
+    if (!hook && drain_handle) {
+        // the spool may have waited on the hook
+        xTaskNotifyGive(drain_handle);
+    }
+}
+
+static int mqtt_client_publish(const char* topic, const char* data, int len, int qos) {
+    int message_id;
+    if (publish_hook) {
+        message_id = publish_hook(topic, data, len, qos);
+    } else {
+        // QoS 1 and up are copied into the client's outbox
+        message_id = esp_mqtt_client_publish(client, topic, data, len, qos, 0);
+        if (qos > 0) {
+            msg_buf_count_copy(len);
+        }
+    }
+    capture_publish(message_id);
+    return message_id;
+}
+
+// Stats, rollups and alerts. They only go to the hook if there is no client
+// (the load generator), a capture replay stands in for reading publishes only
+int mqtt_publish_raw(const char* topic, const char* data, int len) {
+    if (publish_hook && !client) {
+        return publish_hook(topic, data, len, 1);
+    }
+    return esp_mqtt_client_publish(client, topic, data, len, 1, 0);
 }
 
 // returns NULL on fail
@@ -133,32 +721,96 @@ static QueueHandle_t enqueue_reg(int message_id) {
         ASSERT(0);
     }
 
+    // Lowering pub_slots only stops new registrations above it,
+    // the manager still matches acks across the whole array
+    int slots = config_get(CFG_PUB_SLOTS);
     int index = 0;
-    for (; index < PUB_ARR_SIZE; index++) {
-        if (pub_array[index].valid == false) {
+    for (; index < slots; index++) {
+        if (pub_array[index].valid == false && pub_array[index].owned == false) {
             break;
         }
     }
 
-    if (index == PUB_ARR_SIZE) {
+    if (index == slots) {
         ESP_LOGE(TAG, "No room left in the pub arr!");
         xSemaphoreGive(mqtt_arr_sem);
         return NULL;
     }
 
-    QueueHandle_t handle = xQueueCreate(1, sizeof(int));
+    uint32_t timeout_us = rtt_est_deadline_us(&rtt, MQTT_RTO_MIN_MS * 1000,
+                                              config_get(CFG_ACK_TIMEOUT_MS) * 1000, esp_random());
+
+    QueueHandle_t handle = pub_array[index].notification_q;
     ASSERT(handle);
+    xQueueReset(handle);
     pub_array[index].valid                  = true;
+    pub_array[index].owned                  = true;
     pub_array[index].message_id             = message_id;
+    pub_array[index].sent_us                = esp_timer_get_time();
+    pub_array[index].backoff                = rtt.backoff;
     pub_array[index].notification_q         = handle;
-    pub_array[index].max_valid_age_in_ticks = xTaskGetTickCount() + 1000;
+    pub_array[index].max_valid_age_in_ticks = xTaskGetTickCount() + MAX(1, pdMS_TO_TICKS(timeout_us / 1000));
 
     xSemaphoreGive(mqtt_arr_sem);
-    ESP_LOGI(TAG, "Enqueued message id %d, index %d, timeout %d",
-             message_id, index, pub_array[index].max_valid_age_in_ticks);
+    ESP_LOGI(TAG, "Enqueued message id %d, index %d, timeout %d ms",
+             message_id, index, timeout_us / 1000);
     return handle;
 }
 
+// Completes every registration still waiting for an ack with status,
+// MQTT_ERROR when the link dropped, MQTT_MOVED on a failover
+static void fail_pending(int status) {
+    if (pdTRUE != xSemaphoreTake(mqtt_arr_sem, MQTT_SEM_TICKS_TO_WAIT)) {
+        ESP_LOGE(TAG, "Failed to obtain MQTT semaphor!");
+        ASSERT(0);
+    }
+
+    for (int index = 0; index < PUB_ARR_SIZE; index++) {
+        if (pub_array[index].valid) {
+            int sent = status;
+            ESP_LOGE(TAG, "Message ID %d failed, %s!", pub_array[index].message_id,
+                     status == MQTT_MOVED ? "broker changed" : "link down");
+            xQueueSend(pub_array[index].notification_q, &sent, portMAX_DELAY);
+            pub_array[index].valid = false;
+        }
+    }
+    xSemaphoreGive(mqtt_arr_sem);
+}
+
+void mqtt_get_rtt(rtt_est_t* out) {
+    ASSERT(out);
+    if (pdTRUE != xSemaphoreTake(mqtt_arr_sem, MQTT_SEM_TICKS_TO_WAIT)) {
+        ESP_LOGE(TAG, "Failed to obtain MQTT semaphor!");
+        ASSERT(0);
+    }
+    *out = rtt;
+    xSemaphoreGive(mqtt_arr_sem);
+}
+
+// Equal jitter over replay_ms << replays, the ack usually only has to
+// wait for the publisher to get the semaphore
+static uint32_t replay_delay_ms(int replays) {
+    uint32_t ceil_ms = config_get(CFG_REPLAY_DELAY_MS) << MIN(replays, 8);
+    return ceil_ms / 2 + esp_random() % (ceil_ms / 2);
+}
+
+// Hands the slot's notification queue back once the publisher
+// has received its ack/nack
+static void release_reg(QueueHandle_t q) {
+    if (pdTRUE != xSemaphoreTake(mqtt_arr_sem, MQTT_SEM_TICKS_TO_WAIT)) {
+        ESP_LOGE(TAG, "Failed to obtain MQTT semaphor!");
+        ASSERT(0);
+    }
+
+    for (int index = 0; index < PUB_ARR_SIZE; index++) {
+        if (pub_array[index].notification_q == q) {
+            pub_array[index].owned = false;
+            break;
+        }
+    }
+    xSemaphoreGive(mqtt_arr_sem);
+}
+
 static void replay_task(void* arg) {
     int              rxed;
     replay_message_t replay;
@@ -172,24 +824,27 @@ static void replay_task(void* arg) {
 
         if (rxed) {
             ESP_LOGI(TAG, "RXed new message id = %d replays = %d", replay.message_id, replay.total_replays);
-            if (replay.total_replays >= MAXIMUM_REPLAYS) {
+            if (replay.total_replays >= config_get(CFG_MAX_REPLAYS)) {
                 ESP_LOGE(TAG, "Message id %d reached maximum replayed!", replay.message_id);
-                continue;
+                rxed = false; // dropped, the due replays still go out
             }
         }
 
         if (rxed) {
+            bool stored = false;
             for (int i = 0; i < PUB_ARR_SIZE; i++) {
                 if (false == replay_arr[i].valid) {
                     replay_arr[i].valid                  = true;
                     replay_arr[i].message_id             = replay.message_id;
-                    replay_arr[i].replay_time_in_upticks = xTaskGetTickCount() + REPLAY_TIME;
+                    replay_arr[i].replay_time_in_upticks = xTaskGetTickCount() + MAX(1, pdMS_TO_TICKS(replay_delay_ms(replay.total_replays)));
                     replay_arr[i].total_replays          = replay.total_replays;
-                    goto redo_loop;
+                    stored                               = true;
+                    break;
                 }
             }
-            ESP_LOGE(TAG, "No place in replay buffer - dropped messaged id %d ", replay.message_id);
-            continue;
+            if (!stored) {
+                ESP_LOGE(TAG, "No place in replay buffer - dropped messaged id %d ", replay.message_id);
+            }
         }
 
         // Send message back to the sentQ
@@ -202,8 +857,152 @@ static void replay_task(void* arg) {
                 }
             }
         }
-    redo_loop:
-        continue;
+    }
+}
+
+// Readings queued for the publisher, over all producers
+static uint32_t ingest_depth(void) {
+    uint32_t depth = 0;
+    for (int i = 0; i < MQTT_INGEST_PRODUCERS; i++) {
+        depth += spsc_count(&ingest_lanes[i].ring);
+    }
+    return depth;
+}
+
+// Health snapshot for BLE readers (status_core.h). Runs in the manager
+// with mqtt_arr_sem held, so the in-flight count is exact
+static void update_status(void) {
+    static int64_t last_us;
+    int64_t        now_us = esp_timer_get_time();
+    if (now_us - last_us < STATUS_REFRESH_MS * 1000) {
+        return;
+    }
+    last_us = now_us;
+
+    status_snapshot_t snap  = { 0 };
+    uint32_t          slots = config_get(CFG_PUB_SLOTS);
+    for (int i = 0; i < PUB_ARR_SIZE; i++) {
+        snap.in_flight += pub_array[i].valid;
+    }
+    msg_buf_stats_t bufs;
+    spool_stats_t   spool;
+    msg_buf_get_stats(&bufs);
+    spool_get_stats(&spool);
+
+    snap.link         = link_state;
+    snap.sync_quality = get_time_sync_quality();
+    snap.pub_slots    = slots;
+    snap.ingest_depth = ingest_depth();
+    snap.bufs_in_use  = bufs.in_use;
+    snap.srtt_ms      = MIN(rtt.srtt_us / 1000, UINT16_MAX);
+    snap.spool_depth  = spool.depth;
+    snap.spool_fill   = spool.capacity ? (uint64_t)spool.depth * 1000 / spool.capacity : 0;
+    snap.uptime_s     = now_us / 1000000;
+    snap.busy         = MIN(100, MAX(snap.in_flight * 100 / MAX(1, slots),
+                                     MAX(snap.ingest_depth, snap.bufs_in_use) * 100 / MSG_BUF_POOL_SIZE));
+    status_publish(&snap);
+}
+
+// Ack outcome on the active broker, for its health score
+static void broker_sample(bool acked, uint32_t rtt_us) {
+    portENTER_CRITICAL(&broker_mux);
+    if (acked) {
+        broker_ack(&brokers, brokers.active, rtt_us, esp_timer_get_time());
+    } else {
+        broker_error(&brokers, brokers.active);
+    }
+    portEXIT_CRITICAL(&broker_mux);
+}
+
+// Moves the uplink to broker to. Warm: the standby connection becomes the
+// uplink right away and the old one is re-pointed at the standby target.
+// Cold: the client reconnects to the new URI. Either way the publishes
+// still waiting on an ack are handed back to the publisher, which sends
+// them again on the new broker
+static void broker_failover(int to) {
+    int64_t now_us = esp_timer_get_time();
+    portENTER_CRITICAL(&broker_mux);
+    int  from = brokers.active;
+    bool from_up = brokers.health[from].up;
+    bool warm    = standby_client && standby_broker == to && brokers.health[to].up;
+    broker_switch(&brokers, to, now_us);
+    int target = broker_standby_target(&brokers);
+    if (warm) {
+        esp_mqtt_client_handle_t old = client;
+        client                       = standby_client;
+        standby_client               = old;
+        standby_broker               = target;
+        standby_dropped              = from_up;
+    } else {
+        uplink_dropped = from_up;
+    }
+    if (from_up) {
+        broker_down(&brokers, from, now_us);
+    }
+    portEXIT_CRITICAL(&broker_mux);
+    ESP_LOGW(TAG, "Failover from broker %d to %d, %s", from, to, warm ? "warm" : "cold");
+
+    if (pdTRUE != xSemaphoreTake(mqtt_arr_sem, MQTT_SEM_TICKS_TO_WAIT)) {
+        ESP_LOGE(TAG, "Failed to obtain MQTT semaphor!");
+        ASSERT(0);
+    }
+    client_epoch++;
+    rtt_est_init(&rtt, MQTT_RTO_INITIAL_MS * 1000);
+    xSemaphoreGive(mqtt_arr_sem);
+    fail_pending(MQTT_MOVED);
+
+    if (!warm) {
+        // Applies to the next connect. Still connected to the failing
+        // broker, its disconnect event schedules the reconnect
+        esp_mqtt_client_set_uri(client, tls_local_uri(to));
+        if (from_up && esp_mqtt_client_disconnect(client) == ESP_OK) {
+            return;
+        }
+        portENTER_CRITICAL(&broker_mux);
+        uplink_dropped = false;
+        portEXIT_CRITICAL(&broker_mux);
+        esp_timer_stop(reconnect_timer);
+        if (esp_mqtt_client_reconnect(client) != ESP_OK) {
+            schedule_reconnect();
+        }
+        return;
+    }
+
+    esp_timer_stop(reconnect_timer);
+
+    portENTER_CRITICAL(&conn_mux);
+    conn_rtc.stats.attempts = 0;
+    portEXIT_CRITICAL(&conn_mux);
+    esp_mqtt_client_subscribe(client, MQTT_CMD_TOPIC, 1);
+    if (link_state == MQTT_LINK_DOWN) {
+        link_connected();
+    }
+
+    // The old connection keeps the standby target warm from now on. Still
+    // connected, its disconnect event schedules the reconnect
+    esp_mqtt_client_set_uri(standby_client, tls_local_uri(target));
+    if (!from_up || esp_mqtt_client_disconnect(standby_client) != ESP_OK) {
+        portENTER_CRITICAL(&broker_mux);
+        standby_dropped = false;
+        portEXIT_CRITICAL(&broker_mux);
+        schedule_standby_reconnect();
+    }
+}
+
+// Failover decisions, from the manager between passes
+static void broker_check(void) {
+    static int64_t last_us;
+    int64_t        now_us = esp_timer_get_time();
+    if (!client || now_us - last_us < MQTT_BROKER_CHECK_MS * 1000) {
+        return;
+    }
+    last_us = now_us;
+
+    portENTER_CRITICAL(&broker_mux);
+    int to = broker_pick(&brokers, now_us, config_get(CFG_FAILOVER_MS));
+    portEXIT_CRITICAL(&broker_mux);
+    if (to >= 0) {
+        broker_failover(to);
     }
 }
 
@@ -214,7 +1013,8 @@ static void mqtt_manager(void* arg) {
 
     while (true) {
         if (pdTRUE == xQueueReceive(sentQ, &message, (75 / portTICK_PERIOD_MS))) {
-            published = true;
+            // an ack for the connection before the last failover
+            published = message.epoch == client_epoch;
         } else {
             published = false;
         }
@@ -224,45 +1024,72 @@ static void mqtt_manager(void* arg) {
             ASSERT(0);
         }
 
-        int index = 0;
-        for (; index < PUB_ARR_SIZE; index++) {
+        // every slot's deadline is checked on every pass, an ack only
+        // completes its own slot
+        bool matched = false;
+        for (int index = 0; index < PUB_ARR_SIZE; index++) {
             if (pub_array[index].valid) {
                 // In the case that we got a MQTT_EVENT_PUBLISHED event
-                if (published) {
-                    if (pub_array[index].message_id == message.message_id) {
-                        ASSERT(pub_array[index].notification_q);
-                        int sent = MQTT_SUCCESS;
-                        ESP_LOGI(TAG, "Message ID %d was acked!", pub_array[index].message_id);
-                        xQueueSend(pub_array[index].notification_q, &sent, portMAX_DELAY);
-                        pub_array[index].valid = false;
-                        goto redo_loop;
-                    }
-                } else {
-                    // in the case that we timed out waiting for MQTT_EVENT_PUBLISHED
-                    if (pub_array[index].max_valid_age_in_ticks < xTaskGetTickCount()) {
-                        ASSERT(pub_array[index].notification_q);
-                        int sent = MQTT_ERROR;
-                        ESP_LOGE(TAG, "Message ID %d timedout!", pub_array[index].message_id);
-                        xQueueSend(pub_array[index].notification_q, &sent, portMAX_DELAY);
-                        pub_array[index].valid = false;
+                if (published && !matched && pub_array[index].message_id == message.message_id) {
+                    ASSERT(pub_array[index].notification_q);
+                    int sent = MQTT_SUCCESS;
+                    ESP_LOGI(TAG, "Message ID %d was acked!", pub_array[index].message_id);
+                    // a replayed ack came in before the registration,
+                    // sent_us is later than the ack itself
+                    if (message.total_replays == 0) {
+                        uint32_t rtt_us = esp_timer_get_time() - pub_array[index].sent_us;
+                        rtt_est_sample(&rtt, rtt_us);
+                        broker_sample(true, rtt_us);
                     }
+                    xQueueSend(pub_array[index].notification_q, &sent, portMAX_DELAY);
+                    pub_array[index].valid = false;
+                    matched                = true;
+                    continue;
+                }
+                // in the case that we timed out waiting for MQTT_EVENT_PUBLISHED,
+                // checked on every pass so a steady stream of acks can't hold it off
+                if (pub_array[index].max_valid_age_in_ticks < xTaskGetTickCount()) {
+                    ASSERT(pub_array[index].notification_q);
+                    int sent = MQTT_ERROR;
+                    ESP_LOGE(TAG, "Message ID %d timedout!", pub_array[index].message_id);
+                    rtt_est_timeout(&rtt, pub_array[index].backoff);
+                    broker_sample(false, 0);
+                    timed_out[timed_out_next].message_id = pub_array[index].message_id;
+                    timed_out[timed_out_next].sent_us    = pub_array[index].sent_us;
+                    timed_out_next                       = (timed_out_next + 1) % PUB_ARR_SIZE;
+                    xQueueSend(pub_array[index].notification_q, &sent, portMAX_DELAY);
+                    pub_array[index].valid = false;
+                }
+            }
+        }
+
+        // an ack after the timeout, the publisher has moved on
+        if (published && !matched && message.total_replays == 0) {
+            for (int i = 0; i < PUB_ARR_SIZE; i++) {
+                if (timed_out[i].message_id && timed_out[i].message_id == message.message_id) {
+                    ESP_LOGW(TAG, "Message ID %d acked after its timeout", message.message_id);
+                    rtt_est_late_ack(&rtt, esp_timer_get_time() - timed_out[i].sent_us);
+                    timed_out[i].message_id = 0;
+                    matched                 = true;
+                    break;
                 }
             }
         }
 
         // new pub, but nothing registered for it
-        if (published && (index == PUB_ARR_SIZE)) {
+        if (published && !matched) {
             message.total_replays++;
             ESP_LOGI(TAG, "Sent a message to the replay buffer");
             xQueueSend(replayQ, &message, portMAX_DELAY);
         }
-    redo_loop:
+        update_status();
         xSemaphoreGive(mqtt_arr_sem);
+        broker_check();
     }
 }
 
 bool mqtt_publish(char* str) {
-    int           msg_id = esp_mqtt_client_publish(client, "/topic/incidents", str, strlen(str), 1, 0);
+    int           msg_id = mqtt_client_publish("/topic/incidents", str, strlen(str), 1);
     QueueHandle_t q      = enqueue_reg(msg_id);
     int           status = MQTT_ERROR;
     if (q) {
@@ -272,52 +1099,116 @@ bool mqtt_publish(char* str) {
         ESP_LOGE(TAG, "failed to enquue");
     }
     if (q) {
-        vQueueDelete(q);
+        release_reg(q);
     }
 
     return status;
 }
 
 void mqtt_init(void) {
-    mqtt_arr_sem = xSemaphoreCreateMutex();
+    mqtt_arr_sem = xSemaphoreCreateMutexStatic(&mqtt_arr_sem_buf);
     ASSERT(mqtt_arr_sem);
+    status_init();
 
-    sentQ   = xQueueCreate(DEPTTH_MQTT_Q, sizeof(replay_message_t));
-    replayQ = xQueueCreate(DEPTTH_MQTT_Q, sizeof(replay_message_t));
+    // The storage is sized for DEPTTH_MQTT_Q, mqtt_q_depth can only shrink it
+    sentQ   = xQueueCreateStatic(config_get(CFG_MQTT_Q_DEPTH), sizeof(replay_message_t), sentQ_storage, &sentQ_buf);
+    replayQ = xQueueCreateStatic(config_get(CFG_MQTT_Q_DEPTH), sizeof(replay_message_t), replayQ_storage, &replayQ_buf);
 
     ASSERT(sentQ);
     ASSERT(replayQ);
 
-    TaskHandle_t xHandle = NULL;
+    // One notification queue per pub slot, created once and reused
+    for (int i = 0; i < PUB_ARR_SIZE; i++) {
+        pub_array[i].notification_q = xQueueCreateStatic(1, sizeof(int), notification_q_storage[i], &notification_q_buf[i]);
+        ASSERT(pub_array[i].notification_q);
+    }
+
+    rtt_est_init(&rtt, MQTT_RTO_INITIAL_MS * 1000);
+    msg_buf_init();
+    sink_init();
+    agg_init();
+    alert_init();
+    upload_init();
+    mqtt_register_command("broker_list", broker_list_cmd);
+    mqtt_register_command("broker_stats", broker_stats_cmd);
+    mqtt_register_command("conn_stats", conn_stats_cmd);
+    mqtt_register_command("boot_stats", boot_stats_cmd);
+    for (int i = 0; i < MQTT_INGEST_PRODUCERS; i++) {
+        spsc_init(&ingest_lanes[i].ring, ingest_lanes[i].slots, MSG_BUF_POOL_SIZE);
+    }
 
     // Create the mqtt task, storing the handle.
-    BaseType_t xReturned = xTaskCreate(
+    TaskHandle_t xHandle = xTaskCreateStaticPinnedToCore(
         mqtt_manager,         // Function that implements the task.
         "mqtt_manager",       // Text name for the task.
-        MQTT_STACK_SIZE,      // Stack size in words, not bytes.
+        MQTT_STACK_SIZE,      // Stack size in bytes on the ESP32.
         NULL,                 // Parameter passed into the task.
         MQTT_THREAD_PRIORITY, // Priority at which the task is created.
-        &xHandle);            // Used to pass out the created task's handle.
+        mqtt_manager_stack,   // Stack buffer.
+        &mqtt_manager_tcb,    // Task control block.
+        MQTT_PIPELINE_CORE);  // Core the task is pinned to.
 
-    if (xReturned != pdPASS) {
-        ASSERT(0);
+    if (!xHandle) {
         ESP_LOGE(TAG, "Failed to create thread!");
+        ASSERT(0);
     }
 
-    xReturned = xTaskCreate(
+    xHandle = xTaskCreateStaticPinnedToCore(
         replay_task,          // Function that implements the task.
         "replay_task",        // Text name for the task.
-        MQTT_STACK_SIZE,      // Stack size in words, not bytes.
+        MQTT_STACK_SIZE,      // Stack size in bytes on the ESP32.
         NULL,                 // Parameter passed into the task.
         MQTT_THREAD_PRIORITY, // Priority at which the task is created.
-        &xHandle);            // Used to pass out the created task's handle.
+        replay_task_stack,    // Stack buffer.
+        &replay_task_tcb,     // Task control block.
+        MQTT_PIPELINE_CORE);  // Core the task is pinned to.
 
-    if (xReturned != pdPASS) {
+    if (!xHandle) {
+        ESP_LOGE(TAG, "Failed to create thread!");
         ASSERT(0);
+    }
+
+    publisher_handle = xTaskCreateStaticPinnedToCore(
+        publisher_task,            // Function that implements the task.
+        "mqtt_publisher",          // Text name for the task.
+        MQTT_PUBLISHER_STACK_SIZE, // Stack size in bytes on the ESP32.
+        NULL,                      // Parameter passed into the task.
+        MQTT_THREAD_PRIORITY,      // Priority at which the task is created.
+        publisher_stack,           // Stack buffer.
+        &publisher_tcb,            // Task control block.
+        MQTT_PIPELINE_CORE);       // Core the task is pinned to.
+
+    if (!publisher_handle) {
         ESP_LOGE(TAG, "Failed to create thread!");
+        ASSERT(0);
     }
 
-    mqtt_app_start();
+    spool_init();
+    drain_handle = xTaskCreateStaticPinnedToCore(
+        drain_task,            // Function that implements the task.
+        "mqtt_drain",          // Text name for the task.
+        MQTT_DRAIN_STACK_SIZE, // Stack size in bytes on the ESP32.
+        NULL,                  // Parameter passed into the task.
+        MQTT_THREAD_PRIORITY,  // Priority at which the task is created.
+        drain_stack,           // Stack buffer.
+        &drain_tcb,            // Task control block.
+        MQTT_PIPELINE_CORE);   // Core the task is pinned to.
+
+    if (!drain_handle) {
+        ESP_LOGE(TAG, "Failed to create thread!");
+        ASSERT(0);
+    }
+
+    mem_register_stack("mqtt_manager", sizeof(mqtt_manager_stack));
+    mem_register_stack("replay_task", sizeof(replay_task_stack));
+    mem_register_stack("mqtt_publisher", sizeof(publisher_stack));
+    mem_register_stack("mqtt_drain", sizeof(drain_stack));
+    mem_register_static("mqtt_ingest_rings", sizeof(ingest_lanes));
+    mem_register_static("mqtt_pub_array", sizeof(pub_array) + sizeof(replay_arr) + sizeof(timed_out));
+    mem_register_static("mqtt_queues", sizeof(sentQ_storage) + sizeof(replayQ_storage) + sizeof(notification_q_storage)
+                                           + sizeof(sentQ_buf) + sizeof(replayQ_buf) + sizeof(notification_q_buf));
+    mem_register_static("mqtt_json_buf", sizeof(json_buf) + sizeof(drain_json_buf));
+
 #if 0
     for(int i = 0; i < 8; i++){
       test_arr[i].type   = PAGE_NORMAL_ENTRY_MAGIC;
@@ -352,8 +1243,7 @@ void mqtt_init(void) {
         ESP_LOGE(TAG, "failed to enquue");
       }
       if (q){
-        ESP_LOGI(TAG, "Deleting Q");
-        vQueueDelete(q);
+        release_reg(q);
       }
       ESP_LOGI(TAG, "Free %d", heap_caps_get_free_size(MALLOC_CAP_8BIT));
       cJSON_Delete(root);
@@ -361,46 +1251,234 @@ void mqtt_init(void) {
 #endif
 }
 
-// returns 1 on error
-// zero on sucess
-int send_packet_to_aws(uint8_t* packet) {
-    if (!packet) {
-        ESP_LOGE(TAG, "Packet was null!");
-        ASSERT(0);
+void mqtt_start(void) {
+    if (publish_hook) {
+        ESP_LOGI(TAG, "Publish hook installed, not starting the MQTT client");
+        link_state = MQTT_LINK_UP;
+        return;
+    }
+    mqtt_app_start();
+    sink_start();
+}
+
+// Serializes and publishes one reading, then waits for the ack
+// runs in the publisher task, on the MQTT core
+// returns MQTT_SUCCESS/MQTT_ERROR
+int mqtt_publish_acked(const char* topic, const char* data, int len) {
+    int status = MQTT_ERROR;
+    int moves  = 0;
+    for (int attempt = 0;; attempt++) {
+        int message_id = mqtt_client_publish(topic, data, len, 1);
+        ESP_LOGI(TAG, "SENT, msg_id=%d", message_id);
+
+        QueueHandle_t q = enqueue_reg(message_id);
+        if (!q) {
+            ESP_LOGE(TAG, "failed to enquue");
+            break;
+        }
+        xQueueReceive(q, &status, portMAX_DELAY);
+        ESP_LOGI(TAG, "GOT ack/NACK, status == %d", status);
+        release_reg(q);
+
+        // the broker changed under it, not a failed attempt
+        if (status == MQTT_MOVED) {
+            if (moves++ < BROKER_MAX) {
+                attempt--;
+                continue;
+            }
+            status = MQTT_ERROR;
+        }
+
+        // a dead link is the spool's business, not a retry's
+        if (status == MQTT_SUCCESS || pipeline_link() == MQTT_LINK_DOWN || attempt >= config_get(CFG_PUB_RETRIES)) {
+            break;
+        }
+        ESP_LOGW(TAG, "No ack, retry %d", attempt + 1);
     }
+    return status;
+}
 
-    cJSON* json_packet = get_json_uwb_packet(packet);
-    if (!json_packet) {
+static int publish_reading(const uwb_reading_t* reading, char* json_buf) {
+    int len = uwb_reading_to_json(reading, json_buf, MQTT_JSON_BUF_SIZE);
+    if (len <= 0) {
         ESP_LOGE(TAG, "Failed to serialize json data!");
         return MQTT_ERROR;
     }
 
-    char* str = NULL;
-    str       = cJSON_Print(json_packet);
-    if (!str) {
-        ESP_LOGE(TAG, "Failed to get string");
-        cJSON_Delete(json_packet);
-        return MQTT_ERROR;
+    ESP_LOGI(TAG, "JSON STRING = %s", json_buf);
+    int status = mqtt_publish_acked("/topic/cat_location", json_buf, len);
+    if (status == MQTT_SUCCESS && boot_mark(&boot_stats.first_published_ms, "first reading published")) {
+        boot_stats_cmd(NULL, 0);
     }
 
-    ESP_LOGI(TAG, "JSON STRING = %s", str);
-    int message_id = esp_mqtt_client_publish(client, "/topic/cat_location", str, strlen(str), 1, 0);
-    ESP_LOGI(TAG, "SENT, msg_id=%d", message_id);
-    free(str);
+    return status;
+}
 
-    QueueHandle_t q      = enqueue_reg(message_id);
-    int           status = MQTT_ERROR;
-    if (q) {
-        xQueueReceive(q, &status, portMAX_DELAY);
-        ESP_LOGI(TAG, "GOT ack/NACK, status == %d", status);
-    } else {
-        ESP_LOGE(TAG, "failed to enquue");
+// Next reading off the ingest rings, one per ring in turn so a busy
+// producer can't starve the others. NULL once they are all empty
+static msg_buf_t* ingest_pop(void) {
+    static int next;
+    for (int i = 0; i < MQTT_INGEST_PRODUCERS; i++) {
+        msg_buf_t* msg = spsc_pop(&ingest_lanes[next].ring);
+        next           = (next + 1) % MQTT_INGEST_PRODUCERS;
+        if (msg) {
+            return msg;
+        }
     }
-    if (q) {
-        ESP_LOGI(TAG, "Deleting Q");
-        vQueueDelete(q);
+    return NULL;
+}
+
+// Drains the ingest rings, woken by a notification from a producer
+static void publisher_task(void* arg) {
+    ESP_LOGI(TAG, "Starting publisher on core %d", xPortGetCoreID());
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        msg_buf_t*    msg;
+        uwb_reading_t reading;
+        while ((msg = ingest_pop())) {
+            memcpy(&reading.packet, msg->data, sizeof(reading.packet));
+            memcpy(reading.tag, msg->tag, sizeof(reading.tag));
+            reading.rssi   = msg->rssi;
+            reading.rx_utc = utc_of_uptime(msg->created_us / 1000);
+            msg->status    = publish_reading(&reading, json_buf);
+            sink_record(SINK_MQTT, msg->status == MQTT_SUCCESS, esp_timer_get_time() - msg->created_us);
+            if (msg->status != MQTT_SUCCESS && pipeline_link() == MQTT_LINK_DOWN) {
+                // the link dropped under us, the spool takes it from here
+                msg->status = spool_reading(msg) ? MQTT_SUCCESS : MQTT_ERROR;
+                msg_buf_count_copy(msg->len);
+            }
+            if (msg->status == MQTT_SUCCESS) {
+                boot_mark(&boot_stats.first_accepted_ms, "first reading accepted");
+            }
+            msg_buf_complete(msg);
+            msg_buf_unref(msg);
+        }
     }
-    cJSON_Delete(json_packet);
+}
 
-    return status;
+// Spool side of the link state machine: after a reconnect, publishes the
+// backlog oldest first at drain_per_sec, then moves the link to UP
+static void drain_task(void* arg) {
+    spool_entry_t entry;
+    uwb_reading_t reading;
+
+    while (true) {
+        // paused while a hook stands in for the broker, the backlog is for the real one
+        if (link_state != MQTT_LINK_DRAINING || publish_hook) {
+            ulTaskNotifyTake(pdTRUE, MQTT_DRAIN_IDLE_MS / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        bool drained = false;
+        portENTER_CRITICAL(&link_mux);
+        if (link_state == MQTT_LINK_DRAINING && !spool_peek(&entry)) {
+            // nothing can be spooled while we hold link_mux and the link is not DOWN
+            link_state                 = MQTT_LINK_UP;
+            link_stats.last_recover_ms = (esp_timer_get_time() - link_changed_us) / 1000;
+            drained                    = true;
+        }
+        portEXIT_CRITICAL(&link_mux);
+
+        if (drained) {
+            ESP_LOGI(TAG, "Spool drained, recovered in %d ms", link_stats.last_recover_ms);
+            continue;
+        }
+        if (link_state != MQTT_LINK_DRAINING) {
+            continue;
+        }
+
+        msg_buf_count_copy(sizeof(entry.data));
+        memcpy(&reading.packet, entry.data, sizeof(reading.packet));
+        memcpy(reading.tag, entry.tag, sizeof(reading.tag));
+        reading.rssi   = entry.rssi;
+        reading.rx_utc = utc_of_uptime(entry.rx_ms);
+        if (MQTT_SUCCESS == publish_reading(&reading, drain_json_buf)) {
+            spool_pop();
+            link_stats.drained++;
+        }
+        vTaskDelay(MAX(1, 1000 / config_get(CFG_DRAIN_PER_SEC) / portTICK_PERIOD_MS));
+    }
 }
+
+// The calling task's ingest ring, claimed on its first call. A task only
+// ever matches the owner it wrote itself, so the lookup needs no lock.
+// NULL if MQTT_INGEST_PRODUCERS other tasks already have one
+static spsc_ring_t* producer_ring(void) {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < MQTT_INGEST_PRODUCERS; i++) {
+        if (ingest_lanes[i].owner == self) {
+            return &ingest_lanes[i].ring;
+        }
+    }
+    spsc_ring_t* ring = NULL;
+    portENTER_CRITICAL(&lane_mux);
+    for (int i = 0; i < MQTT_INGEST_PRODUCERS; i++) {
+        if (!ingest_lanes[i].owner) {
+            ingest_lanes[i].owner = self;
+            ring                  = &ingest_lanes[i].ring;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&lane_mux);
+    return ring;
+}
+
+// Runs on the BLE core: hands the reading to the publisher on the MQTT
+// core by reference. Returns MQTT_PENDING if the publisher has it, else
+// the final status (spooled, aggregated or refused)
+int mqtt_submit_msg(msg_buf_t* msg) {
+    if (!msg) {
+        ESP_LOGE(TAG, "Message was null!");
+        ASSERT(0);
+    }
+    // nothing waits on a reading, its outcome only reaches on_done
+    ASSERT(msg->on_done);
+    // proximity rules first, their events don't queue behind anything
+    alert_ingest(msg);
+
+    // the LAN sinks don't wait for the cloud, or for it to come back
+    sink_fanout(msg);
+
+    // Tags in rollup mode: the reading is accepted into its window and goes
+    // up with the rollup. Offline it stays raw, the spool can't hold windows
+    if (pipeline_link() != MQTT_LINK_DOWN && agg_add(msg)) {
+        boot_mark(&boot_stats.first_accepted_ms, "first reading accepted");
+        return MQTT_SUCCESS;
+    }
+
+    // Broker unreachable: accept the reading into the spool right away
+    // rather than letting it time out against a dead connection
+    int  status  = MQTT_ERROR;
+    bool spooled = false;
+    portENTER_CRITICAL(&link_mux);
+    if (pipeline_link() == MQTT_LINK_DOWN) {
+        status  = spool_reading(msg) ? MQTT_SUCCESS : MQTT_ERROR;
+        spooled = true;
+    }
+    portEXIT_CRITICAL(&link_mux);
+    if (spooled) {
+        msg_buf_count_copy(msg->len);
+        if (status == MQTT_SUCCESS) {
+            boot_mark(&boot_stats.first_accepted_ms, "first reading accepted");
+        }
+        return status;
+    }
+
+    spsc_ring_t* ring = producer_ring();
+    if (!ring) {
+        ESP_LOGE(TAG, "No ingest ring left for %s!", pcTaskGetTaskName(NULL));
+        return MQTT_ERROR;
+    }
+    // the publisher's reference, dropped once it completed the reading
+    msg->status = MQTT_ERROR;
+    msg_buf_ref(msg);
+    if (!spsc_push(ring, msg)) {
+        ESP_LOGE(TAG, "Ingest ring full!");
+        msg_buf_unref(msg);
+        return MQTT_ERROR;
+    }
+    xTaskNotifyGive(publisher_handle);
+    return MQTT_PENDING;
+}
+
@@ -6,6 +6,11 @@
 #include "freertos/queue.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "broker_core.h"
+#include "msg_buf.h"
+#include "rtt_est.h"
 
 /**********************************************************
 *                                                 GLOBALS *
@@ -14,15 +19,60 @@
 /**********************************************************
 *                                                 DEFINES *
 **********************************************************/
+// PUB_ARR_SIZE and DEPTTH_MQTT_Q size static storage, they are the upper
+// bounds of pub_slots / mqtt_q_depth. Those, the ack timeout, replay
+// delay/count and drain rate are tuned at runtime, see config_core.h
 #define PUB_ARR_SIZE           (16)
-#define MQTT_STACK_SIZE        (2048)
+#define MQTT_STACK_SIZE        (2048) // bytes on the ESP32 port
+#define MQTT_JSON_BUF_SIZE     (128)
+
+// The BLE host (Bluedroid, BTC task) is pinned to core 0 in sdkconfig,
+// the publish pipeline (publisher, manager, replay, ESP-MQTT/mbedTLS) to core 1
+#define MQTT_PIPELINE_CORE        (1)
+#define MQTT_PUBLISHER_STACK_SIZE (3072)
+// Tasks that submit readings, each gets its own SPSC ring to the publisher:
+// BTC (GATT writes, advertisements), the BLE batch task (multi-record
+// writes), the load generator and capture replay, one spare
+#define MQTT_INGEST_PRODUCERS     (5)
+
+// Spool drain after a reconnect, paced so the backlog interleaves with
+// live traffic instead of flooding the broker
+#define MQTT_DRAIN_PER_SEC     (20)
+#define MQTT_DRAIN_STACK_SIZE  (3072)
+#define MQTT_DRAIN_IDLE_MS     (1000)
 #define MQTT_THREAD_PRIORITY   (5)
 #define DEPTTH_MQTT_Q          (5)
 #define MQTT_SEM_TICKS_TO_WAIT (1000 / portTICK_PERIOD_MS)
-#define REPLAY_TIME            (500 / portTICK_PERIOD_MS)
+
+// Reconnect policy, exponential backoff with equal jitter: the delay
+// before attempt n is picked from [ceil/2, ceil), ceil = BASE << n capped at MAX
+#define MQTT_RECONNECT_BASE_MS (500)
+#define MQTT_RECONNECT_MAX_MS  (30000)
+#define MQTT_CONN_STATS_MAGIC  (0x4D515454) // RTC copy is valid across soft reboots
+#define MQTT_BOOT_TOPIC        "/topic/gateway/boot"
+#define MQTT_CONN_TOPIC        "/topic/gateway/conn" // "conn_stats", with the TLS resumption counters
+
+#define MQTT_CMD_TOPIC    "/topic/gateway/cmd"
+#define MQTT_MAX_COMMANDS (20)
+#define MQTT_CMD_NAME_LEN (24)
+
+// Ack timeouts follow the broker RTT (rtt_est.h), between MQTT_RTO_MIN_MS
+// and ack_timeout_ms. A publish that timed out is sent again right away,
+// up to pub_retries times, the backoff is in the timeout
+#define MQTT_RTO_INITIAL_MS (1000) // until the first PUBACK
+#define MQTT_RTO_MIN_MS     (200)
+
+// Broker failover, see broker_core.h. "broker_list <uri> [<uri> ...]" sets
+// the ordered list (kept in NVS, used from the next boot), without it the
+// list is just the AWS endpoint. "broker_stats" reports the health
+#define MQTT_BROKER_TOPIC         "/topic/gateway/broker"
+#define MQTT_BROKER_NVS_NAMESPACE "broker"
+#define MQTT_BROKER_CHECK_MS      (100)
 
 #define MQTT_SUCCESS    (0)
 #define MQTT_ERROR      (1)
+#define MQTT_PENDING    (2) // mqtt_submit_msg only
+#define MQTT_MOVED      (3) // failover, the publisher sends it again on the new broker
 #define MAXIMUM_REPLAYS (2)
 
 /*********************************************************
@@ -30,24 +80,102 @@
 **********************************************************/
 typedef struct {
     bool          valid;
+    bool          owned;                  // notification_q is held by a waiting publisher
     uint32_t      max_valid_age_in_ticks; // maximum age in tick (uptime) that we will wait for ACK
     int           message_id;
+    int64_t       sent_us; // RTT sample start
+    uint8_t       backoff; // rtt_est backoff level at registration
     QueueHandle_t notification_q; // When pending for a response,
-                                  // we create a queue and block on it
+                                  // we block on this slot's queue (created once,
+                                  // statically, in mqtt_init)
                                   // once we timeout/get an ack, we send
                                   // a message through this queue to the thread
                                   // that intitially registered for a response
 } mqtt_published_element_t;
 
+typedef enum {
+    MQTT_LINK_DOWN,     // not connected, ingest goes straight to the spool
+    MQTT_LINK_DRAINING, // connected, spool backlog draining alongside live traffic
+    MQTT_LINK_UP,       // connected, spool empty
+} mqtt_link_state_t;
+
+typedef struct {
+    mqtt_link_state_t state;
+    uint32_t          disconnects;
+    uint32_t          drained;         // spooled readings published since boot
+    uint32_t          last_outage_ms;  // disconnect -> reconnect
+    uint32_t          last_recover_ms; // reconnect -> spool empty (time to recover)
+} mqtt_link_stats_t;
+
+// Connection timing, kept in RTC memory so it survives soft reboots
+typedef struct {
+    uint32_t boots;             // soft reboots these stats have survived
+    uint32_t connects;
+    uint32_t attempts;          // failed attempts since the last connect
+    uint32_t next_backoff_ms;   // delay before the pending attempt
+    uint32_t last_handshake_ms; // BEFORE_CONNECT -> CONNECTED (TCP + TLS + CONNACK), see tls_stats_t for TLS alone
+    uint32_t max_handshake_ms;
+    uint32_t fast_reconnects;   // attempts started early by a fresh IP
+} mqtt_conn_stats_t;
+
+// Boot to first reading, all in ms of uptime, 0 until it happened.
+// "boot_stats" publishes them on MQTT_BOOT_TOPIC, so does the first ack
+typedef struct {
+    uint32_t first_accepted_ms;  // first reading taken in (published or spooled)
+    uint32_t first_connected_ms; // first MQTT connect
+    uint32_t first_published_ms; // first reading acked by the broker
+} mqtt_boot_stats_t;
+
 typedef struct {
     bool     valid;
     int      message_id;
     uint32_t replay_time_in_upticks;
     int      total_replays;
+    uint8_t  epoch; // client_epoch when the ack came in, older acks are dropped
 } replay_message_t;
 
+// Handler for a text command received on MQTT_CMD_TOPIC ("<name> <args>"),
+// runs in the MQTT client task
+typedef void (*mqtt_cmd_handler_t)(const char* args, int args_len);
+
+typedef struct {
+    const char*        name;
+    mqtt_cmd_handler_t handler;
+} mqtt_cmd_t;
+
+// Stand-in for esp_mqtt_client_publish, returns a message id or -1
+typedef int (*mqtt_publish_hook_t)(const char* topic, const char* data, int len, int qos);
+
 /**********************************************************
 *                                        GLOBAL FUNCTIONS *
 **********************************************************/
+// mqtt_init brings up the publish pipeline with the link DOWN, so readings
+// spool from the start. mqtt_start starts the client and needs the network
 void mqtt_init(void);
-int  send_packet_to_aws(uint8_t* packet);
+void mqtt_start(void);
+// Publishes the uwb_packet_t in msg->data without waiting for the ack, so
+// a producer can have several readings in flight. A reading submitted as
+// MQTT_PENDING completes through its on_done (see msg_buf.h), which must
+// be set. The caller keeps its reference either way, the pipeline takes
+// its own. At most
+// MQTT_INGEST_PRODUCERS different tasks may submit
+int mqtt_submit_msg(msg_buf_t* msg);
+
+// Load generator support: install the hook before mqtt_start to
+// replace the broker, acks are then fed back with mqtt_notify_published
+void mqtt_set_publish_hook(mqtt_publish_hook_t hook);
+void mqtt_notify_published(int message_id);
+
+void mqtt_get_link_stats(mqtt_link_stats_t* stats);
+void mqtt_get_conn_stats(mqtt_conn_stats_t* stats);
+void mqtt_get_boot_stats(mqtt_boot_stats_t* stats);
+void mqtt_get_rtt(rtt_est_t* rtt);
+void mqtt_get_brokers(broker_set_t* brokers);
+
+void mqtt_register_command(const char* name, mqtt_cmd_handler_t handler);
+// Fire and forget publish (no ack tracking), returns the message id or -1
+int mqtt_publish_raw(const char* topic, const char* data, int len);
+// QoS 1 publish that waits for its PUBACK, republished up to pub_retries
+// times while the link is up. MQTT_SUCCESS once acked, else MQTT_ERROR.
+// Blocks for up to (pub_retries + 1) ack timeouts, not for the BTC task
+int mqtt_publish_acked(const char* topic, const char* data, int len);
@@ -0,0 +1,96 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "global_defines.h"
+#include "mem_core.h"
+#include "msg_buf.h"
+
+// Message buffer pool shared by every producer (BTC task, advertisement
+// workers, load generator) and the publish pipeline on the other core
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "MSG_BUF";
+
+static msg_buf_t         pool[MSG_BUF_POOL_SIZE];
+static msg_buf_stats_t   stats;
+static portMUX_TYPE      msg_buf_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+void msg_buf_init(void) {
+    mem_register_static("msg_buf_pool", sizeof(pool));
+}
+
+msg_buf_t* msg_buf_alloc(void) {
+    msg_buf_t* buf = NULL;
+    portENTER_CRITICAL(&msg_buf_mux);
+    for (int i = 0; i < MSG_BUF_POOL_SIZE; i++) {
+        if (!pool[i].refs) {
+            buf       = &pool[i];
+            buf->refs = 1;
+            break;
+        }
+    }
+    if (buf) {
+        stats.allocs++;
+        stats.in_use++;
+        stats.high_water = MAX(stats.high_water, stats.in_use);
+    } else {
+        stats.empty++;
+    }
+    portEXIT_CRITICAL(&msg_buf_mux);
+
+    if (buf) {
+        buf->len        = 0;
+        buf->rssi       = 0;
+        buf->created_us = esp_timer_get_time();
+        buf->on_done    = NULL;
+        buf->done_arg   = NULL;
+        memset(buf->tag, 0, sizeof(buf->tag));
+    }
+    return buf;
+}
+
+void msg_buf_complete(msg_buf_t* buf) {
+    ASSERT(buf->on_done);
+    buf->on_done(buf);
+}
+
+void msg_buf_ref(msg_buf_t* buf) {
+    ASSERT(buf);
+    portENTER_CRITICAL(&msg_buf_mux);
+    buf->refs++;
+    portEXIT_CRITICAL(&msg_buf_mux);
+}
+
+void msg_buf_unref(msg_buf_t* buf) {
+    ASSERT(buf && buf->refs);
+    portENTER_CRITICAL(&msg_buf_mux);
+    if (--buf->refs == 0) {
+        stats.in_use--;
+    }
+    portEXIT_CRITICAL(&msg_buf_mux);
+}
+
+void msg_buf_count_copy(uint32_t bytes) {
+    portENTER_CRITICAL(&msg_buf_mux);
+    stats.copies++;
+    stats.bytes_copied += bytes;
+    portEXIT_CRITICAL(&msg_buf_mux);
+}
+
+void msg_buf_get_stats(msg_buf_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&msg_buf_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&msg_buf_mux);
+}
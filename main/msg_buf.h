@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define MSG_BUF_POOL_SIZE (16) // power of two, also the ingest ring size
+#define MSG_BUF_DATA_SIZE (32)
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// Pooled, reference counted reading. The producer decodes the BLE payload
+// into data once, every later stage (publisher, spool fallback) takes a
+// reference instead of a copy and the last msg_buf_unref returns it.
+// The producer learns the outcome from on_done, called by the publisher
+typedef struct msg_buf_t {
+    uint8_t           data[MSG_BUF_DATA_SIZE]; // first member, so word aligned
+    uint16_t          len;
+    uint8_t           refs;       // under msg_buf_mux
+    int64_t           created_us; // msg_buf_alloc time, sink latencies count from here
+    uint8_t           tag[6];     // BLE address of the sender, all zero if unknown
+    int8_t            rssi;       // 0 if unknown
+    int               status;     // MQTT_SUCCESS/MQTT_ERROR, set by the publisher
+    void (*on_done)(struct msg_buf_t* buf); // runs in the publisher task once status is set
+    void* done_arg;                         // for on_done
+} msg_buf_t;
+
+// Copies of reading payloads anywhere on the ingest -> publish path are
+// counted here, copies / allocs is the per reading figure
+typedef struct {
+    uint32_t allocs; // one per reading
+    uint32_t empty;  // allocations that found the pool empty
+    uint32_t in_use;
+    uint32_t high_water;
+    uint32_t copies;
+    uint32_t bytes_copied;
+} msg_buf_stats_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void msg_buf_init(void);
+
+// Returns a buffer holding one reference, NULL if the pool is empty
+msg_buf_t* msg_buf_alloc(void);
+void       msg_buf_ref(msg_buf_t* buf);
+void       msg_buf_unref(msg_buf_t* buf);
+
+// Publisher side, status is set: runs on_done
+void msg_buf_complete(msg_buf_t* buf);
+
+void msg_buf_count_copy(uint32_t bytes);
+void msg_buf_get_stats(msg_buf_stats_t* stats);
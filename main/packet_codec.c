@@ -0,0 +1,112 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "packet_codec.h"
+
+// Codec bodies, generated from the schemas in packet_codec.h. The structs
+// are packed, so the wire offset of a field is its offsetof() and a decode
+// is one memcpy per field (the ESP32 is little endian, like the wire)
+
+/**********************************************************
+*                                                 HELPERS *
+**********************************************************/
+// the INT|UINT column of a scalar, checked against its type below
+#define CODEC_SIGNED_INT  1
+#define CODEC_SIGNED_UINT 0
+
+// appends to the JSON buffer, gives up (returns -1) as soon as it is full
+#define CODEC_APPEND(...)                                        \
+    do {                                                         \
+        int n = snprintf(buf + len, buf_len - len, __VA_ARGS__); \
+        if (n < 0 || (size_t)n >= buf_len - len) {               \
+            return -1;                                           \
+        }                                                        \
+        len += n;                                                \
+    } while (0)
+
+#define CODEC_DECODE_S(member, type, sign, key) \
+    memcpy(&out->member, buf + offsetof(PACKET_T, member), sizeof(type));
+#define CODEC_DECODE_B(member, n, key) \
+    memcpy(out->member, buf + offsetof(PACKET_T, member), (n));
+
+#define CODEC_ENCODE_S(member, type, sign, key) \
+    memcpy(buf + offsetof(PACKET_T, member), &in->member, sizeof(type));
+#define CODEC_ENCODE_B(member, n, key) \
+    memcpy(buf + offsetof(PACKET_T, member), in->member, (n));
+
+#define CODEC_JSON_INT(member, key) \
+    CODEC_APPEND("%s\"" key "\":%ld", sep, (long)in->member);
+#define CODEC_JSON_UINT(member, key) \
+    CODEC_APPEND("%s\"" key "\":%lu", sep, (unsigned long)in->member);
+#define CODEC_JSON_S(member, type, sign, key) \
+    CODEC_JSON_##sign(member, key)            \
+    sep = ",";
+#define CODEC_JSON_B(member, n, key)                                \
+    CODEC_APPEND("%s\"" key "\":\"", sep);                          \
+    for (int i = 0; i < (n); i++) {                                 \
+        CODEC_APPEND(i == (n)-1 ? "%02X" : "%02X ", in->member[i]); \
+    }                                                               \
+    CODEC_APPEND("\"");                                             \
+    sep = ",";
+
+// the schema has to cover the packed struct exactly
+#define CODEC_CHECK_S(member, type, sign, key)                                                                  \
+    _Static_assert(sizeof(((PACKET_T*)0)->member) == sizeof(type), #member " does not match its schema type"); \
+    _Static_assert(((type)-1 > (type)0) != CODEC_SIGNED_##sign, #member " is not " #sign);
+#define CODEC_CHECK_B(member, n, key) \
+    _Static_assert(sizeof(((PACKET_T*)0)->member) == (n), #member " does not match its schema length");
+
+#define CODEC_DEFINE(name, SCHEMA, WIRE_SIZE)                                                 \
+    SCHEMA(CODEC_CHECK_S, CODEC_CHECK_B)                                                      \
+    _Static_assert(WIRE_SIZE == sizeof(PACKET_T), #name " schema does not cover the struct"); \
+                                                                                              \
+    bool name##_decode(const uint8_t* buf, size_t buf_len, PACKET_T* out) {                   \
+        if (!buf || !out || buf_len < WIRE_SIZE) {                                            \
+            return false;                                                                     \
+        }                                                                                     \
+        memset(out, 0, sizeof(*out));                                                         \
+        SCHEMA(CODEC_DECODE_S, CODEC_DECODE_B)                                                \
+        return true;                                                                          \
+    }                                                                                         \
+                                                                                              \
+    size_t name##_encode(const PACKET_T* in, uint8_t* buf, size_t buf_len) {                  \
+        if (!in || !buf || buf_len < WIRE_SIZE) {                                             \
+            return 0;                                                                         \
+        }                                                                                     \
+        SCHEMA(CODEC_ENCODE_S, CODEC_ENCODE_B)                                                \
+        return WIRE_SIZE;                                                                     \
+    }                                                                                         \
+                                                                                              \
+    int name##_to_json(const PACKET_T* in, char* buf, size_t buf_len) {                       \
+        int         len = 0;                                                                  \
+        const char* sep = "";                                                                 \
+        CODEC_APPEND("{");                                                                    \
+        SCHEMA(CODEC_JSON_S, CODEC_JSON_B)                                                    \
+        CODEC_APPEND("}");                                                                    \
+        return len;                                                                           \
+    }
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+#define PACKET_T uwb_packet_t
+CODEC_DEFINE(uwb_packet, UWB_PACKET_SCHEMA, UWB_PACKET_WIRE_SIZE)
+#undef PACKET_T
+
+#define PACKET_T uwb_reading_t
+CODEC_DEFINE(uwb_reading, UWB_READING_SCHEMA, UWB_READING_WIRE_SIZE)
+#undef PACKET_T
+
+#define PACKET_T flash_packet_t
+CODEC_DEFINE(flash_packet, FLASH_PACKET_SCHEMA, FLASH_PACKET_WIRE_SIZE)
+#undef PACKET_T
+
+#define PACKET_T agg_rollup_t
+CODEC_DEFINE(agg_rollup, AGG_ROLLUP_SCHEMA, AGG_ROLLUP_WIRE_SIZE)
+#undef PACKET_T
+
+#define PACKET_T alert_event_t
+CODEC_DEFINE(alert_event, ALERT_EVENT_SCHEMA, ALERT_EVENT_WIRE_SIZE)
+#undef PACKET_T
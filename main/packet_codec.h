@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "agg_core.h"
+#include "alert_core.h"
+#include "flash_core.h"
+#include "uwb_core.h"
+
+// Every packet type is described once, as a field list. The codec below
+// generates from it a length checked decoder (memcpy per field, so the
+// source buffer may be unaligned), an encoder and a compact JSON writer.
+// No IDF calls, the same files build into host tools that decode dumps.
+//
+// A new packet version is a new struct plus a new schema, the static
+// asserts in packet_codec.c catch a schema that no longer covers its struct.
+//
+//   S(member, c type, INT|UINT, json key) scalar, little endian on the wire,
+//                                         signed or not for the JSON writer
+//   B(member, length, json key)           byte array, hex in JSON
+
+/**********************************************************
+*                                                 SCHEMAS *
+**********************************************************/
+#define UWB_PACKET_SCHEMA(S, B)                 \
+    S(distance_uwb, uint32_t, UINT, "Distance") \
+    S(time, uint32_t, UINT, "Time")
+
+// The uplink JSON of a reading, the packet fields keep their old keys
+#define UWB_READING_SCHEMA(S, B)                       \
+    S(packet.distance_uwb, uint32_t, UINT, "Distance") \
+    S(packet.time, uint32_t, UINT, "Time")             \
+    B(tag, 6, "tag")                                   \
+    S(rssi, int8_t, INT, "rssi")                       \
+    S(rx_utc, uint32_t, UINT, "rx_utc")
+
+// specifics is a union, the reading view is the one that gets exported
+#define FLASH_PACKET_SCHEMA(S, B)                                \
+    S(type, uint16_t, UINT, "type")                              \
+    S(specifics.distance_uwb, uint32_t, UINT, "distance_cm")     \
+    B(manufactuers_data, BLE_MANUFACTURERS_DATA_LEN, "adv_code") \
+    S(RSSI, int8_t, INT, "RSSI")                                 \
+    S(counts, uint8_t, UINT, "counts")                           \
+    S(utc, int32_t, INT, "utc")
+
+#define AGG_ROLLUP_SCHEMA(S, B)               \
+    B(tag, 6, "tag")                          \
+    S(window_ms, uint32_t, UINT, "window_ms") \
+    S(count, uint16_t, UINT, "n")             \
+    S(distance_min, uint32_t, UINT, "min")    \
+    S(distance_max, uint32_t, UINT, "max")    \
+    S(distance_mean, uint32_t, UINT, "mean")  \
+    S(distance_last, uint32_t, UINT, "last")  \
+    S(time_last, uint32_t, UINT, "time")      \
+    S(rssi_min, int8_t, INT, "rssi_min")      \
+    S(rssi_max, int8_t, INT, "rssi_max")      \
+    S(rssi_mean, int8_t, INT, "rssi_mean")
+
+#define ALERT_EVENT_SCHEMA(S, B)               \
+    B(tag, 6, "tag")                           \
+    S(rule, uint8_t, UINT, "rule")             \
+    S(event, uint8_t, UINT, "event")           \
+    S(distance, uint32_t, UINT, "distance_cm") \
+    S(time, uint32_t, UINT, "time")
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define CODEC_SIZE_S(member, type, sign, key) +sizeof(type)
+#define CODEC_SIZE_B(member, len, key)        +(len)
+
+// bytes on the wire, the sum of the schema fields
+#define UWB_PACKET_WIRE_SIZE   (0 UWB_PACKET_SCHEMA(CODEC_SIZE_S, CODEC_SIZE_B))
+#define UWB_READING_WIRE_SIZE  (0 UWB_READING_SCHEMA(CODEC_SIZE_S, CODEC_SIZE_B))
+#define FLASH_PACKET_WIRE_SIZE (0 FLASH_PACKET_SCHEMA(CODEC_SIZE_S, CODEC_SIZE_B))
+#define AGG_ROLLUP_WIRE_SIZE   (0 AGG_ROLLUP_SCHEMA(CODEC_SIZE_S, CODEC_SIZE_B))
+#define ALERT_EVENT_WIRE_SIZE  (0 ALERT_EVENT_SCHEMA(CODEC_SIZE_S, CODEC_SIZE_B))
+
+// declares <name>_decode/_encode/_to_json for one packet type
+#define CODEC_DECLARE(name, type)                                        \
+    bool   name##_decode(const uint8_t* buf, size_t buf_len, type* out); \
+    size_t name##_encode(const type* in, uint8_t* buf, size_t buf_len);  \
+    int    name##_to_json(const type* in, char* buf, size_t buf_len);
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+// _decode: false if buf_len is shorter than the wire size
+// _encode: bytes written, 0 if buf_len is too short
+// _to_json: string length, -1 if it did not fit
+CODEC_DECLARE(uwb_packet, uwb_packet_t)
+CODEC_DECLARE(uwb_reading, uwb_reading_t)
+CODEC_DECLARE(flash_packet, flash_packet_t)
+CODEC_DECLARE(agg_rollup, agg_rollup_t)
+CODEC_DECLARE(alert_event, alert_event_t)
@@ -0,0 +1,220 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "config_core.h"
+#include "global_defines.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "prof_core.h"
+
+// Per task CPU and stack profiler. Needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+// with the esp_timer clock, so a run time counter is in microseconds and
+// an interval is worth the same number of microseconds on every core
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// A task as the profiler knows it. Matched by handle and name, a new task
+// may get the TCB of a deleted one
+typedef struct {
+    TaskHandle_t handle; // NULL: free
+    char         name[configMAX_TASK_NAME_LEN];
+    uint32_t     last_run;  // run time counter at the previous sample
+    uint32_t     last_seen; // sample number
+} prof_slot_t;
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "PROF_CORE";
+
+static prof_slot_t   slots[PROF_MAX_SLOTS];
+static prof_sample_t history[PROF_HISTORY]; // under prof_mux
+static uint32_t      samples;               // taken since boot, history[(samples - 1) % PROF_HISTORY] is the latest
+static uint32_t      last_total;
+static portMUX_TYPE  prof_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Only ever used from prof_task
+static TaskStatus_t  task_status[PROF_MAX_TASKS];
+static prof_sample_t scratch;
+static char          json_buf[PROF_JSON_SIZE];
+
+static TaskHandle_t prof_handle;
+static StackType_t  prof_stack[PROF_STACK_SIZE];
+static StaticTask_t prof_tcb;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+// A slot is only reused once no sample in the history refers to it
+static int find_slot(TaskHandle_t handle, const char* name) {
+    int free_slot = -1;
+    for (int i = 0; i < PROF_MAX_SLOTS; i++) {
+        if (slots[i].handle == handle && !strcmp(slots[i].name, name)) {
+            return i;
+        }
+        if (free_slot < 0 && (!slots[i].handle || samples - slots[i].last_seen > PROF_HISTORY)) {
+            free_slot = i;
+        }
+    }
+    if (free_slot < 0) {
+        ESP_LOGE(TAG, "No slot for %s, raise PROF_MAX_SLOTS", name);
+        return -1;
+    }
+    slots[free_slot].handle   = handle;
+    slots[free_slot].last_run = 0; // created since the previous sample
+    strncpy(slots[free_slot].name, name, sizeof(slots[free_slot].name) - 1);
+    return free_slot;
+}
+
+static void take_sample(void) {
+    uint32_t    total;
+    UBaseType_t tasks = uxTaskGetSystemState(task_status, PROF_MAX_TASKS, &total);
+    if (tasks == 0) {
+        ESP_LOGE(TAG, "More than %d tasks, raise PROF_MAX_TASKS", PROF_MAX_TASKS);
+        return;
+    }
+    uint32_t elapsed = total - last_total;
+    last_total       = total;
+    if (!elapsed) {
+        return;
+    }
+    samples++;
+
+    memset(&scratch, 0, sizeof(scratch));
+    scratch.uptime_ms   = esp_timer_get_time() / 1000;
+    scratch.interval_ms = elapsed / 1000;
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        scratch.busy_permille[core] = 1000;
+    }
+
+    for (int i = 0; i < tasks; i++) {
+        TaskStatus_t* t    = &task_status[i];
+        int           slot = find_slot(t->xHandle, t->pcTaskName);
+        if (slot < 0) {
+            continue;
+        }
+        uint32_t run          = t->ulRunTimeCounter - slots[slot].last_run;
+        slots[slot].last_run  = t->ulRunTimeCounter;
+        slots[slot].last_seen = samples;
+
+        BaseType_t          affinity = xTaskGetAffinity(t->xHandle);
+        prof_task_sample_t* out      = &scratch.task[scratch.tasks++];
+        out->slot                    = slot;
+        out->core                    = affinity == tskNO_AFFINITY ? -1 : affinity;
+        out->cpu_permille            = MIN(1000, ((uint64_t)run * 1000) / elapsed);
+        out->stack_free              = t->usStackHighWaterMark;
+
+        // a core is busy whenever its idle task is not running
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            if (t->xHandle == xTaskGetIdleTaskHandleForCPU(core)) {
+                scratch.busy_permille[core] = 1000 - out->cpu_permille;
+            }
+        }
+    }
+
+    portENTER_CRITICAL(&prof_mux);
+    history[(samples - 1) % PROF_HISTORY] = scratch;
+    portEXIT_CRITICAL(&prof_mux);
+}
+
+bool prof_get_sample(int age, prof_sample_t* out) {
+    ASSERT(out);
+    bool found = false;
+    portENTER_CRITICAL(&prof_mux);
+    if (age >= 0 && age < PROF_HISTORY && age < samples) {
+        *out  = history[(samples - 1 - age) % PROF_HISTORY];
+        found = true;
+    }
+    portEXIT_CRITICAL(&prof_mux);
+    return found;
+}
+
+const char* prof_task_name(uint8_t slot) {
+    return slot < PROF_MAX_SLOTS ? slots[slot].name : "?";
+}
+
+// Compact JSON line, see prof_core.h. Returns -1 if it did not fit
+static int sample_to_json(const prof_sample_t* s, char* buf, int size) {
+    int len = snprintf(buf, size, "{\"t\":%u,\"ms\":%u,\"busy\":[", s->uptime_ms, s->interval_ms);
+    for (int core = 0; core < portNUM_PROCESSORS && len < size; core++) {
+        len += snprintf(buf + len, size - len, "%s%u", core ? "," : "", s->busy_permille[core]);
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "],\"tasks\":[");
+    }
+    for (int i = 0; i < s->tasks && len < size; i++) {
+        const prof_task_sample_t* t = &s->task[i];
+        len += snprintf(buf + len, size - len, "%s[\"%s\",%d,%u,%u]", i ? "," : "",
+                        prof_task_name(t->slot), t->core, t->cpu_permille, t->stack_free);
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "]}");
+    }
+    return len < size ? len : -1;
+}
+
+static void publish_sample(int age) {
+    mqtt_link_stats_t link;
+    mqtt_get_link_stats(&link);
+    if (link.state == MQTT_LINK_DOWN || !prof_get_sample(age, &scratch)) {
+        return;
+    }
+    int len = sample_to_json(&scratch, json_buf, sizeof(json_buf));
+    if (len < 0) {
+        ESP_LOGE(TAG, "Sample does not fit PROF_JSON_SIZE");
+        return;
+    }
+    mqtt_publish_raw(PROF_TOPIC, json_buf, len);
+}
+
+// A notification asks for the whole history, see prof_dump_cmd
+static void prof_task(void* arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+    while (true) {
+        uint32_t   interval_ms = config_get(CFG_PROF_MS);
+        TickType_t period      = pdMS_TO_TICKS(interval_ms ? interval_ms : PROF_IDLE_MS);
+        TickType_t waited      = xTaskGetTickCount() - last_wake;
+
+        if (ulTaskNotifyTake(pdTRUE, waited < period ? period - waited : 0)) {
+            for (int age = PROF_HISTORY - 1; age >= 0; age--) {
+                publish_sample(age);
+            }
+            continue;
+        }
+        last_wake = xTaskGetTickCount();
+        if (interval_ms) {
+            take_sample();
+            publish_sample(0);
+        }
+    }
+}
+
+// "prof_dump", the history on PROF_TOPIC, oldest first
+static void prof_dump_cmd(const char* args, int args_len) {
+    xTaskNotifyGive(prof_handle);
+}
+
+void prof_init(void) {
+    prof_handle = xTaskCreateStatic(
+        prof_task,       // Function that implements the task.
+        "prof",          // Text name for the task.
+        PROF_STACK_SIZE, // Stack size in bytes on the ESP32.
+        NULL,            // Parameter passed into the task.
+        PROF_PRIORITY,   // Priority at which the task is created.
+        prof_stack,      // Stack buffer.
+        &prof_tcb);      // Task control block.
+    ASSERT(prof_handle);
+
+    mem_register_stack("prof", sizeof(prof_stack));
+    mem_register_static("prof_history", sizeof(history) + sizeof(slots) + sizeof(task_status) + sizeof(scratch) + sizeof(json_buf));
+    mqtt_register_command("prof_dump", prof_dump_cmd);
+}
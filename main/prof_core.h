@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Every CFG_PROF_MS the profiler diffs the FreeRTOS run time counters
+// (esp_timer microseconds) and keeps the result for the last PROF_HISTORY
+// intervals. Each sample is published as one JSON line on PROF_TOPIC:
+//   {"t":uptime_ms,"ms":interval,"busy":[core0,core1],
+//    "tasks":[["name",core,cpu,stack_free],...]}
+// busy and cpu are per mille of one core, core is -1 for unpinned tasks
+#define PROF_HISTORY    (8)
+#define PROF_MAX_TASKS  (24)
+#define PROF_MAX_SLOTS  (32) // task names, outlive tasks that are still in the history
+#define PROF_STACK_SIZE (3072)
+#define PROF_PRIORITY   (2) // above mem_report, below everything on the data path
+#define PROF_JSON_SIZE  (1280)
+#define PROF_IDLE_MS    (1000) // config poll while CFG_PROF_MS is 0
+#define PROF_TOPIC      "/topic/gateway/prof"
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint8_t  slot;         // prof_task_name(slot)
+    int8_t   core;         // -1: not pinned
+    uint16_t cpu_permille; // of one core, over the interval
+    uint16_t stack_free;   // high water mark in bytes
+} prof_task_sample_t;
+
+typedef struct {
+    uint32_t           uptime_ms;
+    uint32_t           interval_ms;
+    uint16_t           busy_permille[portNUM_PROCESSORS]; // everything but the idle task
+    uint8_t            tasks;
+    prof_task_sample_t task[PROF_MAX_TASKS];
+} prof_sample_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void prof_init(void);
+
+// Copies the sample taken age intervals ago (0 is the latest),
+// false if there is none
+bool        prof_get_sample(int age, prof_sample_t* out);
+const char* prof_task_name(uint8_t slot);
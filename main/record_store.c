@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "record_store.h"
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+const flash_packet_t* record_store_records(record_store_t* store, size_t offset, flash_packet_t* buf,
+                                           uint16_t count, bool copy) {
+    size_t len = (size_t)count * sizeof(flash_packet_t);
+    if (offset + len > store->size) {
+        return NULL;
+    }
+    if (store->map && !copy) {
+        return (const flash_packet_t*)(store->map + offset);
+    }
+    return store->read(store, offset, buf, len) ? NULL : buf;
+}
+
+// RAM
+
+static int ram_read(record_store_t* store, size_t offset, void* dst, size_t len) {
+    memcpy(dst, store->ram + offset, len);
+    return 0;
+}
+
+static int ram_write(record_store_t* store, size_t offset, const void* src, size_t len) {
+    memcpy(store->ram + offset, src, len);
+    return 0;
+}
+
+static int ram_erase(record_store_t* store, size_t offset, size_t len) {
+    memset(store->ram + offset, RECORD_STORE_ERASED, len);
+    return 0;
+}
+
+static void ram_close(record_store_t* store) {
+    free(store->ram);
+    store->ram = NULL;
+    store->map = NULL;
+}
+
+int record_store_open_ram(record_store_t* store, size_t size) {
+    memset(store, 0, sizeof(*store));
+    store->ram = malloc(size);
+    if (!store->ram) {
+        return -1;
+    }
+    memset(store->ram, RECORD_STORE_ERASED, size);
+    store->name  = "ram";
+    store->size  = size;
+    store->map   = store->ram;
+    store->read  = ram_read;
+    store->write = ram_write;
+    store->erase = ram_erase;
+    store->close = ram_close;
+    return 0;
+}
+
+#ifdef ESP_PLATFORM
+
+// Partition. Writes and erases go through the flash driver, which flushes
+// the cache lines of any mapping over the range, so map stays coherent
+
+static const char* TAG = "RECORD_STORE";
+
+static int part_read(record_store_t* store, size_t offset, void* dst, size_t len) {
+    return esp_partition_read(store->part, offset, dst, len);
+}
+
+static int part_write(record_store_t* store, size_t offset, const void* src, size_t len) {
+    return esp_partition_write(store->part, offset, src, len);
+}
+
+static int part_erase(record_store_t* store, size_t offset, size_t len) {
+    return esp_partition_erase_range(store->part, offset, len);
+}
+
+static void part_close(record_store_t* store) {
+    if (store->map) {
+        spi_flash_munmap(store->map_handle);
+        store->map = NULL;
+    }
+}
+
+int record_store_open_partition(record_store_t* store, const esp_partition_t* part) {
+    memset(store, 0, sizeof(*store));
+    store->name  = "partition";
+    store->part  = part;
+    store->size  = part->size;
+    store->read  = part_read;
+    store->write = part_write;
+    store->erase = part_erase;
+    store->close = part_close;
+
+    // esp_partition_mmap is spi_flash_mmap at the partition's offset
+    const void*             map;
+    spi_flash_mmap_handle_t handle;
+    esp_err_t               err = esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &map, &handle);
+    if (err == ESP_OK) {
+        store->map        = map;
+        store->map_handle = handle;
+    } else {
+        ESP_LOGW(TAG, "Could not map %d bytes of %s (err %d), reads will copy", part->size, part->label, err);
+    }
+    return 0;
+}
+
+#else
+
+// Host file. Reads use pread like esp_partition_read would, the mapping
+// is MAP_SHARED so it sees the writes
+
+static int file_read(record_store_t* store, size_t offset, void* dst, size_t len) {
+    return pread(store->fd, dst, len, offset) == (ssize_t)len ? 0 : -1;
+}
+
+static int file_write(record_store_t* store, size_t offset, const void* src, size_t len) {
+    return pwrite(store->fd, src, len, offset) == (ssize_t)len ? 0 : -1;
+}
+
+static int file_erase(record_store_t* store, size_t offset, size_t len) {
+    uint8_t erased[FLASH_PAGE_SIZE];
+    memset(erased, RECORD_STORE_ERASED, sizeof(erased));
+    for (size_t done = 0; done < len; done += sizeof(erased)) {
+        size_t n = len - done < sizeof(erased) ? len - done : sizeof(erased);
+        if (file_write(store, offset + done, erased, n)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void file_close(record_store_t* store) {
+    if (store->map) {
+        munmap((void*)store->map, store->size);
+        store->map = NULL;
+    }
+    if (store->fd >= 0) {
+        close(store->fd);
+        store->fd = -1;
+    }
+}
+
+int record_store_open_file(record_store_t* store, const char* path, size_t size) {
+    memset(store, 0, sizeof(*store));
+    store->name  = "file";
+    store->size  = size;
+    store->read  = file_read;
+    store->write = file_write;
+    store->erase = file_erase;
+    store->close = file_close;
+
+    struct stat st;
+    store->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (store->fd < 0 || fstat(store->fd, &st)) {
+        file_close(store);
+        return -1;
+    }
+    if ((size_t)st.st_size != size && (ftruncate(store->fd, size) || file_erase(store, 0, size))) {
+        file_close(store);
+        return -1;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED) {
+        file_close(store);
+        return -1;
+    }
+    store->map = map;
+    return 0;
+}
+
+#endif
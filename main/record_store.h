@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#endif
+
+#include "flash_core.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Storage under the record log (flash_core.c). Every backend erases to
+// 0xFF like NOR flash, and if it can, maps the whole store into the
+// address space so readers take flash_packet_t records in place instead
+// of copying them out. Offsets are from the start of the store.
+//   partition: the "records" partition, mapped with spi_flash_mmap
+//   ram:       heap, for boards without the partition and for tests
+//   file:      host only, an mmap'd file (tools/store_bench.c)
+// Calls return 0 (ESP_OK) on success
+#define RECORD_STORE_ERASED (0xFF)
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct record_store record_store_t;
+
+struct record_store {
+    const char*    name;
+    size_t         size;
+    const uint8_t* map; // the whole store, NULL if reads have to copy
+    int (*read)(record_store_t* store, size_t offset, void* dst, size_t len);
+    int (*write)(record_store_t* store, size_t offset, const void* src, size_t len);
+    int (*erase)(record_store_t* store, size_t offset, size_t len);
+    void (*close)(record_store_t* store);
+
+    // backend state
+    const void* part;
+    uint32_t    map_handle;
+    int         fd;
+    uint8_t*    ram;
+};
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+#ifdef ESP_PLATFORM
+// Falls back to copying reads if the MMU has no room for the mapping
+int record_store_open_partition(record_store_t* store, const esp_partition_t* part);
+#else
+// Creates the file erased if it is missing or of another size
+int record_store_open_file(record_store_t* store, const char* path, size_t size);
+#endif
+int record_store_open_ram(record_store_t* store, size_t size);
+
+// count records at offset, in place if the store is mapped and copy is
+// false, otherwise read into buf. NULL on a read error. Records in place
+// are only good until the page they are on is erased
+const flash_packet_t* record_store_records(record_store_t* store, size_t offset, flash_packet_t* buf,
+                                           uint16_t count, bool copy);
@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+#include "rtt_est.h"
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+void rtt_est_init(rtt_est_t* est, uint32_t initial_us) {
+    est->srtt_us   = 0;
+    est->rttvar_us = 0;
+    est->rto_us    = initial_us;
+    est->backoff   = 0;
+    est->samples   = 0;
+    est->timeouts  = 0;
+    est->spurious  = 0;
+}
+
+void rtt_est_sample(rtt_est_t* est, uint32_t rtt_us) {
+    if (!est->samples) {
+        est->srtt_us   = rtt_us;
+        est->rttvar_us = rtt_us / 2;
+    } else {
+        uint32_t err   = abs((int32_t)(est->srtt_us - rtt_us));
+        est->rttvar_us = est->rttvar_us - est->rttvar_us / 4 + err / 4;
+        est->srtt_us   = est->srtt_us - est->srtt_us / 8 + rtt_us / 8;
+    }
+    est->rto_us  = MAX(est->srtt_us + 4 * est->rttvar_us, RTT_EST_SRTT_FLOOR * est->srtt_us);
+    est->backoff = 0;
+    est->samples++;
+}
+
+void rtt_est_late_ack(rtt_est_t* est, uint32_t rtt_us) {
+    est->spurious++;
+    rtt_est_sample(est, rtt_us);
+}
+
+void rtt_est_timeout(rtt_est_t* est, uint8_t level) {
+    est->timeouts++;
+    if (level == est->backoff && est->backoff < RTT_EST_MAX_BACKOFF) {
+        est->backoff++;
+    }
+}
+
+uint32_t rtt_est_deadline_us(const rtt_est_t* est, uint32_t min_us, uint32_t max_us, uint32_t rnd) {
+    uint64_t rto = (uint64_t)est->rto_us << est->backoff;
+    if (rto < min_us) {
+        rto = min_us;
+    }
+    if (rto > max_us) {
+        rto = max_us;
+    }
+    return rto + rnd % (rto / 8 + 1);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+// Broker round trip estimator, the TCP retransmission timer (RFC 6298)
+// fed with PUBACK latencies:
+//   SRTT   = 7/8 SRTT + 1/8 R
+//   RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+//   RTO    = max(SRTT + 4 RTTVAR, 4 SRTT), doubled for every timeout since
+//            the last sample
+// SRTT + 4 RTTVAR alone sits inside the exponential tail of a steady AWS
+// link, it retried 0.4% of the readings that were on their way. The
+// 4 SRTT floor covers the tail: no more spurious retries than the old
+// fixed 1 s on aws, with a lost publish detected in about 700 ms instead
+// of 1 s (tools/rtt_sim.c). The price is on links slower than the fixed
+// timeout: slow_link (700 ms + a 250 ms tail) takes about 4 s to detect a
+// loss, where the fixed 1 s detected it in 1 s but retried over 40% of
+// the healthy publishes and failed 3% of the readings. Through AWS
+// hiccups detection takes about 1.5 s (fixed: 1 s and 5% failed).
+// Every attempt is published with its own message id, so even an ack that
+// came in after its timeout is an unambiguous sample.
+// No IDF calls, the same files build into the host simulation (tools/rtt_sim.c)
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define RTT_EST_MAX_BACKOFF (6) // doublings
+#define RTT_EST_SRTT_FLOOR  (4) // RTO is at least this many SRTTs
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint32_t srtt_us; // 0 until the first sample
+    uint32_t rttvar_us;
+    uint32_t rto_us;  // before backoff and clamping
+    uint8_t  backoff; // timeouts since the last sample, at most RTT_EST_MAX_BACKOFF
+    uint32_t samples;
+    uint32_t timeouts;
+    uint32_t spurious; // timeouts whose ack came in later
+} rtt_est_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+// initial_us is the RTO until the first sample
+void rtt_est_init(rtt_est_t* est, uint32_t initial_us);
+
+// One ack latency. Only for acks that can't be confused with an earlier
+// attempt (Karn), resets the backoff
+void rtt_est_sample(rtt_est_t* est, uint32_t rtt_us);
+
+// The ack of a publish that already timed out, the timeout was spurious
+void rtt_est_late_ack(rtt_est_t* est, uint32_t rtt_us);
+
+// A publish sent at backoff level `level` timed out. Publishes in flight
+// together time out together, only the first one of a level backs off
+void rtt_est_timeout(rtt_est_t* est, uint8_t level);
+
+// Ack timeout for a publish sent now: the backed off RTO clamped to
+// [min_us, max_us], plus up to 1/8 of it from rnd so retries after a
+// hiccup spread out
+uint32_t rtt_est_deadline_us(const rtt_est_t* est, uint32_t min_us, uint32_t max_us, uint32_t rnd);
@@ -0,0 +1,294 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "lwip/sockets.h"
+#include "mqtt_client.h"
+
+#include "config_core.h"
+#include "global_defines.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "msg_buf.h"
+#include "packet_codec.h"
+#include "sink_core.h"
+
+// Output sinks. The cloud pipeline (mqtt_core) records its own results
+// here, the local sinks are driven by sink_task
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "SINK_CORE";
+
+static bool udp_start(void);
+static bool udp_send(const char* json, int len);
+static bool local_mqtt_start(void);
+static bool local_mqtt_send(const char* json, int len);
+static bool console_send(const char* json, int len);
+
+static const sink_t sinks[SINK_COUNT] = {
+    [SINK_MQTT]       = { "mqtt", true, NULL, NULL },
+    [SINK_UDP]        = { "udp", true, udp_start, udp_send },
+    [SINK_LOCAL_MQTT] = { "local_mqtt", true, local_mqtt_start, local_mqtt_send },
+    [SINK_CONSOLE]    = { "console", false, NULL, console_send },
+};
+
+static sink_stats_t stats[SINK_COUNT];
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static QueueHandle_t sinkQ;
+static StaticQueue_t sinkQ_buf;
+static uint8_t       sinkQ_storage[SINK_QUEUE_DEPTH * sizeof(msg_buf_t*)];
+static StackType_t   sink_stack[SINK_STACK_SIZE];
+static StaticTask_t  sink_tcb;
+
+// Only ever used from sink_task
+static char json_buf[SINK_JSON_SIZE];
+
+static int                      udp_sock = -1;
+static struct sockaddr_in       udp_group;
+static uint32_t                 udp_seq;
+static char                     udp_buf[sizeof(uint32_t) + SINK_JSON_SIZE];
+static esp_mqtt_client_handle_t local_client;
+static esp_mqtt_client_config_t local_cfg;
+static char                     local_uri[SINK_URI_LEN] = SINK_LOCAL_BROKER_URI;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static bool sink_enabled(int id) {
+    return id == SINK_MQTT || (config_get(CFG_SINK_MASK) & (1 << id));
+}
+
+void sink_record(sink_id_t id, bool ok, uint32_t latency_us) {
+    portENTER_CRITICAL(&stats_mux);
+    if (ok) {
+        stats[id].sent++;
+        stats[id].last_us = latency_us;
+        stats[id].max_us  = MAX(stats[id].max_us, latency_us);
+        stats[id].total_us += latency_us;
+    } else {
+        stats[id].failed++;
+    }
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+void sink_get_stats(sink_id_t id, sink_stats_t* out) {
+    ASSERT(out && id < SINK_COUNT);
+    portENTER_CRITICAL(&stats_mux);
+    *out = stats[id];
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+static bool udp_start(void) {
+    udp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udp_sock < 0) {
+        ESP_LOGE(TAG, "UDP socket failed, errno %d", errno);
+        return false;
+    }
+    uint8_t ttl = SINK_UDP_TTL;
+    setsockopt(udp_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    memset(&udp_group, 0, sizeof(udp_group));
+    udp_group.sin_family      = AF_INET;
+    udp_group.sin_port        = htons(SINK_UDP_PORT);
+    udp_group.sin_addr.s_addr = inet_addr(SINK_UDP_GROUP);
+    return true;
+}
+
+static bool udp_send(const char* json, int len) {
+    if (udp_sock < 0) {
+        return false;
+    }
+    // consumers spot loss and reordering by the sequence number
+    uint32_t seq = udp_seq++;
+    memcpy(udp_buf, &seq, sizeof(seq));
+    memcpy(udp_buf + sizeof(seq), json, len);
+    msg_buf_count_copy(len);
+    return sendto(udp_sock, udp_buf, sizeof(seq) + len, 0, (struct sockaddr*)&udp_group, sizeof(udp_group)) > 0;
+}
+
+// "mqtt://host[:port]" with a non empty host and a numeric port. The sink
+// has no client certificate or CA, so anything but plain MQTT is refused
+static bool local_uri_valid(const char* uri) {
+    const char* scheme = "mqtt://";
+    if (strncmp(uri, scheme, strlen(scheme))) {
+        return false;
+    }
+    const char* host = uri + strlen(scheme);
+    size_t      len  = strcspn(host, ":/");
+    if (!len || host[len] == '/') {
+        return false;
+    }
+    for (const char* c = host; c < host + len; c++) {
+        if (*c <= ' ' || *c > '~') {
+            return false;
+        }
+    }
+    if (host[len] == ':') {
+        const char* port = host + len + 1;
+        if (!*port || strlen(port) > 5 || strspn(port, "0123456789") != strlen(port) || atoi(port) > 65535) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool local_mqtt_start(void) {
+    nvs_handle_t nvs;
+    char         stored[SINK_URI_LEN];
+    size_t       uri_len = sizeof(stored);
+    if (nvs_open(SINK_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        if (nvs_get_str(nvs, "broker_uri", stored, &uri_len) == ESP_OK) {
+            // written by an older build that didn't check it
+            if (local_uri_valid(stored)) {
+                strcpy(local_uri, stored);
+            } else {
+                ESP_LOGE(TAG, "Ignoring stored broker URI %s", stored);
+            }
+        }
+        nvs_close(nvs);
+    }
+
+    local_cfg.uri = local_uri;
+    local_client  = esp_mqtt_client_init(&local_cfg);
+    if (!local_client || esp_mqtt_client_start(local_client) != ESP_OK) {
+        ESP_LOGE(TAG, "Local broker client failed to start (%s)", local_uri);
+        return false;
+    }
+    ESP_LOGI(TAG, "Local broker %s", local_uri);
+    return true;
+}
+
+static bool local_mqtt_send(const char* json, int len) {
+    // QoS 0 goes straight to the socket, no outbox copy
+    return local_client && esp_mqtt_client_publish(local_client, SINK_LOCAL_TOPIC, json, len, 0, 0) >= 0;
+}
+
+static bool console_send(const char* json, int len) {
+    bool ok = fwrite(json, 1, len, stdout) == len && fputc('\n', stdout) != EOF;
+    fflush(stdout);
+    return ok;
+}
+
+static void sink_task(void* arg) {
+    msg_buf_t* msg;
+    while (true) {
+        xQueueReceive(sinkQ, &msg, portMAX_DELAY);
+
+        int len = uwb_packet_to_json((const uwb_packet_t*)msg->data, json_buf, sizeof(json_buf));
+        for (int id = SINK_MQTT + 1; id < SINK_COUNT; id++) {
+            if (!sink_enabled(id)) {
+                continue;
+            }
+            bool ok = len > 0 && sinks[id].send(json_buf, len);
+            sink_record(id, ok, esp_timer_get_time() - msg->created_us);
+        }
+        msg_buf_unref(msg);
+    }
+}
+
+void sink_fanout(msg_buf_t* msg) {
+    if (!sinkQ || !(config_get(CFG_SINK_MASK) & ~(1 << SINK_MQTT))) {
+        return;
+    }
+    msg_buf_ref(msg);
+    if (xQueueSend(sinkQ, &msg, 0) != pdTRUE) {
+        msg_buf_unref(msg);
+        portENTER_CRITICAL(&stats_mux);
+        for (int id = SINK_MQTT + 1; id < SINK_COUNT; id++) {
+            if (sink_enabled(id)) {
+                stats[id].dropped++;
+            }
+        }
+        portEXIT_CRITICAL(&stats_mux);
+    }
+}
+
+// "sink_broker mqtt://host[:port]", used from the next boot on
+static void sink_broker_cmd(const char* args, int args_len) {
+    char         uri[SINK_URI_LEN] = { 0 };
+    nvs_handle_t nvs;
+    if (args_len <= 0 || args_len >= sizeof(uri)) {
+        ESP_LOGE(TAG, "Broker URI has to be 1 to %d characters", sizeof(uri) - 1);
+        return;
+    }
+    memcpy(uri, args, args_len);
+    if (!local_uri_valid(uri)) {
+        ESP_LOGE(TAG, "Not an mqtt://host[:port] URI: %s", uri);
+        return;
+    }
+    if (nvs_open(SINK_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_str(nvs, "broker_uri", uri) == ESP_OK && nvs_commit(nvs) == ESP_OK) {
+        ESP_LOGI(TAG, "Local broker %s after reboot", uri);
+    }
+    nvs_close(nvs);
+}
+
+// "sink_stats", one line per sink on SINK_STATS_TOPIC
+static void sink_stats_cmd(const char* args, int args_len) {
+    static char out[SINK_COUNT * 96];
+    int         len = 0;
+    for (int id = 0; id < SINK_COUNT && len < sizeof(out); id++) {
+        sink_stats_t s;
+        sink_get_stats(id, &s);
+        len += snprintf(out + len, sizeof(out) - len, "%s %s sent=%d failed=%d dropped=%d last_us=%d max_us=%d mean_us=%d\n",
+                        sinks[id].name, sink_enabled(id) ? "on" : "off",
+                        s.sent, s.failed, s.dropped, s.last_us, s.max_us,
+                        s.sent ? (uint32_t)(s.total_us / s.sent) : 0);
+    }
+    mqtt_publish_raw(SINK_STATS_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
+// sink_mask is applied at boot, only enabled sinks open sockets or clients
+static void start_sinks(bool network) {
+    for (int id = SINK_MQTT + 1; id < SINK_COUNT; id++) {
+        if (sinks[id].network != network || !sink_enabled(id)) {
+            continue;
+        }
+        if (sinks[id].start && !sinks[id].start()) {
+            ESP_LOGE(TAG, "Sink %s not started", sinks[id].name);
+        }
+    }
+}
+
+void sink_init(void) {
+    sinkQ = xQueueCreateStatic(SINK_QUEUE_DEPTH, sizeof(msg_buf_t*), sinkQ_storage, &sinkQ_buf);
+    ASSERT(sinkQ);
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        sink_task,           // Function that implements the task.
+        "sink",              // Text name for the task.
+        SINK_STACK_SIZE,     // Stack size in bytes on the ESP32.
+        NULL,                // Parameter passed into the task.
+        SINK_PRIORITY,       // Priority at which the task is created.
+        sink_stack,          // Stack buffer.
+        &sink_tcb,           // Task control block.
+        MQTT_PIPELINE_CORE); // Core the task is pinned to.
+    ASSERT(handle);
+
+    start_sinks(false);
+
+    mem_register_stack("sink", sizeof(sink_stack));
+    mem_register_static("sink_queue", sizeof(sinkQ_storage) + sizeof(json_buf) + sizeof(udp_buf));
+    mqtt_register_command("sink_broker", sink_broker_cmd);
+    mqtt_register_command("sink_stats", sink_stats_cmd);
+}
+
+void sink_start(void) {
+    start_sinks(true);
+}
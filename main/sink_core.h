@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "msg_buf.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// AWS IoT stays the system of record: every reading goes through the acked
+// MQTT pipeline. The other sinks are best effort copies for consumers on
+// the LAN, fed from their own task as soon as a reading comes in, so they
+// don't wait on the cloud round trip. CFG_SINK_MASK enables them by bit
+#define SINK_QUEUE_DEPTH (8)
+#define SINK_STACK_SIZE  (3072)
+#define SINK_PRIORITY    (6) // above the publish pipeline, local delivery is the fast path
+#define SINK_JSON_SIZE   (128)
+
+// UDP: one datagram per reading, [u32 sequence, little endian][JSON]
+#define SINK_UDP_GROUP "239.255.70.1"
+#define SINK_UDP_PORT  (5070)
+#define SINK_UDP_TTL   (1) // stay on the LAN
+
+// Local broker: plain MQTT, QoS 0, same topic as the cloud.
+// "sink_broker mqtt://host[:port]" overrides the URI (kept in NVS)
+#define SINK_LOCAL_BROKER_URI "mqtt://192.168.1.2:1883"
+#define SINK_LOCAL_TOPIC      "/topic/cat_location"
+#define SINK_URI_LEN          (64)
+#define SINK_NVS_NAMESPACE    "sink"
+
+// Console: JSON lines on stdout (the UART), for a host on the serial port.
+// There is no filesystem on the gateway to write them to
+
+#define SINK_STATS_TOPIC "/topic/gateway/sinks"
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef enum {
+    SINK_MQTT,       // AWS IoT, always on
+    SINK_UDP,        // LAN multicast
+    SINK_LOCAL_MQTT, // broker on the LAN
+    SINK_CONSOLE,
+    SINK_COUNT,
+} sink_id_t;
+
+// Latencies run from msg_buf_alloc (the reading was decoded) to the sink
+// taking it, for SINK_MQTT to the PUBACK
+typedef struct {
+    uint32_t sent;
+    uint32_t failed;
+    uint32_t dropped; // sink queue full
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us; // total_us / sent is the mean
+} sink_stats_t;
+
+// One output, the local sinks are fire and forget
+typedef struct {
+    const char* name;
+    bool        network;                     // started by sink_start, otherwise by sink_init
+    bool (*start)(void);                     // only called if the sink is enabled, may be NULL
+    bool (*send)(const char* json, int len); // false if the reading was not delivered
+} sink_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void sink_init(void);
+// Brings up the network sinks, call once the station has an address
+void sink_start(void);
+
+// Hands the reading to the enabled local sinks, takes its own reference
+// and never blocks. Called for every reading on its way to the cloud
+void sink_fanout(msg_buf_t* msg);
+
+// Delivery result of a sink that is fed elsewhere (SINK_MQTT)
+void sink_record(sink_id_t id, bool ok, uint32_t latency_us);
+
+void sink_get_stats(sink_id_t id, sink_stats_t* stats);
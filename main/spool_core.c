@@ -0,0 +1,94 @@
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "global_defines.h"
+#include "mem_core.h"
+#include "spool_core.h"
+
+// Bounded FIFO of readings that arrived while the broker was unreachable.
+// Lives in PSRAM when the board has it, otherwise in a small static buffer
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "SPOOL";
+
+static spool_entry_t  internal_entries[SPOOL_ENTRIES_INTERNAL];
+static spool_entry_t* entries = internal_entries;
+static uint32_t       capacity = SPOOL_ENTRIES_INTERNAL;
+static uint32_t       head; // next free
+static uint32_t       tail; // oldest
+static spool_stats_t  stats;
+static portMUX_TYPE   spool_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+void spool_init(void) {
+#ifdef CONFIG_ESP32_SPIRAM_SUPPORT
+    spool_entry_t* ext = heap_caps_calloc(SPOOL_ENTRIES_PSRAM, sizeof(spool_entry_t), MALLOC_CAP_SPIRAM);
+    if (ext) {
+        entries  = ext;
+        capacity = SPOOL_ENTRIES_PSRAM;
+    } else {
+        ESP_LOGE(TAG, "No PSRAM, falling back to the internal spool");
+    }
+#endif
+    stats.capacity = capacity;
+    mem_register_static("spool", sizeof(internal_entries));
+    ESP_LOGI(TAG, "Spool holds %d readings", capacity);
+}
+
+// returns false (and counts a drop) if the spool is full
+bool spool_push(const spool_entry_t* entry) {
+    bool pushed = false;
+    portENTER_CRITICAL(&spool_mux);
+    if (head - tail < capacity) {
+        entries[head % capacity] = *entry;
+        head++;
+        stats.pushed++;
+        stats.high_water = MAX(stats.high_water, head - tail);
+        pushed           = true;
+    } else {
+        stats.dropped++;
+    }
+    portEXIT_CRITICAL(&spool_mux);
+    return pushed;
+}
+
+// Copies out the oldest entry without removing it, so a failed
+// publish leaves it at the front
+bool spool_peek(spool_entry_t* entry) {
+    bool found = false;
+    portENTER_CRITICAL(&spool_mux);
+    if (head != tail) {
+        *entry = entries[tail % capacity];
+        found  = true;
+    }
+    portEXIT_CRITICAL(&spool_mux);
+    return found;
+}
+
+void spool_pop(void) {
+    portENTER_CRITICAL(&spool_mux);
+    if (head != tail) {
+        tail++;
+    }
+    portEXIT_CRITICAL(&spool_mux);
+}
+
+void spool_get_stats(spool_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&spool_mux);
+    *out       = stats;
+    out->depth = head - tail;
+    portEXIT_CRITICAL(&spool_mux);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define SPOOL_ENTRIES_PSRAM    (16384) // used when PSRAM is available
+#define SPOOL_ENTRIES_INTERNAL (256)
+#define SPOOL_ENTRY_DATA_SIZE  (8) // one uwb_packet_t
+#define SPOOL_TAG_SIZE         (6)
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// A reading with what the gateway knew about it on receipt, so it goes up
+// the same whether it was published live or drained later
+typedef struct {
+    uint8_t  data[SPOOL_ENTRY_DATA_SIZE];
+    uint8_t  tag[SPOOL_TAG_SIZE]; // BLE address of the sender, all zero if unknown
+    int8_t   rssi;                // 0 if unknown
+    uint32_t rx_ms;               // uptime when the gateway took it in, turned into
+                                  // wall clock time on the drain once SNTP synced
+} spool_entry_t;
+
+typedef struct {
+    uint32_t capacity;
+    uint32_t depth;
+    uint32_t high_water;
+    uint32_t pushed;
+    uint32_t dropped; // spool was full
+} spool_stats_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void spool_init(void);
+bool spool_push(const spool_entry_t* entry);
+bool spool_peek(spool_entry_t* entry);
+void spool_pop(void);
+void spool_get_stats(spool_stats_t* stats);
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// The ESP32 caches external RAM in 32 byte lines, keep the producer
+// and consumer indexes on different lines so the two cores don't share one
+#ifdef __XTENSA__
+#define SPSC_CACHE_LINE (32)
+#else
+#define SPSC_CACHE_LINE (64)
+#endif
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// Lock-free single producer / single consumer ring of pointers.
+// head is only written by the producer, tail only by the consumer, each
+// side keeps a private copy of the other's index and only re-reads the
+// shared one when the ring looks full (or empty). No IDF calls, the
+// stress test / benchmark builds it on the host (tools/spsc_stress.c)
+typedef struct {
+    _Alignas(SPSC_CACHE_LINE) atomic_uint head;
+    uint32_t cached_tail; // producer private
+
+    _Alignas(SPSC_CACHE_LINE) atomic_uint tail;
+    uint32_t cached_head; // consumer private
+
+    _Alignas(SPSC_CACHE_LINE) void** slots;
+    uint32_t mask;
+} spsc_ring_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+// slots must be a power of two
+static inline void spsc_init(spsc_ring_t* ring, void** storage, uint32_t slots) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->cached_tail = 0;
+    ring->cached_head = 0;
+    ring->slots       = storage;
+    ring->mask        = slots - 1;
+}
+
+// Producer side, returns false if the ring is full
+static inline bool spsc_push(spsc_ring_t* ring, void* item) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail > ring->mask) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail > ring->mask) {
+            return false;
+        }
+    }
+    ring->slots[head & ring->mask] = item;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Consumer side, returns NULL if the ring is empty
+static inline void* spsc_pop(spsc_ring_t* ring) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == ring->cached_head) {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == ring->cached_head) {
+            return NULL;
+        }
+    }
+    void* item = ring->slots[tail & ring->mask];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return item;
+}
+
+// Approximate, either side may call it
+static inline uint32_t spsc_count(spsc_ring_t* ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire)
+           - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
@@ -0,0 +1,86 @@
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "global_defines.h"
+#include "mem_core.h"
+#include "status_core.h"
+
+// Seqlock: seq is odd while the writer copies a snapshot in. A reader
+// takes seq, copies, and keeps the copy only if seq was even and did not
+// move meanwhile. The writer runs the copy in a critical section on its
+// own core, so a reader on the other core never waits on a preempted
+// writer. writer_mux is never taken by a reader
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "STATUS_CORE";
+
+static status_snapshot_t current;
+static atomic_uint       seq;
+static portMUX_TYPE      writer_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static char fw[STATUS_FW_LEN];
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+void status_publish(const status_snapshot_t* snap) {
+    status_snapshot_t next = *snap;
+    next.layout            = STATUS_LAYOUT_VERSION;
+    memcpy(next.fw, fw, sizeof(next.fw));
+
+    portENTER_CRITICAL(&writer_mux);
+    unsigned s = atomic_load_explicit(&seq, memory_order_relaxed);
+    next.seq   = s / 2 + 1;
+    atomic_store_explicit(&seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    current = next;
+    atomic_store_explicit(&seq, s + 2, memory_order_release);
+    portEXIT_CRITICAL(&writer_mux);
+}
+
+bool status_get(status_snapshot_t* snap) {
+    ASSERT(snap);
+    for (int i = 0; i < STATUS_READ_RETRIES; i++) {
+        unsigned before = atomic_load_explicit(&seq, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        *snap = current;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&seq, memory_order_relaxed) == before) {
+            return before != 0;
+        }
+    }
+    return false;
+}
+
+int status_read(status_snapshot_t* snap, uint16_t offset, uint8_t* buf, uint16_t buf_len) {
+    ASSERT(snap);
+    if (offset > sizeof(*snap)) {
+        return -1;
+    }
+    if (!offset && !status_get(snap)) {
+        // nothing consistent yet, continuations find the layout byte 0
+        memset(snap, 0, sizeof(*snap));
+        return 0;
+    }
+    uint16_t len = MIN(buf_len, sizeof(*snap) - offset);
+    memcpy(buf, (uint8_t*)snap + offset, len);
+    return len;
+}
+
+void status_init(void) {
+    atomic_init(&seq, 0);
+    strncpy(fw, esp_ota_get_app_description()->version, sizeof(fw));
+    ESP_LOGI(TAG, "Status snapshot of %d bytes, firmware %.*s", sizeof(status_snapshot_t), sizeof(fw), fw);
+    mem_register_static("status_snapshot", sizeof(current) + sizeof(fw));
+}
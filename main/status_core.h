@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Gateway health for tags and installers. The MQTT manager fills a
+// snapshot every STATUS_REFRESH_MS from state it already owns, readers
+// (GATT reads in the BTC task, the scan response refresh in the esp_timer
+// task) copy it under a sequence counter and never take a pipeline lock
+#define STATUS_LAYOUT_VERSION (1)
+#define STATUS_REFRESH_MS     (250)
+#define STATUS_FW_LEN         (12)
+#define STATUS_READ_RETRIES   (8) // then the reader gives up, the writer is mid update
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// Served as is by the status characteristic, little endian
+typedef struct {
+    uint8_t  layout;            // STATUS_LAYOUT_VERSION
+    char     fw[STATUS_FW_LEN]; // app version, not terminated if it fills the field
+    uint8_t  link;              // mqtt_link_state_t
+    uint8_t  sync_quality;      // as in ble_adv_time_t
+    uint8_t  busy;              // 0..100, the fullest of slots, ingest ring and buffer pool
+    uint8_t  in_flight;         // publishes waiting on a PUBACK
+    uint8_t  pub_slots;
+    uint8_t  ingest_depth;      // readings queued for the publisher
+    uint8_t  bufs_in_use;
+    uint16_t srtt_ms;
+    uint32_t spool_depth;
+    uint16_t spool_fill; // permille
+    uint32_t uptime_s;
+    uint32_t seq; // snapshots since boot
+} __attribute__((packed)) status_snapshot_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void status_init(void);
+
+// Single writer, the MQTT manager. fw, layout and seq are filled in here
+void status_publish(const status_snapshot_t* snap);
+
+// Lock free, any task. False if no consistent copy could be taken
+bool status_get(status_snapshot_t* snap);
+
+// GATT read of the status characteristic from byte offset on. A read at
+// offset 0 takes a new snapshot into snap, the Read Blob continuations
+// serve the rest of that one, so a client on the default MTU reads one
+// consistent snapshot. Returns the bytes written, -1 if offset is past
+// the end
+int status_read(status_snapshot_t* snap, uint16_t offset, uint8_t* buf, uint16_t buf_len);
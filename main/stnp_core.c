@@ -4,6 +4,7 @@
 #include "esp_sleep.h"
 #include "esp_sntp.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
@@ -13,18 +14,43 @@
 #include <sys/time.h>
 #include <time.h>
 
+#include "stnp_core.h"
+
 #define TAG "SNTP"
 
+static volatile uint32_t last_sync_ms; // uptime of the last SNTP sync, 0 = never
+
+static uint32_t uptime_ms(void) {
+    return esp_timer_get_time() / 1000;
+}
+
+static void time_sync_cb(struct timeval* tv) {
+    last_sync_ms = uptime_ms() | 1;
+    ESP_LOGI(TAG, "Time synced");
+}
+
 void initialize_sntp(void) {
     ESP_LOGI(TAG, "Initializing SNTP");
+    sntp_set_time_sync_notification_cb(time_sync_cb);
     sntp_setoperatingmode(SNTP_OPMODE_POLL);
     sntp_setservername(0, "pool.ntp.org");
     sntp_init();
 }
 
 uint32_t get_time_utc(void) {
-    ESP_LOGI(TAG, "Get time");
+    ESP_LOGD(TAG, "Get time");
     time_t now;
     time(&now);
     return (uint32_t)now;
 }
+
+// 0 if SNTP never synced, otherwise 255 minus the minutes since the last
+// sync (bottoming out at 1), so tags can pick the freshest gateway
+uint8_t get_time_sync_quality(void) {
+    uint32_t synced_ms = last_sync_ms;
+    if (!synced_ms) {
+        return 0;
+    }
+    uint32_t minutes = (uptime_ms() - synced_ms) / (60 * 1000);
+    return 255 - (minutes < 254 ? minutes : 254);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,7 @@
 **********************************************************/
 void     initialize_sntp(void);
 uint32_t get_time_utc(void);
+uint8_t  get_time_sync_quality(void);
 
 /**********************************************************
 *                      GLOBALS    
@@ -0,0 +1,362 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "lwip/sockets.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+
+#include "global_defines.h"
+#include "mem_core.h"
+#include "tls_core.h"
+
+/*********************************************************
+*                                               TYPEDEFS *
+*********************************************************/
+// One broker as the relay dials it
+typedef struct {
+    char                host[BROKER_URI_LEN];
+    char                port[8];
+    int                 listen_fd;
+    mbedtls_ssl_session session; // last one negotiated, under session_sem
+    bool                has_session;
+} tls_broker_t;
+
+// One relayed connection at a time per relay task
+typedef struct {
+    mbedtls_ssl_context ssl;
+    mbedtls_net_context net;
+    uint8_t             buf[TLS_RELAY_BUF_SIZE];
+} tls_relay_t;
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "TLS_CORE";
+
+static tls_broker_t tls_brokers[BROKER_MAX];
+static int          broker_count;
+static char         local_uris[BROKER_MAX][TLS_LOCAL_URI_LEN];
+static tls_relay_t  relays[TLS_RELAYS];
+
+static mbedtls_ssl_config conf;
+static mbedtls_x509_crt   client_cert;
+static mbedtls_pk_context client_key;
+
+static SemaphoreHandle_t session_sem;
+static StaticSemaphore_t session_sem_buf;
+static tls_stats_t       stats;
+static portMUX_TYPE      stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static StackType_t  relay_stacks[TLS_RELAYS][TLS_RELAY_STACK_SIZE];
+static StaticTask_t relay_tcbs[TLS_RELAYS];
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+bool tls_parse_uri(const char* uri, char* host, int host_len, char* port, int port_len) {
+    static const char scheme[] = "mqtts://";
+    if (strncmp(uri, scheme, sizeof(scheme) - 1)) {
+        return false;
+    }
+    const char* start = uri + sizeof(scheme) - 1;
+    const char* end   = start;
+    while (*end && *end != ':' && *end != '/') {
+        end++;
+    }
+    const char* port_str = TLS_DEFAULT_PORT;
+    int         port_n   = strlen(TLS_DEFAULT_PORT);
+    if (*end == ':') {
+        port_str = end + 1;
+        port_n   = strspn(port_str, "0123456789");
+        if (!port_n || port_n > 5 || (port_str[port_n] && port_str[port_n] != '/')) {
+            return false;
+        }
+    }
+    if (end == start || (host && end - start >= host_len) || (port && port_n >= port_len)) {
+        return false;
+    }
+    if (host) {
+        memcpy(host, start, end - start);
+        host[end - start] = 0;
+    }
+    if (port) {
+        memcpy(port, port_str, port_n);
+        port[port_n] = 0;
+    }
+    return true;
+}
+
+// The hardware RNG, the radio is on whenever the relay runs
+static int relay_random(void* ctx, unsigned char* out, size_t len) {
+    esp_fill_random(out, len);
+    return 0;
+}
+
+// Waits for ESP-MQTT to connect to one of the loopback ports, both relay
+// tasks wait on all of them and whichever accepts first takes the connection
+static int relay_accept(int* broker) {
+    fd_set set;
+    int    max_fd = -1;
+    FD_ZERO(&set);
+    for (int i = 0; i < broker_count; i++) {
+        FD_SET(tls_brokers[i].listen_fd, &set);
+        max_fd = MAX(max_fd, tls_brokers[i].listen_fd);
+    }
+    if (select(max_fd + 1, &set, NULL, NULL, NULL) <= 0) {
+        return -1;
+    }
+    for (int i = 0; i < broker_count; i++) {
+        if (!FD_ISSET(tls_brokers[i].listen_fd, &set)) {
+            continue;
+        }
+        int fd = accept(tls_brokers[i].listen_fd, NULL, NULL);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, 0);
+            *broker = i;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static void count_handshake(bool ok, bool offered, bool resumed, uint32_t ms) {
+    portENTER_CRITICAL(&stats_mux);
+    if (!ok) {
+        stats.failed++;
+    } else if (resumed) {
+        stats.resumed++;
+        stats.last_resumed_ms = ms;
+    } else {
+        stats.full++;
+        stats.rejected += offered;
+        stats.last_full_ms = ms;
+    }
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+// Connects to broker and runs the handshake, offering its cached session.
+// mbedTLS has no call telling whether a session was resumed: a resumed
+// handshake goes from the ServerHello straight to the server's
+// ChangeCipherSpec, a full one passes through the server Certificate state
+static bool relay_handshake(tls_relay_t* r, int broker) {
+    tls_broker_t* b        = &tls_brokers[broker];
+    int64_t       start_us = esp_timer_get_time();
+    bool          offered  = false;
+    bool          full     = false;
+
+    mbedtls_ssl_session_reset(&r->ssl);
+    if (mbedtls_net_connect(&r->net, b->host, b->port, MBEDTLS_NET_PROTO_TCP)) {
+        ESP_LOGE(TAG, "Connect to %s:%s failed", b->host, b->port);
+        count_handshake(false, false, false, 0);
+        return false;
+    }
+    mbedtls_ssl_set_hostname(&r->ssl, b->host);
+    mbedtls_ssl_set_bio(&r->ssl, &r->net, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+
+    xSemaphoreTake(session_sem, portMAX_DELAY);
+    if (b->has_session) {
+        offered = !mbedtls_ssl_set_session(&r->ssl, &b->session);
+    }
+    xSemaphoreGive(session_sem);
+
+    while (r->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        full |= r->ssl.state == MBEDTLS_SSL_SERVER_CERTIFICATE;
+        int ret = mbedtls_ssl_handshake_step(&r->ssl);
+        if (ret) {
+            ESP_LOGE(TAG, "Handshake with broker %d failed, -0x%x%s", broker, -ret, offered ? ", session dropped" : "");
+            // a broker that chokes on the session would fail every retry
+            xSemaphoreTake(session_sem, portMAX_DELAY);
+            if (offered && b->has_session) {
+                mbedtls_ssl_session_free(&b->session);
+                b->has_session = false;
+            }
+            xSemaphoreGive(session_sem);
+            count_handshake(false, offered, false, 0);
+            return false;
+        }
+    }
+    uint32_t ms      = (esp_timer_get_time() - start_us) / 1000;
+    bool     resumed = offered && !full;
+    count_handshake(true, offered, resumed, ms);
+    ESP_LOGI(TAG, "Broker %d: %s handshake in %d ms", broker, resumed ? "resumed" : "full", ms);
+
+    // Keep what was negotiated, with a fresh ticket if the broker sent one
+    xSemaphoreTake(session_sem, portMAX_DELAY);
+    if (b->has_session) {
+        mbedtls_ssl_session_free(&b->session);
+    }
+    mbedtls_ssl_session_init(&b->session);
+    b->has_session = !mbedtls_ssl_get_session(&r->ssl, &b->session);
+    xSemaphoreGive(session_sem);
+    return true;
+}
+
+static bool tls_write_all(mbedtls_ssl_context* ssl, const uint8_t* data, int len) {
+    while (len > 0) {
+        int n = mbedtls_ssl_write(ssl, data, len);
+        if (n == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool local_write_all(int fd, const uint8_t* data, int len) {
+    while (len > 0) {
+        int n = send(fd, data, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Copies both ways until either side closes
+static void relay_pipe(tls_relay_t* r, int local_fd) {
+    int tls_fd = r->net.fd;
+    for (;;) {
+        // decrypted bytes mbedTLS already holds don't show on the socket
+        if (!mbedtls_ssl_get_bytes_avail(&r->ssl)) {
+            fd_set set;
+            FD_ZERO(&set);
+            FD_SET(local_fd, &set);
+            FD_SET(tls_fd, &set);
+            if (select(MAX(local_fd, tls_fd) + 1, &set, NULL, NULL, NULL) < 0) {
+                return;
+            }
+            if (FD_ISSET(local_fd, &set)) {
+                int n = recv(local_fd, r->buf, sizeof(r->buf), 0);
+                if (n <= 0 || !tls_write_all(&r->ssl, r->buf, n)) {
+                    return;
+                }
+            }
+            if (!FD_ISSET(tls_fd, &set)) {
+                continue;
+            }
+        }
+        int n = mbedtls_ssl_read(&r->ssl, r->buf, sizeof(r->buf));
+        if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_TIMEOUT) {
+            continue;
+        }
+        if (n <= 0 || !local_write_all(local_fd, r->buf, n)) {
+            return;
+        }
+    }
+}
+
+static void relay_task(void* arg) {
+    tls_relay_t* r = arg;
+    for (;;) {
+        int broker;
+        int local_fd = relay_accept(&broker);
+        if (local_fd < 0) {
+            continue;
+        }
+        mbedtls_net_init(&r->net);
+        if (relay_handshake(r, broker)) {
+            relay_pipe(r, local_fd);
+            mbedtls_ssl_close_notify(&r->ssl);
+        }
+        mbedtls_net_free(&r->net);
+        close(local_fd);
+    }
+}
+
+static int listen_local(int port) {
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family         = AF_INET;
+    addr.sin_port           = htons(port);
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+
+    int fd  = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 1)) {
+        close(fd);
+        return -1;
+    }
+    // two relay tasks race for every connection, the loser must not block
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+
+void tls_init(const char (*uris)[BROKER_URI_LEN], int count, const char* cert_pem, const char* key_pem) {
+    session_sem = xSemaphoreCreateMutexStatic(&session_sem_buf);
+    ASSERT(session_sem);
+
+    // Like the ESP-MQTT config this replaces, no CA is configured and the
+    // broker certificate is not verified
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_x509_crt_init(&client_cert);
+    mbedtls_pk_init(&client_key);
+    ASSERT(!mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT));
+    ASSERT(!mbedtls_x509_crt_parse(&client_cert, (const unsigned char*)cert_pem, strlen(cert_pem) + 1));
+    ASSERT(!mbedtls_pk_parse_key(&client_key, (const unsigned char*)key_pem, strlen(key_pem) + 1, NULL, 0));
+    ASSERT(!mbedtls_ssl_conf_own_cert(&conf, &client_cert, &client_key));
+    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&conf, relay_random, NULL);
+    mbedtls_ssl_conf_read_timeout(&conf, TLS_READ_TIMEOUT_MS);
+    mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+    broker_count = MIN(count, BROKER_MAX);
+    for (int i = 0; i < broker_count; i++) {
+        tls_broker_t* b = &tls_brokers[i];
+        if (!tls_parse_uri(uris[i], b->host, sizeof(b->host), b->port, sizeof(b->port))) {
+            ESP_LOGE(TAG, "Broker %d: %s is not an mqtts:// URI", i, uris[i]);
+        }
+        mbedtls_ssl_session_init(&b->session);
+        b->listen_fd = listen_local(TLS_RELAY_PORT + i);
+        ASSERT(b->listen_fd >= 0);
+        snprintf(local_uris[i], TLS_LOCAL_URI_LEN, "mqtt://127.0.0.1:%d", TLS_RELAY_PORT + i);
+    }
+
+    // The in/out record buffers are allocated here, once per relay
+    for (int i = 0; i < TLS_RELAYS; i++) {
+        mbedtls_ssl_init(&relays[i].ssl);
+        ASSERT(!mbedtls_ssl_setup(&relays[i].ssl, &conf));
+        TaskHandle_t handle = xTaskCreateStaticPinnedToCore(relay_task, "tls_relay", TLS_RELAY_STACK_SIZE, &relays[i],
+                                                            TLS_RELAY_PRIORITY, relay_stacks[i], &relay_tcbs[i],
+                                                            TLS_RELAY_CORE);
+        ASSERT(handle);
+    }
+    mem_register_stack("tls_relay", sizeof(relay_stacks));
+    mem_register_static("tls_relays", sizeof(relays) + sizeof(tls_brokers));
+}
+
+const char* tls_local_uri(int broker) {
+    ASSERT(broker >= 0 && broker < broker_count);
+    return local_uris[broker];
+}
+
+void tls_get_stats(tls_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&stats_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
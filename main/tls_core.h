@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "broker_core.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// TLS towards the brokers, with session resumption. ESP-MQTT (IDF v4.2)
+// builds its own esp-tls transport, it neither takes a custom transport
+// nor exposes the mbedTLS session, so every reconnect paid a full
+// handshake. The MQTT clients now speak plain MQTT to 127.0.0.1, port
+// TLS_RELAY_PORT + broker index, and a relay task terminates TLS towards
+// that broker with the client identity. The relay keeps the last session
+// of every broker (session ID or ticket, whichever the broker issues) and
+// offers it on the next connect; a resumed handshake skips the certificate
+// exchange, the ECDHE and the signature. Sessions are kept in RAM, the
+// first connect after a reboot is a full handshake.
+// tools/tls_broker.py is a local TLS broker that logs which handshakes resumed
+#define TLS_RELAY_PORT          (18830)
+#define TLS_RELAYS              (2) // connections at once, uplink and standby
+#define TLS_RELAY_STACK_SIZE    (6144)
+#define TLS_RELAY_BUF_SIZE      (1024)
+#define TLS_RELAY_PRIORITY      (5) // MQTT_THREAD_PRIORITY
+#define TLS_RELAY_CORE          (1) // MQTT_PIPELINE_CORE
+#define TLS_READ_TIMEOUT_MS     (10000)
+#define TLS_DEFAULT_PORT        "8883"
+#define TLS_LOCAL_URI_LEN       (32)
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint32_t full;            // full handshakes
+    uint32_t resumed;         // abbreviated, the broker took the cached session
+    uint32_t rejected;        // full ones although a session was offered
+    uint32_t failed;          // connect or handshake errors
+    uint32_t last_full_ms;    // TCP connect + handshake
+    uint32_t last_resumed_ms;
+} tls_stats_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+// Starts relaying to uris[0 .. count), all of them mqtts://host[:port].
+// The same client certificate is presented to every broker
+void tls_init(const char (*uris)[BROKER_URI_LEN], int count, const char* cert_pem, const char* key_pem);
+
+// The plain mqtt:// URI on the loopback that reaches broker
+const char* tls_local_uri(int broker);
+
+// Splits "mqtts://host[:port]", false for any other scheme. host and port
+// may be NULL to only check the URI
+bool tls_parse_uri(const char* uri, char* host, int host_len, char* port, int port_len);
+
+void tls_get_stats(tls_stats_t* stats);
@@ -7,6 +7,7 @@
 #include "flash_core.h"
 #include "uwb_core.h"
 #include "global_defines.h"
+#include "packet_codec.h"
 
 
 /**********************************************************
@@ -53,7 +54,8 @@ cJSON* get_json_from_trace_packet(uint8_t* trace_packet) {
         ASSERT(0);
     }
 
-    flash_packet_t* test = (flash_packet_t*)trace_packet;
+    flash_packet_t  packet;
+    flash_packet_t* test = &packet;
     char            adv_data_str[BLE_MANUFACTURERS_DATA_LEN * 4];
     cJSON*          root = cJSON_CreateArray();
     if (!root) {
@@ -62,6 +64,8 @@ cJSON* get_json_from_trace_packet(uint8_t* trace_packet) {
     }
 
     for (int i = 0; i < FLASH_PACKETS_PER_CHUNK; i++) {
+        // the chunk comes straight from a BLE buffer, it may not be aligned
+        flash_packet_decode(trace_packet + i * FLASH_SIZE_PACKET, FLASH_SIZE_PACKET, &packet);
         if (i > 0 && test->type != PAGE_NORMAL_ENTRY_MAGIC) {
             ESP_LOGI(TAG, "Had a partial packet, stopping!");
             break;
@@ -86,27 +90,27 @@ cJSON* get_json_from_trace_packet(uint8_t* trace_packet) {
             ESP_LOGI(TAG, "Adding sub node RSSI = %d Counts =%d", test->RSSI, test->counts);
             cJSON_AddItemToObject(root, "root", node);
         }
-        test++;
     }
     return root;
 }
 
 
-// Parses a simple UWB packet
-cJSON* get_json_uwb_packet(uint8_t* uwb_packet) {
-    if (!uwb_packet) {
+// Serializes a simple UWB packet straight into the caller's buffer,
+// no heap is used (this runs once per reading). The field mapping
+// is UWB_PACKET_SCHEMA
+// returns the string length, or -1 if it did not fit
+int get_json_str_uwb_packet(uint8_t* uwb_packet, char* buf, size_t buf_len) {
+    if (!uwb_packet || !buf) {
         ESP_LOGE(TAG, "UWB packet was null!");
         ASSERT(0);
     }
 
-    uwb_packet_t* test = (uwb_packet_t*)uwb_packet;
-    cJSON*               root = cJSON_CreateObject();
-    if (!root) {
-        ESP_LOGE(TAG, "node was null!");
-        ASSERT(0);
+    uwb_packet_t packet;
+    uwb_packet_decode(uwb_packet, UWB_PACKET_SIZE, &packet);
+    int len = uwb_packet_to_json(&packet, buf, buf_len);
+    if (len < 0) {
+        ESP_LOGE(TAG, "JSON buffer too small!");
+        return -1;
     }
-
-    cJSON_AddNumberToObject(root, "Distance", test->distance_uwb);
-    cJSON_AddNumberToObject(root, "Time",     test->time);
-    return root;
+    return len;
 }
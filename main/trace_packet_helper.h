@@ -1,4 +1,7 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
+
 #include "cJSON.h"
 
 /**********************************************************
@@ -10,4 +13,4 @@
 **********************************************************/
 
 cJSON* get_json_from_trace_packet(uint8_t* trace_packet);
-cJSON* get_json_uwb_packet(uint8_t* uwb_packet);
+int    get_json_str_uwb_packet(uint8_t* uwb_packet, char* buf, size_t buf_len);
@@ -0,0 +1,286 @@
+#include "esp32/rom/crc.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "cJSON.h"
+#include "global_defines.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "trace_packet_helper.h"
+#include "upload_core.h"
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+// The page one device is uploading. A chunk of another page starts over
+typedef struct {
+    uint8_t  bda[6];
+    bool     used;
+    int64_t  last_us; // last chunk, the oldest session is taken over
+    uint32_t page;
+    uint8_t  count;
+    uint16_t received;
+    uint16_t in_flight; // queued or waiting for the ack
+    uint8_t  crc_errors;
+} upload_session_t;
+
+// A validated chunk on its way to the upload task, the frame is copied
+// out of the Bluedroid buffer
+typedef struct {
+    uint8_t            bda[6];
+    upload_chunk_hdr_t hdr;
+    uint8_t            records[UPLOAD_SIZE_CHUNK];
+    upload_done_t      done;
+    void*              done_arg;
+} upload_job_t;
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "UPLOAD_CORE";
+
+// Under upload_mux
+static upload_session_t sessions[UPLOAD_MAX_SESSIONS];
+static upload_stats_t   stats;
+static portMUX_TYPE     upload_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static const uint8_t no_tag[6];
+
+static QueueHandle_t uploadQ;
+static StaticQueue_t uploadQ_buf;
+static uint8_t       uploadQ_storage[UPLOAD_QUEUE_DEPTH * sizeof(upload_job_t)];
+static StackType_t   upload_stack[UPLOAD_STACK_SIZE];
+static StaticTask_t  upload_tcb;
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static uint16_t expected_bits(uint8_t count) {
+    return (uint16_t)((1u << count) - 1);
+}
+
+// Called with upload_mux held
+static upload_session_t* find_session(const uint8_t* bda, bool create) {
+    upload_session_t* victim = &sessions[0];
+    for (int i = 0; i < UPLOAD_MAX_SESSIONS; i++) {
+        if (sessions[i].used && !memcmp(sessions[i].bda, bda, sizeof(sessions[i].bda))) {
+            return &sessions[i];
+        }
+        if (victim->used && (!sessions[i].used || sessions[i].last_us < victim->last_us)) {
+            victim = &sessions[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    memset(victim, 0, sizeof(*victim));
+    memcpy(victim->bda, bda, sizeof(victim->bda));
+    victim->used = true;
+    return victim;
+}
+
+bool upload_is_chunk(const uint8_t* value, uint16_t len) {
+    uint16_t magic;
+    if (len != UPLOAD_FRAME_SIZE) {
+        return false;
+    }
+    memcpy(&magic, value, sizeof(magic));
+    return magic == UPLOAD_CHUNK_MAGIC;
+}
+
+// Validated records go up as one JSON array, the same shape
+// get_json_from_trace_packet always produced. true once acked
+static bool publish_chunk(const uint8_t* records) {
+    mqtt_link_stats_t link;
+    mqtt_get_link_stats(&link);
+    if (link.state == MQTT_LINK_DOWN) {
+        return false;
+    }
+
+    // the helper decodes with memcpy, but takes a non const pointer
+    cJSON* root = get_json_from_trace_packet((uint8_t*)records);
+    char*  str  = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (!str) {
+        ESP_LOGE(TAG, "No memory for the chunk JSON");
+        return false;
+    }
+    int status = mqtt_publish_acked(UPLOAD_TOPIC, str, strlen(str));
+    free(str);
+    return status == MQTT_SUCCESS;
+}
+
+int upload_chunk(const uint8_t* bda, const uint8_t* value, uint16_t len, upload_done_t done, void* done_arg) {
+    upload_job_t job;
+    if (!upload_is_chunk(value, len)) {
+        return MQTT_ERROR;
+    }
+    memcpy(job.bda, bda ? bda : no_tag, sizeof(job.bda));
+    memcpy(&job.hdr, value, sizeof(job.hdr));
+    memcpy(job.records, value + sizeof(job.hdr), sizeof(job.records));
+    job.done     = done;
+    job.done_arg = done_arg;
+
+    uint32_t crc = crc32_le(0, value, offsetof(upload_chunk_hdr_t, crc));
+    crc          = crc32_le(crc, job.records, UPLOAD_SIZE_CHUNK);
+    bool valid   = crc == job.hdr.crc && job.hdr.count && job.hdr.count <= UPLOAD_CHUNKS_IN_PAGE
+                 && job.hdr.chunk < job.hdr.count;
+
+    // only a chunk that passed the check may move the session to its page,
+    // a corrupted page or count would throw away what was received
+    uint16_t bit = 1u << job.hdr.chunk;
+    int      status;
+    portENTER_CRITICAL(&upload_mux);
+    upload_session_t* session = find_session(job.bda, true);
+    session->last_us          = esp_timer_get_time();
+    if (!valid) {
+        stats.crc_errors++;
+        session->crc_errors = MIN(session->crc_errors + 1, UINT8_MAX);
+        status              = MQTT_ERROR;
+    } else {
+        if (session->page != job.hdr.page || session->count != job.hdr.count) {
+            session->page       = job.hdr.page;
+            session->count      = job.hdr.count;
+            session->received   = 0;
+            session->in_flight  = 0;
+            session->crc_errors = 0;
+        }
+        if (session->received & bit) {
+            stats.duplicates++;
+            status = MQTT_SUCCESS;
+        } else if (session->in_flight & bit) {
+            status = MQTT_ERROR; // resent before the first copy was acked
+        } else {
+            session->in_flight |= bit;
+            status = MQTT_PENDING;
+        }
+    }
+    portEXIT_CRITICAL(&upload_mux);
+
+    if (!valid) {
+        ESP_LOGE(TAG, "Chunk %d/%d of page %d rejected, crc %08x, expected %08x",
+                 job.hdr.chunk, job.hdr.count, job.hdr.page, job.hdr.crc, crc);
+        return MQTT_ERROR;
+    }
+    if (status != MQTT_PENDING) {
+        // MQTT_SUCCESS: the ACK got lost, the records are already up
+        return status;
+    }
+    if (xQueueSend(uploadQ, &job, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Upload queue full!");
+        portENTER_CRITICAL(&upload_mux);
+        stats.failed++;
+        session = find_session(job.bda, false);
+        if (session && session->page == job.hdr.page && session->count == job.hdr.count) {
+            session->in_flight &= ~bit;
+        }
+        portEXIT_CRITICAL(&upload_mux);
+        return MQTT_ERROR;
+    }
+    return MQTT_PENDING;
+}
+
+// Publishes queued chunks one at a time, a chunk is received once acked
+static void upload_task(void* arg) {
+    static upload_job_t job;
+    while (true) {
+        xQueueReceive(uploadQ, &job, portMAX_DELAY);
+        bool     published = publish_chunk(job.records);
+        uint16_t bit       = 1u << job.hdr.chunk;
+
+        portENTER_CRITICAL(&upload_mux);
+        bool complete = false;
+        if (published) {
+            stats.chunks++;
+        } else {
+            stats.failed++;
+        }
+        // the session may have moved on to another page meanwhile
+        upload_session_t* session = find_session(job.bda, false);
+        if (session && session->page == job.hdr.page && session->count == job.hdr.count) {
+            session->in_flight &= ~bit;
+            if (published) {
+                session->received |= bit;
+                complete = session->received == expected_bits(session->count);
+                stats.pages += complete;
+            }
+        }
+        portEXIT_CRITICAL(&upload_mux);
+
+        if (complete) {
+            ESP_LOGI(TAG, "Page %d complete, %d chunks", job.hdr.page, job.hdr.count);
+        }
+        if (job.done) {
+            job.done(job.done_arg, published ? MQTT_SUCCESS : MQTT_ERROR);
+        }
+    }
+}
+
+uint16_t upload_read_status(const uint8_t* bda, uint8_t* buf, uint16_t buf_len) {
+    upload_status_t status = { 0 };
+    if (buf_len < sizeof(status)) {
+        return 0;
+    }
+
+    portENTER_CRITICAL(&upload_mux);
+    upload_session_t* session = find_session(bda ? bda : no_tag, false);
+    if (session) {
+        status.page       = session->page;
+        status.count      = session->count;
+        status.received   = session->received;
+        status.missing    = expected_bits(session->count) & ~session->received;
+        status.crc_errors = session->crc_errors;
+    }
+    portEXIT_CRITICAL(&upload_mux);
+
+    memcpy(buf, &status, sizeof(status));
+    return sizeof(status);
+}
+
+void upload_get_stats(upload_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&upload_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&upload_mux);
+}
+
+// "upload_stats", on UPLOAD_STATS_TOPIC
+static void upload_stats_cmd(const char* args, int args_len) {
+    char           out[128];
+    upload_stats_t s;
+    upload_get_stats(&s);
+    int len = snprintf(out, sizeof(out), "chunks=%d crc_errors=%d duplicates=%d failed=%d pages=%d",
+                       s.chunks, s.crc_errors, s.duplicates, s.failed, s.pages);
+    mqtt_publish_raw(UPLOAD_STATS_TOPIC, out, MIN(len, sizeof(out) - 1));
+}
+
+void upload_init(void) {
+    uploadQ = xQueueCreateStatic(UPLOAD_QUEUE_DEPTH, sizeof(upload_job_t), uploadQ_storage, &uploadQ_buf);
+    ASSERT(uploadQ);
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        upload_task,         // Function that implements the task.
+        "upload",            // Text name for the task.
+        UPLOAD_STACK_SIZE,   // Stack size in bytes on the ESP32.
+        NULL,                // Parameter passed into the task.
+        UPLOAD_PRIORITY,     // Priority at which the task is created.
+        upload_stack,        // Stack buffer.
+        &upload_tcb,         // Task control block.
+        MQTT_PIPELINE_CORE); // Core the task is pinned to.
+    ASSERT(handle);
+
+    mem_register_stack("upload", sizeof(upload_stack));
+    mem_register_static("upload_sessions", sizeof(sessions) + sizeof(uploadQ_storage));
+    mqtt_register_command("upload_stats", upload_stats_cmd);
+}
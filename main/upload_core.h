@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "flash_core.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Page uploads from edge devices. A device sends one page of its record
+// log as UPLOAD_CHUNKS_IN_PAGE chunks of FLASH_PACKETS_PER_CHUNK records,
+// each as its own (long) write to the dump characteristic:
+//
+//   [upload_chunk_hdr_t][UPLOAD_SIZE_CHUNK record bytes]
+//
+// crc is CRC32 (crc32_le, seed 0) over the header up to crc followed by
+// the records. A chunk that fails the check is NACKed and changes nothing,
+// not even the page of the session. A valid chunk is published by the
+// upload task and answered once the broker acked it, it only counts as
+// received then. One that isn't acked is NACKed and stays missing, a
+// resend while it is still being published is NACKed too, one that was
+// already taken is ACKed again without a second publish. Reading the
+// upload characteristic returns an upload_status_t for the reader's
+// current page, the device resends just the chunks in missing and moves
+// on once missing is 0
+#define UPLOAD_CHUNK_MAGIC  (0xC4C5)
+#define UPLOAD_FRAME_SIZE   (sizeof(upload_chunk_hdr_t) + UPLOAD_SIZE_CHUNK)
+#define UPLOAD_MAX_SESSIONS (4)    // devices uploading at the same time
+#define UPLOAD_QUEUE_DEPTH  (4)    // chunks waiting for the upload task
+#define UPLOAD_STACK_SIZE   (4096) // cJSON
+#define UPLOAD_PRIORITY     (4)    // below the publish pipeline
+#define UPLOAD_TOPIC        "/topic/cat_location/trace"
+#define UPLOAD_STATS_TOPIC  "/topic/gateway/upload"
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint16_t magic; // UPLOAD_CHUNK_MAGIC
+    uint32_t page;  // page header id on the device
+    uint8_t  chunk; // 0 .. count - 1
+    uint8_t  count; // chunks in this page, a partly filled last page sends fewer
+    uint32_t crc;
+} __attribute__((packed)) upload_chunk_hdr_t;
+_Static_assert(UPLOAD_CHUNKS_IN_PAGE <= 16, "chunk bitmaps are 16 bits");
+
+// Bit n stands for chunk n of page
+typedef struct {
+    uint32_t page;
+    uint16_t received;
+    uint16_t missing; // of the count chunks, the ones not received yet
+    uint8_t  count;
+    uint8_t  crc_errors; // on this page, saturates at 255
+} __attribute__((packed)) upload_status_t;
+
+// Outcome of a chunk upload_chunk returned MQTT_PENDING for, called from
+// the upload task with MQTT_SUCCESS once the chunk is acked
+typedef void (*upload_done_t)(void* arg, int status);
+
+typedef struct {
+    uint32_t chunks;     // published and acked
+    uint32_t crc_errors;
+    uint32_t duplicates; // resends of chunks already taken
+    uint32_t failed;     // valid chunks that were not acked, or found the queue full
+    uint32_t pages;      // pages with every chunk received
+} upload_stats_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+void upload_init(void);
+
+// True if the write is a chunk frame rather than a reading
+bool upload_is_chunk(const uint8_t* value, uint16_t len);
+
+// Takes one chunk frame written by bda (NULL if unknown). Returns
+// MQTT_PENDING if it was queued for publishing, done then gets the
+// outcome. Otherwise the final status: MQTT_SUCCESS for a chunk already
+// taken, MQTT_ERROR for a bad one. Copies the frame, never blocks
+int upload_chunk(const uint8_t* bda, const uint8_t* value, uint16_t len, upload_done_t done, void* done_arg);
+
+// GATT read of the upload characteristic, fills an upload_status_t for
+// bda's page. Returns the bytes written
+uint16_t upload_read_status(const uint8_t* bda, uint8_t* buf, uint16_t buf_len);
+
+void upload_get_stats(upload_stats_t* stats);
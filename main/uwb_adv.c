@@ -0,0 +1,51 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "uwb_adv.h"
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+#define AD_TYPE_MANUFACTURER_SPECIFIC (0xFF)
+
+const uint8_t* uwb_adv_parse(const uint8_t* adv, uint8_t adv_len, uint8_t* seq) {
+    int pos = 0;
+    // AD structures: [len][type][len - 1 bytes of data], len 0 ends the data
+    while (pos < adv_len) {
+        uint8_t len = adv[pos];
+        if (len == 0 || pos + 1 + len > adv_len) {
+            break;
+        }
+        const uint8_t* data     = &adv[pos + 2];
+        uint8_t        data_len = len - 1;
+        if (adv[pos + 1] == AD_TYPE_MANUFACTURER_SPECIFIC && data_len >= sizeof(uwb_adv_payload_t)
+            && data[0] == UWB_ADV_MAGIC_0 && data[1] == UWB_ADV_MAGIC_1 && data[2] == UWB_ADV_TYPE_READING) {
+            *seq = data[offsetof(uwb_adv_payload_t, seq)];
+            return data + offsetof(uwb_adv_payload_t, packet);
+        }
+        pos += 1 + len;
+    }
+    return NULL;
+}
+
+bool uwb_dedup_check(uwb_dedup_t* dedup, const uint8_t* bda, uint8_t seq, uint32_t now_ms) {
+    uwb_dedup_slot_t* victim = &dedup->slots[0];
+    for (int i = 0; i < UWB_ADV_DEDUP_SLOTS; i++) {
+        uwb_dedup_slot_t* slot = &dedup->slots[i];
+        if (slot->used && !memcmp(slot->bda, bda, sizeof(slot->bda))) {
+            bool repeat = slot->seq == seq && now_ms - slot->last_ms < UWB_ADV_DEDUP_MS;
+            slot->seq     = seq;
+            slot->last_ms = now_ms;
+            return repeat;
+        }
+        if (victim->used && (!slot->used || now_ms - slot->last_ms > now_ms - victim->last_ms)) {
+            victim = slot;
+        }
+    }
+    memcpy(victim->bda, bda, sizeof(victim->bda));
+    victim->seq     = seq;
+    victim->last_ms = now_ms;
+    victim->used    = true;
+    return false;
+}
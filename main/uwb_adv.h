@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uwb_core.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Transport independent half of the connectionless ingest: finding a
+// reading in raw advertising data and dropping a tag's repeats of it.
+// No IDF calls, tools/uwb_adv_test.c checks both on the host
+#define UWB_ADV_DEDUP_SLOTS (32)   // tags remembered for deduplication
+#define UWB_ADV_DEDUP_MS    (5000) // same tag + seq inside this window is a repeat
+
+/*********************************************************
+*                                               TYPEDEFS *
+**********************************************************/
+typedef struct {
+    uint8_t  bda[6];
+    uint8_t  seq;
+    bool     used;
+    uint32_t last_ms; // last time this tag + seq was seen
+} uwb_dedup_slot_t;
+
+typedef struct {
+    uwb_dedup_slot_t slots[UWB_ADV_DEDUP_SLOTS];
+} uwb_dedup_t;
+
+/**********************************************************
+*                                        GLOBAL FUNCTIONS *
+**********************************************************/
+// Finds a reading in raw advertising data (AD structures). Returns its
+// UWB_PACKET_SIZE packet bytes inside adv and sets seq, NULL if none
+const uint8_t* uwb_adv_parse(const uint8_t* adv, uint8_t adv_len, uint8_t* seq);
+
+// true if this tag + seq was already seen inside UWB_ADV_DEDUP_MS,
+// otherwise remembers it, replacing the least recently seen tag.
+// now_ms may wrap
+bool uwb_dedup_check(uwb_dedup_t* dedup, const uint8_t* bda, uint8_t seq, uint32_t now_ms);
@@ -0,0 +1,161 @@
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "capture_core.h"
+#include "config_core.h"
+#include "enc_core.h"
+#include "global_defines.h"
+#include "mem_core.h"
+#include "mqtt_core.h"
+#include "msg_buf.h"
+#include "packet_codec.h"
+#include "uwb_adv.h"
+#include "uwb_core.h"
+
+// Connectionless ingest. Tags that only need to hand over a reading don't
+// connect and write, they advertise it. Scan results arrive in the BTC task,
+// which must not block on a PUBACK, so it parses, deduplicates, fills a
+// message buffer and submits it; the outcome comes back to adv_msg_done
+
+/*********************************************************
+*                                                STATICS *
+*********************************************************/
+static const char* TAG = "UWB_CORE";
+
+// only touched from the BTC task
+static uwb_dedup_t dedup;
+
+static uwb_adv_stats_t stats;
+static portMUX_TYPE    stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#define STAT_INC(field)                 \
+    do {                                \
+        portENTER_CRITICAL(&stats_mux); \
+        stats.field++;                  \
+        portEXIT_CRITICAL(&stats_mux);  \
+    } while (0)
+
+/**********************************************************
+*                                          IMPLEMENTATION *
+**********************************************************/
+
+static void adv_count(int status) {
+    if (status == MQTT_SUCCESS) {
+        STAT_INC(published);
+    } else {
+        STAT_INC(failed);
+    }
+}
+
+// msg_buf_t on_done, in the publisher task
+static void adv_msg_done(msg_buf_t* msg) {
+    adv_count(msg->status);
+}
+
+bool uwb_adv_ingest_report(const uint8_t* bda, const uint8_t* adv, uint8_t adv_len, int rssi, uint32_t now_ms) {
+    uint8_t seq;
+
+    STAT_INC(reports);
+    const uint8_t* packet = uwb_adv_parse(adv, adv_len, &seq);
+    if (!packet) {
+        // not a tag reading, just something advertising nearby
+        enc_ingest(adv, adv_len, rssi);
+        return false;
+    }
+    STAT_INC(readings);
+    if (capture_replaying()) {
+        // a replay owns the pipeline, nothing live goes in meanwhile
+        STAT_INC(dropped);
+        return false;
+    }
+    if (uwb_dedup_check(&dedup, bda, seq, now_ms)) {
+        STAT_INC(duplicates);
+        return false;
+    }
+
+    // the report buffer is gone once this returns, the reading's only copy
+    // is into the message buffer the publisher then takes by reference
+    msg_buf_t* msg = msg_buf_alloc();
+    if (!msg) {
+        STAT_INC(dropped);
+        return false;
+    }
+    uwb_packet_decode(packet, UWB_PACKET_SIZE, (uwb_packet_t*)msg->data);
+    msg->len     = UWB_PACKET_SIZE;
+    msg->rssi    = rssi;
+    msg->on_done = adv_msg_done;
+    memcpy(msg->tag, bda, sizeof(msg->tag));
+    msg_buf_count_copy(msg->len);
+    ESP_LOGD(TAG, "Tag %02x:%02x:%02x:%02x:%02x:%02x seq %d rssi %d",
+             bda[0], bda[1], bda[2], bda[3], bda[4], bda[5], seq, rssi);
+
+    int status = mqtt_submit_msg(msg);
+    if (status != MQTT_PENDING) {
+        // spooled, rolled up or refused, on_done won't run
+        adv_count(status);
+    }
+    msg_buf_unref(msg);
+    return true;
+}
+
+void uwb_adv_get_stats(uwb_adv_stats_t* out) {
+    ASSERT(out);
+    portENTER_CRITICAL(&stats_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+void uwb_scan_gap_event(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+    switch (event) {
+    case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT:
+        if (param->scan_param_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+            ESP_LOGE(TAG, "Scan params failed, status %d", param->scan_param_cmpl.status);
+            break;
+        }
+        // 0: scan until stopped
+        esp_ble_gap_start_scanning(0);
+        break;
+    case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
+        if (param->scan_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+            ESP_LOGE(TAG, "Scan start failed, status %d", param->scan_start_cmpl.status);
+        } else {
+            ESP_LOGI(TAG, "Scanning for tag advertisements");
+        }
+        break;
+    case ESP_GAP_BLE_SCAN_RESULT_EVT:
+        if (param->scan_rst.search_evt == ESP_GAP_SEARCH_INQ_RES_EVT) {
+            uwb_adv_ingest_report(param->scan_rst.bda, param->scan_rst.ble_adv,
+                                  param->scan_rst.adv_data_len + param->scan_rst.scan_rsp_len,
+                                  param->scan_rst.rssi, (uint32_t)(esp_timer_get_time() / 1000));
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+int uwb_scan_adv() {
+    mem_register_static("uwb_adv_dedup", sizeof(dedup));
+
+    // Passive: the reading is in the advertisement itself, no scan request needed.
+    // Duplicate filtering stays off, the controller would hide a tag's next reading
+    esp_ble_scan_params_t scan_params = {
+        .scan_type          = BLE_SCAN_TYPE_PASSIVE,
+        .own_addr_type      = BLE_ADDR_TYPE_PUBLIC,
+        .scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL,
+        .scan_interval      = config_get(CFG_SCAN_INTERVAL),
+        .scan_window        = MIN(config_get(CFG_SCAN_WINDOW), config_get(CFG_SCAN_INTERVAL)),
+        .scan_duplicate     = BLE_SCAN_DUPLICATE_DISABLE,
+    };
+    esp_err_t ret = esp_ble_gap_set_scan_params(&scan_params);
+    if (ret) {
+        ESP_LOGE(TAG, "set scan params failed, error code = %x", ret);
+        return MQTT_ERROR;
+    }
+    return MQTT_SUCCESS;
+}
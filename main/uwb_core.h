@@ -1,11 +1,22 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
+#ifdef ESP_PLATFORM
+#include "esp_gap_ble_api.h"
+#endif
+
 /**********************************************************
 *                                                 DEFINES *
 **********************************************************/
 #define UWB_PACKET_SIZE (8)
 
+// Connectionless ingest: tags put readings in the manufacturer data of
+// their advertisements, [0xAB 0xCD 'U'][seq][uwb_packet_t], and repeat
+// each one a few times. The gateway scans for them (observer role)
+#define UWB_ADV_MAGIC_0      (0xAB)
+#define UWB_ADV_MAGIC_1      (0xCD)
+#define UWB_ADV_TYPE_READING ('U')
 
 /**********************************************************
 *                                                   TYPES *
@@ -17,7 +28,44 @@ typedef struct {
 }__attribute__((packed)) uwb_packet_t;
 _Static_assert(sizeof(uwb_packet_t) == UWB_PACKET_SIZE, "UWB packet is not 8 bytes long!");
 
+// A reading as it goes up to the broker: the tag's packet and what the
+// gateway saw of it (see UWB_READING_SCHEMA)
+typedef struct {
+    uwb_packet_t packet;
+    uint8_t      tag[6]; // BLE address of the sender, all zero if unknown
+    int8_t       rssi;   // 0 if unknown
+    uint32_t     rx_utc; // gateway wall clock on receipt, 0 if SNTP never synced
+} __attribute__((packed)) uwb_reading_t;
+
+typedef struct {
+    uint8_t      magic[2];
+    uint8_t      type;
+    uint8_t      seq; // bumped by the tag for every new reading
+    uwb_packet_t packet;
+} __attribute__((packed)) uwb_adv_payload_t;
+
+typedef struct {
+    uint32_t reports;    // advertising reports seen
+    uint32_t readings;   // reports carrying a reading
+    uint32_t duplicates; // repeats dropped
+    uint32_t dropped;    // no message buffer, or a capture replay running
+    uint32_t published;
+    uint32_t failed;
+} uwb_adv_stats_t;
+
 /**********************************************************
 *                                                 GLOBALS *
 **********************************************************/
+// Starts observer mode scanning, call once the BLE stack is up
 int uwb_scan_adv();
+#ifdef ESP_PLATFORM // the packet types are shared with host tools
+// Scan events, forwarded by the BLE core's GAP handler
+void uwb_scan_gap_event(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
+#endif
+
+// Parses (uwb_adv.h), deduplicates and submits one advertising report,
+// called from the BTC task. Doesn't touch the radio, so synthetic reports
+// can be pushed through it. Returns true if a new reading was submitted
+bool uwb_adv_ingest_report(const uint8_t* bda, const uint8_t* adv, uint8_t adv_len, int rssi, uint32_t now_ms);
+
+void uwb_adv_get_stats(uwb_adv_stats_t* stats);
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Factory provisioning of the per-device GATT config secret (main/config_core.h)
+# and signing of config writes with it.
+#
+#   tools/config_secret.py provision <device> [--out DIR]
+#
+# makes a random secret and writes <device>.csv for the IDF NVS partition
+# generator, plus <device>.secret with the secret in hex for the device
+# registry. On the production line:
+#
+#   python $IDF_PATH/components/nvs_flash/nvs_partition_generator/nvs_partition_gen.py \
+#       generate <device>.csv <device>.bin 0x4000
+#   esptool.py write_flash 0x9000 <device>.bin
+#
+# (the nvs partition in partitions.csv). The secret never goes over MQTT
+# or BLE; the .csv, .bin and .secret files all hold it, keep them out of
+# the repo.
+#
+#   tools/config_secret.py sign <secret hex> <counter> key=value
+#
+# prints the value of an authenticated config write in hex:
+# [u32 counter, little endian][key=value][first 8 bytes of HMAC-SHA256].
+# The counter has to be above the last one the gateway accepted.
+
+import argparse
+import hashlib
+import hmac
+import os
+import secrets
+import struct
+import sys
+
+SECRET_LEN = 32  # CONFIG_AUTH_SECRET_LEN
+TAG_LEN = 8  # CONFIG_AUTH_TAG_LEN
+MAX_TEXT_LEN = 48  # CONFIG_MAX_TEXT_LEN
+NAMESPACE = "cfg"  # CONFIG_NVS_NAMESPACE
+
+
+# both files hold the secret: owner only, and never overwrite a provisioned device's
+def write_private(path, text):
+    fd = os.open(path, os.O_WRONLY | os.O_CREAT | os.O_EXCL, 0o600)
+    with os.fdopen(fd, "w") as f:
+        f.write(text)
+
+
+def provision(device, out):
+    secret = secrets.token_bytes(SECRET_LEN)
+    csv = os.path.join(out, device + ".csv")
+    path = os.path.join(out, device + ".secret")
+    write_private(csv, "key,type,encoding,value\n%s,namespace,,\nauth_secret,data,hex2bin,%s\nauth_counter,data,u32,0\n"
+                  % (NAMESPACE, secret.hex()))
+    write_private(path, secret.hex() + "\n")
+    print("%s: wrote %s and %s" % (device, csv, path))
+
+
+def sign(secret_hex, counter, text):
+    secret = bytes.fromhex(secret_hex)
+    if len(secret) != SECRET_LEN:
+        sys.exit("secret has to be %d bytes" % SECRET_LEN)
+    if "=" not in text or len(text) > MAX_TEXT_LEN:
+        sys.exit("expected key=value, up to %d characters" % MAX_TEXT_LEN)
+    signed = struct.pack("<I", counter) + text.encode()
+    print((signed + hmac.new(secret, signed, hashlib.sha256).digest()[:TAG_LEN]).hex())
+
+
+def main():
+    parser = argparse.ArgumentParser(description="GATT config secret provisioning and signing")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("provision", help="make a device secret and its NVS CSV")
+    p.add_argument("device")
+    p.add_argument("--out", default=".")
+    s = sub.add_parser("sign", help="sign a key=value config write")
+    s.add_argument("secret")
+    s.add_argument("counter", type=lambda v: int(v, 0))
+    s.add_argument("text")
+    args = parser.parse_args()
+
+    if args.cmd == "provision":
+        provision(args.device, args.out)
+    else:
+        sign(args.secret, args.counter, args.text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,101 @@
+// Encounter table benchmark: folding advertisements into main/enc_table.c
+// at different numbers of advertisers in range, and closing the window.
+//
+//   cc -O2 -Imain -o enc_bench tools/enc_bench.c main/enc_table.c && ./enc_bench
+//
+// Each advertiser sends AD structures like a phone does (flags, then
+// manufacturer data with random bytes), sightings are drawn uniformly
+// over the advertisers with a random RSSI. Every window is folded into a
+// cleared table, then closed into records like enc_core.c does. Past
+// ENC_MAX_FILL advertisers the extra ones are refused, the rest still fold
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "enc_table.h"
+
+#define ADV_LEN     (3 + 2 + BLE_MANUFACTURERS_DATA_LEN)
+#define SIGHTINGS   (20000) // per window
+#define WINDOWS     (200)
+#define MAX_SOURCES (1000)
+
+static uint8_t     advs[MAX_SOURCES][ADV_LEN];
+static enc_table_t table;
+
+static uint32_t rng = 2463534242u;
+static uint32_t next(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int sources) {
+    flash_packet_t record;
+    uint32_t       folded  = 0;
+    uint32_t       refused = 0;
+    uint32_t       records = 0;
+    uint32_t       sum     = 0;
+    double         fold_s  = 0;
+    double         close_s = 0;
+
+    for (int w = 0; w < WINDOWS; w++) {
+        enc_table_clear(&table);
+        double start = now_s();
+        for (int i = 0; i < SIGHTINGS; i++) {
+            uint32_t r = next();
+            uint8_t  key[BLE_MANUFACTURERS_DATA_LEN];
+            if (enc_key_from_adv(advs[r % sources], ADV_LEN, key)) {
+                enc_table_add(&table, key, -40 - (int8_t)((r >> 16) % 60));
+            }
+        }
+        double mid = now_s();
+        for (int i = 0; i < ENC_SLOTS; i++) {
+            if (table.slots[i].count) {
+                enc_entry_record(&table.slots[i], 1700000000 + w, &record);
+                sum += record.RSSI + record.counts;
+                records++;
+            }
+        }
+        close_s += now_s() - mid;
+        fold_s += mid - start;
+        folded += table.folded;
+        refused += table.refused;
+    }
+
+    printf("%8d %12.0f %10.1f %10.1f %10.2f %10u\n", sources, (double)WINDOWS * SIGHTINGS / fold_s,
+           (double)records / WINDOWS, 100.0 * refused / (folded + refused), close_s / WINDOWS * 1e6, sum);
+}
+
+int main(void) {
+    for (int s = 0; s < MAX_SOURCES; s++) {
+        uint8_t* adv = advs[s];
+        adv[0]       = 2;
+        adv[1]       = 0x01; // flags
+        adv[2]       = 0x06;
+        adv[3]       = 1 + BLE_MANUFACTURERS_DATA_LEN;
+        adv[4]       = 0xFF;
+        for (int i = 0; i < BLE_MANUFACTURERS_DATA_LEN; i++) {
+            adv[5 + i] = next();
+        }
+    }
+
+    printf("table %zu bytes, %d slots, new keys refused past %d\n", sizeof(table), ENC_SLOTS, ENC_MAX_FILL);
+    printf("%8s %12s %10s %10s %10s %10s\n", "sources", "folds/s", "records", "refused%", "close us", "check");
+    int sources[] = { 10, 50, 150, 192, 300, 1000 };
+    for (unsigned i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        run(sources[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,378 @@
+// Broker failover simulation: the policy in main/broker_core.c driving the
+// MQTT pipeline of main/mqtt_core.c against two in-process broker stand-ins,
+// with broker 0 killed mid-stream.
+//
+//   cc -O2 -Imain -o failover_sim tools/failover_sim.c main/broker_core.c main/rtt_est.c -lm && ./failover_sim
+//
+// One reading every 100 ms, up to SLOTS publishes in flight. A publish
+// reaches the broker after half its latency and is acked after all of it.
+// Broker 0 dies at KILL_MS, either
+//   rst:       connections are reset and connects refused right away
+//   blackhole: nothing is answered, the connection only drops on the
+//              keepalive and connects time out
+// and the gateway runs with or without a warm standby connection to broker 1.
+//
+// The manager's loop is followed: ack timeouts from the RTT estimator, up to
+// RETRIES resends, then the reading goes to the spool and is drained once the
+// link is up. broker_pick runs every MQTT_BROKER_CHECK_MS. On a failover the
+// publishes in flight are moved (MQTT_MOVED) and sent again on the new broker.
+// A reading that reached a broker whose ack never came back is a duplicate
+// when it is sent again; a reading that never reached any broker is lost.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "broker_core.h"
+#include "rtt_est.h"
+
+#define RUN_MS             (240000)
+#define READINGS_UNTIL_MS  (180000) // then the spool gets time to drain
+#define KILL_MS            (30000)
+#define PERIOD_MS          (100)
+#define SLOTS              (4)
+#define RETRIES            (2)
+#define RTO_INITIAL_MS     (1000)
+#define RTO_MIN_MS         (200)
+#define RTO_MAX_MS         (10000)
+#define CHECK_MS           (100)
+#define FAILOVER_MS        (5000)
+#define HANDSHAKE_MS       (400)
+#define RST_MS             (5)
+#define CONNECT_TIMEOUT_MS (10000) // network_timeout_ms of ESP-MQTT
+#define KEEPALIVE_MS       (120000) // ESP-MQTT default, no keepalive set in mqtt_app_start
+#define RECONNECT_BASE_MS  (500)
+#define RECONNECT_MAX_MS   (30000)
+#define LATENCY_MS         (40)
+#define JITTER_MS          (10)
+
+#define READINGS (READINGS_UNTIL_MS / PERIOD_MS)
+#define CONNS    (4096)
+
+enum { CONN_DOWN, CONN_CONNECTING, CONN_UP };
+
+typedef struct {
+    int    broker;
+    int    state;
+    double until_ms; // connect done, or the next reconnect when down
+    bool   waiting;  // a reconnect is scheduled
+    int    id;       // current connection, for the TCP stream a publish went out on
+    int    attempts;
+} conn_t;
+
+typedef struct {
+    bool    used;
+    int     reading;
+    int     attempts;
+    int     conn_id;
+    int     broker;
+    double  sent_ms;
+    double  deliver_ms;
+    double  ack_ms;
+    double  deadline_ms;
+    uint8_t level;
+} slot_t;
+
+typedef struct {
+    double   failover_ms; // broker 0 killed until the first ack from broker 1
+    double   gap_ms;      // longest time without an ack
+    double   max_delay_ms;
+    uint32_t moved;
+    uint32_t spooled;
+    uint32_t duplicates;
+    uint32_t lost;
+} result_t;
+
+static uint64_t rng_state;
+
+static double uniform(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// the simulation state, reset by run()
+static bool         blackhole;
+static broker_set_t set;
+static rtt_est_t    est;
+static conn_t       uplink;
+static conn_t       standby;
+static bool         with_standby;
+static slot_t       slots[SLOTS];
+static double       closed_ms[CONNS];
+static int          next_conn_id;
+static uint8_t      deliveries[READINGS];
+static double       created_ms[READINGS];
+static double       first_delivery_ms[READINGS];
+static int          spool[READINGS];
+static int          spool_head;
+static int          spool_tail;
+static result_t*    res;
+
+static bool alive(int broker, double t) {
+    return broker != 0 || t < KILL_MS;
+}
+
+static double backoff_ms(int attempt) {
+    double ceil_ms = attempt < 16 ? fmin((double)RECONNECT_BASE_MS * (1 << attempt), RECONNECT_MAX_MS) : RECONNECT_MAX_MS;
+    return ceil_ms / 2 + uniform() * ceil_ms / 2;
+}
+
+static void spool_push(int reading) {
+    spool[spool_tail++ % READINGS] = reading;
+}
+
+static void connect_start(conn_t* c, double now) {
+    c->state    = CONN_CONNECTING;
+    c->waiting  = false;
+    c->until_ms = now + (alive(c->broker, now) ? HANDSHAKE_MS : (blackhole ? CONNECT_TIMEOUT_MS : RST_MS));
+}
+
+static void reconnect_later(conn_t* c, double now) {
+    c->state    = CONN_DOWN;
+    c->waiting  = true;
+    c->until_ms = now + backoff_ms(c->attempts++);
+}
+
+// A publish attempt ended without its ack, did it reach the broker anyway
+static void account(const slot_t* s, double now) {
+    if (s->deliver_ms <= now && alive(s->broker, s->deliver_ms) && s->deliver_ms < closed_ms[s->conn_id]) {
+        if (deliveries[s->reading]++) {
+            res->duplicates++;
+        } else {
+            first_delivery_ms[s->reading] = s->deliver_ms;
+        }
+    }
+}
+
+static void send(slot_t* s, double now) {
+    double lat     = LATENCY_MS + JITTER_MS * -log(1 - uniform());
+    s->used        = true;
+    s->conn_id     = uplink.id;
+    s->broker      = uplink.broker;
+    s->sent_ms     = now;
+    s->deliver_ms  = now + lat / 2;
+    s->ack_ms      = now + lat;
+    s->level       = est.backoff;
+    s->deadline_ms = now + rtt_est_deadline_us(&est, RTO_MIN_MS * 1000, RTO_MAX_MS * 1000, (uint32_t)rng_state) / 1000.0;
+}
+
+// Every publish in flight completes with an error (link down) or is moved
+static void fail_pending(double now, bool moved) {
+    for (int i = 0; i < SLOTS; i++) {
+        slot_t* s = &slots[i];
+        if (!s->used) {
+            continue;
+        }
+        account(s, now);
+        s->used = false;
+        if (moved) {
+            res->moved++;
+            if (uplink.state == CONN_UP) {
+                s->attempts = 0;
+                send(s, now);
+                continue;
+            }
+        }
+        res->spooled++;
+        spool_push(s->reading);
+    }
+}
+
+static void close_conn(conn_t* c, double now) {
+    closed_ms[c->id] = now;
+    c->id            = ++next_conn_id;
+}
+
+static void uplink_event(double now) {
+    if (uplink.state == CONN_CONNECTING && now >= uplink.until_ms) {
+        if (alive(uplink.broker, now)) {
+            uplink.state    = CONN_UP;
+            uplink.attempts = 0;
+            broker_up(&set, set.active, now * 1000);
+        } else {
+            broker_down(&set, set.active, now * 1000);
+            close_conn(&uplink, now);
+            reconnect_later(&uplink, now);
+        }
+    } else if (uplink.state == CONN_DOWN && uplink.waiting && now >= uplink.until_ms) {
+        connect_start(&uplink, now);
+    } else if (uplink.state == CONN_UP && !alive(uplink.broker, now)
+               && now >= KILL_MS + (blackhole ? KEEPALIVE_MS : RST_MS)) {
+        broker_down(&set, set.active, now * 1000);
+        close_conn(&uplink, now);
+        fail_pending(now, false);
+        reconnect_later(&uplink, now);
+    }
+}
+
+static void standby_event(double now) {
+    if (standby.state == CONN_CONNECTING && now >= standby.until_ms) {
+        if (alive(standby.broker, now)) {
+            standby.state    = CONN_UP;
+            standby.attempts = 0;
+            broker_up(&set, standby.broker, now * 1000);
+        } else {
+            broker_down(&set, standby.broker, now * 1000);
+            close_conn(&standby, now);
+            reconnect_later(&standby, now);
+        }
+    } else if (standby.state == CONN_DOWN && standby.waiting && now >= standby.until_ms) {
+        connect_start(&standby, now);
+    } else if (standby.state == CONN_UP && !alive(standby.broker, now)
+               && now >= KILL_MS + (blackhole ? KEEPALIVE_MS : RST_MS)) {
+        broker_down(&set, standby.broker, now * 1000);
+        close_conn(&standby, now);
+        reconnect_later(&standby, now);
+    }
+}
+
+// broker_failover() of mqtt_core.c
+static void failover(int to, double now) {
+    bool from_up = set.health[set.active].up;
+    bool warm    = with_standby && standby.broker == to && set.health[to].up;
+    int  from    = set.active;
+    broker_switch(&set, to, now * 1000);
+    int target = broker_standby_target(&set);
+
+    if (warm) {
+        conn_t old = uplink;
+        uplink     = standby;
+        standby    = old;
+    }
+    if (from_up) {
+        broker_down(&set, from, now * 1000);
+    }
+    rtt_est_init(&est, RTO_INITIAL_MS * 1000);
+    fail_pending(now, true);
+
+    if (!warm) {
+        uplink.broker = to;
+        if (from_up) {
+            close_conn(&uplink, now);
+            reconnect_later(&uplink, now);
+        } else if (uplink.state == CONN_DOWN) {
+            connect_start(&uplink, now);
+        }
+        return;
+    }
+    if (standby.state != CONN_DOWN) {
+        close_conn(&standby, now);
+    }
+    standby.broker = target;
+    reconnect_later(&standby, now);
+}
+
+static void run(bool bh, bool warm, result_t* r) {
+    blackhole    = bh;
+    with_standby = warm;
+    res          = r;
+    rng_state    = 0x9E3779B97F4A7C15ull;
+    memset(r, 0, sizeof(*r));
+    memset(slots, 0, sizeof(slots));
+    memset(deliveries, 0, sizeof(deliveries));
+    for (int i = 0; i < CONNS; i++) {
+        closed_ms[i] = INFINITY;
+    }
+    next_conn_id = 0;
+    spool_head   = 0;
+    spool_tail   = 0;
+
+    broker_set_init(&set, 2, 0);
+    rtt_est_init(&est, RTO_INITIAL_MS * 1000);
+    uplink  = (conn_t){ .broker = 0, .id = ++next_conn_id };
+    standby = (conn_t){ .broker = 1, .id = ++next_conn_id };
+    connect_start(&uplink, 0);
+    if (warm) {
+        connect_start(&standby, 0);
+    }
+
+    double last_ack = 0;
+    r->failover_ms  = -1;
+    for (int ms = 0; ms < RUN_MS; ms++) {
+        double now = ms;
+        if (ms % PERIOD_MS == 0 && ms < READINGS_UNTIL_MS) {
+            int reading         = ms / PERIOD_MS;
+            created_ms[reading] = now;
+            spool_push(reading);
+        }
+
+        uplink_event(now);
+        if (warm) {
+            standby_event(now);
+        }
+
+        for (int i = 0; i < SLOTS; i++) {
+            slot_t* s = &slots[i];
+            if (!s->used) {
+                continue;
+            }
+            bool answered = alive(s->broker, s->ack_ms) && s->ack_ms < closed_ms[s->conn_id];
+            if (answered && now >= s->ack_ms && s->ack_ms <= s->deadline_ms) {
+                if (!s->attempts) {
+                    rtt_est_sample(&est, (s->ack_ms - s->sent_ms) * 1000);
+                }
+                broker_ack(&set, set.active, (s->ack_ms - s->sent_ms) * 1000, now * 1000);
+                account(s, now);
+                s->used  = false;
+                r->gap_ms = fmax(r->gap_ms, now - last_ack);
+                last_ack = now;
+                if (s->broker == 1 && r->failover_ms < 0 && now > KILL_MS) {
+                    r->failover_ms = now - KILL_MS;
+                }
+            } else if (now >= s->deadline_ms) {
+                rtt_est_timeout(&est, s->level);
+                broker_error(&set, set.active);
+                account(s, now);
+                if (++s->attempts > RETRIES || uplink.state != CONN_UP) {
+                    s->used = false;
+                    r->spooled++;
+                    spool_push(s->reading);
+                } else {
+                    send(s, now);
+                }
+            }
+        }
+
+        if (ms % CHECK_MS == 0) {
+            int to = broker_pick(&set, now * 1000, FAILOVER_MS);
+            if (to >= 0) {
+                failover(to, now);
+            }
+        }
+
+        for (int i = 0; i < SLOTS && uplink.state == CONN_UP && spool_head != spool_tail; i++) {
+            if (!slots[i].used) {
+                slots[i].reading  = spool[spool_head++ % READINGS];
+                slots[i].attempts = 0;
+                send(&slots[i], now);
+            }
+        }
+    }
+
+    for (int i = 0; i < READINGS; i++) {
+        if (!deliveries[i]) {
+            r->lost++;
+        } else {
+            r->max_delay_ms = fmax(r->max_delay_ms, first_delivery_ms[i] - created_ms[i]);
+        }
+    }
+}
+
+int main(void) {
+    printf("%-10s %-8s %12s %9s %8s %8s %11s %6s %13s\n",
+           "failure", "standby", "failover ms", "gap ms", "moved", "spooled", "duplicates", "lost", "max delay ms");
+    for (int bh = 0; bh < 2; bh++) {
+        for (int warm = 1; warm >= 0; warm--) {
+            result_t r;
+            run(bh, warm, &r);
+            printf("%-10s %-8s %12.0f %9.0f %8u %8u %11u %6u %13.0f\n",
+                   bh ? "blackhole" : "rst", warm ? "warm" : "cold",
+                   r.failover_ms, r.gap_ms, r.moved, r.spooled, r.duplicates, r.lost, r.max_delay_ms);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+// Load generator planning: the synthetic fleet's traffic model from
+// main/loadgen_model.c run on the host, to see what a config offers the
+// gateway before it is flashed with LOADGEN_ENABLED.
+//
+//   cc -O2 -Imain -o loadgen_plan tools/loadgen_plan.c main/loadgen_model.c main/packet_codec.c -lm
+//   ./loadgen_plan [seconds=600] [tags=200] [rate_mhz=200] [burst_factor=4] [mtu=23] ...
+//
+// The model is stepped in LOADGEN_TICK_MS ticks like the generator task
+// does, every reading is encoded and split into ATT requests like the
+// ingest task sends them. Reported per one second window: readings, ATT
+// requests and bytes over the air, mean and peak. The broker stand-in's
+// ack delay is drawn for every reading into the same histogram the target
+// reports latencies in; with Little's law it gives how many readings wait
+// on an ack at the offered rate, against the msg_buf pool the gateway has.
+// Capacity (accepted/s, NACKs, latency under load) is only measured on
+// target, this tool says what load a config puts on it
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loadgen_model.h"
+#include "packet_codec.h"
+
+#define TICK_MS       (10) // LOADGEN_TICK_MS
+#define POOL_SIZE     (16) // MSG_BUF_POOL_SIZE
+#define ATT_WRITE_HDR (3)  // opcode + handle
+#define ATT_EXEC_LEN  (2)  // opcode + flags
+#define MAX_SECONDS   (86400)
+
+static loadgen_config_t config;
+static loadgen_hist_t   ack_hist;
+
+static uint32_t rng = 2463534242u;
+static uint32_t next(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+typedef struct {
+    uint32_t readings;
+    uint32_t requests;
+    uint32_t bytes;
+} window_t;
+
+static window_t windows[MAX_SECONDS];
+
+static bool set_option(const char* arg, uint32_t* seconds) {
+    const char* eq = strchr(arg, '=');
+    if (!eq) {
+        return false;
+    }
+    size_t   key_len = eq - arg;
+    uint32_t value   = strtoul(eq + 1, NULL, 0);
+#define OPTION(key, field)                                         \
+    if (key_len == strlen(key) && !strncmp(arg, key, key_len)) { \
+        field = value;                                             \
+        return true;                                               \
+    }
+    OPTION("seconds", *seconds)
+    OPTION("tags", config.tags)
+    OPTION("rate_mhz", config.rate_mhz_per_tag)
+    OPTION("burst_factor", config.burst_factor)
+    OPTION("burst_ms", config.burst_ms)
+    OPTION("burst_period_ms", config.burst_period_ms)
+    OPTION("mtu", config.mtu)
+    OPTION("long_write_pct", config.long_write_pct)
+    OPTION("ack_delay_ms", config.ack_delay_ms)
+    OPTION("ack_jitter_ms", config.ack_jitter_ms)
+    OPTION("ack_loss_pct", config.ack_loss_pct)
+#undef OPTION
+    return false;
+}
+
+// ATT requests and bytes of one reading, the way loadgen_core.c's deliver sends it
+static void offer(const loadgen_event_t* event, window_t* window) {
+    uint8_t payload[LOADGEN_MAX_PAYLOAD];
+    memset(payload, 0xFF, sizeof(payload));
+    size_t len = uwb_packet_encode(&event->packet, payload, sizeof(payload));
+
+    window->readings++;
+    if (!event->long_write) {
+        window->requests++;
+        window->bytes += ATT_WRITE_HDR + len;
+        return;
+    }
+    uint16_t fragment = loadgen_model_fragment(&config);
+    for (uint32_t offset = 0; offset < LOADGEN_MAX_PAYLOAD; offset += fragment) {
+        uint32_t chunk = LOADGEN_MAX_PAYLOAD - offset < fragment ? LOADGEN_MAX_PAYLOAD - offset : fragment;
+        window->requests++;
+        window->bytes += LOADGEN_ATT_HEADER + chunk;
+    }
+    window->requests++;
+    window->bytes += ATT_EXEC_LEN;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// mean, 99th percentile and peak of one window field
+static void report(const char* name, size_t offset, uint32_t seconds) {
+    static uint32_t values[MAX_SECONDS];
+    uint64_t        total = 0;
+    for (uint32_t i = 0; i < seconds; i++) {
+        values[i] = *(const uint32_t*)((const uint8_t*)&windows[i] + offset);
+        total += values[i];
+    }
+    qsort(values, seconds, sizeof(values[0]), cmp_u32);
+    printf("%-12s %10.1f %10u %10u\n", name, (double)total / seconds, values[(seconds * 99) / 100], values[seconds - 1]);
+}
+
+int main(int argc, char** argv) {
+    uint32_t seconds = 600;
+    config           = loadgen_default_config;
+    for (int i = 1; i < argc; i++) {
+        if (!set_option(argv[i], &seconds)) {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!config.tags || !config.rate_mhz_per_tag || !seconds || seconds > MAX_SECONDS) {
+        fprintf(stderr, "tags, rate_mhz and seconds (up to %d) have to be set\n", MAX_SECONDS);
+        return 1;
+    }
+
+    loadgen_model_t model;
+    loadgen_event_t event;
+    uint32_t        lost       = 0;
+    uint32_t        generated  = 0;
+    uint32_t        burst_ones = 0;
+    loadgen_hist_init(&ack_hist);
+    loadgen_model_init(&model, &config, next, 0);
+
+    for (int64_t now = 0; now < (int64_t)seconds * 1000000; now += TICK_MS * 1000) {
+        bool bursting = loadgen_model_bursting(&model, now);
+        while (loadgen_model_next(&model, now, &event)) {
+            offer(&event, &windows[now / 1000000]);
+            generated++;
+            burst_ones += bursting;
+            if (loadgen_model_ack_lost(&model)) {
+                lost++;
+            } else {
+                ack_hist.counts[loadgen_hist_bucket(&ack_hist, loadgen_model_ack_delay_us(&model))]++;
+            }
+        }
+    }
+
+    printf("%d tags at %d mHz, bursts x%d for %d of every %d ms, mtu %d (%d bytes per fragment), %d%% long writes\n",
+           config.tags, config.rate_mhz_per_tag, config.burst_factor, config.burst_ms, config.burst_period_ms,
+           config.mtu, loadgen_model_fragment(&config), config.long_write_pct);
+    printf("%d readings in %d s, %.1f%% of them in bursts\n\n", generated, seconds, 100.0 * burst_ones / generated);
+    printf("%-12s %10s %10s %10s\n", "per second", "mean", "p99", "peak");
+    report("readings", offsetof(window_t, readings), seconds);
+    report("requests", offsetof(window_t, requests), seconds);
+    report("air bytes", offsetof(window_t, bytes), seconds);
+
+    // Little's law on the mean ack delay, the pool has to hold what waits on acks
+    double mean_ack_ms = config.ack_delay_ms + config.ack_jitter_ms / 2.0;
+    double rate        = config.tags * config.rate_mhz_per_tag / 1000.0;
+    double burst_rate  = config.burst_factor > 1 ? rate * config.burst_factor : rate;
+    printf("\nbroker ack p50 %u us, p99 %u us, %.2f%% lost\n", loadgen_hist_percentile(&ack_hist, 50),
+           loadgen_hist_percentile(&ack_hist, 99), 100.0 * lost / generated);
+    printf("waiting on acks: %.1f readings between bursts, %.1f in a burst, msg_buf pool %d\n",
+           rate * mean_ack_ms / 1000, burst_rate * mean_ack_ms / 1000, POOL_SIZE);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+# Renders the gateway profiler samples (main/prof_core.h) as a text timeline,
+# one column per sample, oldest on the left:
+#
+#   mosquitto_sub ... -t /topic/gateway/prof | tools/prof_timeline.py
+#
+# or from a file of captured JSON lines. Each cell is the task's CPU share
+# of one core over the interval, " .:-=+*#%@" from 0 to 100%.
+
+import json
+import sys
+
+SHADES = " .:-=+*#%@"
+WIDTH = 60
+
+
+def shade(permille):
+    return SHADES[min(len(SHADES) - 1, permille * len(SHADES) // 1001)]
+
+
+def render(samples):
+    samples = samples[-WIDTH:]
+    tasks = {}
+    for i, s in enumerate(samples):
+        for name, core, cpu, stack_free in s["tasks"]:
+            # both idle tasks are called IDLE, the core tells them apart
+            row = tasks.setdefault((name, core), {"cpu": {}, "stack": stack_free})
+            row["cpu"][i] = cpu
+            row["stack"] = min(row["stack"], stack_free)
+
+    span = (samples[-1]["t"] - samples[0]["t"]) / 1000
+    print("%d samples over %.0f s" % (len(samples), span))
+    for core in range(len(samples[0]["busy"])):
+        cells = "".join(shade(s["busy"][core]) for s in samples)
+        peak = max(s["busy"][core] for s in samples) / 10
+        print("%-16s %4s |%s| peak %5.1f%%" % ("core %d" % core, "", cells, peak))
+
+    # busiest first
+    for (name, core), row in sorted(tasks.items(), key=lambda kv: -sum(kv[1]["cpu"].values())):
+        cells = "".join(shade(row["cpu"][i]) if i in row["cpu"] else " " for i in range(len(samples)))
+        peak = max(row["cpu"].values()) / 10
+        print("%-16s %4s |%s| peak %5.1f%% stack free %d" % (name, "-" if core < 0 else core, cells, peak, row["stack"]))
+
+
+def main():
+    samples = []
+    try:
+        for line in open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin:
+            try:
+                samples.append(json.loads(line))
+            except ValueError:
+                continue
+    except KeyboardInterrupt:
+        pass  # Ctrl-C ends a live capture
+    if not samples:
+        sys.exit("no samples")
+    samples.sort(key=lambda s: s["t"])
+    render(samples)
+
+
+if __name__ == "__main__":
+    main()
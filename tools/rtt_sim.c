@@ -0,0 +1,147 @@
+// Ack timeout simulation: the old fixed 1 s PUBACK timeout against the
+// RTT estimator in main/rtt_est.c, over a few broker latency profiles.
+//
+//   cc -O2 -Imain -o rtt_sim tools/rtt_sim.c main/rtt_est.c -lm && ./rtt_sim
+//
+// One publish every 100 ms, each attempt either gets its ack after a random
+// latency or is lost. A timeout with the ack still on its way is spurious
+// (a duplicate reading at the broker), a timeout on a lost attempt is the
+// failure detection time. Up to 2 retries, like pub_retries.
+//
+// Events are applied in publish order, a late ack is fed to the estimator
+// before the retry it raced with. Close enough at one publish in flight.
+//
+// "fixed" is the reference. RTT_EST_SRTT_FLOOR is set so that aws has no
+// more spurious retries than fixed, see rtt_est.h for the trade-off on
+// slow_link.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rtt_est.h"
+
+#define MESSAGES     (20000)
+#define PERIOD_MS    (100)
+#define RETRIES      (2)
+#define FIXED_MS     (1000)
+#define RTO_MIN_MS   (200)
+#define RTO_MAX_MS   (10000) // ack_timeout_ms
+#define RTO_FIRST_MS (1000)
+
+typedef enum {
+    POLICY_FIXED,
+    POLICY_RTT,
+    POLICY_COUNT,
+} policy_t;
+
+static const char* policy_names[POLICY_COUNT] = { "fixed", "rtt" };
+
+typedef struct {
+    const char* name;
+    double      base_ms;
+    double      jitter_ms; // mean of an exponential tail
+    double      loss;
+    double      hiccup_every_s; // 0: none
+    double      hiccup_len_s;
+    double      hiccup_ms; // extra latency during a hiccup
+} profile_t;
+
+static const profile_t profiles[] = {
+    { "lan", 25, 10, 0.005, 0, 0, 0 },
+    { "aws", 120, 40, 0.01, 0, 0, 0 },
+    { "aws_hiccups", 120, 40, 0.01, 60, 5, 2000 },
+    { "slow_link", 700, 250, 0.01, 0, 0, 0 },
+};
+
+typedef struct {
+    uint32_t attempts;
+    uint32_t spurious;
+    uint32_t lost;
+    double   detect_ms; // sum over lost attempts
+    uint32_t failed;    // out of retries
+    double   latency_ms;
+    uint32_t delivered;
+} result_t;
+
+static uint64_t rng_state;
+
+static double uniform(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// ms until the ack, negative if the attempt is lost
+static double latency(const profile_t* p, double now_ms) {
+    if (uniform() < p->loss) {
+        return -1;
+    }
+    double ms = p->base_ms - p->jitter_ms * log(1 - uniform());
+    if (p->hiccup_every_s && fmod(now_ms / 1000, p->hiccup_every_s) < p->hiccup_len_s) {
+        ms += p->hiccup_ms;
+    }
+    return ms;
+}
+
+static void run(const profile_t* p, policy_t policy, result_t* r) {
+    rtt_est_t est;
+    rtt_est_init(&est, RTO_FIRST_MS * 1000);
+    rng_state = 0x9E3779B97F4A7C15ull;
+
+    for (int m = 0; m < MESSAGES; m++) {
+        double now   = (double)m * PERIOD_MS;
+        double start = now;
+        bool   ok    = false;
+        for (int attempt = 0; attempt <= RETRIES && !ok; attempt++) {
+            double  ack     = latency(p, now);
+            uint8_t level   = est.backoff;
+            double  timeout = FIXED_MS;
+            if (policy == POLICY_RTT) {
+                timeout = rtt_est_deadline_us(&est, RTO_MIN_MS * 1000, RTO_MAX_MS * 1000, (uint32_t)rng_state) / 1000.0;
+            }
+            r->attempts++;
+            if (ack >= 0 && ack <= timeout) {
+                rtt_est_sample(&est, ack * 1000);
+                r->latency_ms += now + ack - start;
+                r->delivered++;
+                ok = true;
+                break;
+            }
+            rtt_est_timeout(&est, level);
+            if (ack < 0) {
+                r->lost++;
+                r->detect_ms += timeout;
+            } else {
+                r->spurious++;
+                if (policy == POLICY_RTT) {
+                    rtt_est_late_ack(&est, ack * 1000);
+                }
+            }
+            now += timeout;
+        }
+        if (!ok) {
+            r->failed++;
+        }
+    }
+}
+
+int main(void) {
+    printf("%-12s %-8s %9s %9s %12s %8s %12s\n",
+           "profile", "policy", "attempts", "spurious", "detect ms", "failed", "latency ms");
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+        for (policy_t policy = 0; policy < POLICY_COUNT; policy++) {
+            result_t r = { 0 };
+            run(&profiles[i], policy, &r);
+            printf("%-12s %-8s %9u %9u %12.0f %8u %12.0f\n",
+                   profiles[i].name, policy_names[policy],
+                   r.attempts, r.spurious,
+                   r.lost ? r.detect_ms / r.lost : 0,
+                   r.failed,
+                   r.delivered ? r.latency_ms / r.delivered : 0);
+        }
+    }
+    return 0;
+}
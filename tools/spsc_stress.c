@@ -0,0 +1,190 @@
+// SPSC ring stress test and benchmark: main/spsc_ring.h with a producer
+// and a consumer thread, against a mutex + condition variable queue of
+// pointers (what a FreeRTOS queue amounts to) for comparison, which only
+// passes sequence numbers.
+//
+//   cc -O2 -pthread -Imain -o spsc_stress tools/spsc_stress.c && ./spsc_stress [items]
+//
+// The producer fills a record (sequence number and a checksum of it) in a
+// pool slot, then pushes a pointer to it, the way a msg_buf_t goes to the
+// publisher. The consumer checks that every record arrives once, in order,
+// and with the contents written before the push, then hands the slot back
+// over a second ring. A record seen half written means the push/pop
+// ordering is broken. Each ring size is run with the consumer busy polling
+// an empty ring and with it yielding straight away, to vary the
+// interleavings. Exits non zero on any error
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "spsc_ring.h"
+
+#define MAX_SLOTS  (1024)
+#define SPIN_LIMIT (4096)
+
+typedef struct {
+    uint64_t seq;
+    uint64_t check; // ~seq * constant, written before seq
+} record_t;
+
+typedef struct {
+    spsc_ring_t     to_consumer;
+    spsc_ring_t     to_producer; // free records back to the producer
+    void*           fwd_slots[MAX_SLOTS];
+    void*           back_slots[MAX_SLOTS];
+    record_t        pool[MAX_SLOTS];
+    uint64_t        items;
+    bool            yield;
+    uint64_t        errors;
+    pthread_mutex_t lock; // queue mode
+    pthread_cond_t  cond;
+    void*           queue[MAX_SLOTS];
+    uint32_t        q_head;
+    uint32_t        q_tail;
+    uint32_t        q_size;
+    bool            use_queue;
+} test_t;
+
+static uint64_t check_of(uint64_t seq) {
+    return ~seq * 0x9E3779B97F4A7C15ull;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void queue_put(test_t* t, void* item) {
+    pthread_mutex_lock(&t->lock);
+    while (t->q_head - t->q_tail == t->q_size) {
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    t->queue[t->q_head++ % t->q_size] = item;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void* queue_get(test_t* t) {
+    pthread_mutex_lock(&t->lock);
+    while (t->q_head == t->q_tail) {
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    void* item = t->queue[t->q_tail++ % t->q_size];
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    return item;
+}
+
+static void* producer(void* arg) {
+    test_t* t = arg;
+    for (uint64_t seq = 1; seq <= t->items; seq++) {
+        if (t->use_queue) {
+            queue_put(t, (void*)(uintptr_t)seq);
+            continue;
+        }
+        record_t* rec;
+        while (!(rec = spsc_pop(&t->to_producer))) {
+            sched_yield();
+        }
+        rec->check = check_of(seq);
+        rec->seq   = seq;
+        while (!spsc_push(&t->to_consumer, rec)) {
+            sched_yield(); // full, the consumer is behind
+        }
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    test_t*  t        = arg;
+    uint64_t expected = 1;
+    while (expected <= t->items) {
+        if (t->use_queue) {
+            uint64_t seq = (uintptr_t)queue_get(t);
+            if (seq != expected) {
+                t->errors++;
+                expected = seq;
+            }
+            expected++;
+            continue;
+        }
+        record_t* rec;
+        uint32_t  spins = 0;
+        while (!(rec = spsc_pop(&t->to_consumer))) {
+            // spinning gives way now and then, the producer may share the core
+            if (t->yield || ++spins % SPIN_LIMIT == 0) {
+                sched_yield();
+            }
+        }
+        if (rec->seq != expected || rec->check != check_of(rec->seq)) {
+            t->errors++;
+            expected = rec->seq;
+        }
+        expected++;
+        // can't fail, there are only as many records as slots
+        spsc_push(&t->to_producer, rec);
+    }
+    return NULL;
+}
+
+static bool run(uint32_t slots, bool yield, bool use_queue, uint64_t items) {
+    static test_t t;
+    t.items     = items;
+    t.yield     = yield;
+    t.errors    = 0;
+    t.use_queue = use_queue;
+    t.q_head    = 0;
+    t.q_tail    = 0;
+    t.q_size    = slots;
+    spsc_init(&t.to_consumer, t.fwd_slots, slots);
+    spsc_init(&t.to_producer, t.back_slots, slots);
+    for (uint32_t i = 0; i < slots; i++) {
+        spsc_push(&t.to_producer, &t.pool[i]);
+    }
+    pthread_mutex_init(&t.lock, NULL);
+    pthread_cond_init(&t.cond, NULL);
+
+    pthread_t prod;
+    pthread_t cons;
+    double    start = now_s();
+    pthread_create(&cons, NULL, consumer, &t);
+    pthread_create(&prod, NULL, producer, &t);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    double elapsed = now_s() - start;
+
+    printf("%-8s %6u %-6s %12.0f %8llu\n", use_queue ? "queue" : "spsc", slots,
+           use_queue ? "block" : yield ? "yield" : "spin",
+           items / elapsed, (unsigned long long)t.errors);
+    pthread_mutex_destroy(&t.lock);
+    pthread_cond_destroy(&t.cond);
+    return t.errors == 0;
+}
+
+int main(int argc, char** argv) {
+    uint64_t items = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    bool     ok    = true;
+
+    printf("%llu items per run, %d byte cache lines, spsc_ring_t is %zu bytes\n",
+           (unsigned long long)items, SPSC_CACHE_LINE, sizeof(spsc_ring_t));
+    printf("%-8s %6s %-6s %12s %8s\n", "handoff", "slots", "wait", "items/s", "errors");
+    uint32_t sizes[] = { 2, 16, 64, MAX_SLOTS };
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        ok &= run(sizes[i], false, false, items);
+        ok &= run(sizes[i], true, false, items);
+    }
+    // 16 is MSG_BUF_POOL_SIZE, the ring size on target
+    ok &= run(16, false, true, items / 10);
+    ok &= run(MAX_SLOTS, false, true, items / 10);
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+// Record log drain benchmark: copying records out of the store against
+// reading them in place from the mapping, over the record_store_t backends
+// in main/record_store.c.
+//
+//   cc -O2 -Imain -o store_bench tools/store_bench.c main/record_store.c && ./store_bench [file]
+//
+// Fills a store laid out like flash_core.c writes it (header, records,
+// summary per page), then drains every page the way flash_query and the
+// flash_query stream do: a page is walked in FLASH_PACKETS_PER_CHUNK
+// blocks read into a buffer (copy), or in one run straight from the
+// mapping (mapped), and the stream serializes FLASH_QUERY_BATCH records
+// per message. A message is copied into an outbox like ESP-MQTT does.
+// The file store reads with pread, like esp_partition_read goes to the
+// SPI driver per block.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "record_store.h"
+
+#define STORE_PAGES (256)
+#define PASSES      (50)
+
+typedef struct {
+    flash_packet_t batch[FLASH_QUERY_BATCH];
+    int            count;
+    uint8_t        outbox[FLASH_QUERY_BATCH * sizeof(flash_packet_t)];
+    uint32_t       messages;
+    uint32_t       sum;
+} stream_t;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void publish(stream_t* stream, const flash_packet_t* records, int count) {
+    memcpy(stream->outbox, records, count * sizeof(flash_packet_t));
+    stream->sum += stream->outbox[0] + stream->outbox[count * sizeof(flash_packet_t) - 1];
+    stream->messages++;
+}
+
+// query_stream_cb of flash_core.c
+static void stream_run(stream_t* stream, const flash_packet_t* records, uint16_t count) {
+    while (count) {
+        if (!stream->count && count >= FLASH_QUERY_BATCH) {
+            publish(stream, records, FLASH_QUERY_BATCH);
+            records += FLASH_QUERY_BATCH;
+            count -= FLASH_QUERY_BATCH;
+            continue;
+        }
+        uint16_t n = count < FLASH_QUERY_BATCH - stream->count ? count : FLASH_QUERY_BATCH - stream->count;
+        memcpy(&stream->batch[stream->count], records, n * sizeof(flash_packet_t));
+        stream->count += n;
+        records += n;
+        count -= n;
+        if (stream->count == FLASH_QUERY_BATCH) {
+            publish(stream, stream->batch, stream->count);
+            stream->count = 0;
+        }
+    }
+}
+
+// query_page of flash_core.c without the time filter, returns the records
+static uint32_t drain_page(record_store_t* store, uint16_t page, bool copy, stream_t* stream) {
+    flash_packet_t block[FLASH_PACKETS_PER_CHUNK];
+    uint16_t       step    = store->map && !copy ? PACKETS_IN_PAGE : FLASH_PACKETS_PER_CHUNK;
+    size_t         base_of = (size_t)page * FLASH_PAGE_SIZE;
+    uint32_t       matches = 0;
+
+    const flash_packet_t* header = record_store_records(store, base_of, block, 1, copy);
+    if (!header || header->type != PAGE_HEADER_MAGIC) {
+        return 0;
+    }
+    for (uint16_t base = 0; base < PACKETS_IN_PAGE; base += step) {
+        const flash_packet_t* records = record_store_records(store, base_of + base * sizeof(flash_packet_t), block, step, copy);
+        uint16_t              run     = 0;
+        for (uint16_t i = 0; i <= step; i++) {
+            if (i < step && records[i].type == PAGE_NORMAL_ENTRY_MAGIC) {
+                run++;
+                continue;
+            }
+            if (run) {
+                stream_run(stream, &records[i - run], run);
+                matches += run;
+                run = 0;
+            }
+        }
+    }
+    return matches;
+}
+
+static void fill(record_store_t* store) {
+    flash_packet_t packet;
+    for (uint16_t page = 0; page < STORE_PAGES; page++) {
+        store->erase(store, (size_t)page * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+        for (uint16_t slot = 0; slot < PACKETS_IN_PAGE; slot++) {
+            memset(&packet, 0xFF, sizeof(packet));
+            packet.type = slot == HEADER_PACKET_OFFSET ? PAGE_HEADER_MAGIC
+                        : (slot == SUMMARY_PACKET_OFFSET ? PAGE_SUMMARY_MAGIC : PAGE_NORMAL_ENTRY_MAGIC);
+            packet.specifics.distance_uwb = page * PACKETS_IN_PAGE + slot;
+            packet.utc                    = 1700000000 + page * PACKETS_IN_PAGE + slot;
+            store->write(store, ((size_t)page * PACKETS_IN_PAGE + slot) * sizeof(packet), &packet, sizeof(packet));
+        }
+    }
+}
+
+static void run(record_store_t* store, bool copy) {
+    stream_t stream  = { 0 };
+    uint32_t records = 0;
+
+    double start = now_s();
+    for (int pass = 0; pass < PASSES; pass++) {
+        for (uint16_t page = 0; page < STORE_PAGES; page++) {
+            records += drain_page(store, page, copy, &stream);
+        }
+    }
+    double elapsed = now_s() - start;
+
+    printf("%-6s %-7s %12.0f %10.1f %10u %10u\n", store->name, copy ? "copy" : "mapped",
+           records / elapsed, records * sizeof(flash_packet_t) / elapsed / 1e6, stream.messages, stream.sum);
+}
+
+int main(int argc, char** argv) {
+    const char*    path = argc > 1 ? argv[1] : "/tmp/store_bench.bin";
+    record_store_t stores[2];
+
+    if (record_store_open_ram(&stores[0], STORE_PAGES * FLASH_PAGE_SIZE)
+        || record_store_open_file(&stores[1], path, STORE_PAGES * FLASH_PAGE_SIZE)) {
+        fprintf(stderr, "Could not open the stores (%s)\n", path);
+        return 1;
+    }
+
+    printf("%-6s %-7s %12s %10s %10s %10s\n", "store", "drain", "records/s", "MB/s", "messages", "check");
+    for (int i = 0; i < 2; i++) {
+        fill(&stores[i]);
+        run(&stores[i], true);
+        run(&stores[i], false);
+        stores[i].close(&stores[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+# Local TLS MQTT broker that reports TLS session resumption, to check the
+# gateway's relay (main/tls_core.h) against something that resumes:
+#
+#   tools/tls_broker.py [--port 8883] [--cert crt --key key] [--no-tickets]
+#
+# then "broker_list mqtts://<this host>:8883" on the gateway command topic
+# and a reboot. Every handshake is logged as full or resumed. The first
+# connect after the reboot is full, a reconnect (take the AP down and up)
+# should resume and show in tls_resumed of the gateway's "conn_stats".
+# Restarting the broker loses its session cache and ticket key.
+# Without --cert a throwaway self-signed certificate is made with openssl.
+# The broker accepts CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH (PUBACK for
+# QoS 1) and PINGREQ, and routes nothing.
+#
+#   tools/tls_broker.py --selftest
+#
+# runs the broker on a free port and connects to it the way the relay does,
+# twice per session store (tickets, then session IDs with tickets off),
+# offering the first connection's session on the second. Passes if the
+# broker saw a full handshake and then a resumed one each time.
+# Limited to TLS 1.2 like the gateway's mbedTLS.
+
+import argparse
+import os
+import socket
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def make_cert(directory):
+    crt = os.path.join(directory, "broker.crt")
+    key = os.path.join(directory, "broker.key")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                    "-nodes", "-days", "30", "-subj", "/CN=localhost", "-keyout", key, "-out", crt],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return crt, key
+
+
+def server_context(crt, key, tickets):
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+    ctx.load_cert_chain(crt, key)
+    if not tickets:
+        ctx.options |= ssl.OP_NO_TICKET  # session ID cache only
+    return ctx
+
+
+def recv_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def read_packet(sock):
+    first = recv_exact(sock, 1)[0]
+    length, shift = 0, 0
+    while True:
+        byte = recv_exact(sock, 1)[0]
+        length |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            break
+    return first, recv_exact(sock, length)
+
+
+def serve_mqtt(sock, verbose):
+    while True:
+        first, body = read_packet(sock)
+        kind = first >> 4
+        if kind == 1:  # CONNECT
+            sock.sendall(b"\x20\x02\x00\x00")
+        elif kind == 3:  # PUBLISH
+            qos = (first >> 1) & 3
+            topic_len = struct.unpack(">H", body[:2])[0]
+            if verbose:
+                print("  publish %s, %d bytes" % (body[2:2 + topic_len].decode(errors="replace"), len(body)))
+            if qos == 1:
+                sock.sendall(b"\x40\x02" + body[2 + topic_len:4 + topic_len])
+        elif kind == 8:  # SUBSCRIBE, grant up to QoS 1
+            pos, granted = 2, b""
+            while pos < len(body):
+                n = struct.unpack(">H", body[pos:pos + 2])[0]
+                granted += bytes([min(body[pos + 2 + n], 1)])
+                pos += 3 + n
+            sock.sendall(bytes([0x90, 2 + len(granted)]) + body[:2] + granted)
+        elif kind == 10:  # UNSUBSCRIBE
+            sock.sendall(b"\xB0\x02" + body[:2])
+        elif kind == 12:  # PINGREQ
+            sock.sendall(b"\xD0\x00")
+        elif kind == 14:  # DISCONNECT
+            return
+
+
+class Broker:
+    def __init__(self, ctx, port, verbose=False):
+        self.ctx = ctx
+        self.verbose = verbose
+        self.handshakes = []  # True for every resumed one
+        self.listener = socket.create_server(("", port), reuse_port=False)
+        self.port = self.listener.getsockname()[1]
+
+    def handle(self, raw, peer):
+        start = time.monotonic()
+        try:
+            with self.ctx.wrap_socket(raw, server_side=True) as tls:
+                ms = (time.monotonic() - start) * 1000
+                self.handshakes.append(tls.session_reused)
+                print("%s:%d %s handshake, %s %s, %.1f ms" % (peer[0], peer[1],
+                      "resumed" if tls.session_reused else "full", tls.version(), tls.cipher()[0], ms))
+                serve_mqtt(tls, self.verbose)
+                # OpenSSL drops the cached session of a connection closed
+                # without close_notify, session IDs would never resume
+                tls.unwrap()
+        except EOFError:
+            print("%s:%d closed without DISCONNECT" % peer)
+        except (OSError, ssl.SSLError) as e:
+            print("%s:%d %s" % (peer[0], peer[1], e))
+
+    def run(self):
+        while True:
+            raw, peer = self.listener.accept()
+            threading.Thread(target=self.handle, args=(raw, peer), daemon=True).start()
+
+
+def client_context():
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    ctx.check_hostname = False
+    ctx.verify_mode = ssl.CERT_NONE
+    ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+    return ctx
+
+
+# What the gateway sends on a connection: CONNECT, one QoS 1 PUBLISH, DISCONNECT
+def client_session(ctx, port, session):
+    with socket.create_connection(("127.0.0.1", port)) as raw:
+        with ctx.wrap_socket(raw, server_hostname="localhost", session=session) as tls:
+            client_id = b"selftest"
+            connect = b"\x00\x04MQTT\x04\x02\x00\x3c" + struct.pack(">H", len(client_id)) + client_id
+            tls.sendall(bytes([0x10, len(connect)]) + connect)
+            assert read_packet(tls) == (0x20, b"\x00\x00")
+            publish = struct.pack(">H", 5) + b"/test" + b"\x00\x01" + b"{}"
+            tls.sendall(bytes([0x32, len(publish)]) + publish)
+            assert read_packet(tls) == (0x40, b"\x00\x01")
+            tls.sendall(b"\xE0\x00")
+            session = tls.session
+            tls.unwrap()  # close_notify, like the relay
+            return session
+
+
+def selftest(crt, key):
+    ok = True
+    for tickets in (True, False):
+        broker = Broker(server_context(crt, key, tickets), 0)
+        threading.Thread(target=broker.run, daemon=True).start()
+        ctx = client_context()
+        session = client_session(ctx, broker.port, None)
+        client_session(ctx, broker.port, session)
+        time.sleep(0.1)  # the broker logs after the handshake
+        passed = broker.handshakes == [False, True]
+        print("%s: %s" % ("tickets" if tickets else "session ids", "PASS" if passed else "FAIL %s" % broker.handshakes))
+        ok &= passed
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description="local TLS MQTT broker reporting session resumption")
+    parser.add_argument("--port", type=int, default=8883)
+    parser.add_argument("--cert")
+    parser.add_argument("--key")
+    parser.add_argument("--no-tickets", action="store_true", help="resume from the session ID cache only")
+    parser.add_argument("--selftest", action="store_true")
+    parser.add_argument("-v", "--verbose", action="store_true", help="log every publish")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        crt, key = (args.cert, args.key) if args.cert else make_cert(tmp)
+        if args.selftest:
+            sys.exit(0 if selftest(crt, key) else 1)
+        broker = Broker(server_context(crt, key, not args.no_tickets), args.port, args.verbose)
+        print("listening on %d, %s" % (broker.port, "session IDs only" if args.no_tickets else "tickets and session IDs"))
+        try:
+            broker.run()
+        except KeyboardInterrupt:
+            pass
+
+
+if __name__ == "__main__":
+    main()
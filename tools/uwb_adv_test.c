@@ -0,0 +1,218 @@
+// Host test of the connectionless ingest's parsing and deduplication
+// (main/uwb_adv.c), the parts of an advertising report's path that don't
+// touch the radio.
+//
+//   cc -g -fsanitize=address,undefined -Imain -o uwb_adv_test tools/uwb_adv_test.c main/uwb_adv.c && ./uwb_adv_test
+//
+// Parsing: well formed reports with the reading in different places,
+// reports that must be ignored (other manufacturer data, short payloads,
+// AD lengths running past the report), then random reports, which the
+// sanitizers check for reads outside the report. Deduplication: repeats
+// inside and outside UWB_ADV_DEDUP_MS, a full table evicting the least
+// recently seen tag, and the millisecond clock wrapping. Exits non zero
+// on any failure
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uwb_adv.h"
+
+#define ADV_MAX (62) // advertising data + scan response
+#define FUZZ    (200000)
+
+static int failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+static uint32_t rng = 2463534242u;
+static uint32_t next(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Appends one AD structure, returns the new length
+static uint8_t put_ad(uint8_t* adv, uint8_t len, uint8_t type, const uint8_t* data, uint8_t data_len) {
+    adv[len]     = data_len + 1;
+    adv[len + 1] = type;
+    memcpy(&adv[len + 2], data, data_len);
+    return len + 2 + data_len;
+}
+
+static uint8_t reading_payload(uint8_t* out, uint8_t seq, uint32_t distance) {
+    uwb_adv_payload_t payload = {
+        .magic  = { UWB_ADV_MAGIC_0, UWB_ADV_MAGIC_1 },
+        .type   = UWB_ADV_TYPE_READING,
+        .seq    = seq,
+        .packet = { .distance_uwb = distance, .time = ~distance },
+    };
+    memcpy(out, &payload, sizeof(payload));
+    return sizeof(payload);
+}
+
+static bool parsed(const uint8_t* adv, uint8_t len, uint8_t want_seq, uint32_t want_distance) {
+    uint8_t        seq    = 0;
+    const uint8_t* packet = uwb_adv_parse(adv, len, &seq);
+    if (!packet || packet < adv || packet + UWB_PACKET_SIZE > adv + len) {
+        return false;
+    }
+    uwb_packet_t out;
+    memcpy(&out, packet, sizeof(out));
+    return seq == want_seq && out.distance_uwb == want_distance && out.time == ~want_distance;
+}
+
+static void test_parse(void) {
+    const uint8_t flags[]  = { 0x06 };
+    const uint8_t name[]   = { 't', 'a', 'g' };
+    uint8_t       data[32] = { 0 };
+    uint8_t       adv[ADV_MAX];
+    uint8_t       len;
+    uint8_t       seq;
+
+    // the reading alone, and behind the flags and a name
+    uint8_t data_len = reading_payload(data, 7, 1234);
+    len              = put_ad(adv, 0, 0xFF, data, data_len);
+    CHECK(parsed(adv, len, 7, 1234));
+    len = put_ad(adv, 0, 0x01, flags, sizeof(flags));
+    len = put_ad(adv, len, 0x09, name, sizeof(name));
+    len = put_ad(adv, len, 0xFF, data, data_len);
+    CHECK(parsed(adv, len, 7, 1234));
+
+    // trailing bytes in the manufacturer data are allowed
+    data_len = reading_payload(data, 8, 99) + 3;
+    len      = put_ad(adv, 0, 0xFF, data, data_len);
+    CHECK(parsed(adv, len, 8, 99));
+
+    // some other manufacturer data first, then the reading
+    const uint8_t other[] = { 0x4C, 0x00, 0x02, 0x15, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+    data_len              = reading_payload(data, 9, 5);
+    len                   = put_ad(adv, 0, 0xFF, other, sizeof(other));
+    len                   = put_ad(adv, len, 0xFF, data, data_len);
+    CHECK(parsed(adv, len, 9, 5));
+
+    // nothing to find
+    CHECK(!uwb_adv_parse(adv, 0, &seq));
+    len = put_ad(adv, 0, 0x01, flags, sizeof(flags));
+    CHECK(!uwb_adv_parse(adv, len, &seq));
+    len = put_ad(adv, 0, 0xFF, other, sizeof(other));
+    CHECK(!uwb_adv_parse(adv, len, &seq));
+
+    // wrong magic, wrong type, one byte short, right bytes in another AD type
+    data_len = reading_payload(data, 1, 1);
+    data[1]  = 0xCE;
+    len      = put_ad(adv, 0, 0xFF, data, data_len);
+    CHECK(!uwb_adv_parse(adv, len, &seq));
+    data_len = reading_payload(data, 1, 1);
+    data[2]  = 'V';
+    len      = put_ad(adv, 0, 0xFF, data, data_len);
+    CHECK(!uwb_adv_parse(adv, len, &seq));
+    data_len = reading_payload(data, 1, 1);
+    len      = put_ad(adv, 0, 0xFF, data, data_len - 1);
+    CHECK(!uwb_adv_parse(adv, len, &seq));
+    len = put_ad(adv, 0, 0x16, data, data_len);
+    CHECK(!uwb_adv_parse(adv, len, &seq));
+
+    // the report cut short inside the reading, its AD length runs past the end
+    len = put_ad(adv, 0, 0xFF, data, data_len);
+    CHECK(!uwb_adv_parse(adv, len - 1, &seq));
+
+    // a zero length ends the data, what follows is padding
+    len      = put_ad(adv, 0, 0x01, flags, sizeof(flags));
+    adv[len] = 0;
+    CHECK(!uwb_adv_parse(adv, put_ad(adv, len + 1, 0xFF, data, data_len), &seq));
+
+    // random reports: whatever comes back lies inside the report
+    uint8_t* fuzz = adv;
+    int      hits = 0;
+    for (int i = 0; i < FUZZ; i++) {
+        uint8_t fuzz_len = next() % (ADV_MAX + 1);
+        for (int j = 0; j < fuzz_len; j++) {
+            fuzz[j] = next();
+        }
+        // often a plausible AD length and the magic, so some get through
+        if (fuzz_len > 5 && next() % 2) {
+            fuzz[0] = next() % fuzz_len;
+            fuzz[1] = 0xFF;
+            fuzz[2] = UWB_ADV_MAGIC_0;
+            fuzz[3] = UWB_ADV_MAGIC_1;
+            fuzz[4] = UWB_ADV_TYPE_READING;
+        }
+        const uint8_t* packet = uwb_adv_parse(fuzz, fuzz_len, &seq);
+        if (packet) {
+            hits++;
+            CHECK(packet >= fuzz && packet + UWB_PACKET_SIZE <= fuzz + fuzz_len);
+        }
+    }
+    printf("parse: %d random reports, %d carried a reading\n", FUZZ, hits);
+}
+
+static void tag_addr(uint8_t* bda, int n) {
+    const uint8_t base[6] = { 0xC0, 0xFF, 0xEE, 0x00, 0x00, 0x00 };
+    memcpy(bda, base, sizeof(base));
+    bda[4] = n >> 8;
+    bda[5] = n;
+}
+
+static void test_dedup(uint32_t start_ms) {
+    static uwb_dedup_t dedup;
+    uint8_t            bda[6];
+    uint32_t           now = start_ms;
+
+    memset(&dedup, 0, sizeof(dedup));
+    tag_addr(bda, 1);
+    CHECK(!uwb_dedup_check(&dedup, bda, 10, now));
+    CHECK(uwb_dedup_check(&dedup, bda, 10, now + 100));
+    // repeats keep the window open, the tag is still sending the reading
+    CHECK(uwb_dedup_check(&dedup, bda, 10, now + UWB_ADV_DEDUP_MS));
+    CHECK(!uwb_dedup_check(&dedup, bda, 10, now + 2 * UWB_ADV_DEDUP_MS + 1));
+    // a new reading, then the old seq again is new too (seq wrapped)
+    CHECK(!uwb_dedup_check(&dedup, bda, 11, now + 2 * UWB_ADV_DEDUP_MS + 2));
+    CHECK(!uwb_dedup_check(&dedup, bda, 10, now + 2 * UWB_ADV_DEDUP_MS + 3));
+
+    // the same seq from another tag is its own reading
+    uint8_t other[6];
+    tag_addr(other, 2);
+    CHECK(!uwb_dedup_check(&dedup, other, 10, now + 2 * UWB_ADV_DEDUP_MS + 4));
+
+    // fill the table, tag n seen at now + n
+    memset(&dedup, 0, sizeof(dedup));
+    for (int n = 0; n < UWB_ADV_DEDUP_SLOTS; n++) {
+        tag_addr(bda, n);
+        CHECK(!uwb_dedup_check(&dedup, bda, 1, now + n));
+    }
+    for (int n = 0; n < UWB_ADV_DEDUP_SLOTS; n++) {
+        tag_addr(bda, n);
+        CHECK(uwb_dedup_check(&dedup, bda, 1, now + UWB_ADV_DEDUP_SLOTS + n));
+    }
+    // one more tag takes the least recently seen slot, tag 0's
+    now += 2 * UWB_ADV_DEDUP_SLOTS;
+    tag_addr(bda, UWB_ADV_DEDUP_SLOTS);
+    CHECK(!uwb_dedup_check(&dedup, bda, 1, now));
+    CHECK(uwb_dedup_check(&dedup, bda, 1, now + 1));
+    tag_addr(bda, 0);
+    CHECK(!uwb_dedup_check(&dedup, bda, 1, now + 2)); // forgotten, takes tag 1's slot
+    tag_addr(bda, 2);
+    CHECK(uwb_dedup_check(&dedup, bda, 1, now + 3)); // still remembered
+    tag_addr(bda, 1);
+    CHECK(!uwb_dedup_check(&dedup, bda, 1, now + 4));
+}
+
+int main(void) {
+    test_parse();
+    test_dedup(1000);
+    // the uptime clock wraps after 49.7 days, the window spans the wrap
+    test_dedup(UINT32_MAX - UWB_ADV_DEDUP_MS / 2);
+    printf("dedup: %d slots, %d ms window\n", UWB_ADV_DEDUP_SLOTS, UWB_ADV_DEDUP_MS);
+
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}